@@ -1,6 +1,7 @@
 #include "main.h"
 
 #include <boot_config.h>
+#include <console.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -9,11 +10,13 @@
 #include <unistd.h>
 
 UART_HandleTypeDef huart2;
+DMA_HandleTypeDef hdma_usart2_tx;
 
 volatile bootloader_api_t* bootloader_api_ptr = (bootloader_api_t*) BOOT_CONFIG_START_ADDR;
 
 void SystemClock_Config(void);
 static void MX_GPIO_Init(void);
+static void MX_DMA_Init(void);
 static void MX_USART2_UART_Init(void);
 
 void blink(uint32_t delay_ms)
@@ -35,14 +38,27 @@ int main(void)
     HAL_Init();
     SystemClock_Config();
     MX_GPIO_Init();
+    MX_DMA_Init();
     MX_USART2_UART_Init();
     printf("STARTING APPLICATION\n");
+    if (bootloader_api_ptr->boot_info.magic == BOOT_INFO_MAGIC)
+    {
+        printf("BOOT SLOT: %c\n", bootloader_api_ptr->boot_info.boot_slot == 1 ? 'B' : 'A');
+        printf("BOOT TIME: %lu us\n", bootloader_api_ptr->boot_info.boot_time_us);
+        printf("IMAGE CRC %s AT BOOT\n", (bootloader_api_ptr->boot_info.boot_flags & BOOT_FLAG_IMAGE_VERIFIED) ? "CHECKED" : "CACHED");
+    }
+    // older bootloaders leave the table out, the update has to go through DFU then
+    if (UPDATE_API_HAS(&bootloader_api_ptr->update, commit))
+    {
+        printf("UPDATE API V%lu\n", bootloader_api_ptr->update.version);
+    }
     reset_called = false;  // set reset to false to avoid spurious IRQs
     while (!reset_called)
     {
         blink(500);
     }
     printf("RESET CALLED\n");
+    console_flush();
     bootloader_api_ptr->reset(FIRMWARE_UPDATE);
 }
 
@@ -90,6 +106,10 @@ void SystemClock_Config(void)
  */
 static void MX_USART2_UART_Init(void)
 {
+    // the console transfers complete through the transmission complete interrupt
+    HAL_NVIC_SetPriority(USART2_IRQn, 3, 0);
+    HAL_NVIC_EnableIRQ(USART2_IRQn);
+
     huart2.Instance = USART2;
     huart2.Init.BaudRate = 115200;
     huart2.Init.WordLength = UART_WORDLENGTH_8B;
@@ -104,6 +124,20 @@ static void MX_USART2_UART_Init(void)
     }
 }
 
+/**
+ * @brief DMA Initialization Function
+ * @param None
+ * @retval None
+ */
+static void MX_DMA_Init(void)
+{
+    __HAL_RCC_DMA1_CLK_ENABLE();
+
+    /* DMA1_Stream6_IRQn interrupt configuration, USART2_TX console */
+    HAL_NVIC_SetPriority(DMA1_Stream6_IRQn, 3, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Stream6_IRQn);
+}
+
 /**
  * @brief GPIO Initialization Function
  * @param None
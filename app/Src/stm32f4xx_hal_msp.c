@@ -17,6 +17,8 @@
  */
 #include "main.h"
 
+extern DMA_HandleTypeDef hdma_usart2_tx;
+
 /**
  * Initializes the Global MSP.
  */
@@ -53,6 +55,24 @@ void HAL_UART_MspInit(UART_HandleTypeDef* huart)
         GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
         GPIO_InitStruct.Alternate = GPIO_AF7_USART2;
         HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
+        /* USART2_TX DMA Init */
+        hdma_usart2_tx.Instance = DMA1_Stream6;
+        hdma_usart2_tx.Init.Channel = DMA_CHANNEL_4;
+        hdma_usart2_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+        hdma_usart2_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+        hdma_usart2_tx.Init.MemInc = DMA_MINC_ENABLE;
+        hdma_usart2_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+        hdma_usart2_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+        hdma_usart2_tx.Init.Mode = DMA_NORMAL;
+        hdma_usart2_tx.Init.Priority = DMA_PRIORITY_LOW;
+        hdma_usart2_tx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+        if (HAL_DMA_Init(&hdma_usart2_tx) != HAL_OK)
+        {
+            Error_Handler();
+        }
+
+        __HAL_LINKDMA(huart, hdmatx, hdma_usart2_tx);
     }
 }
 
@@ -73,5 +93,8 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* huart)
         PA3     ------> USART2_RX
         */
         HAL_GPIO_DeInit(GPIOA, USART_TX_Pin | USART_RX_Pin);
+
+        /* USART2 DMA DeInit */
+        HAL_DMA_DeInit(huart->hdmatx);
     }
 }
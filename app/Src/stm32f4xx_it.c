@@ -19,6 +19,9 @@
 
 #include "main.h"
 
+extern UART_HandleTypeDef huart2;
+extern DMA_HandleTypeDef hdma_usart2_tx;
+
 /******************************************************************************/
 /*           Cortex-M4 Processor Interruption and Exception Handlers          */
 /******************************************************************************/
@@ -95,3 +98,13 @@ void EXTI15_10_IRQHandler(void)
     /* Check if EXTI line is pending for B1_Pin */
     HAL_GPIO_EXTI_IRQHandler(B1_Pin);
 }
+
+void USART2_IRQHandler(void)
+{
+    HAL_UART_IRQHandler(&huart2);  // transmission complete, calls HAL_UART_TxCpltCallback()
+}
+
+void DMA1_Stream6_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_usart2_tx);  // console chunk moved to USART2, enables its transmission complete interrupt
+}
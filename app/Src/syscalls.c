@@ -1,19 +1,16 @@
 #include "main.h"
 
+#include <console.h>
 #include <errno.h>
-#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 extern UART_HandleTypeDef huart2;
-// Dummy implementation of _write
+// Queued on the USART2 console, printf() does not wait for the link
 int _write(int file, const char* ptr, int len)
 {
-    const char* prefix = "APP: ";
-    const size_t prefix_len = strlen(prefix);
-    HAL_UART_Transmit(&huart2, (uint8_t*) prefix, prefix_len, HAL_MAX_DELAY);
-    HAL_UART_Transmit(&huart2, (uint8_t*) ptr, len, HAL_MAX_DELAY);
+    console_write("APP: ", ptr, len);
     return len;
 }
 
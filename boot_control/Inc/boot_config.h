@@ -1,6 +1,7 @@
 #pragma once
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -68,11 +69,35 @@
  */
 #define BOOT_START_ADDR FLASH_SECTOR_0_START_ADDR
 
+/**
+ * @def FW_SLOT_COUNT
+ * @brief Number of firmware slots, each holds a header and an image linked to run from it.
+ */
+#define FW_SLOT_COUNT 2
+
+/**
+ * @def FW_SLOT_A_ADDR
+ * @brief Header address of slot A, sectors 2 to 4.
+ */
+#define FW_SLOT_A_ADDR FLASH_SECTOR_2_START_ADDR
+
+/**
+ * @def FW_SLOT_B_ADDR
+ * @brief Header address of slot B, sector 5.
+ */
+#define FW_SLOT_B_ADDR FLASH_SECTOR_5_START_ADDR
+
 /**
  * @def APP_START_ADDR
- * @brief Start address of the application firmware.
+ * @brief Start address of the application firmware in slot A.
+ */
+#define APP_START_ADDR (FW_SLOT_A_ADDR + FW_HEADER_SIZE)
+
+/**
+ * @def APP_B_START_ADDR
+ * @brief Start address of the application firmware in slot B.
  */
-#define APP_START_ADDR (FLASH_SECTOR_2_START_ADDR + FW_HEADER_SIZE)
+#define APP_B_START_ADDR (FW_SLOT_B_ADDR + FW_HEADER_SIZE)
 
 /**
  * @def APP_SECTOR_SIZE
@@ -86,6 +111,21 @@
  */
 #define BOOT_CONFIG_START_ADDR 0x20017c00
 
+/**
+ * @def BOOT_CONFIG_SIZE
+ * @brief Size of the boot configuration storage, the RAM_CFG region of both linker scripts.
+ */
+#define BOOT_CONFIG_SIZE 0x400
+
+/**
+ * @def FW_HEADER_JOURNAL_SIZE
+ * @brief Number of progress entries in the firmware header.
+ *
+ * One is appended per programmed staging buffer while the entries left cover the rest of the image. Images larger
+ * than that get one every few buffers, the entries always reach the end of the slot.
+ */
+#define FW_HEADER_JOURNAL_SIZE 64
+
 /**
  * @brief Firmware header stored at the beginning of the application image.
  *
@@ -94,13 +134,31 @@
  */
 typedef struct __attribute__((packed, aligned(4)))
 {
-    uint32_t magic;   /**< Firmware magic number */
-    uint32_t fw_size; /**< Firmware size in bytes (excluding header) */
-    uint32_t crc;     /**< CRC of the firmware image only */
-    uint8_t reserved[FW_HEADER_SIZE - 3 * sizeof(uint32_t)];
+    uint32_t magic;     /**< Firmware magic number */
+    uint32_t fw_size;   /**< Firmware size in bytes (excluding header) */
+    uint32_t crc;       /**< CRC16 of the firmware image only */
+    uint32_t flags;     /**< FW_HEADER_FLAG_* bits, 0 in headers written by older bootloaders */
+    uint32_t crc32;     /**< CRC32 of the firmware image as computed by the CRC unit, valid with FW_HEADER_FLAG_CRC32 */
+    uint32_t keep_mask; /**< Sectors kept from the previous image, valid with FW_HEADER_FLAG_JOURNAL */
+    uint32_t journal[FW_HEADER_JOURNAL_SIZE];
+    /**< Bytes programmed so far, appended during the update, 0xFFFFFFFF in unused entries */
+    uint32_t sequence; /**< Incremented by each update, the valid slot with the highest one boots, 0 in older headers */
+    uint8_t reserved[FW_HEADER_SIZE - (7 + FW_HEADER_JOURNAL_SIZE) * sizeof(uint32_t)];
     /**< Reserved for future use and padding */
 } fw_header_t;
 
+/**
+ * @def FW_HEADER_FLAG_CRC32
+ * @brief The header crc32 field is valid and is used instead of the CRC16 to verify the image.
+ */
+#define FW_HEADER_FLAG_CRC32 (1u << 0)
+
+/**
+ * @def FW_HEADER_FLAG_JOURNAL
+ * @brief The header keep_mask and journal fields are valid, an interrupted update can be resumed.
+ */
+#define FW_HEADER_FLAG_JOURNAL (1u << 1)
+
 /**
  * @brief Compile-time check to ensure firmware header size correctness.
  */
@@ -133,9 +191,18 @@ typedef struct PACKED boot_info_t
 {
     uint32_t magic;             /**< Validation magic value */
     uint32_t reset_reason_uint; /**< Reset reason as integer */
-    uint32_t reserved[5];       /**< Reserved for future use */
+    uint32_t boot_time_us;      /**< Time from HAL_Init() in the bootloader to the jump to the application */
+    uint32_t boot_flags;        /**< BOOT_FLAG_* bits of the last boot */
+    uint32_t boot_slot;         /**< Firmware slot started by jump_to_application, 0 for A and 1 for B */
+    uint32_t reserved[2];       /**< Reserved for future use */
 } boot_info_t;
 
+/**
+ * @def BOOT_FLAG_IMAGE_VERIFIED
+ * @brief The bootloader computed the image CRC on this boot, clear when a cached verification was trusted.
+ */
+#define BOOT_FLAG_IMAGE_VERIFIED (1u << 0)
+
 /* -------------------------------------------------------------------------- */
 /* Bootloader API                                                              */
 /* -------------------------------------------------------------------------- */
@@ -152,6 +219,102 @@ typedef void (*jump_to_app_func_t)(void);
  */
 typedef void (*reset_funct_t)(const reset_reason_e reset_reason);
 
+/**
+ * @def UPDATE_API_VERSION
+ * @brief ABI version of update_api_t. Entries are only appended, the version changes when an existing one changes.
+ */
+#define UPDATE_API_VERSION 1u
+
+/**
+ * @brief State of an update written by the application, owned by the caller and opaque to it.
+ *
+ * The update functions run on the application RAM, they keep their state here and nowhere else.
+ */
+typedef struct
+{
+    uint32_t slot;        /**< Slot written, 0 for A and 1 for B */
+    uint32_t fw_size;     /**< Image size announced to begin */
+    uint32_t programmed;  /**< Image bytes programmed, whole words */
+    uint32_t erased;      /**< Sectors of the slot erased */
+    uint32_t pending;     /**< Bytes waiting for a whole word, little-endian */
+    uint32_t pending_len; /**< Number of pending bytes */
+} update_session_t;
+
+/**
+ * @brief Start an update of the slot the application does not run from.
+ *
+ * @param session State of the update, provided by the caller.
+ * @param fw_size Image size in bytes, excluding the header.
+ * @return int Slot written, 0 for A and 1 for B, the image has to be linked for it. -1 if the image does not fit.
+ */
+typedef int (*update_begin_t)(update_session_t* session, uint32_t fw_size);
+
+/**
+ * @brief Erase the next sector the image needs.
+ *
+ * The CPU stalls on its flash fetches until the sector is erased, up to 2 s for 128 KB. Calling it between other work
+ * spreads the stalls, update_write_t erases the sectors it reaches otherwise.
+ *
+ * @param session State of the update.
+ * @return int 1 if more sectors remain, 0 once all are erased, -1 on a flash error.
+ */
+typedef int (*update_erase_t)(update_session_t* session);
+
+/**
+ * @brief Program the next bytes of the image, in any chunk size.
+ *
+ * @param session State of the update.
+ * @param data Bytes of the image, any alignment.
+ * @param len Number of bytes.
+ * @return int 0 on success, -1 past the announced size or on a flash error.
+ */
+typedef int (*update_write_t)(update_session_t* session, const uint8_t* data, size_t len);
+
+/**
+ * @brief Compute the CRC32 the bootloader checks, on the CRC unit.
+ *
+ * The buffer is fed as 32 bits little-endian words, a partial last word is padded with 0xFF.
+ *
+ * @param data Pointer to the data.
+ * @param len Number of bytes.
+ * @return uint32_t CRC32 value.
+ */
+typedef uint32_t (*update_crc32_t)(const uint8_t* data, size_t len);
+
+/**
+ * @brief Check the written image and program its header, the next reset boots it.
+ *
+ * The header is newer than the one of the running slot. The magic is programmed last, a reset before leaves the
+ * running image as the one that boots. When the new image fails its checks at boot the bootloader falls back.
+ *
+ * @param session State of the update, every announced byte written.
+ * @param crc32 Expected update_crc32_t of the image.
+ * @return int 0 once the header is programmed, -1 if the image is incomplete, differs or is not linked for the slot.
+ */
+typedef int (*update_commit_t)(update_session_t* session, uint32_t crc32);
+
+/**
+ * @brief Versioned table of the functions the application uses to update the other slot while it keeps running.
+ */
+typedef struct PACKED update_api_t
+{
+    uint32_t version;       /**< UPDATE_API_VERSION of the bootloader */
+    uint32_t size;          /**< sizeof(update_api_t) of the bootloader, the entries past it are missing */
+    update_begin_t begin;   /**< Select the slot and announce the image */
+    update_erase_t erase;   /**< Erase one sector ahead of the data */
+    update_write_t write;   /**< Stage and program image bytes */
+    update_crc32_t crc32;   /**< CRC32 as checked at boot */
+    update_commit_t commit; /**< Verify and program the header */
+} update_api_t;
+
+/**
+ * @def UPDATE_API_HAS
+ * @brief Check that the bootloader filled an update_api_t entry.
+ *
+ * BOOT_CONFIG is not initialized by the startup, a bootloader without the table leaves what the RAM held there.
+ */
+#define UPDATE_API_HAS(api, entry) ((api)->version == UPDATE_API_VERSION && (api)->size >= offsetof(update_api_t, entry) + sizeof((api)->entry))
+
 /**
  * @brief Bootloader API exposed to the application.
  *
@@ -163,8 +326,20 @@ typedef struct PACKED bootloader_api_t
     jump_to_app_func_t jump_to_application; /**< Jump to application entry */
     reset_funct_t reset;                    /**< Trigger system reset */
     boot_info_t boot_info;                  /**< Persistent boot information */
+    update_api_t update;                    /**< Update while the application runs, check UPDATE_API_HAS() first */
 } bootloader_api_t;
 
+/**
+ * @brief Compile-time checks of the layout, the application may be built against another version of this file.
+ */
+_Static_assert(sizeof(boot_info_t) == 7 * sizeof(uint32_t), "BOOT INFO SIZE MISMATCH");
+_Static_assert(offsetof(bootloader_api_t, boot_info) == 2 * sizeof(jump_to_app_func_t), "BOOTLOADER API LAYOUT MISMATCH");
+_Static_assert(offsetof(bootloader_api_t, update) == offsetof(bootloader_api_t, boot_info) + sizeof(boot_info_t), "BOOTLOADER API LAYOUT MISMATCH");
+_Static_assert(offsetof(update_api_t, begin) == 2 * sizeof(uint32_t), "UPDATE API LAYOUT MISMATCH");
+_Static_assert(sizeof(update_api_t) == 2 * sizeof(uint32_t) + 5 * sizeof(update_begin_t), "UPDATE API LAYOUT MISMATCH");
+_Static_assert(sizeof(update_session_t) == 6 * sizeof(uint32_t), "UPDATE SESSION SIZE MISMATCH");
+_Static_assert(sizeof(bootloader_api_t) <= BOOT_CONFIG_SIZE, "BOOTLOADER API DOES NOT FIT BOOT_CONFIG");
+
 /**
  * @brief Pointer to the bootloader API structure.
  *
@@ -183,9 +358,28 @@ extern volatile bootloader_api_t* bootloader_api_ptr;
  */
 void init_boot_api(void);
 
+/**
+ * @brief Slot the application was started from, boot_info.boot_slot.
+ *
+ * Reads the BOOT_CONFIG storage directly. Bootloader code called by the application cannot go through
+ * bootloader_api_ptr, the pointer itself lives in the bootloader RAM.
+ *
+ * @return uint32_t 0 for slot A, 1 for slot B.
+ */
+uint32_t get_boot_slot(void);
+
 /**
  * @brief Get a human-readable string describing the last reset reason.
  *
  * @return const char* Null-terminated string describing the reset reason.
  */
 const char* get_reset_reason_string(void);
+
+/**
+ * @brief Time since HAL_Init() in microseconds, from the SysTick tick count and counter.
+ *
+ * Bootloader only, the application reads the value recorded at the jump in boot_info.boot_time_us.
+ *
+ * @return uint32_t Elapsed microseconds.
+ */
+uint32_t boot_elapsed_us(void);
@@ -3,6 +3,8 @@
 
 #include "stm32f4xx_hal.h"
 
+#include <console.h>
+#include <inttypes.h>
 #include <stdio.h>
 
 static volatile BOOT_CONFIG bootloader_api_t bootloader_api;
@@ -37,10 +39,10 @@ static void deinit_peripherals(void)
 
 static void jump_to_address(uintptr_t app_addr)
 {
-    size_t app_stack = *(volatile size_t*) app_addr;
-    size_t app_reset_handler = *(volatile size_t*) (app_addr + 4);
-    printf("app_stack: 0x%x\tapp_reset_handler: 0x%x\n", app_stack, app_reset_handler);
-    printf("Vector table @0x%08X: MSP=0x%08X, Reset=0x%08X\n", app_addr, app_stack, app_reset_handler);
+    uint32_t app_stack = *(volatile uint32_t*) app_addr;
+    uint32_t app_reset_handler = *(volatile uint32_t*) (app_addr + 4);
+    printf("app_stack: 0x%" PRIx32 "\tapp_reset_handler: 0x%" PRIx32 "\n", app_stack, app_reset_handler);
+    printf("Vector table @0x%08" PRIXPTR ": MSP=0x%08" PRIX32 ", Reset=0x%08" PRIX32 "\n", app_addr, app_stack, app_reset_handler);
 
     if ((app_stack & 0x2FFE0000) != 0x20000000)
     {
@@ -48,18 +50,27 @@ static void jump_to_address(uintptr_t app_addr)
         return;
     }
 
+    // the console text still queued would be cut by the peripheral reset
+    console_flush();
+    if (bootloader_api.boot_info.magic != BOOT_INFO_MAGIC)
+    {
+        // cold start, the RAM holds garbage
+        bootloader_api.boot_info.magic = BOOT_INFO_MAGIC;
+        bootloader_api.boot_info.reset_reason_uint = POWER_CYCLE;
+    }
+    bootloader_api.boot_info.boot_time_us = boot_elapsed_us();
     __disable_irq();
     deinit_peripherals();
     HAL_DeInit();
     SCB->VTOR = app_addr;
     __set_MSP(app_stack);
     __enable_irq();
-    ((void (*)(void)) app_reset_handler)();
+    ((void (*)(void)) (uintptr_t) app_reset_handler)();
 }
 
 static void jump_to_application_implementation()
 {
-    jump_to_address(APP_START_ADDR);
+    jump_to_address(bootloader_api.boot_info.boot_slot == 1 ? APP_B_START_ADDR : APP_START_ADDR);
 }
 
 static void jump_to_bootloader_implementaton(const reset_reason_e reset_reason)
@@ -75,6 +86,26 @@ void init_boot_api()
     bootloader_api.reset = jump_to_bootloader_implementaton;
 }
 
+uint32_t boot_elapsed_us(void)
+{
+    uint32_t ms = 0;
+    uint32_t counter = 0;
+    do
+    {
+        // the tick may advance between the two reads
+        ms = HAL_GetTick();
+        counter = SysTick->VAL;
+    } while (ms != HAL_GetTick());
+    // the counter runs down from LOAD once per millisecond
+    const uint32_t reload = SysTick->LOAD + 1;
+    return ms * 1000u + (uint32_t) ((uint64_t) (reload - 1 - counter) * 1000u / reload);
+}
+
+uint32_t get_boot_slot(void)
+{
+    return bootloader_api.boot_info.boot_slot;
+}
+
 const char* get_reset_reason_string()
 {
     if (bootloader_api.boot_info.magic != BOOT_INFO_MAGIC)
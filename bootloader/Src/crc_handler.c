@@ -0,0 +1,134 @@
+#include "crc_handler.h"
+
+#include "crc.h"
+
+#include <string.h>
+
+#ifdef CRC_HW_HOST
+
+// software model of the CRC data register
+static uint32_t crc_register;
+
+static void crc_port_init(void) {}
+
+static void crc_port_reset(void)
+{
+    crc_register = crc32_mpeg2_init();
+}
+
+static void crc_port_feed(const uint32_t* words, size_t num_words)
+{
+    crc_register = crc32_stm32_update(crc_register, words, num_words);
+}
+
+static uint32_t crc_port_read(void)
+{
+    return crc_register;
+}
+
+#else
+
+#include "main.h"
+
+// NDTR is a 16 bits register
+#define DMA_MAX_TRANSFER_WORDS (0xFFFFu)
+#define DMA_TIMEOUT_MS         (100u)
+
+static CRC_HandleTypeDef hcrc;
+#ifdef CRC_HW_USE_DMA
+static DMA_HandleTypeDef hdma_crc;
+#endif
+
+static void crc_port_init(void)
+{
+    hcrc.Instance = CRC;
+    HAL_CRC_Init(&hcrc);
+#ifdef CRC_HW_USE_DMA
+    // the CRC unit has no DMA request, DMA2 in memory-to-memory mode writes the data register directly
+    __HAL_RCC_DMA2_CLK_ENABLE();
+    hdma_crc.Instance = DMA2_Stream0;
+    hdma_crc.Init.Channel = DMA_CHANNEL_0;
+    hdma_crc.Init.Direction = DMA_MEMORY_TO_MEMORY;
+    hdma_crc.Init.PeriphInc = DMA_PINC_ENABLE;
+    hdma_crc.Init.MemInc = DMA_MINC_DISABLE;
+    hdma_crc.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+    hdma_crc.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+    hdma_crc.Init.Mode = DMA_NORMAL;
+    hdma_crc.Init.Priority = DMA_PRIORITY_HIGH;
+    hdma_crc.Init.FIFOMode = DMA_FIFOMODE_ENABLE;
+    hdma_crc.Init.FIFOThreshold = DMA_FIFO_THRESHOLD_FULL;
+    hdma_crc.Init.MemBurst = DMA_MBURST_SINGLE;
+    hdma_crc.Init.PeriphBurst = DMA_PBURST_SINGLE;
+    HAL_DMA_Init(&hdma_crc);
+#endif
+}
+
+static void crc_port_reset(void)
+{
+    __HAL_CRC_DR_RESET(&hcrc);
+}
+
+static void crc_port_feed(const uint32_t* words, size_t num_words)
+{
+#ifdef CRC_HW_USE_DMA
+    while (num_words > 0)
+    {
+        const size_t transfer_words = num_words > DMA_MAX_TRANSFER_WORDS ? DMA_MAX_TRANSFER_WORDS : num_words;
+        if (HAL_DMA_Start(&hdma_crc, (uint32_t) words, (uint32_t) &hcrc.Instance->DR, transfer_words) != HAL_OK
+            || HAL_DMA_PollForTransfer(&hdma_crc, HAL_DMA_FULL_TRANSFER, DMA_TIMEOUT_MS) != HAL_OK)
+        {
+            // fall back to the CPU for whatever is left
+            HAL_DMA_Abort(&hdma_crc);
+            break;
+        }
+        words += transfer_words;
+        num_words -= transfer_words;
+    }
+#endif
+    for (size_t i = 0; i < num_words; i++)
+    {
+        hcrc.Instance->DR = words[i];
+    }
+}
+
+static uint32_t crc_port_read(void)
+{
+    return hcrc.Instance->DR;
+}
+
+#endif
+
+void crc_hw_init(void)
+{
+    crc_port_init();
+}
+
+uint32_t crc_hw_calculate(const uint8_t* data, size_t len)
+{
+    crc_port_reset();
+
+    const size_t num_words = len / sizeof(uint32_t);
+    if (((uintptr_t) data % sizeof(uint32_t)) == 0)
+    {
+        crc_port_feed((const uint32_t*) data, num_words);
+    }
+    else
+    {
+        for (size_t i = 0; i < num_words; i++)
+        {
+            uint32_t word;
+            memcpy(&word, &data[i * sizeof(uint32_t)], sizeof(word));
+            crc_port_feed(&word, 1);
+        }
+    }
+
+    const size_t tail = len % sizeof(uint32_t);
+    if (tail > 0)
+    {
+        // pad like the erased flash after the image
+        uint32_t word = 0xFFFFFFFFu;
+        memcpy(&word, &data[num_words * sizeof(uint32_t)], tail);
+        crc_port_feed(&word, 1);
+    }
+    return crc_port_read();
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Initialize the CRC unit used by crc_hw_calculate().
+ *
+ * On target builds this configures the STM32 CRC peripheral (and the DMA2 stream used to feed it when
+ * CRC_HW_USE_DMA is defined). With CRC_HW_HOST the CRC unit is replaced by a software model so the same
+ * path runs on a host build.
+ */
+void crc_hw_init(void);
+
+/**
+ * @brief Compute the CRC32 of a buffer on the CRC unit.
+ *
+ * The buffer is fed as 32 bits little-endian words, a partial last word is padded with 0xFF.
+ * The result matches crc32_stm32() and the CRC computed by the host tool.
+ *
+ * @param data Pointer to the data, word aligned buffers are fed without copies.
+ * @param len Number of bytes.
+ * @return uint32_t CRC32 value.
+ */
+uint32_t crc_hw_calculate(const uint8_t* data, size_t len);
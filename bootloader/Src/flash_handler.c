@@ -1,71 +1,225 @@
 #include "flash_handler.h"
 
 #include "boot_config.h"
+#include "crc.h"
+#include "crc_handler.h"
+#include "flash_program.h"
+#include "flash_slots.h"
 #include "main.h"
+#include "profile.h"
+#include "trace.h"
+#include "verify_cache.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 
+typedef enum
+{
+    SECTOR_ERASE_NONE,    // erased synchronously when the sector is written
+    SECTOR_ERASE_QUEUED,  // waiting for a background erase
+    SECTOR_ERASE_BUSY,    // being erased by the FLASH interrupt
+    SECTOR_ERASE_DONE,    // erased and not programmed since
+} sector_erase_t;
+
+// state of a sector of flash_slots, in RAM for the FLASH interrupt
 typedef struct
 {
-    const uint32_t sector_id;  // e.g.: FLASH_SECTOR_2
-    const uint32_t start_addr;
-    const size_t length_bytes;
     bool used;
+    volatile uint8_t erase;  // sector_erase_t, updated from the FLASH interrupt
 } flash_handler_t;
 
-#define BYTES_TO_WORDS(SIZE)  (SIZE / sizeof(uint32_t))
-#define SECTOR_SIZE_BYTES_MAX FLASH_SECTOR_4_SIZE
+// one buffer fills while the other one is programmed, the size divides every sector and holds the firmware header
+#define STAGING_BUFFER_COUNT (2u)
+#define STAGING_BUFFER_SIZE  (1024u)
+
+typedef struct
+{
+    uint8_t data[STAGING_BUFFER_SIZE];
+    uint32_t address;    // flash address it is programmed to
+    size_t watermark;    // bytes programmed from the header on once the job completed, 0 for a partial buffer
+    volatile bool busy;  // cleared by the programming engine once the job completed
+    bool stale;          // holds the previous chunk, refilled with 0xFF before reuse
+} staging_buffer_t;
+
+typedef struct
+{
+    const flash_slot_t* const layout;
+    flash_handler_t* const sectors;  // one per layout sector
+} fw_slot_t;
 
-flash_handler_t flash_handler_array[] = {
-    {FLASH_SECTOR_2, FLASH_SECTOR_2_START_ADDR, FLASH_SECTOR_2_SIZE, false},
-    {FLASH_SECTOR_3, FLASH_SECTOR_3_START_ADDR, FLASH_SECTOR_3_SIZE, false},
-    {FLASH_SECTOR_4, FLASH_SECTOR_4_START_ADDR, FLASH_SECTOR_4_SIZE, false},
+static flash_handler_t sector_states[FW_SLOT_COUNT][FLASH_SLOT_SECTORS_MAX];
+
+static fw_slot_t slots[FW_SLOT_COUNT] = {
+    {&flash_slots[0], sector_states[0]},
+    {&flash_slots[1], sector_states[1]},
 };
-#define FLASH_HANDLER_ARRAY_SIZE (sizeof(flash_handler_array) / sizeof(flash_handler_t))
+
+// the slot written by updates, the other one keeps the running image, picked by update_slot()
+static fw_slot_t* target = &slots[0];
+static bool target_selected = false;
+static fw_slot_t* update_slot(void);
 static size_t current_sector_pivot = 0;
+// bytes of the current sector handed to the programming engine
+static size_t sector_pivot = 0;
+
+static __attribute__((aligned(4))) staging_buffer_t staging[STAGING_BUFFER_COUNT];
+static size_t staging_index = 0;  // buffer being filled
+static size_t pivot = 0;          // bytes in the buffer being filled
+static size_t reserved = 0;       // bytes past the pivot handed out by flash_fw_reserve
+static size_t staged_bytes = 0;   // bytes handed to the programming engine, header included
+// a chunk failed to program since the last reset, set from the FLASH interrupt
+static volatile bool program_failed = false;
+
+// progress of the update appended to the journal of the firmware header, see FW_HEADER_FLAG_JOURNAL
+static volatile size_t journal_pending = 0;  // watermark of the last buffer programmed, set from the FLASH interrupt
+static volatile bool journal_busy = false;   // an entry is being programmed
+static size_t journal_slot = 0;              // next free entry
+static uint32_t journal_entry = 0;           // last entry written, programmed from here
+static uint32_t journal_end = 0;             // watermark of the complete update, header included
+
+// a HAL_FLASHEx_Erase_IT run is in progress, cleared by the FLASH interrupt
+static volatile bool erase_running = false;
+// programming owns the flash controller, no new erase run is started
+static bool erase_hold = false;
+// first sector of the erase run in progress, the FLASH interrupt finds the erased sectors without reading the layout
+static size_t erase_run_first = 0;
+static uint32_t erase_run_sector_id = 0;
+
+static void erase_run_finished(sector_erase_t state)
+{
+    // the sectors past the layout stay SECTOR_ERASE_NONE
+    for (size_t i = 0; i < FLASH_SLOT_SECTORS_MAX; i++)
+    {
+        if (target->sectors[i].erase == SECTOR_ERASE_BUSY)
+        {
+            target->sectors[i].erase = state;
+        }
+    }
+    prof_stop(PROF_ERASE_AHEAD);
+    erase_running = false;
+}
 
-static __attribute__((aligned(4))) uint8_t sector[SECTOR_SIZE_BYTES_MAX];
-static size_t pivot = 0;
+// called by HAL_FLASH_IRQHandler, once per erased sector and with 0xFFFFFFFF after the last one
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue)
+{
+    if (!erase_running)
+    {
+        return;
+    }
+    if (ReturnValue == 0xFFFFFFFFU)
+    {
+        erase_run_finished(SECTOR_ERASE_DONE);
+        return;
+    }
+    // the sectors of a run are consecutive
+    const size_t erased = erase_run_first + (ReturnValue - erase_run_sector_id);
+    if (erased < FLASH_SLOT_SECTORS_MAX)
+    {
+        target->sectors[erased].erase = SECTOR_ERASE_DONE;
+    }
+}
 
-size_t get_max_fw_size()
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue)
 {
-    return FLASH_SECTOR_2_SIZE + FLASH_SECTOR_3_SIZE;
+    if (!erase_running)
+    {
+        return;
+    }
+    // the run stops, the remaining sectors are erased when they are written
+    erase_run_finished(SECTOR_ERASE_NONE);
 }
 
-static void print_buffer(const uint8_t* buf, size_t len)
+// starts the next run of consecutive queued sectors, the HAL chains the sectors of a run
+static void erase_poll(void)
 {
-    printf("SECTOR [%u bytes]: ", len);
-    for (size_t i = 0; i < len; i++)
+    if (erase_running || erase_hold || flash_program_busy())
+    {
+        return;
+    }
+    size_t first = 0;
+    while (first < target->layout->sector_count && target->sectors[first].erase != SECTOR_ERASE_QUEUED)
+    {
+        first++;
+    }
+    if (first == target->layout->sector_count)
+    {
+        HAL_FLASH_Lock();
+        return;
+    }
+    size_t last = first;
+    while (last + 1 < target->layout->sector_count && target->sectors[last + 1].erase == SECTOR_ERASE_QUEUED
+           && target->layout->sectors[last + 1].sector_id == target->layout->sectors[last].sector_id + 1)
     {
-        printf("%c[%x] ", buf[i], buf[i]);
-        if ((i + 1) % 16 == 0)
-            printf("\n");
+        last++;
+    }
+    for (size_t i = first; i <= last; i++)
+    {
+        target->sectors[i].erase = SECTOR_ERASE_BUSY;
+    }
+
+    FLASH_EraseInitTypeDef erase;
+    erase.TypeErase = FLASH_TYPEERASE_SECTORS;
+    erase.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+    erase.Sector = target->layout->sectors[first].sector_id;
+    erase.NbSectors = last - first + 1;
+
+    erase_run_first = first;
+    erase_run_sector_id = erase.Sector;
+    erase_running = true;
+    HAL_FLASH_Unlock();
+    prof_start(PROF_ERASE_AHEAD);
+    if (HAL_FLASHEx_Erase_IT(&erase) != HAL_OK)
+    {
+        erase_run_finished(SECTOR_ERASE_NONE);
+        HAL_FLASH_Lock();
     }
-    printf("\n");
 }
 
-static int flash_erase_once(flash_handler_t* current_sector)
+static void erase_wait_idle(void)
 {
+    erase_hold = true;
+    while (erase_running)
+    {
+    }
+}
+
+static void erase_release(void)
+{
+    erase_hold = false;
+    erase_poll();
+}
+
+static int flash_erase_once(size_t index)
+{
+    flash_handler_t* current_sector = &target->sectors[index];
     if (current_sector->used)
     {
         return 0;
     }
+    if (current_sector->erase == SECTOR_ERASE_DONE)
+    {
+        // erased ahead, the content is about to change
+        current_sector->erase = SECTOR_ERASE_NONE;
+        return 0;
+    }
+    // a queued sector not reached by the background erase yet is erased right here
+    current_sector->erase = SECTOR_ERASE_NONE;
 
     FLASH_EraseInitTypeDef erase;
     uint32_t sectorError;
 
-    __disable_irq();
     HAL_FLASH_Unlock();
 
     erase.TypeErase = FLASH_TYPEERASE_SECTORS;
     erase.VoltageRange = FLASH_VOLTAGE_RANGE_3;
-    erase.Sector = current_sector->sector_id;
+    erase.Sector = target->layout->sectors[index].sector_id;
     erase.NbSectors = 1;
 
     int ret = 0;
+    prof_start(PROF_ERASE);
     if (HAL_FLASHEx_Erase(&erase, &sectorError) == HAL_OK)
     {
         ret = 0;
@@ -74,9 +228,9 @@ static int flash_erase_once(flash_handler_t* current_sector)
     {
         ret = -1;
     }
+    prof_stop(PROF_ERASE);
 
     HAL_FLASH_Lock();
-    __enable_irq();
 
     return ret;
 }
@@ -84,71 +238,171 @@ static int flash_erase_once(flash_handler_t* current_sector)
 static void increment_current_sector()
 {
     current_sector_pivot++;
-    if (current_sector_pivot >= FLASH_HANDLER_ARRAY_SIZE)
+    // kept sectors already hold their content
+    while (current_sector_pivot < target->layout->sector_count && target->sectors[current_sector_pivot].used)
     {
-        printf("ALL SECTORS HAVE BEEN FLASHED\n");
+        current_sector_pivot++;
+    }
+    if (current_sector_pivot >= target->layout->sector_count)
+    {
+        TRACE0(TRACE_SECTORS_DONE);
         current_sector_pivot = 0;
     }
 }
 
-static int flash_write_sector_internal(const uint8_t* buf)
+// called by the programming engine from the FLASH interrupt
+static void staging_programmed(uint32_t address, int status)
 {
-    flash_handler_t* current_sector = &flash_handler_array[current_sector_pivot];
-    if (current_sector->used)
+    if (status)
     {
-        return -1;
+        program_failed = true;
     }
-    printf("Writting sector ADDR: 0x%08lx SIZE: %u bytes\n", current_sector->start_addr, current_sector->length_bytes);
-    int ret = flash_erase_once(current_sector);
-    if (ret)
+    for (size_t i = 0; i < STAGING_BUFFER_COUNT; i++)
     {
-        return -1;
+        if (staging[i].busy && staging[i].address == address)
+        {
+            staging[i].busy = false;
+            // jobs complete in order, nothing past a failed one is journaled
+            if (!program_failed && staging[i].watermark > journal_pending)
+            {
+                journal_pending = staging[i].watermark;
+            }
+        }
     }
+}
 
-    uint32_t address = current_sector->start_addr;
-    const size_t length_words = BYTES_TO_WORDS(current_sector->length_bytes);
-    const uint32_t* data = (const uint32_t*) buf;
+// called by the programming engine from the FLASH interrupt
+static void journal_programmed(uint32_t address, int status)
+{
+    if (status)
+    {
+        program_failed = true;
+    }
+    journal_busy = false;
+}
 
-    __disable_irq();
-    HAL_FLASH_Unlock();
+// appends the watermark of the last programmed buffer, intermediate ones are skipped
+static void journal_poll(void)
+{
+    const uint32_t watermark = journal_pending;
+    // the controller runs one operation at a time, the entry waits for the erase run in progress
+    if (journal_busy || erase_running || program_failed || watermark == journal_entry || journal_slot >= FW_HEADER_JOURNAL_SIZE)
+    {
+        return;
+    }
+    // the entries left are spread over the rest of the update, every buffer gets one while they suffice
+    const uint32_t free_entries = FW_HEADER_JOURNAL_SIZE - journal_slot;
+    const uint32_t step = journal_end > journal_entry ? (journal_end - journal_entry + free_entries - 1) / free_entries : 0;
+    if (watermark - journal_entry < step)
+    {
+        return;
+    }
+    fw_header_t* fw_header = (fw_header_t*) (uintptr_t) target->layout->sectors[0].start_addr;
+    const uint32_t previous = journal_entry;
+    journal_entry = watermark;
+    journal_busy = true;
+    if (flash_program_submit((uint32_t) (uintptr_t) &fw_header->journal[journal_slot], (const uint8_t*) &journal_entry, sizeof(journal_entry), journal_programmed))
+    {
+        journal_entry = previous;
+        journal_busy = false;
+        return;
+    }
+    journal_slot++;
+}
 
-    ret = 0;
-    for (size_t i = 0; i < length_words; i++)
+// programs the first len bytes of the buffer being filled and switches to the other one
+static int staging_program(size_t len)
+{
+    flash_handler_t* current_sector = &target->sectors[current_sector_pivot];
+    const flash_slot_sector_t* layout = &target->layout->sectors[current_sector_pivot];
+    staging_buffer_t* buffer = &staging[staging_index];
+    // the controller runs one operation at a time, let the erase run in progress finish first
+    erase_wait_idle();
+    int ret = 0;
+    if (sector_pivot == 0)
     {
-        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address, data[i]) != HAL_OK)
+        if (current_sector->used)
         {
             ret = -1;
-            break;
         }
-        address += 4;
+        else
+        {
+            TRACE(TRACE_SECTOR_WRITE, layout->start_addr, layout->size);
+            // the previous sector may still be programming
+            flash_program_wait();
+            ret = flash_erase_once(current_sector_pivot);
+            current_sector->used = true;
+        }
     }
-
-    HAL_FLASH_Lock();
-    __enable_irq();
     if (ret == 0)
     {
-        current_sector->used = true;
+        buffer->address = layout->start_addr + sector_pivot;
+        // the flushed remainder is not journaled, a resumed update programs it again
+        buffer->watermark = len == STAGING_BUFFER_SIZE ? staged_bytes + len : 0;
+        buffer->busy = true;
+        ret = flash_program_submit(buffer->address, buffer->data, len, staging_programmed);
+        if (ret)
+        {
+            buffer->busy = false;
+        }
+    }
+    erase_release();
+
+    buffer->stale = true;
+    staging_index = (staging_index + 1) % STAGING_BUFFER_COUNT;
+    pivot = 0;
+    staged_bytes += len;
+    sector_pivot += STAGING_BUFFER_SIZE;
+    if (sector_pivot == layout->size)
+    {
+        sector_pivot = 0;
+        increment_current_sector();
+    }
+    if (ret)
+    {
+        TRACE0(TRACE_WRITE_FAILED);
+        program_failed = true;
     }
     return ret;
 }
 
-static void flash_write_sector()
+// waits until a buffer is no longer programmed, a reservation may reach past the one being filled
+static void staging_acquire_buffer(size_t index)
 {
-    const int ret = flash_write_sector_internal(sector);
-    if (ret == 0)
+    staging_buffer_t* buffer = &staging[index];
+    prof_start(PROF_STAGING_WAIT);
+    while (buffer->busy)
     {
-        increment_current_sector();
     }
-    else
+    prof_stop(PROF_STAGING_WAIT);
+    journal_poll();
+    // the controller may be free again, resume erasing ahead
+    erase_poll();
+    if (buffer->stale)
     {
-        printf("WRITING IN SECTOR FAILED\n");
+        memset(buffer->data, 0xFF, STAGING_BUFFER_SIZE);
+        buffer->stale = false;
     }
 }
 
-static void pivot_reset()
+static void staging_acquire(void)
 {
-    pivot = 0;
-    memset(sector, 0xFF, SECTOR_SIZE_BYTES_MAX);
+    staging_acquire_buffer(staging_index);
+}
+
+static void flash_fw_advance(size_t len)
+{
+    // data received in place may fill the buffer and continue in the next one
+    while (len > 0)
+    {
+        const size_t step = (len < STAGING_BUFFER_SIZE - pivot) ? len : STAGING_BUFFER_SIZE - pivot;
+        pivot += step;
+        len -= step;
+        if (pivot == STAGING_BUFFER_SIZE)
+        {
+            staging_program(STAGING_BUFFER_SIZE);
+        }
+    }
 }
 
 static void flash_fw_feed_internal(const uint8_t* buf, size_t len)
@@ -157,115 +411,558 @@ static void flash_fw_feed_internal(const uint8_t* buf, size_t len)
 
     while (offset < len)
     {
-        flash_handler_t* current_sector = &flash_handler_array[current_sector_pivot];
-        size_t space = current_sector->length_bytes - pivot;
+        staging_acquire();
+        size_t space = STAGING_BUFFER_SIZE - pivot;
         size_t copy_len = (len - offset < space) ? (len - offset) : space;
 
-        memcpy(&sector[pivot], &buf[offset], copy_len);
-        pivot += copy_len;
+        prof_start(PROF_STAGING_COPY);
+        memcpy(&staging[staging_index].data[pivot], &buf[offset], copy_len);
+        prof_stop(PROF_STAGING_COPY);
         offset += copy_len;
-
-        if (pivot == current_sector->length_bytes)
-        {
-            printf("SECTOR IS FULL\n");
-            flash_write_sector();
-            pivot_reset();  // reset pivot + buffer
-        }
+        flash_fw_advance(copy_len);
     }
 }
 
 static void flash_fw_flush_internal(void)
 {
-    printf("FLUSHING SECTOR\n");
+    TRACE0(TRACE_FLUSH);
     if (pivot == 0)
     {
         return;
     }
 
-    flash_handler_t* current_sector = &flash_handler_array[current_sector_pivot];
-    // pad current sector with trash data
-    memset(&sector[pivot], 0xFF, current_sector->length_bytes - pivot);
-    // write sector
-    flash_write_sector();
-    pivot_reset();  // reset pivot + buffer
+    // the rest of the sector stays erased, which is the 0xFF padding, only whole words are programmed
+    const size_t len = (pivot + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+    memset(&staging[staging_index].data[pivot], 0xFF, len - pivot);
+    staging_program(len);
+}
+
+static bool verify_token_matches(const verify_token_t* token, const fw_header_t* fw_header)
+{
+    return token->fw_size == fw_header->fw_size && token->crc == fw_header->crc && token->crc32 == fw_header->crc32
+           && token->flags == fw_header->flags && token->sequence == fw_header->sequence;
+}
+
+// removes the token if it stands for this header, the token of the other slot keeps its boots
+static void verify_token_forget(const fw_header_t* fw_header)
+{
+    verify_token_t token = {0};
+    if (verify_cache_load(&token) && verify_token_matches(&token, fw_header))
+    {
+        verify_cache_clear();
+    }
 }
 
 void flash_fw_reset(void)
 {
-    pivot_reset();
-    for (size_t i = 0; i < FLASH_HANDLER_ARRAY_SIZE; i++)
+    update_slot();
+    flash_program_wait();
+    program_failed = false;
+    for (size_t i = 0; i < STAGING_BUFFER_COUNT; i++)
     {
-        flash_handler_t* sector = &flash_handler_array[i];
+        staging[i].stale = true;
+    }
+    staging_index = 0;
+    pivot = 0;
+    reserved = 0;
+    staged_bytes = 0;
+    sector_pivot = 0;
+    journal_pending = 0;
+    journal_slot = 0;
+    journal_entry = 0;
+    journal_end = 0;
+    for (size_t i = 0; i < target->layout->sector_count; i++)
+    {
+        flash_handler_t* sector = &target->sectors[i];
         sector->used = false;
+        if (sector->erase == SECTOR_ERASE_QUEUED)
+        {
+            sector->erase = SECTOR_ERASE_NONE;
+        }
     }
     current_sector_pivot = 0;
+    // the slot is about to change, even an update of the same image leaves it incomplete for a while
+    verify_token_forget((const fw_header_t*) (uintptr_t) target->layout->sectors[0].start_addr);
+}
+
+void flash_fw_init(void)
+{
+    HAL_NVIC_SetPriority(FLASH_IRQn, 1, 0);
+    HAL_NVIC_EnableIRQ(FLASH_IRQn);
+}
+
+void flash_fw_erase_ahead(size_t fw_size)
+{
+    // the header shares the first sector with the beginning of the image
+    const size_t end = sizeof(fw_header_t) + fw_size;
+    size_t start = 0;
+    for (size_t i = 0; i < target->layout->sector_count && start < end; i++)
+    {
+        flash_handler_t* sector = &target->sectors[i];
+        // written or kept sectors already hold the new content
+        if (!sector->used && sector->erase == SECTOR_ERASE_NONE)
+        {
+            sector->erase = SECTOR_ERASE_QUEUED;
+        }
+        start += target->layout->sectors[i].size;
+    }
+    erase_poll();
 }
 
 int flash_fw_feed(const uint8_t* buf, size_t len)
 {
+    erase_poll();
     flash_fw_feed_internal(buf, len);
     return 0;
 }
 
-int flash_fw_flush(void)
+uint8_t* flash_fw_reserve(size_t* len)
 {
-    flash_fw_flush_internal();
+    flash_handler_t* current_sector = &target->sectors[current_sector_pivot];
+    // the whole reservation has to fit before the buffer being filled comes around again, a sector not started yet must be free
+    if (reserved == 0 && ((sector_pivot == 0 && current_sector->used) || pivot + *len > STAGING_BUFFER_COUNT * STAGING_BUFFER_SIZE))
+    {
+        return NULL;
+    }
+    const size_t position = pivot + reserved;
+    const size_t index = (staging_index + position / STAGING_BUFFER_SIZE) % STAGING_BUFFER_COUNT;
+    const size_t offset = position % STAGING_BUFFER_SIZE;
+    if (offset == 0 || reserved == 0)
+    {
+        staging_acquire_buffer(index);
+    }
+    if (*len > STAGING_BUFFER_SIZE - offset)
+    {
+        *len = STAGING_BUFFER_SIZE - offset;
+    }
+    reserved += *len;
+    return &staging[index].data[offset];
+}
+
+int flash_fw_commit(size_t len)
+{
+    erase_poll();
+    reserved = 0;
+    flash_fw_advance(len);
     return 0;
 }
 
-static uint16_t crc16_ccitt(const uint8_t* data, size_t len)
+void flash_fw_rollback(size_t len)
 {
-    uint16_t crc = 0xFFFF;
-    for (uint16_t i = 0; i < len; i++)
+    // the staging buffers past the pivot are expected to hold erased flash content
+    size_t position = pivot;
+    while (len > 0)
     {
-        crc ^= (uint16_t) data[i] << 8;
-        for (uint8_t j = 0; j < 8; j++)
-            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        const size_t index = (staging_index + position / STAGING_BUFFER_SIZE) % STAGING_BUFFER_COUNT;
+        const size_t offset = position % STAGING_BUFFER_SIZE;
+        const size_t step = (len < STAGING_BUFFER_SIZE - offset) ? len : STAGING_BUFFER_SIZE - offset;
+        memset(&staging[index].data[offset], 0xFF, step);
+        position += step;
+        len -= step;
     }
-    return crc;
+    reserved = 0;
 }
 
-// this function is called externally after the firmware is flashed
-bool fw_crc_check(uint16_t crc_recv, size_t fw_len)
+int flash_fw_flush(void)
+{
+    flash_fw_flush_internal();
+    // the image is read back right after, the last chunk has to be programmed
+    flash_program_wait();
+    journal_poll();
+    flash_program_wait();
+    erase_poll();
+    return program_failed ? -1 : 0;
+}
+
+static const fw_header_t* slot_header(const fw_slot_t* slot)
+{
+    return (const fw_header_t*) (uintptr_t) slot->layout->sectors[0].start_addr;
+}
+
+static const uint8_t* slot_image(const fw_slot_t* slot)
+{
+    return (const uint8_t*) (slot->layout->sectors[0].start_addr + sizeof(fw_header_t));
+}
+
+static size_t slot_size(const fw_slot_t* slot)
+{
+    return flash_slot_size(slot->layout);
+}
+
+static fw_slot_t* other_slot(const fw_slot_t* slot)
+{
+    return slot == &slots[0] ? &slots[1] : &slots[0];
+}
+
+static bool slot_has_header(const fw_slot_t* slot)
+{
+    return slot_header(slot)->magic == BOOT_INFO_MAGIC;
+}
+
+// the sequence numbers wrap, a header is newer when it is less than half the range ahead
+static bool sequence_newer(uint32_t sequence, uint32_t than)
+{
+    return (int32_t) (sequence - than) > 0;
+}
+
+// the slot with the newest header first, a slot without header last
+static void slots_newest_first(fw_slot_t* order[FW_SLOT_COUNT])
 {
-    flash_handler_t* first_sector = &flash_handler_array[0];
-    const uint8_t* data = (const uint8_t*) (first_sector->start_addr + sizeof(fw_header_t));
-    uint16_t crc = crc16_ccitt(data, fw_len);
+    const bool b_newer = slot_has_header(&slots[1])
+                         && (!slot_has_header(&slots[0]) || sequence_newer(slot_header(&slots[1])->sequence, slot_header(&slots[0])->sequence));
+    order[0] = b_newer ? &slots[1] : &slots[0];
+    order[1] = other_slot(order[0]);
+}
+
+// the image runs in place, its reset vector has to point into the slot it was written to
+static bool slot_image_linked(const fw_slot_t* slot)
+{
+    const uint32_t reset_handler = ((const uint32_t*) slot_image(slot))[1];
+    const uint32_t start = slot->layout->sectors[0].start_addr + sizeof(fw_header_t);
+    return reset_handler >= start && reset_handler < slot->layout->sectors[0].start_addr + slot_size(slot);
+}
+
+size_t get_max_fw_size()
+{
+    return flash_slots_max_fw_size();
+}
+
+static bool fw_crc16_check(const uint8_t* image, uint16_t crc_recv, size_t fw_len)
+{
+    uint16_t crc = crc16_ccitt(image, fw_len);
     printf("FW CRC CALC: 0x%x RECV: 0x%x\n", crc, crc_recv);
     return crc == crc_recv;
 }
 
-int fw_write_header(uint16_t crc_recv, size_t fw_len)
+static bool fw_crc32_check(const uint8_t* image, uint32_t crc_recv, size_t fw_len)
 {
-    flash_handler_t* current_sector = &flash_handler_array[current_sector_pivot];
-    if (pivot != 0 || current_sector->sector_id != FLASH_SECTOR_2)
+    uint32_t crc = crc_hw_calculate(image, fw_len);
+    printf("FW CRC32 CALC: 0x%" PRIx32 " RECV: 0x%" PRIx32 "\n", crc, crc_recv);
+    return crc == crc_recv;
+}
+
+// this function is called externally after the firmware is flashed
+bool fw_crc_check(const fw_image_info_t* info)
+{
+    const uint8_t* image = slot_image(target);
+    const bool crc_ok = info->has_crc32 ? fw_crc32_check(image, info->crc32, info->fw_size) : fw_crc16_check(image, info->crc16, info->fw_size);
+    if (crc_ok && !slot_image_linked(target))
+    {
+        printf("IMAGE NOT LINKED FOR SLOT %c\n", target->layout->name);
+        return false;
+    }
+    return crc_ok;
+}
+
+int fw_write_header(const fw_image_info_t* info)
+{
+    if (pivot != 0 || sector_pivot != 0 || current_sector_pivot != 0)
     {
-        printf("HEADER NOT BEING WRITTEN IN THE BEGINNING OF THE SECOND SECTOR\n");
+        printf("HEADER NOT BEING WRITTEN IN THE BEGINNING OF THE SLOT\n");
         return -1;
     }
     fw_header_t fw_header = {0};
     fw_header.magic = BOOT_INFO_MAGIC;
-    fw_header.fw_size = fw_len;
-    fw_header.crc = crc_recv;
+    fw_header.fw_size = info->fw_size;
+    fw_header.crc = info->crc16;
+    journal_end = sizeof(fw_header_t) + info->fw_size;
+    if (info->has_crc32)
+    {
+        fw_header.flags |= FW_HEADER_FLAG_CRC32;
+        fw_header.crc32 = info->crc32;
+    }
+    // the journal entries stay erased, they are programmed one by one as the update progresses
+    fw_header.flags |= FW_HEADER_FLAG_JOURNAL;
+    for (size_t i = 0; i < target->layout->sector_count; i++)
+    {
+        if (target->sectors[i].used)
+        {
+            fw_header.keep_mask |= 1u << i;
+        }
+    }
+    memset(fw_header.journal, 0xFF, sizeof(fw_header.journal));
+    // newer than both slots, the new image boots as soon as it verifies
+    fw_slot_t* order[FW_SLOT_COUNT];
+    slots_newest_first(order);
+    fw_header.sequence = slot_has_header(order[0]) ? slot_header(order[0])->sequence + 1 : 1;
     flash_fw_feed_internal((uint8_t*) &fw_header, sizeof(fw_header_t));
     return 0;
 }
 
-int fw_check_header(void)
+static int fw_check_slot(const fw_slot_t* slot)
 {
-    flash_handler_t* first_sector = &flash_handler_array[0];
-    fw_header_t* fw_header = (fw_header_t*) (first_sector->start_addr);
-    printf("FW HEADER - MAGIC: 0x%lx FW_SIZE: 0x%lx CRC: 0x%lx\n", fw_header->magic, fw_header->fw_size, fw_header->crc);
+    const fw_header_t* fw_header = slot_header(slot);
+    printf("SLOT %c HEADER - MAGIC: 0x%" PRIx32 " FW_SIZE: 0x%" PRIx32 " CRC: 0x%" PRIx32 " FLAGS: 0x%" PRIx32 " SEQUENCE: %" PRIu32 "\n",
+           slot->layout->name,
+           fw_header->magic,
+           fw_header->fw_size,
+           fw_header->crc,
+           fw_header->flags,
+           fw_header->sequence);
     if (fw_header->magic != BOOT_INFO_MAGIC)
     {
         printf("MAGIC NUMBER MISMATCH\n");
         return -1;
     }
-    const bool ret = fw_crc_check(fw_header->crc, fw_header->fw_size);
+    if (fw_header->fw_size > slot_size(slot) - sizeof(fw_header_t))
+    {
+        printf("FW SIZE TOO BIG\n");
+        return -1;
+    }
+    bool ret = false;
+    if (fw_header->flags & FW_HEADER_FLAG_CRC32)
+    {
+        ret = fw_crc32_check(slot_image(slot), fw_header->crc32, fw_header->fw_size);
+    }
+    else
+    {
+        ret = fw_crc16_check(slot_image(slot), fw_header->crc, fw_header->fw_size);
+    }
     if (!ret)
     {
         printf("CRC MISMATCH\n");
         return -1;
     }
+    if (!slot_image_linked(slot))
+    {
+        printf("IMAGE NOT LINKED FOR SLOT %c\n", slot->layout->name);
+        return -1;
+    }
     return 0;
+}
+
+// the update goes to the slot not holding the image that boots, a failed or interrupted update is written over
+static fw_slot_t* update_slot(void)
+{
+    if (target_selected)
+    {
+        return target;
+    }
+    fw_slot_t* order[FW_SLOT_COUNT];
+    slots_newest_first(order);
+    // without a valid image the newest attempt is continued
+    target = order[0];
+    for (size_t i = 0; i < FW_SLOT_COUNT; i++)
+    {
+        if (fw_check_slot(order[i]) == 0)
+        {
+            target = other_slot(order[i]);
+            break;
+        }
+    }
+    target_selected = true;
+    printf("UPDATES GO TO SLOT %c\n", target->layout->name);
+    return target;
+}
+
+int fw_check_header(void)
+{
+    return fw_check_slot(update_slot());
+}
+
+// whether a token matching the header still stands for this boot
+static bool verify_token_trusted(const verify_token_t* token)
+{
+#if VERIFY_POLICY == VERIFY_POLICY_EVERY_N
+    return token->boots + 1 < VERIFY_EVERY_N;
+#elif VERIFY_POLICY == VERIFY_POLICY_AFTER_UPDATE
+    return true;
+#else
+    return false;
+#endif
+}
+
+static int slot_boot_check(const fw_slot_t* slot, bool* verified)
+{
+    const fw_header_t* fw_header = slot_header(slot);
+    verify_token_t token = {0};
+    *verified = false;
+    if (VERIFY_POLICY != VERIFY_POLICY_ALWAYS && fw_header->magic == BOOT_INFO_MAGIC
+        && fw_header->fw_size <= slot_size(slot) - sizeof(fw_header_t) && verify_cache_load(&token) && verify_token_matches(&token, fw_header)
+        && verify_token_trusted(&token))
+    {
+        token.boots++;
+        verify_cache_store(&token);
+        printf("SLOT %c CRC CHECK SKIPPED, VERIFIED %" PRIu32 " BOOTS AGO\n", slot->layout->name, token.boots);
+        return 0;
+    }
+    if (fw_check_slot(slot))
+    {
+        verify_token_forget(fw_header);
+        return -1;
+    }
+    *verified = true;
+    if (VERIFY_POLICY != VERIFY_POLICY_ALWAYS)
+    {
+        token = (verify_token_t){fw_header->fw_size, fw_header->crc, fw_header->crc32, fw_header->flags, fw_header->sequence, 0};
+        verify_cache_store(&token);
+    }
+    return 0;
+}
+
+int fw_boot_check(size_t* slot, bool* verified)
+{
+    fw_slot_t* order[FW_SLOT_COUNT];
+    slots_newest_first(order);
+    for (size_t i = 0; i < FW_SLOT_COUNT; i++)
+    {
+        if (slot_boot_check(order[i], verified) == 0)
+        {
+            *slot = (size_t) (order[i] - slots);
+            // an update requested over the link from now on goes to the other slot
+            target = other_slot(order[i]);
+            target_selected = true;
+            return 0;
+        }
+        printf("SLOT %c DOES NOT BOOT\n", order[i]->layout->name);
+    }
+    return -1;
+}
+
+const uint8_t* fw_base_image(const fw_image_info_t* base)
+{
+    // the installed image stays in the other slot while the update is written, the delta reads it in place
+    const fw_slot_t* installed = other_slot(update_slot());
+    const fw_header_t* fw_header = slot_header(installed);
+    if (fw_header->magic != BOOT_INFO_MAGIC || fw_header->fw_size != base->fw_size)
+    {
+        printf("DELTA BASE NOT INSTALLED\n");
+        return NULL;
+    }
+    const bool crc_match = (fw_header->flags & FW_HEADER_FLAG_CRC32) ? fw_header->crc32 == base->crc32 : fw_header->crc == base->crc16;
+    if (!crc_match || fw_check_slot(installed))
+    {
+        printf("DELTA BASE MISMATCH\n");
+        return NULL;
+    }
+    return slot_image(installed);
+}
+
+size_t fw_base_intact(void)
+{
+    // the update never overwrites the slot the delta reads
+    return 0;
+}
+
+static size_t sector_image_size(size_t index)
+{
+    // the header shares the first sector with the beginning of the image
+    return target->layout->sectors[index].size - (index == 0 ? sizeof(fw_header_t) : 0);
+}
+
+size_t flash_sector_hashes(flash_sector_hash_t* hashes, size_t max)
+{
+    const uint8_t* image = slot_image(update_slot());
+    size_t count = 0;
+    for (; count < target->layout->sector_count && count < max; count++)
+    {
+        hashes[count].size = sector_image_size(count);
+        // the first sector is rewritten for the new header anyway
+        hashes[count].keepable = count != 0;
+        hashes[count].crc32 = crc_hw_calculate(image, hashes[count].size);
+        image += hashes[count].size;
+    }
+    return count;
+}
+
+size_t flash_keep_sectors(uint32_t mask, size_t fw_size)
+{
+    size_t kept = 0;
+    size_t image_offset = 0;
+    for (size_t i = 0; i < target->layout->sector_count; i++)
+    {
+        const size_t size = sector_image_size(i);
+        // the first sector carries the header, it is never keepable
+        if ((mask & (1u << i)) && i != 0 && image_offset < fw_size)
+        {
+            kept += (fw_size - image_offset < size) ? (fw_size - image_offset) : size;
+            target->sectors[i].used = true;
+            TRACE(TRACE_KEEP_SECTOR, target->layout->sectors[i].start_addr);
+        }
+        image_offset += size;
+    }
+    return kept;
+}
+
+bool fw_resume(const fw_image_info_t* info, fw_resume_info_t* resume)
+{
+    const fw_header_t* fw_header = (const fw_header_t*) (uintptr_t) target->layout->sectors[0].start_addr;
+    const bool crc_match = fw_header->crc == info->crc16
+                           && (!info->has_crc32 || ((fw_header->flags & FW_HEADER_FLAG_CRC32) && fw_header->crc32 == info->crc32));
+    if (fw_header->magic != BOOT_INFO_MAGIC || !(fw_header->flags & FW_HEADER_FLAG_JOURNAL) || fw_header->fw_size != info->fw_size
+        || !crc_match)
+    {
+        printf("NO UPDATE TO RESUME\n");
+        return false;
+    }
+    size_t entries = 0;
+    while (entries < FW_HEADER_JOURNAL_SIZE && fw_header->journal[entries] != 0xFFFFFFFFU)
+    {
+        entries++;
+    }
+    // whole staging buffers are journaled, the first one holds the header
+    const size_t programmed = entries ? fw_header->journal[entries - 1] : 0;
+    if (programmed <= sizeof(fw_header_t) || programmed % STAGING_BUFFER_SIZE != 0
+        || programmed - sizeof(fw_header_t) > info->fw_size)
+    {
+        printf("NO UPDATE TO RESUME\n");
+        return false;
+    }
+
+    const uint32_t keep_mask = fw_header->keep_mask;
+    const size_t feed_size = info->fw_size - flash_keep_sectors(keep_mask, info->fw_size);
+    if (programmed - sizeof(fw_header_t) > feed_size)
+    {
+        flash_fw_reset();
+        return false;
+    }
+    // the sectors programmed so far are not erased again, the next buffer goes right after them
+    size_t remaining = programmed;
+    while (remaining > 0)
+    {
+        const size_t size = target->layout->sectors[current_sector_pivot].size;
+        target->sectors[current_sector_pivot].used = true;
+        if (remaining < size)
+        {
+            sector_pivot = remaining;
+            break;
+        }
+        remaining -= size;
+        increment_current_sector();
+    }
+    staged_bytes = programmed;
+    journal_slot = entries;
+    journal_entry = programmed;
+    journal_end = sizeof(fw_header_t) + info->fw_size;
+    journal_pending = programmed;
+    printf("RESUMING UPDATE AT ADDR: 0x%08lx\n", target->layout->sectors[current_sector_pivot].start_addr + sector_pivot);
+
+    resume->offset = programmed - sizeof(fw_header_t);
+    resume->feed_size = feed_size;
+    resume->keep_mask = keep_mask;
+    return true;
+}
+
+void flash_fw_layout(flash_layout_t* layout)
+{
+    // chunks that fill the staging buffers exactly are received in place
+    layout->chunk_size = STAGING_BUFFER_SIZE;
+    const fw_slot_t* slot = update_slot();
+    size_t count = 0;
+    for (; count < slot->layout->sector_count && count < FLASH_LAYOUT_SECTORS_MAX; count++)
+    {
+        layout->sectors[count].address = slot->layout->sectors[count].start_addr;
+        layout->sectors[count].size = slot->layout->sectors[count].size;
+    }
+    layout->sector_count = count;
+    // the sectors are those of the next update, the installed firmware is the one in the other slot
+    const fw_header_t* fw_header = slot_header(other_slot(slot));
+    layout->installed = fw_header->magic == BOOT_INFO_MAGIC;
+    if (layout->installed)
+    {
+        layout->image.fw_size = fw_header->fw_size;
+        layout->image.crc16 = fw_header->crc;
+        layout->image.has_crc32 = (fw_header->flags & FW_HEADER_FLAG_CRC32) != 0;
+        layout->image.crc32 = layout->image.has_crc32 ? fw_header->crc32 : 0;
+    }
 }
\ No newline at end of file
@@ -1,15 +1,34 @@
 #pragma once
 
+#include "serial_flasher.h"
+
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/**
+ * @brief Enable the FLASH interrupt driving the background sector erases.
+ */
+void flash_fw_init(void);
+
+/**
+ * @brief Start erasing every sector the firmware needs in the background.
+ *
+ * Called after fw_write_header. The sectors are erased with HAL_FLASHEx_Erase_IT while
+ * data keeps arriving. Programming a chunk only waits for the erase run in progress, a
+ * sector the background erase did not reach yet is erased synchronously before its first chunk.
+ * Written and kept sectors are skipped.
+ *
+ * @param fw_size Size of the firmware announced in CMD_START.
+ */
+void flash_fw_erase_ahead(size_t fw_size);
+
 /**
  * @brief Feed firmware data into flash memory.
  *
  * Buffers a chunk of firmware data to be written in flash. This function is typically
- * called repeatedly as firmware data packets are received. The data will be written when the sector is full or when flash_fw_flush is
- * called
+ * called repeatedly as firmware data packets are received. The data is programmed a staging buffer at a time
+ * while the next one fills, the rest is written when flash_fw_flush is called
  *
  * @param buf Pointer to the firmware data buffer.
  * @param len Number of bytes to write.
@@ -18,10 +37,42 @@
  */
 int flash_fw_feed(const uint8_t* buf, size_t len);
 
+/**
+ * @brief Reserve space in the staging buffers to receive firmware data in place.
+ *
+ * The first call reserves from the current write position, the next ones continue after the
+ * bytes already reserved and may span into the following staging buffer. The data becomes part
+ * of the firmware once flash_fw_commit is called, flash_fw_rollback gives the space back.
+ *
+ * @param len In: bytes left to reserve. Out: contiguous bytes granted, up to the end of a staging buffer.
+ *
+ * @return uint8_t* Pointer to the granted bytes, NULL if the staging buffers cannot hold all len bytes.
+ */
+uint8_t* flash_fw_reserve(size_t* len);
+
+/**
+ * @brief Commit data received in place with flash_fw_reserve.
+ *
+ * Works like flash_fw_feed without copying the data.
+ *
+ * @param len Number of bytes to commit, the whole reserved length.
+ *
+ * @return int Status code (0 for success, negative for error).
+ */
+int flash_fw_commit(size_t len);
+
+/**
+ * @brief Give back space reserved with flash_fw_reserve.
+ *
+ * @param len Number of bytes that were reserved.
+ */
+void flash_fw_rollback(size_t len);
+
 /**
  * @brief Flush pending firmware data to flash memory.
  *
- * Writes the current buffered data in flash, it pads the remaining address of the sector with 0xFF
+ * Writes the current buffered data in flash and waits until it is programmed, the remaining
+ * addresses of the sector were erased and read as 0xFF
  *
  * @return int Status code (0 for success, negative for error).
  */
@@ -32,13 +83,15 @@ int flash_fw_flush(void);
  *
  * Resets any internal state related to firmware programming and
  * prepares the system for a new firmware update or normal operation.
+ * The first call picks the slot written by updates, the one not holding the newest valid image.
+ * The cached verification of the installed image is removed.
  */
 void flash_fw_reset(void);
 
 /**
  * @brief Get the maximum supported firmware size.
  *
- * @return size_t Maximum firmware size in bytes.
+ * @return size_t Maximum firmware size in bytes, the image fits either slot.
  */
 size_t get_max_fw_size(void);
 
@@ -46,15 +99,16 @@ size_t get_max_fw_size(void);
  * @brief Verify the CRC of the received firmware.
  *
  * Compares the received CRC value against a calculated CRC over
- * the programmed firmware data.
+ * the programmed firmware data. When the host sent a CRC32 the image
+ * is verified with the CRC unit, otherwise the software CRC16 is used.
+ * The image also has to be linked to run from the slot it was written to.
  *
- * @param crc_recv CRC value received from the host.
- * @param fw_len Length of the firmware in bytes.
+ * @param info Firmware image description received from the host.
  *
  * @return true If the CRC matches.
  * @return false If the CRC check fails.
  */
-bool fw_crc_check(uint16_t crc_recv, size_t fw_len);
+bool fw_crc_check(const fw_image_info_t* info);
 
 /**
  * @brief Buffers the firmware header to flash.
@@ -62,21 +116,108 @@ bool fw_crc_check(uint16_t crc_recv, size_t fw_len);
  * Stores metadata such as firmware length and CRC into a
  * header region for validation during boot.
  *
- * The data will be written when the sector is full or when flash_fw_flush is called
+ * The data will be written when the staging buffer is full or when flash_fw_flush is called
  *
- * @param crc_recv CRC value of the firmware.
- * @param fw_len Length of the firmware in bytes.
+ * @param info Firmware image description received from the host.
  *
  * @return int Status code (0 for success, negative for error).
  */
-int fw_write_header(uint16_t crc_recv, size_t fw_len);
+int fw_write_header(const fw_image_info_t* info);
 
 /**
- * @brief Validate the firmware header stored in flash.
+ * @brief Validate the firmware header and image of the slot written by updates.
  *
- * Checks the integrity and correctness of the firmware header,
- * typically during system startup or before firmware execution.
+ * Checks the header, the image CRC and that the image is linked for the slot,
+ * typically right after an update.
  *
  * @return int Status code (0 if the header is valid, negative for error).
  */
 int fw_check_header(void);
+
+/**
+ * @brief Pick the firmware slot to boot.
+ *
+ * The slot with the newest header sequence is checked first, the other one is the fallback.
+ * The CRC is computed unless VERIFY_POLICY lets a token stored by an earlier check of the same header stand in
+ * for it. A successful check stores a new token, a failed one removes it. flash_fw_reset() removes it as well.
+ * Updates requested afterwards go to the slot not picked.
+ *
+ * @param slot Set to the slot to boot, 0 for A and 1 for B.
+ * @param verified Set when the CRC was computed on this boot, cleared when the token was trusted.
+ *
+ * @return int Status code (0 if a slot may be started, negative for error).
+ */
+int fw_boot_check(size_t* slot, bool* verified);
+
+/**
+ * @brief Locate the installed firmware a delta update was made against.
+ *
+ * The installed firmware is the one in the slot not written by the update. Its header has to describe
+ * the same size and CRC as base and the image has to verify.
+ *
+ * @param base Installed image description announced by the host.
+ *
+ * @return const uint8_t* Start of the installed image, NULL if it does not match.
+ */
+const uint8_t* fw_base_image(const fw_image_info_t* base);
+
+/**
+ * @brief Get the first image offset not overwritten by the firmware being flashed.
+ *
+ * The delta reads the other slot, which the update never writes.
+ *
+ * @return size_t Always 0.
+ */
+size_t fw_base_intact(void);
+
+/**
+ * @brief Compute the CRC32 of the image bytes of every sector of the slot written by updates.
+ *
+ * That slot is not the running one, it holds an older image or none, so the hashes seldom match
+ * a new image. The first sector is hashed without the firmware header. It is not keepable, the new
+ * header is programmed into it on every update.
+ *
+ * @param hashes Array receiving one entry per sector, in flashing order.
+ * @param max Number of entries hashes can hold.
+ *
+ * @return size_t Number of sectors hashed.
+ */
+size_t flash_sector_hashes(flash_sector_hash_t* hashes, size_t max);
+
+/**
+ * @brief Keep unchanged sectors during the update started after flash_fw_reset.
+ *
+ * Kept sectors are skipped by the feed and never erased. The first sector always receives
+ * the new header, it is reported not keepable and ignored in the mask.
+ *
+ * @param mask Bit i set keeps sector i of the slot written by updates.
+ * @param fw_size Size of the new firmware.
+ *
+ * @return size_t Number of firmware bytes provided by the kept sectors, they are not fed.
+ */
+size_t flash_keep_sectors(uint32_t mask, size_t fw_size);
+
+/**
+ * @brief Restore the flash state of an interrupted update of the same image.
+ *
+ * Called after flash_fw_reset. Every programmed staging buffer appends its end to the journal
+ * of the firmware header, which survives a reset or a power loss. When the header describes
+ * the same size and CRCs as info, the sectors written so far and the kept ones are marked used
+ * and feeding continues right after the last journaled byte.
+ *
+ * @param info Firmware image description received from the host.
+ * @param resume Filled with the DATA offset to continue from, the bytes to feed and the kept sectors.
+ *
+ * @return true If the update can be resumed, false if the next update starts over.
+ */
+bool fw_resume(const fw_image_info_t* info, fw_resume_info_t* resume);
+
+/**
+ * @brief Describe the sectors of the next update and the installed firmware for CMD_GET_INFO.
+ *
+ * The sectors are those of the slot written by updates. The installed firmware is the one in the other
+ * slot, reported as its header describes it, without verifying the image.
+ *
+ * @param layout Filled with the staging buffer size, the sectors of the slot and the header.
+ */
+void flash_fw_layout(flash_layout_t* layout);
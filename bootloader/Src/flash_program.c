@@ -0,0 +1,146 @@
+#include "flash_program.h"
+
+#include "main.h"
+#include "profile.h"
+
+// power of two, the indexes below wrap freely
+#define FLASH_PROGRAM_QUEUE_SIZE (4u)
+#define FLASH_SR_ERRORS          (FLASH_SR_SOP | FLASH_SR_WRPERR | FLASH_SR_PGAERR | FLASH_SR_PGPERR | FLASH_SR_PGSERR | FLASH_SR_RDERR)
+
+typedef struct
+{
+    uint32_t address;
+    const uint32_t* data;
+    size_t length_words;
+    flash_program_done_t done;
+} flash_program_job_t;
+
+static flash_program_job_t queue[FLASH_PROGRAM_QUEUE_SIZE];
+static volatile size_t queue_head = 0;  // job being programmed, advanced by the FLASH interrupt
+static volatile size_t queue_tail = 0;  // next free slot, advanced by flash_program_submit()
+// the engine owns the flash controller until the queue drains
+static volatile bool program_active = false;
+static volatile int program_status = 0;  // sticky until flash_program_wait()
+static size_t word_index = 0;
+static int job_status = 0;
+
+static void program_word(void)
+{
+    const flash_program_job_t* job = &queue[queue_head % FLASH_PROGRAM_QUEUE_SIZE];
+    *(volatile uint32_t*) (job->address + word_index * sizeof(uint32_t)) = job->data[word_index];
+}
+
+static void program_job_reset(void)
+{
+    word_index = 0;
+    job_status = 0;
+    prof_start(PROF_PROGRAM);
+}
+
+static void program_start(void)
+{
+    program_active = true;
+    program_job_reset();
+    HAL_FLASH_Unlock();
+    FLASH->SR = FLASH_SR_EOP | FLASH_SR_ERRORS;
+    FLASH->CR &= ~FLASH_CR_PSIZE;
+    // EOP is only flagged with EOPIE set, each completed word raises the interrupt
+    FLASH->CR |= FLASH_PSIZE_WORD | FLASH_CR_PG | FLASH_CR_EOPIE | FLASH_CR_ERRIE;
+    program_word();
+}
+
+static void program_stop(void)
+{
+    FLASH->CR &= ~(FLASH_CR_PG | FLASH_CR_EOPIE | FLASH_CR_ERRIE);
+    HAL_FLASH_Lock();
+    program_active = false;
+}
+
+int flash_program_submit(uint32_t address, const uint8_t* data, size_t len, flash_program_done_t done)
+{
+    if ((address % sizeof(uint32_t)) || ((uintptr_t) data % sizeof(uint32_t)) || (len % sizeof(uint32_t)) || len == 0)
+    {
+        return -1;
+    }
+    if (queue_tail - queue_head >= FLASH_PROGRAM_QUEUE_SIZE)
+    {
+        return -1;
+    }
+    flash_program_job_t* job = &queue[queue_tail % FLASH_PROGRAM_QUEUE_SIZE];
+    job->address = address;
+    job->data = (const uint32_t*) data;
+    job->length_words = len / sizeof(uint32_t);
+    job->done = done;
+    // published before the engine is checked, an interrupt finishing the previous job picks it up
+    queue_tail++;
+    if (!program_active)
+    {
+        program_start();
+    }
+    return 0;
+}
+
+bool flash_program_busy(void)
+{
+    return program_active || queue_head != queue_tail;
+}
+
+int flash_program_wait(void)
+{
+    while (flash_program_busy())
+    {
+    }
+    const int status = program_status;
+    program_status = 0;
+    return status;
+}
+
+bool flash_program_irq(void)
+{
+    if (!program_active)
+    {
+        return false;
+    }
+    const flash_program_job_t* job = &queue[queue_head % FLASH_PROGRAM_QUEUE_SIZE];
+    const uint32_t status = FLASH->SR;
+    if (status & FLASH_SR_ERRORS)
+    {
+        // the rest of the job is dropped, the image CRC check fails later on
+        FLASH->SR = status & (FLASH_SR_EOP | FLASH_SR_ERRORS);
+        job_status = -1;
+        word_index = job->length_words;
+    }
+    else if (status & FLASH_SR_EOP)
+    {
+        FLASH->SR = FLASH_SR_EOP;
+        word_index++;
+    }
+    else
+    {
+        return true;
+    }
+
+    if (word_index < job->length_words)
+    {
+        program_word();
+        return true;
+    }
+    prof_stop(PROF_PROGRAM);
+    if (job_status)
+    {
+        program_status = -1;
+    }
+    if (job->done != NULL)
+    {
+        job->done(job->address, job_status);
+    }
+    queue_head++;
+    if (queue_head != queue_tail)
+    {
+        program_job_reset();
+        program_word();
+        return true;
+    }
+    program_stop();
+    return true;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Function pointer type called when a programming job completes (interrupt context).
+ *
+ * @param address Flash address of the job.
+ * @param status 0 if every word was programmed, -1 on a flash error.
+ */
+typedef void (*flash_program_done_t)(uint32_t address, int status);
+
+/**
+ * @brief Queue a programming job, words are written one at a time from the FLASH end-of-operation interrupt.
+ *
+ * Interrupts stay enabled. The data must stay untouched until the job completes and the target must be erased.
+ * No erase may be started while jobs are pending, see flash_program_busy().
+ *
+ * @param address Word aligned flash address.
+ * @param data Word aligned data.
+ * @param len Number of bytes, a multiple of 4.
+ * @param done Optional completion callback.
+ * @return int 0 if queued, -1 if the queue is full or the job is invalid.
+ */
+int flash_program_submit(uint32_t address, const uint8_t* data, size_t len, flash_program_done_t done);
+
+/**
+ * @brief Check whether programming jobs are pending.
+ *
+ * @return true While a job is queued or being programmed.
+ */
+bool flash_program_busy(void);
+
+/**
+ * @brief Wait until every queued job completed.
+ *
+ * @return int 0 if all jobs since the last call succeeded, -1 if one of them failed.
+ */
+int flash_program_wait(void);
+
+/**
+ * @brief Handle the FLASH interrupt while programming.
+ *
+ * @return true If the interrupt belonged to the programming engine, false to pass it to HAL_FLASH_IRQHandler.
+ */
+bool flash_program_irq(void);
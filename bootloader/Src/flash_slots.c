@@ -0,0 +1,44 @@
+#include "flash_slots.h"
+
+#include "main.h"
+
+static const flash_slot_sector_t slot_a_sectors[] = {
+    {FLASH_SECTOR_2, FLASH_SECTOR_2_START_ADDR, FLASH_SECTOR_2_SIZE},
+    {FLASH_SECTOR_3, FLASH_SECTOR_3_START_ADDR, FLASH_SECTOR_3_SIZE},
+    {FLASH_SECTOR_4, FLASH_SECTOR_4_START_ADDR, FLASH_SECTOR_4_SIZE},
+};
+
+static const flash_slot_sector_t slot_b_sectors[] = {
+    {FLASH_SECTOR_5, FLASH_SECTOR_5_START_ADDR, FLASH_SECTOR_5_SIZE},
+};
+
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+
+const flash_slot_t flash_slots[FW_SLOT_COUNT] = {
+    {slot_a_sectors, ARRAY_SIZE(slot_a_sectors), 'A'},
+    {slot_b_sectors, ARRAY_SIZE(slot_b_sectors), 'B'},
+};
+
+_Static_assert(FW_SLOT_A_ADDR == FLASH_SECTOR_2_START_ADDR && FW_SLOT_B_ADDR == FLASH_SECTOR_5_START_ADDR, "FIRMWARE SLOT MISMATCH");
+_Static_assert(ARRAY_SIZE(slot_a_sectors) <= FLASH_SLOT_SECTORS_MAX && ARRAY_SIZE(slot_b_sectors) <= FLASH_SLOT_SECTORS_MAX,
+               "FLASH_SLOT_SECTORS_MAX TOO SMALL");
+
+uint32_t flash_slot_size(const flash_slot_t* slot)
+{
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < slot->sector_count; i++)
+    {
+        size += slot->sectors[i].size;
+    }
+    return size;
+}
+
+uint32_t flash_slots_max_fw_size(void)
+{
+    uint32_t max = flash_slot_size(&flash_slots[0]);
+    for (uint32_t i = 1; i < FW_SLOT_COUNT; i++)
+    {
+        max = flash_slot_size(&flash_slots[i]) < max ? flash_slot_size(&flash_slots[i]) : max;
+    }
+    return max - FW_HEADER_SIZE;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <boot_config.h>
+
+#include <stdint.h>
+
+/**
+ * @brief Most sectors a firmware slot spans.
+ */
+#define FLASH_SLOT_SECTORS_MAX (3u)
+
+/**
+ * @brief A flash sector of a firmware slot.
+ */
+typedef struct
+{
+    uint32_t sector_id;  // e.g.: FLASH_SECTOR_2
+    uint32_t start_addr;
+    uint32_t size;
+} flash_slot_sector_t;
+
+/**
+ * @brief The sectors of a firmware slot.
+ */
+typedef struct
+{
+    const flash_slot_sector_t* sectors;  // the first one starts with the firmware header
+    uint32_t sector_count;
+    char name;
+} flash_slot_t;
+
+/**
+ * @brief Layout of the firmware slots, constant and in flash.
+ *
+ * flash_handler.c keeps the erase state of these sectors in RAM. update_api.c runs for the application, which owns
+ * the RAM, and reads nothing else.
+ */
+extern const flash_slot_t flash_slots[FW_SLOT_COUNT];
+
+/**
+ * @brief Get the size of a slot.
+ *
+ * @param slot Slot from flash_slots.
+ *
+ * @return uint32_t Bytes of all its sectors, firmware header included.
+ */
+uint32_t flash_slot_size(const flash_slot_t* slot);
+
+/**
+ * @brief Get the largest firmware an update may write.
+ *
+ * The host does not know which slot the next update goes to, the image has to fit both.
+ *
+ * @return uint32_t Image bytes, firmware header excluded.
+ */
+uint32_t flash_slots_max_fw_size(void);
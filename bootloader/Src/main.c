@@ -1,22 +1,31 @@
 #include "main.h"
 
 #include "boot_config.h"
+#include "crc_handler.h"
 #include "flash_handler.h"
 #include "uart_handler.h"
+#include "update_api.h"
 
+#include <console.h>
 #include <errno.h>
+#include <profile.h>
 #include <serial_flasher.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <trace.h>
 #include <unistd.h>
 
 UART_HandleTypeDef huart2;
 UART_HandleTypeDef huart1;
+DMA_HandleTypeDef hdma_usart1_rx;
+DMA_HandleTypeDef hdma_usart2_tx;
 
 void SystemClock_Config(void);
 static void MX_GPIO_Init(void);
+static void MX_DMA_Init(void);
 static void MX_USART2_UART_Init(void);
 static void MX_USART1_UART_Init(void);
 
@@ -26,34 +35,182 @@ void blink(int delay_ms)
     HAL_Delay(delay_ms);
 }
 
+#ifdef RAM_ISR
+// 16 system exceptions then the interrupts up to SPI4, VTOR needs the size rounded up to a power of two as alignment
+#define VECTOR_TABLE_WORDS (16u + (uint32_t) SPI4_IRQn + 1u)
+extern const uint32_t g_pfnVectors[];
+static uint32_t ram_vector_table[VECTOR_TABLE_WORDS] __attribute__((aligned(512)));
+
+// exceptions taken while the flash is busy must not fetch their vector from it
+static void relocate_vector_table(void)
+{
+    memcpy(ram_vector_table, g_pfnVectors, sizeof(ram_vector_table));
+    __DSB();
+    SCB->VTOR = (uint32_t) ram_vector_table;
+    __DSB();
+}
+#endif
+
+// time the host has after the reset to ask for DFU mode over USART1, 0 boots a valid image right away
+#ifndef DFU_WINDOW_MS
+#define DFU_WINDOW_MS (100u)
+#endif
+
+// the header of the PING frame asking for DFU mode, SOF | VER | CMD | LEN(4), see serial_flasher.c
+// the DMA ring keeps no framing error flags so a break cannot be told from a null byte
+#define DFU_REQUEST_HEADER_SIZE  (7u)
+#define DFU_REQUEST_SOF          (0xA5u)
+#define DFU_REQUEST_VER_V1       (0x01u)
+#define DFU_REQUEST_VER_V2       (0x02u)
+#define DFU_REQUEST_CMD_PING     (0x01u)
+#define DFU_REQUEST_PING_LEN_MAX (3u) // window | max frame payload
+
+typedef enum
+{
+    DFU_REQUEST_NONE,
+    DFU_REQUEST_BUTTON,
+    DFU_REQUEST_BOOT_INFO,
+    DFU_REQUEST_NO_IMAGE,
+    DFU_REQUEST_UART,
+} dfu_request_t;
+
+static const char* get_dfu_request_string(const dfu_request_t request)
+{
+    switch (request)
+    {
+        case DFU_REQUEST_BUTTON:
+            return "BUTTON";
+        case DFU_REQUEST_BOOT_INFO:
+            return "FIRMWARE UPDATE RESET";
+        case DFU_REQUEST_NO_IMAGE:
+            return "NO VALID IMAGE";
+        case DFU_REQUEST_UART:
+            return "UART";
+        default:
+            return "NONE";
+    }
+}
+
 static volatile bool button_pressed = false;
-bool try_enter_DFU_mode()
+
+// requests known at reset, no need to wait for them
+static dfu_request_t dfu_request_at_reset(void)
+{
+    if (HAL_GPIO_ReadPin(B1_GPIO_Port, B1_Pin) == GPIO_PIN_RESET)
+    {
+        return DFU_REQUEST_BUTTON;
+    }
+    if (bootloader_api_ptr->boot_info.magic == BOOT_INFO_MAGIC
+        && (reset_reason_e) bootloader_api_ptr->boot_info.reset_reason_uint == FIRMWARE_UPDATE)
+    {
+        return DFU_REQUEST_BOOT_INFO;
+    }
+    return DFU_REQUEST_NONE;
+}
+
+// checks the header bytes received so far, false once one of them cannot start a PING frame
+static bool dfu_request_header_valid(const uint8_t* header, size_t len)
+{
+    if (len > 0 && header[0] != DFU_REQUEST_SOF)
+    {
+        return false;
+    }
+    if (len > 1 && header[1] != DFU_REQUEST_VER_V1 && header[1] != DFU_REQUEST_VER_V2)
+    {
+        return false;
+    }
+    if (len > 2 && header[2] != DFU_REQUEST_CMD_PING)
+    {
+        return false;
+    }
+    if (len == DFU_REQUEST_HEADER_SIZE)
+    {
+        const uint32_t payload_len = (uint32_t) header[3] | ((uint32_t) header[4] << 8) | ((uint32_t) header[5] << 16)
+                                     | ((uint32_t) header[6] << 24);
+        return payload_len <= DFU_REQUEST_PING_LEN_MAX;
+    }
+    return true;
+}
+
+// the request bytes stay in the receive ring, recv_firmware() answers the PING
+static bool uart_dfu_request(void)
+{
+    uint8_t header[DFU_REQUEST_HEADER_SIZE];
+    size_t len = uart1_peek(header, sizeof(header));
+    while (len > 0)
+    {
+        if (dfu_request_header_valid(header, len))
+        {
+            // a partial header is completed by the next wake up
+            return len == DFU_REQUEST_HEADER_SIZE;
+        }
+        // line noise, or a stray SOF, the header may start on the next byte
+        uart1_recv(header, 1, 0);
+        len = uart1_peek(header, sizeof(header));
+    }
+    return false;
+}
+
+// the window opened at window_start, the image check already ran in it
+static dfu_request_t wait_dfu_request(uint32_t window_start)
 {
-    button_pressed = false;
-    bool dfu = (bootloader_api_ptr->boot_info.magic == BOOT_INFO_MAGIC
-                && (reset_reason_e) bootloader_api_ptr->boot_info.reset_reason_uint == FIRMWARE_UPDATE);
-    const uint16_t delay_ms = 1000u;
-    const int num_tries = 3;
-    for (int i = 0; i < num_tries && !dfu; i++)
+    while (true)
+    {
+        if (button_pressed)
+        {
+            return DFU_REQUEST_BUTTON;
+        }
+        if (uart_dfu_request())
+        {
+            return DFU_REQUEST_UART;
+        }
+        if (HAL_GetTick() - window_start >= DFU_WINDOW_MS)
+        {
+            return DFU_REQUEST_NONE;
+        }
+        // woken by the SysTick, the B1 EXTI or the USART1 idle line
+        __WFI();
+    }
+}
+
+static dfu_request_t decide_boot(void)
+{
+    const uint32_t window_start = HAL_GetTick();
+    dfu_request_t request = dfu_request_at_reset();
+    bool verified = false;
+    size_t slot = 0;
+    if (request == DFU_REQUEST_NONE && fw_boot_check(&slot, &verified) != 0)
+    {
+        request = DFU_REQUEST_NO_IMAGE;
+    }
+    bootloader_api_ptr->boot_info.boot_flags = verified ? BOOT_FLAG_IMAGE_VERIFIED : 0;
+    bootloader_api_ptr->boot_info.boot_slot = (uint32_t) slot;
+    if (request == DFU_REQUEST_NONE)
     {
-        printf("Booting in %i ms\n", (num_tries - i) * delay_ms);
-        dfu |= button_pressed;
-        HAL_Delay(delay_ms);
+        request = wait_dfu_request(window_start);
     }
-    return dfu;
+    return request;
 }
 
 int main(void)
 {
+#ifdef RAM_ISR
+    relocate_vector_table();
+#endif
     HAL_Init();
     SystemClock_Config();
+    prof_clock_init();
 
     MX_GPIO_Init();
+    MX_DMA_Init();
     MX_USART1_UART_Init();
     MX_USART2_UART_Init();
 
     uart_start_it();
+    crc_hw_init();
+    flash_fw_init();
     init_boot_api();
+    update_api_init(&bootloader_api_ptr->update);
 
     printf("   ____              __\n");
     printf("  / __ )____  ____  / /_\n");
@@ -61,32 +218,31 @@ int main(void)
     printf("/ /_/ / /_/ / /_/ / /_\n");
     printf("/_____/\\____/\\____/\\__/\n");
     printf("\n");
-    printf("Press Button to Enter DFU mode\n");
+    printf("Hold B1 at reset, or send a PING within %u ms, to enter DFU mode\n", DFU_WINDOW_MS);
     const char* reboot_reason = get_reset_reason_string();
     printf("MAGIC NUMBER: 0x%08lx RESET_REASON: %s\n", bootloader_api_ptr->boot_info.magic, reboot_reason);
 
-    bool dfu = try_enter_DFU_mode();
+    const dfu_request_t request = decide_boot();
+    printf("Boot decision after %lu us: %s\n", boot_elapsed_us(), get_dfu_request_string(request));
 
-    if (dfu)
+    if (request != DFU_REQUEST_NONE)
     {
         printf("Entering in DFU ...\n");
         // write application reset as reason to avoid DFU mode loop in soft reboots while debugging
         bootloader_api_ptr->boot_info.reset_reason_uint = APPLICATION_RESET;
         const size_t max_fw_size = get_max_fw_size();
         serial_api_t serial_api = {
-            uart1_send, uart1_recv, flash_fw_feed, flash_fw_flush, flash_fw_reset, fw_crc_check, fw_write_header, max_fw_size};
+            uart1_send, uart1_recv, flash_fw_feed, flash_fw_flush, flash_fw_reset, fw_crc_check, fw_write_header, max_fw_size,
+            flash_fw_reserve, flash_fw_commit, flash_fw_rollback, uart1_baudrate_supported, uart1_set_baudrate, fw_base_image,
+            fw_base_intact, flash_sector_hashes, flash_keep_sectors,
+            flash_fw_erase_ahead, fw_resume, flash_fw_layout};
         set_serial_api(serial_api);
         recv_firmware();
+        trace_flush();
+        console_flush();
         bootloader_api_ptr->reset(APPLICATION_RESET);
     }
 
-    int ret = fw_check_header();
-    if (ret)
-    {
-        printf("HEADER MISMATCH\n");
-        bootloader_api_ptr->reset(FIRMWARE_UPDATE);
-    }
-
     if (bootloader_api_ptr != (void*) (BOOT_CONFIG_START_ADDR))
     {
         printf("BootLoader API not in place\n");
@@ -95,6 +251,7 @@ int main(void)
 
     bootloader_api_ptr->jump_to_application();
     printf("SHOULD NOT HAVE RETURNED RESETING IN DFU\n");
+    console_flush();
     bootloader_api_ptr->reset(FIRMWARE_UPDATE);
     Error_Handler();
 }
@@ -144,6 +301,10 @@ void SystemClock_Config(void)
  */
 static void MX_USART2_UART_Init(void)
 {
+    // below USART1, the trace transfers complete through the transmission complete interrupt
+    HAL_NVIC_SetPriority(USART2_IRQn, 3, 0);
+    HAL_NVIC_EnableIRQ(USART2_IRQn);
+
     huart2.Instance = USART2;
     huart2.Init.BaudRate = 115200;
     huart2.Init.WordLength = UART_WORDLENGTH_8B;
@@ -169,7 +330,7 @@ static void MX_USART1_UART_Init(void)
     HAL_NVIC_EnableIRQ(USART1_IRQn);
 
     huart1.Instance = USART1;
-    huart1.Init.BaudRate = 115200;
+    huart1.Init.BaudRate = UART1_DEFAULT_BAUDRATE;
     huart1.Init.WordLength = UART_WORDLENGTH_8B;
     huart1.Init.StopBits = UART_STOPBITS_1;
     huart1.Init.Parity = UART_PARITY_NONE;
@@ -182,6 +343,26 @@ static void MX_USART1_UART_Init(void)
     }
 }
 
+/**
+ * @brief DMA Initialization Function
+ * @param None
+ * @retval None
+ */
+static void MX_DMA_Init(void)
+{
+    __HAL_RCC_DMA2_CLK_ENABLE();
+
+    /* DMA2_Stream2_IRQn interrupt configuration, USART1_RX */
+    HAL_NVIC_SetPriority(DMA2_Stream2_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(DMA2_Stream2_IRQn);
+
+    __HAL_RCC_DMA1_CLK_ENABLE();
+
+    /* DMA1_Stream6_IRQn interrupt configuration, USART2_TX trace records */
+    HAL_NVIC_SetPriority(DMA1_Stream6_IRQn, 3, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Stream6_IRQn);
+}
+
 /**
  * @brief GPIO Initialization Function
  * @param None
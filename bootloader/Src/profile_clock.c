@@ -0,0 +1,49 @@
+#include "profile.h"
+
+#ifdef PROFILE
+
+#ifdef PROFILE_HOST
+
+#include <time.h>
+
+#define NS_PER_S (1000000000u)
+
+void prof_clock_init(void) {}
+
+uint32_t prof_clock_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t) ((uint64_t) now.tv_sec * NS_PER_S + (uint64_t) now.tv_nsec);
+}
+
+uint32_t prof_clock_hz(void)
+{
+    return NS_PER_S;
+}
+
+#else
+
+#include "main.h"
+
+void prof_clock_init(void)
+{
+    // the cycle counter runs without a debugger once trace is enabled
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+uint32_t prof_clock_now(void)
+{
+    return DWT->CYCCNT;
+}
+
+uint32_t prof_clock_hz(void)
+{
+    return SystemCoreClock;
+}
+
+#endif
+
+#endif
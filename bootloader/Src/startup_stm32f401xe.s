@@ -77,6 +77,23 @@ LoopCopyDataInit:
   cmp r4, r1
   bcc CopyDataInit
 
+/* Copy the code running from SRAM, see ram_func.ld */
+  ldr r0, =_sram_func
+  ldr r1, =_eram_func
+  ldr r2, =_siram_func
+  movs r3, #0
+  b LoopCopyRamFuncInit
+
+CopyRamFuncInit:
+  ldr r4, [r2, r3]
+  str r4, [r0, r3]
+  adds r3, r3, #4
+
+LoopCopyRamFuncInit:
+  adds r4, r0, r3
+  cmp r4, r1
+  bcc CopyRamFuncInit
+
 /* Zero fill the bss segment. */
   ldr r2, =_sbss
   ldr r4, =_ebss
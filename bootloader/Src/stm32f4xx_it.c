@@ -17,8 +17,12 @@
 
 #include "stm32f4xx_it.h"
 
+#include "flash_program.h"
 #include "main.h"
 extern UART_HandleTypeDef huart1;
+extern UART_HandleTypeDef huart2;
+extern DMA_HandleTypeDef hdma_usart1_rx;
+extern DMA_HandleTypeDef hdma_usart2_tx;
 
 /******************************************************************************/
 /*           Cortex-M4 Processor Interruption and Exception Handlers          */
@@ -99,5 +103,29 @@ void EXTI15_10_IRQHandler(void)
 
 void USART1_IRQHandler(void)
 {
-    HAL_UART_IRQHandler(&huart1);  // This calls HAL_UART_RxCpltCallback() when a byte is received
+    HAL_UART_IRQHandler(&huart1);  // IDLE line, calls HAL_UARTEx_RxEventCallback()
+}
+
+void FLASH_IRQHandler(void)
+{
+    // programming jobs are driven register level, HAL only runs the background sector erases
+    if (!flash_program_irq())
+    {
+        HAL_FLASH_IRQHandler();  // calls HAL_FLASH_EndOfOperationCallback()
+    }
+}
+
+void DMA2_Stream2_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_usart1_rx);  // half/full transfer, calls HAL_UARTEx_RxEventCallback()
+}
+
+void USART2_IRQHandler(void)
+{
+    HAL_UART_IRQHandler(&huart2);  // transmission complete, calls HAL_UART_TxCpltCallback()
+}
+
+void DMA1_Stream6_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_usart2_tx);  // trace records moved to USART2, enables its transmission complete interrupt
 }
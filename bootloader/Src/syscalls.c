@@ -1,19 +1,18 @@
 #include "main.h"
+#include "profile.h"
 
+#include <console.h>
 #include <errno.h>
-#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 extern UART_HandleTypeDef huart1;
 extern UART_HandleTypeDef huart2;
-// Dummy implementation of _write
+// Queued on the USART2 console, printf() does not wait for the link
 int _write(int file, const char* ptr, int len)
 {
-    const char* prefix = "BOOTLOADER: ";
-    const size_t prefix_len = strlen(prefix);
-    HAL_UART_Transmit(&huart2, (uint8_t*) prefix, prefix_len, HAL_MAX_DELAY);
-    HAL_UART_Transmit(&huart2, (uint8_t*) ptr, len, HAL_MAX_DELAY);
+    PROF_SCOPE(PROF_CONSOLE);
+    console_write("BOOTLOADER: ", ptr, len);
     return len;
 }
 
@@ -0,0 +1,20 @@
+#include "main.h"
+#include "trace.h"
+
+#include <console.h>
+
+// the records go out between the console text chunks, the console calls back once they left
+bool trace_port_send(const uint8_t* data, size_t len)
+{
+    return console_send_raw(data, len);
+}
+
+uint32_t trace_port_time_ms(void)
+{
+    return HAL_GetTick();
+}
+
+void console_raw_sent(void)
+{
+    trace_sent();
+}
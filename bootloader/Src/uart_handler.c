@@ -1,40 +1,48 @@
 #include "uart_handler.h"
 
 #include "main.h"
+#include "uart_ring.h"
 
 extern UART_HandleTypeDef huart1;
 
-#define RX_BUFFER_SIZE (128)
+// must be a power of two, sized to hold a full window of DATA frames with their headers and CRCs
+#define RX_BUFFER_SIZE (8192)
 static uint8_t rxBuffer[RX_BUFFER_SIZE];
-volatile uint16_t rxHead = 0;
-volatile uint16_t rxTail = 0;
+static uart_ring_t rx_ring;
 
-void HAL_UART_RxCpltCallback(UART_HandleTypeDef* huart)
+// a receiver tolerates a few percent of total mismatch, keep our share below 2%
+#define BAUDRATE_TOLERANCE_PERMILLE (20u)
+#define TX_DRAIN_TIMEOUT_MS         (10u)
+
+static int uart1_start_rx_dma(void)
 {
-    if (huart->Instance == USART1)  // Check which UART triggered
+    if (HAL_UARTEx_ReceiveToIdle_DMA(&huart1, rxBuffer, RX_BUFFER_SIZE) != HAL_OK)
     {
-        // Increment head
-        rxHead = (rxHead + 1) % RX_BUFFER_SIZE;
-
-        // Restart reception
-        HAL_UART_Receive_IT(&huart1, (uint8_t*) &rxBuffer[rxHead], 1);
+        return -1;
     }
+    // noise/framing errors must not abort the circular transfer, the frame CRC catches corrupted bytes
+    __HAL_UART_DISABLE_IT(&huart1, UART_IT_PE);
+    __HAL_UART_DISABLE_IT(&huart1, UART_IT_ERR);
+    return 0;
 }
 
-uint8_t UART_Available(void)
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef* huart, uint16_t Size)
 {
-    return (rxHead != rxTail);
+    if (huart->Instance == USART1)
+    {
+        // half transfer, transfer complete or idle line: Size is the DMA write index
+        uart_ring_publish(&rx_ring, Size);
+    }
 }
 
-uint8_t UART_ReadByte(void)
+void HAL_UART_ErrorCallback(UART_HandleTypeDef* huart)
 {
-    uint8_t data = 0;
-    if (rxHead != rxTail)
+    if (huart->Instance == USART1 && huart->RxState == HAL_UART_STATE_READY)
     {
-        data = rxBuffer[rxTail];
-        rxTail = (rxTail + 1) % RX_BUFFER_SIZE;
+        // the reception was aborted, restart it and drop what was not read yet
+        uart_ring_restart(&rx_ring);
+        uart1_start_rx_dma();
     }
-    return data;
 }
 
 int uart1_send(const uint8_t* buf, size_t len)
@@ -50,24 +58,87 @@ int uart1_recv(uint8_t* buf, size_t len, uint32_t timeout_ms)
 
     while (pivot < len)
     {
-        // Check if a byte is available in ring buffer
-        if (UART_Available())
-        {
-            buf[pivot++] = UART_ReadByte();
-        }
-        else
+        const size_t read = uart_ring_read(&rx_ring, &buf[pivot], len - pivot);
+        pivot += read;
+        if (read == 0 && (HAL_GetTick() - tickstart) >= timeout_ms)
         {
-            // No data available, check timeout
-            if ((HAL_GetTick() - tickstart) >= timeout_ms)
-            {
-                break;  // Timeout expired
-            }
+            break;  // Timeout expired
         }
     }
     return pivot;  // Number of bytes actually read
 }
 
+static bool uart1_get_oversampling(uint32_t baudrate, uint32_t* oversampling)
+{
+    if (baudrate == 0)
+    {
+        return false;
+    }
+    // USARTDIV in 1/16 (oversampling 16) or 1/8 (oversampling 8) steps is the same divider of the clock
+    const uint32_t pclk = HAL_RCC_GetPCLK2Freq();
+    const uint32_t div = (pclk + baudrate / 2) / baudrate;
+    if (div < 8)
+    {
+        return false;
+    }
+    const uint32_t actual = pclk / div;
+    const uint32_t error = actual > baudrate ? actual - baudrate : baudrate - actual;
+    if (error * 1000u > baudrate * BAUDRATE_TOLERANCE_PERMILLE)
+    {
+        return false;
+    }
+    *oversampling = div >= 16 ? UART_OVERSAMPLING_16 : UART_OVERSAMPLING_8;
+    return true;
+}
+
+bool uart1_baudrate_supported(uint32_t baudrate)
+{
+    uint32_t oversampling = 0;
+    return uart1_get_oversampling(baudrate == 0 ? UART1_DEFAULT_BAUDRATE : baudrate, &oversampling);
+}
+
+int uart1_set_baudrate(uint32_t baudrate)
+{
+    if (baudrate == 0)
+    {
+        baudrate = UART1_DEFAULT_BAUDRATE;
+    }
+    uint32_t oversampling = 0;
+    if (!uart1_get_oversampling(baudrate, &oversampling))
+    {
+        return -1;
+    }
+
+    // let the last response leave the shift register at the old rate
+    const uint32_t tickstart = HAL_GetTick();
+    while (!__HAL_UART_GET_FLAG(&huart1, UART_FLAG_TC) && (HAL_GetTick() - tickstart) < TX_DRAIN_TIMEOUT_MS)
+    {
+    }
+
+    HAL_UART_AbortReceive(&huart1);
+    huart1.Init.BaudRate = baudrate;
+    huart1.Init.OverSampling = oversampling;
+    if (HAL_UART_Init(&huart1) != HAL_OK)
+    {
+        return -1;
+    }
+    // bytes received around the switch are garbage
+    uart_ring_restart(&rx_ring);
+    return uart1_start_rx_dma();
+}
+
+size_t uart1_peek(uint8_t* buf, size_t len)
+{
+    return uart_ring_peek(&rx_ring, buf, len);
+}
+
+uint32_t uart1_dropped(void)
+{
+    return uart_ring_dropped(&rx_ring);
+}
+
 int uart_start_it()
 {
-    return UART_Start_Receive_IT(&huart1, (uint8_t*) &rxBuffer[rxHead], 1);
+    uart_ring_init(&rx_ring, rxBuffer, RX_BUFFER_SIZE);
+    return uart1_start_rx_dma();
 }
@@ -1,8 +1,14 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/**
+ * @brief Baud rate UART1 starts with and falls back to.
+ */
+#define UART1_DEFAULT_BAUDRATE (115200u)
+
 /**
  * @brief Send data over UART1.
  *
@@ -19,7 +25,8 @@ int uart1_send(const uint8_t* buf, size_t len);
  * @brief Receive data over UART1.
  *
  * Receives data from the UART1 interface, blocking until the requested
- * number of bytes is received or the timeout expires.
+ * number of bytes is received or the timeout expires. Data is copied
+ * out of the DMA receive ring in bulk.
  *
  * @param buf Pointer to the buffer to store received data.
  * @param len Number of bytes to receive.
@@ -30,10 +37,54 @@ int uart1_send(const uint8_t* buf, size_t len);
 int uart1_recv(uint8_t* buf, size_t len, uint32_t timeout_ms);
 
 /**
- * @brief Start UART1 interrupt-driven operation.
+ * @brief Check whether UART1 can run at a baud rate.
+ *
+ * The rate is supported when the peripheral clock divides to it within 2%,
+ * using oversampling by 8 for rates above PCLK2 / 16.
+ *
+ * @param baudrate Baud rate to check, 0 for UART1_DEFAULT_BAUDRATE.
+ *
+ * @return true If the baud rate can be generated.
+ */
+bool uart1_baudrate_supported(uint32_t baudrate);
+
+/**
+ * @brief Switch UART1 to another baud rate.
+ *
+ * Waits for the pending transmission to complete, then reconfigures the peripheral
+ * and restarts the DMA reception. Bytes not read yet are dropped.
+ *
+ * @param baudrate New baud rate, 0 for UART1_DEFAULT_BAUDRATE.
+ *
+ * @return int Status code (0 for success, negative for error).
+ */
+int uart1_set_baudrate(uint32_t baudrate);
+
+/**
+ * @brief Copy up to len received bytes without consuming them.
+ *
+ * @param buf Destination buffer.
+ * @param len Maximum number of bytes to copy.
+ *
+ * @return size_t Number of bytes received and not read yet that were copied.
+ */
+size_t uart1_peek(uint8_t* buf, size_t len);
+
+/**
+ * @brief Get the number of received bytes UART1 dropped.
+ *
+ * Bytes are dropped when the reader falls more than the receive ring behind
+ * the DMA or when the reception has to be restarted after an error.
+ *
+ * @return uint32_t Dropped bytes since uart_start_it().
+ */
+uint32_t uart1_dropped(void);
+
+/**
+ * @brief Start UART1 DMA reception.
  *
- * Initializes and enables UART1 interrupts required for asynchronous
- * transmit and receive operations.
+ * Starts a circular DMA transfer into the receive ring. Half-transfer,
+ * transfer-complete and IDLE-line events publish the DMA write index.
  *
  * @return int Status code (0 for success, negative for error).
  */
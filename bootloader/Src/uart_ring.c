@@ -0,0 +1,102 @@
+#include "uart_ring.h"
+
+#include <string.h>
+
+void uart_ring_init(uart_ring_t* ring, uint8_t* buffer, size_t size)
+{
+    ring->buffer = buffer;
+    ring->size = size;
+    ring->write_total = 0;
+    ring->discard_from = 0;
+    ring->discard_until = 0;
+    ring->dma_pos = 0;
+    ring->read_total = 0;
+    ring->dropped = 0;
+}
+
+void uart_ring_publish(uart_ring_t* ring, size_t dma_pos)
+{
+    size_t delta = 0;
+    if (dma_pos >= ring->size)
+    {
+        // transfer complete, the DMA wrapped to index 0
+        delta = ring->size - ring->dma_pos;
+        dma_pos = 0;
+    }
+    else
+    {
+        delta = (dma_pos + ring->size - ring->dma_pos) & (ring->size - 1);
+    }
+    ring->dma_pos = dma_pos;
+    ring->write_total += delta;
+}
+
+void uart_ring_restart(uart_ring_t* ring)
+{
+    // the DMA starts over at index 0, move the stream position to the next buffer boundary
+    const uint32_t restart_total = (ring->write_total + ring->size - 1) & ~(uint32_t) (ring->size - 1);
+    ring->discard_from = ring->write_total;
+    ring->discard_until = restart_total;
+    ring->write_total = restart_total;
+    ring->dma_pos = 0;
+}
+
+static size_t uart_ring_sync(uart_ring_t* ring)
+{
+    const uint32_t discard_until = ring->discard_until;
+    if ((int32_t) (discard_until - ring->read_total) > 0)
+    {
+        // only the bytes received before the restart were lost, the gap up to the boundary never existed
+        const uint32_t discard_from = ring->discard_from;
+        if ((int32_t) (discard_from - ring->read_total) > 0)
+        {
+            ring->dropped += discard_from - ring->read_total;
+        }
+        ring->read_total = discard_until;
+    }
+
+    // until the next half/full transfer event the DMA may write up to the next half buffer boundary,
+    // the bytes it can reach are no longer safe to read
+    const size_t half = ring->size / 2;
+    const size_t in_flight = half - (ring->dma_pos & (half - 1));
+    const size_t capacity = ring->size - in_flight;
+
+    uint32_t used = ring->write_total - ring->read_total;
+    if (used > capacity)
+    {
+        // the DMA lapped the reader
+        ring->dropped += used - capacity;
+        ring->read_total += used - capacity;
+        used = capacity;
+    }
+    return used;
+}
+
+size_t uart_ring_available(uart_ring_t* ring)
+{
+    return uart_ring_sync(ring);
+}
+
+size_t uart_ring_read(uart_ring_t* ring, uint8_t* buf, size_t len)
+{
+    const size_t count = uart_ring_peek(ring, buf, len);
+    ring->read_total += count;
+    return count;
+}
+
+size_t uart_ring_peek(uart_ring_t* ring, uint8_t* buf, size_t len)
+{
+    const size_t available = uart_ring_available(ring);
+    const size_t count = len < available ? len : available;
+    const size_t tail = ring->read_total & (ring->size - 1);
+    const size_t first = (ring->size - tail) < count ? (ring->size - tail) : count;
+
+    memcpy(buf, &ring->buffer[tail], first);
+    memcpy(&buf[first], ring->buffer, count - first);
+    return count;
+}
+
+uint32_t uart_ring_dropped(const uart_ring_t* ring)
+{
+    return ring->dropped;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Receive ring written by a circular DMA stream.
+ *
+ * The ring does not touch any peripheral: the interrupt side publishes the DMA write index and the
+ * main loop side reads in bulk, so the logic can be exercised on a host with a simulated DMA index.
+ *
+ * write_total and dma_pos are only written by the publisher (interrupt context), read_total and dropped
+ * only by the reader. Byte number n of the stream is stored at buffer[n % size], size must be a power of two.
+ */
+typedef struct
+{
+    uint8_t* buffer;
+    size_t size;
+    volatile uint32_t write_total;   /**< Bytes published by the DMA since start */
+    volatile uint32_t discard_from;  /**< write_total when the DMA was restarted, the bytes after it never arrived */
+    volatile uint32_t discard_until; /**< Bytes before this position were lost by a DMA restart */
+    volatile size_t dma_pos;         /**< Last published DMA write index */
+    uint32_t read_total;             /**< Bytes consumed by the reader since start */
+    uint32_t dropped;                /**< Bytes overwritten before being read */
+} uart_ring_t;
+
+/**
+ * @brief Initialize a ring over a buffer.
+ *
+ * @param ring Ring to initialize.
+ * @param buffer Storage written by the DMA.
+ * @param size Buffer size in bytes, must be a power of two.
+ */
+void uart_ring_init(uart_ring_t* ring, uint8_t* buffer, size_t size);
+
+/**
+ * @brief Publish the DMA write index (interrupt context).
+ *
+ * Called on half-transfer, transfer-complete and IDLE-line events. Events must not be more than
+ * one buffer apart.
+ *
+ * @param ring Ring written by the DMA.
+ * @param dma_pos Current DMA write index, size - NDTR. A value equal to size means a full wrap.
+ */
+void uart_ring_publish(uart_ring_t* ring, size_t dma_pos);
+
+/**
+ * @brief Account for a DMA restart at index 0 (interrupt context).
+ *
+ * Unread bytes are discarded and reported as dropped by the reader.
+ *
+ * @param ring Ring written by the DMA.
+ */
+void uart_ring_restart(uart_ring_t* ring);
+
+/**
+ * @brief Number of bytes ready to be read.
+ *
+ * @param ring Ring to query.
+ * @return size_t Bytes available. Bytes the DMA may overwrite before the next half/full transfer
+ *                event are counted as dropped, so at least half of the ring is always usable.
+ */
+size_t uart_ring_available(uart_ring_t* ring);
+
+/**
+ * @brief Copy up to len bytes out of the ring.
+ *
+ * @param ring Ring to read from.
+ * @param buf Destination buffer.
+ * @param len Maximum number of bytes to read.
+ * @return size_t Number of bytes copied.
+ */
+size_t uart_ring_read(uart_ring_t* ring, uint8_t* buf, size_t len);
+
+/**
+ * @brief Copy up to len bytes out of the ring without consuming them.
+ *
+ * @param ring Ring to read from.
+ * @param buf Destination buffer.
+ * @param len Maximum number of bytes to copy.
+ * @return size_t Number of bytes copied.
+ */
+size_t uart_ring_peek(uart_ring_t* ring, uint8_t* buf, size_t len);
+
+/**
+ * @brief Number of bytes lost because the reader fell behind or the DMA was restarted.
+ *
+ * @param ring Ring to query.
+ * @return uint32_t Dropped bytes since initialization.
+ */
+uint32_t uart_ring_dropped(const uart_ring_t* ring);
@@ -0,0 +1,252 @@
+#include "update_api.h"
+
+#include "flash_slots.h"
+#include "main.h"
+
+#include <stdbool.h>
+
+#ifdef CRC_HW_HOST
+#include "crc.h"
+#endif
+
+#define FLASH_SR_ERRORS (FLASH_SR_SOP | FLASH_SR_WRPERR | FLASH_SR_PGAERR | FLASH_SR_PGPERR | FLASH_SR_PGSERR | FLASH_SR_RDERR)
+
+// everything below runs for the application: arguments, flash_slots and registers only, no library calls that a
+// RAM_ISR build copies to SRAM and no compiler generated memcpy/memset
+
+// sectors holding the header and fw_size bytes of image
+static uint32_t sectors_needed(const update_session_t* session)
+{
+    const flash_slot_t* slot = &flash_slots[session->slot];
+    uint32_t covered = 0;
+    uint32_t count = 0;
+    while (count < slot->sector_count && covered < FW_HEADER_SIZE + session->fw_size)
+    {
+        covered += slot->sectors[count++].size;
+    }
+    return count;
+}
+
+static uint32_t erased_bytes(const update_session_t* session)
+{
+    const flash_slot_t* slot = &flash_slots[session->slot];
+    uint32_t bytes = 0;
+    for (uint32_t i = 0; i < session->erased; i++)
+    {
+        bytes += slot->sectors[i].size;
+    }
+    return bytes;
+}
+
+// STRT stays set until BSY clears, it covers the time before the controller raises BSY
+static int flash_wait(void)
+{
+    while ((FLASH->CR & FLASH_CR_STRT) || (FLASH->SR & FLASH_SR_BSY))
+    {
+    }
+    const uint32_t errors = FLASH->SR & FLASH_SR_ERRORS;
+    FLASH->SR = FLASH_SR_EOP | errors;
+    return errors ? -1 : 0;
+}
+
+// the ART data cache may still hold words of the sector read before the erase
+static void data_cache_reset(void)
+{
+    if (FLASH->ACR & FLASH_ACR_DCEN)
+    {
+        FLASH->ACR &= ~FLASH_ACR_DCEN;
+        FLASH->ACR |= FLASH_ACR_DCRST;
+        FLASH->ACR &= ~FLASH_ACR_DCRST;
+        FLASH->ACR |= FLASH_ACR_DCEN;
+    }
+}
+
+static int sector_erase(uint32_t sector_id)
+{
+    if (HAL_FLASH_Unlock() != HAL_OK)
+    {
+        return -1;
+    }
+    FLASH->SR = FLASH_SR_EOP | FLASH_SR_ERRORS;
+    FLASH->CR = (FLASH->CR & ~(FLASH_CR_PSIZE | FLASH_CR_SNB)) | FLASH_PSIZE_WORD | FLASH_CR_SER | (sector_id << FLASH_CR_SNB_Pos);
+    FLASH->CR |= FLASH_CR_STRT;
+    const int status = flash_wait();
+    FLASH->CR &= ~(FLASH_CR_SER | FLASH_CR_SNB);
+    HAL_FLASH_Lock();
+    data_cache_reset();
+    return status;
+}
+
+static int word_program(uint32_t address, uint32_t word)
+{
+    if (HAL_FLASH_Unlock() != HAL_OK)
+    {
+        return -1;
+    }
+    FLASH->SR = FLASH_SR_EOP | FLASH_SR_ERRORS;
+    FLASH->CR = (FLASH->CR & ~FLASH_CR_PSIZE) | FLASH_PSIZE_WORD | FLASH_CR_PG;
+    *(volatile uint32_t*) (uintptr_t) address = word;
+    const int status = flash_wait();
+    FLASH->CR &= ~FLASH_CR_PG;
+    HAL_FLASH_Lock();
+    return status;
+}
+
+static int erase_next(update_session_t* session)
+{
+    const uint32_t needed = sectors_needed(session);
+    if (session->erased >= needed)
+    {
+        return 0;
+    }
+    if (sector_erase(flash_slots[session->slot].sectors[session->erased].sector_id))
+    {
+        return -1;
+    }
+    session->erased++;
+    return session->erased < needed ? 1 : 0;
+}
+
+static int pending_program(update_session_t* session)
+{
+    const flash_slot_t* slot = &flash_slots[session->slot];
+    const uint32_t offset = FW_HEADER_SIZE + session->programmed;
+    // the application did not erase this far ahead, the write stalls for the erase instead
+    while (offset >= erased_bytes(session))
+    {
+        if (erase_next(session) <= 0 && offset >= erased_bytes(session))
+        {
+            return -1;
+        }
+    }
+    // the erased cells already hold 0xFFFFFFFF
+    const int status = session->pending == 0xFFFFFFFFu ? 0 : word_program(slot->sectors[0].start_addr + offset, session->pending);
+    session->programmed += sizeof(uint32_t);
+    session->pending = 0;
+    session->pending_len = 0;
+    return status;
+}
+
+static uint32_t load_word(const uint8_t* data)
+{
+    return (uint32_t) data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24;
+}
+
+static uint32_t update_crc32(const uint8_t* data, size_t len)
+{
+#ifdef CRC_HW_HOST
+    return crc32_stm32(data, len);
+#else
+    // crc_handler.c keeps its handle in the bootloader RAM, the unit is driven through its registers
+    __HAL_RCC_CRC_CLK_ENABLE();
+    CRC->CR = CRC_CR_RESET;
+    const size_t num_words = len / sizeof(uint32_t);
+    for (size_t i = 0; i < num_words; i++)
+    {
+        CRC->DR = load_word(&data[i * sizeof(uint32_t)]);
+    }
+    const size_t tail = len % sizeof(uint32_t);
+    if (tail > 0)
+    {
+        // pad like the erased flash after the image
+        uint32_t word = 0xFFFFFFFFu;
+        for (size_t i = 0; i < tail; i++)
+        {
+            word &= ~(0xFFu << (8 * i));
+            word |= (uint32_t) data[num_words * sizeof(uint32_t) + i] << (8 * i);
+        }
+        CRC->DR = word;
+    }
+    return CRC->DR;
+#endif
+}
+
+static int update_begin(update_session_t* session, uint32_t fw_size)
+{
+    if (fw_size == 0 || fw_size > flash_slots_max_fw_size())
+    {
+        return -1;
+    }
+    // the running slot is never written, the other one holds the previous image or nothing
+    session->slot = get_boot_slot() == 1 ? 0 : 1;
+    session->fw_size = fw_size;
+    session->programmed = 0;
+    session->erased = 0;
+    session->pending = 0;
+    session->pending_len = 0;
+    return (int) session->slot;
+}
+
+static int update_erase(update_session_t* session)
+{
+    return erase_next(session);
+}
+
+static int update_write(update_session_t* session, const uint8_t* data, size_t len)
+{
+    // programmed is rounded up to a word once committed
+    const uint32_t written = session->programmed + session->pending_len;
+    if (written > session->fw_size || len > session->fw_size - written)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        session->pending |= (uint32_t) data[i] << (8 * session->pending_len);
+        if (++session->pending_len == sizeof(uint32_t) && pending_program(session))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// the image runs in place, its reset vector has to point into the slot it was written to
+static bool image_linked(const flash_slot_t* slot)
+{
+    const uint32_t start = slot->sectors[0].start_addr + FW_HEADER_SIZE;
+    const uint32_t reset_handler = load_word((const uint8_t*) (uintptr_t) (start + sizeof(uint32_t)));
+    return reset_handler >= start && reset_handler < slot->sectors[0].start_addr + flash_slot_size(slot);
+}
+
+static int update_commit(update_session_t* session, uint32_t crc32)
+{
+    if (session->pending_len > 0)
+    {
+        // the last partial word is padded like the erased flash
+        session->pending |= 0xFFFFFFFFu << (8 * session->pending_len);
+        if (pending_program(session))
+        {
+            return -1;
+        }
+    }
+    const flash_slot_t* slot = &flash_slots[session->slot];
+    const uint32_t header = slot->sectors[0].start_addr;
+    if (session->erased == 0 || session->programmed < session->fw_size
+        || update_crc32((const uint8_t*) (uintptr_t) (header + FW_HEADER_SIZE), session->fw_size) != crc32 || !image_linked(slot))
+    {
+        return -1;
+    }
+    // the other slot is the one running, the new image has to be newer
+    const fw_header_t* running = (const fw_header_t*) (uintptr_t) flash_slots[session->slot ^ 1].sectors[0].start_addr;
+    const uint32_t sequence = running->magic == BOOT_INFO_MAGIC ? running->sequence + 1 : 1;
+    // the CRC16, keep mask and journal stay erased, the magic goes last
+    if (word_program(header + offsetof(fw_header_t, fw_size), session->fw_size)
+        || word_program(header + offsetof(fw_header_t, flags), FW_HEADER_FLAG_CRC32) || word_program(header + offsetof(fw_header_t, crc32), crc32)
+        || word_program(header + offsetof(fw_header_t, sequence), sequence) || word_program(header + offsetof(fw_header_t, magic), BOOT_INFO_MAGIC))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+void update_api_init(volatile update_api_t* api)
+{
+    api->version = UPDATE_API_VERSION;
+    api->size = sizeof(update_api_t);
+    api->begin = update_begin;
+    api->erase = update_erase;
+    api->write = update_write;
+    api->crc32 = update_crc32;
+    api->commit = update_commit;
+}
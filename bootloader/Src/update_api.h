@@ -0,0 +1,13 @@
+#pragma once
+
+#include <boot_config.h>
+
+/**
+ * @brief Fill the update_api_t entries of the bootloader API.
+ *
+ * The application calls them while it runs and owns the RAM. They keep their state in the caller's update_session_t
+ * and use the flash registers directly, no bootloader variable, HAL state or code copied to SRAM.
+ *
+ * @param api Table in the BOOT_CONFIG storage.
+ */
+void update_api_init(volatile update_api_t* api);
@@ -0,0 +1,43 @@
+#include "verify_cache.h"
+
+#include "main.h"
+
+// "VRFY", written last so that an interrupted store leaves no token
+#define VERIFY_TOKEN_MAGIC (0x59465256u)
+
+bool verify_cache_load(verify_token_t* token)
+{
+    if (RTC->BKP0R != VERIFY_TOKEN_MAGIC)
+    {
+        return false;
+    }
+    token->fw_size = RTC->BKP1R;
+    token->crc = RTC->BKP2R;
+    token->crc32 = RTC->BKP3R;
+    token->flags = RTC->BKP4R;
+    token->sequence = RTC->BKP5R;
+    token->boots = RTC->BKP6R;
+    return true;
+}
+
+// the backup domain is write protected, PWR_CR DBP lifts it, the PWR clock is enabled by SystemClock_Config()
+void verify_cache_store(const verify_token_t* token)
+{
+    HAL_PWR_EnableBkUpAccess();
+    RTC->BKP0R = 0;
+    RTC->BKP1R = token->fw_size;
+    RTC->BKP2R = token->crc;
+    RTC->BKP3R = token->crc32;
+    RTC->BKP4R = token->flags;
+    RTC->BKP5R = token->sequence;
+    RTC->BKP6R = token->boots;
+    RTC->BKP0R = VERIFY_TOKEN_MAGIC;
+    HAL_PWR_DisableBkUpAccess();
+}
+
+void verify_cache_clear(void)
+{
+    HAL_PWR_EnableBkUpAccess();
+    RTC->BKP0R = 0;
+    HAL_PWR_DisableBkUpAccess();
+}
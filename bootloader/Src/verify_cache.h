@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @name Boot verification policies
+ * @brief Values of VERIFY_POLICY, which boots run the full image CRC check.
+ * @{
+ */
+#define VERIFY_POLICY_ALWAYS       0 /**< Every boot, the cache is not used */
+#define VERIFY_POLICY_EVERY_N      1 /**< One boot out of VERIFY_EVERY_N */
+#define VERIFY_POLICY_AFTER_UPDATE 2 /**< The first boot of a new image, the application may check it in the background */
+/** @} */
+
+#ifndef VERIFY_POLICY
+#define VERIFY_POLICY VERIFY_POLICY_ALWAYS
+#endif
+
+#ifndef VERIFY_EVERY_N
+#define VERIFY_EVERY_N (16u)
+#endif
+
+/**
+ * @brief Result of a successful image verification, bound to the header fields it was computed for.
+ */
+typedef struct
+{
+    uint32_t fw_size;  /**< fw_header_t fw_size */
+    uint32_t crc;      /**< fw_header_t crc */
+    uint32_t crc32;    /**< fw_header_t crc32 */
+    uint32_t flags;    /**< fw_header_t flags */
+    uint32_t sequence; /**< fw_header_t sequence, tells the slots apart */
+    uint32_t boots;    /**< Boots that trusted the token since the image was verified */
+} verify_token_t;
+
+/**
+ * @brief Read the token stored by the last verification.
+ *
+ * The token lives in the RTC backup registers. They keep their value across resets, and across power cycles while
+ * VBAT is supplied.
+ *
+ * @param token Filled with the stored token.
+ * @return true If a complete token is stored.
+ */
+bool verify_cache_load(verify_token_t* token);
+
+/**
+ * @brief Store a token, a reset in the middle leaves no token rather than a mixed one.
+ *
+ * @param token Token to store.
+ */
+void verify_cache_store(const verify_token_t* token);
+
+/**
+ * @brief Remove the stored token, the next boot runs the full check.
+ */
+void verify_cache_clear(void);
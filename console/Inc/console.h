@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @def CONSOLE_RING_SIZE
+ * @brief Text waiting for USART2 in bytes, a power of two.
+ */
+#define CONSOLE_RING_SIZE (1024u)
+
+/**
+ * @def CONSOLE_DMA_CHUNK
+ * @brief Largest DMA transfer of text, copied out of the ring so that the ring slots are free while it is sent.
+ */
+#define CONSOLE_DMA_CHUNK (64u)
+
+/**
+ * @brief Queue text for USART2 and return without waiting for the link.
+ *
+ * The prefix is inserted at the start of every line. When the ring is full the oldest queued text is dropped,
+ * builds with CONSOLE_BLOCK wait for room instead unless called with interrupts masked or before USART2 is up.
+ *
+ * @param prefix Inserted at line starts, NULL for none.
+ * @param text Text to send.
+ * @param len Number of bytes.
+ */
+void console_write(const char* prefix, const char* text, size_t len);
+
+/**
+ * @brief Send memory owned by the caller once the console is idle, ahead of the queued text.
+ *
+ * The memory stays untouched until console_raw_sent() is called from the transfer complete interrupt.
+ *
+ * @param data Bytes to send.
+ * @param len Number of bytes.
+ * @return true If the transfer started, false while another one is in progress.
+ */
+bool console_send_raw(const uint8_t* data, size_t len);
+
+/**
+ * @brief Called from the interrupt once the console_send_raw() transfer is complete, weak default does nothing.
+ */
+void console_raw_sent(void);
+
+/**
+ * @brief Wait until the queued text has been sent, before a reset or a jump stops USART2.
+ *
+ * Needs the USART2 and DMA1 Stream6 interrupts.
+ */
+void console_flush(void);
+
+/**
+ * @brief Number of bytes dropped because the ring was full.
+ */
+uint32_t console_dropped(void);
@@ -0,0 +1,155 @@
+#include "console.h"
+
+#include "main.h"
+
+extern UART_HandleTypeDef huart2;
+
+// indexes are free running byte counts, the ring holds the text not copied to the DMA buffer yet
+static char ring[CONSOLE_RING_SIZE];
+static uint32_t head = 0;           // next byte written, advanced by console_write()
+static volatile uint32_t tail = 0;  // next byte sent, advanced when copied out or dropped
+static uint8_t dma_buffer[CONSOLE_DMA_CHUNK];
+static volatile bool busy = false;  // a transfer is in progress
+static volatile bool raw = false;   // the transfer comes from console_send_raw()
+static uint32_t dropped = 0;
+static bool line_start = true;
+static size_t prefix_pos = 0;
+
+_Static_assert((CONSOLE_RING_SIZE & (CONSOLE_RING_SIZE - 1)) == 0, "CONSOLE_RING_SIZE must be a power of two");
+
+// writers may be interrupts, the ring and the transfer state change with interrupts masked
+static uint32_t console_lock(void)
+{
+    const uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    return primask;
+}
+
+static void console_unlock(uint32_t primask)
+{
+    __set_PRIMASK(primask);
+}
+
+static bool console_can_wait(uint32_t primask)
+{
+#ifdef CONSOLE_BLOCK
+    // room is made by the transfer complete interrupt, it must be able to run
+    return primask == 0 && __get_IPSR() == 0 && huart2.gState != HAL_UART_STATE_RESET;
+#else
+    return false;
+#endif
+}
+
+// called with interrupts masked
+static void console_start(void)
+{
+    if (busy || head == tail)
+    {
+        return;
+    }
+    const uint32_t queued = head - tail;
+    const uint32_t len = queued < CONSOLE_DMA_CHUNK ? queued : CONSOLE_DMA_CHUNK;
+    for (uint32_t i = 0; i < len; i++)
+    {
+        dma_buffer[i] = ring[(tail + i) % CONSOLE_RING_SIZE];
+    }
+    // refused before USART2 is initialized, the text waits for the next write
+    if (HAL_UART_Transmit_DMA(&huart2, dma_buffer, len) == HAL_OK)
+    {
+        busy = true;
+        tail += len;
+    }
+}
+
+static void console_kick(void)
+{
+    const uint32_t primask = console_lock();
+    console_start();
+    console_unlock(primask);
+}
+
+void console_write(const char* prefix, const char* text, size_t len)
+{
+    size_t pos = 0;
+    while (pos < len)
+    {
+        const uint32_t primask = console_lock();
+        while (pos < len)
+        {
+            if (head - tail == CONSOLE_RING_SIZE)
+            {
+                if (console_can_wait(primask))
+                {
+                    break;
+                }
+                tail++;
+                dropped++;
+            }
+            if (line_start && prefix != NULL && prefix[prefix_pos] != '\0')
+            {
+                ring[head++ % CONSOLE_RING_SIZE] = prefix[prefix_pos++];
+                continue;
+            }
+            const char c = text[pos++];
+            ring[head++ % CONSOLE_RING_SIZE] = c;
+            line_start = (c == '\n');
+            prefix_pos = 0;
+        }
+        console_start();
+        console_unlock(primask);
+
+        // CONSOLE_BLOCK only, the transfer complete interrupt copies the next chunk out
+        while (pos < len && head - tail == CONSOLE_RING_SIZE)
+        {
+            console_kick();
+        }
+    }
+}
+
+bool console_send_raw(const uint8_t* data, size_t len)
+{
+    const uint32_t primask = console_lock();
+    const bool started = !busy && HAL_UART_Transmit_DMA(&huart2, (uint8_t*) data, len) == HAL_OK;
+    if (started)
+    {
+        busy = true;
+        raw = true;
+    }
+    console_unlock(primask);
+    return started;
+}
+
+__weak void console_raw_sent(void) {}
+
+void console_flush(void)
+{
+    if (huart2.gState == HAL_UART_STATE_RESET)
+    {
+        return;
+    }
+    while (busy || head != tail)
+    {
+        console_kick();
+    }
+}
+
+uint32_t console_dropped(void)
+{
+    return dropped;
+}
+
+// the console owns the USART2 transmit path of both images
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef* huart)
+{
+    if (huart->Instance != USART2)
+    {
+        return;
+    }
+    busy = false;
+    if (raw)
+    {
+        raw = false;
+        console_raw_sent();
+    }
+    console_kick();
+}
@@ -0,0 +1,126 @@
+"""Check that the code serviced while the flash is busy runs from SRAM.
+
+The bootloader built with RAM_ISR copies the hot paths listed in bootloader/ram_isr/ram_func.ld to SRAM. This walks
+the direct calls of the linked image from the interrupt handlers and the receive path and fails if one of them reaches
+a function left in flash, an instruction fetch from it would stall the core during an erase or a programming job.
+Calls through function pointers cannot be followed, their targets are listed in ram_func.ld as well.
+"""
+import argparse
+import re
+import subprocess
+import sys
+
+SRAM_START = 0x20000000
+SRAM_END = 0x20018000
+
+ROOTS = (
+    # interrupts taken while the flash is busy
+    'SysTick_Handler',
+    'USART1_IRQHandler',
+    'DMA2_Stream2_IRQHandler',
+    'FLASH_IRQHandler',
+    'USART2_IRQHandler',
+    'DMA1_Stream6_IRQHandler',
+    # reached through DMA and programming engine callback pointers
+    'UART_DMAReceiveCplt',
+    'UART_DMARxHalfCplt',
+    'UART_DMATransmitCplt',
+    'UART_DMATxHalfCplt',
+    'staging_programmed',
+    'journal_programmed',
+    # receive path and frame parser
+    'uart1_recv',
+    'uart1_send',
+    'frame_parser_next_buffer',
+    'frame_parser_advance',
+    'frame_queue_peek',
+    'frame_queue_release',
+)
+
+# only reached on reception errors, the stall is acceptable there
+COLD = {
+    'HAL_UART_ErrorCallback',
+    'HAL_DMA_Abort',
+    'UART_DMAError',
+}
+
+FUNC_RE = re.compile(r'^([0-9a-f]+) <([^>]+)>:$')
+CALL_RE = re.compile(r'\s(?:bl|blx|b|b\.w|b[a-z]{2}|b[a-z]{2}\.w|cbz|cbnz)\s+(?:r\d+,\s*)?([0-9a-f]+) <([^>+]+)(\+0x[0-9a-f]+)?>')
+INDIRECT_RE = re.compile(r'\s(?:blx|bx)\s+r\d+')
+VENEER_RE = re.compile(r'^__(.+)_veneer$')
+
+
+def disassemble(objdump: str, elf: str):
+    """Address, direct call targets and indirect call count of every function"""
+    out = subprocess.run([objdump, '-d', '--no-show-raw-insn', elf], check=True, capture_output=True, text=True).stdout
+    functions = {}
+    current = None
+    for line in out.splitlines():
+        match = FUNC_RE.match(line)
+        if match:
+            current = match.group(2)
+            functions[current] = {'address': int(match.group(1), 16), 'calls': set(), 'indirect': 0}
+            continue
+        if current is None:
+            continue
+        match = CALL_RE.search(line)
+        if match:
+            target = match.group(2)
+            # branches inside the function itself
+            if target != current:
+                functions[current]['calls'].add(target)
+        elif INDIRECT_RE.search(line) and 'lr' not in line:
+            functions[current]['indirect'] += 1
+    return functions
+
+
+def in_sram(address: int) -> bool:
+    return SRAM_START <= address < SRAM_END
+
+
+def check(functions):
+    """Functions reached from the roots that live in flash, with the call chain that reaches them"""
+    violations = []
+    reached = {}
+    pending = []
+    for root in ROOTS:
+        if root in functions:
+            reached[root] = [root]
+            pending.append(root)
+    while pending:
+        name = pending.pop()
+        chain = reached[name]
+        veneer = VENEER_RE.match(name)
+        if veneer:
+            # the linker bridges calls between SRAM and flash, the destination is out of range
+            violations.append(chain[:-1] + [veneer.group(1)])
+            continue
+        if not in_sram(functions[name]['address']):
+            violations.append(chain)
+            continue
+        for target in sorted(functions[name]['calls']):
+            if target in reached or target in COLD or target not in functions:
+                continue
+            reached[target] = chain + [target]
+            pending.append(target)
+    return reached, violations
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description='Check the SRAM hot paths of the bootloader')
+    parser.add_argument('elf', type=str, help='Linked bootloader')
+    parser.add_argument('--objdump', type=str, default='arm-none-eabi-objdump', help='objdump of the arm toolchain')
+    args = parser.parse_args()
+
+    functions = disassemble(args.objdump, args.elf)
+    missing = [root for root in ROOTS if root not in functions]
+    reached, violations = check(functions)
+
+    indirect = sum(functions[name]['indirect'] for name in reached if name in functions)
+    print(f"{len(reached)} functions reached from {len(ROOTS) - len(missing)} roots, {indirect} indirect calls")
+    if missing:
+        # inlined or dropped by --gc-sections
+        print("not found: " + ", ".join(missing))
+    for chain in violations:
+        print("runs from flash: " + " -> ".join(chain))
+    sys.exit(1 if violations else 0)
@@ -0,0 +1,67 @@
+"""Generate the table serial_flasher/python/trace_decode.py turns the binary trace records back into text with.
+
+The event ids follow the TRACE_EVENT() order of trace_events.h starting at 1, like the trace_event_t enum of trace.h.
+The %{enum_t} conversions of the formats name a typedef'd enum, its enumerators are looked up in the given sources.
+"""
+import argparse
+import json
+import re
+import sys
+
+EVENT_RE = re.compile(r'^\s*TRACE_EVENT\(\s*(\w+)\s*,\s*"((?:[^"\\]|\\.)*)"\s*\)', re.MULTILINE)
+ENUM_RE = re.compile(r'typedef\s+enum\s*\w*\s*\{([^}]*)\}\s*(\w+)\s*;', re.DOTALL)
+ENUM_REF_RE = re.compile(r'%\{(\w+)\}')
+COMMENT_RE = re.compile(r'/\*.*?\*/|//[^\n]*', re.DOTALL)
+
+
+def parse_events(text: str):
+    """Event names and formats in id order"""
+    return [(name, bytes(fmt, 'utf-8').decode('unicode_escape')) for name, fmt in EVENT_RE.findall(text)]
+
+
+def parse_enums(text: str):
+    """Enumerator names by value of every typedef'd enum, values are literals or follow the previous one"""
+    enums = {}
+    for body, name in ENUM_RE.findall(COMMENT_RE.sub('', text)):
+        values = {}
+        value = -1
+        for entry in body.split(','):
+            entry = entry.strip()
+            if not entry:
+                continue
+            enumerator, _, literal = entry.partition('=')
+            value = int(literal.strip(), 0) if literal else value + 1
+            values.setdefault(value, enumerator.strip())
+        enums[name] = values
+    return enums
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description='Generate the trace decoding table')
+    parser.add_argument('events', type=str, help='trace_events.h')
+    parser.add_argument('sources', type=str, nargs='*', help='Headers and sources declaring the enums used by the formats')
+    parser.add_argument('-o', '--output', type=str, required=True, help='JSON table')
+    args = parser.parse_args()
+
+    with open(args.events) as f:
+        events = parse_events(f.read())
+    enums = {}
+    for source in args.sources:
+        with open(source) as f:
+            enums.update(parse_enums(f.read()))
+
+    used = set()
+    for name, fmt in events:
+        for enum in ENUM_REF_RE.findall(fmt):
+            if enum not in enums:
+                print(f"{args.events}: {name} prints {enum}, not found in the sources", file=sys.stderr)
+                sys.exit(1)
+            used.add(enum)
+
+    table = {
+        'events': {str(i + 1): {'name': name, 'format': fmt} for i, (name, fmt) in enumerate(events)},
+        'enums': {enum: {str(value): name for value, name in sorted(enums[enum].items())} for enum in sorted(used)},
+    }
+    with open(args.output, 'w') as f:
+        json.dump(table, f, indent=2)
+        f.write('\n')
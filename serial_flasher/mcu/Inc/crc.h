@@ -0,0 +1,180 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+CRC engine shared by the frame layer and the flash handler
+
+- CRC16: CRC16-CCITT (ccitt-false), poly 0x1021, init 0xFFFF, no reflection, no final xor
+- CRC32: CRC-32/MPEG-2, poly 0x04C11DB7, init 0xFFFFFFFF, no reflection, no final xor.
+         Same polynomial and bit order as the STM32 CRC unit.
+- CRC32 STM32: CRC-32/MPEG-2 as computed by the STM32 CRC unit fed with 32 bits little-endian words read
+               from memory, i.e. the bytes of each word are processed from the most significant one.
+               A partial last word is padded with 0xFF, the erased flash value.
+
+Table size is selected at compile time:
+- default: 256 entries tables, 8 of them for slice-by-8, built in RAM on first use
+- CRC_SMALL_TABLE: 16 entries (nibble) tables stored in flash, slice-by-4/8 fall back to the nibble table
+*/
+
+/**
+ * @brief Compute the CRC16-CCITT of a buffer with the fastest variant compiled in.
+ *
+ * @param data Pointer to the data.
+ * @param len Number of bytes.
+ * @return uint16_t CRC16 value.
+ */
+uint16_t crc16_ccitt(const uint8_t* data, size_t len);
+
+/**
+ * @brief Reference CRC16-CCITT, computed bit by bit.
+ *
+ * @param data Pointer to the data.
+ * @param len Number of bytes.
+ * @return uint16_t CRC16 value.
+ */
+uint16_t crc16_ccitt_bitwise(const uint8_t* data, size_t len);
+
+/**
+ * @brief CRC16-CCITT using one table lookup per byte (per nibble with CRC_SMALL_TABLE).
+ *
+ * @param data Pointer to the data.
+ * @param len Number of bytes.
+ * @return uint16_t CRC16 value.
+ */
+uint16_t crc16_ccitt_table(const uint8_t* data, size_t len);
+
+/**
+ * @brief CRC16-CCITT processing 4 bytes per iteration.
+ *
+ * @param data Pointer to the data.
+ * @param len Number of bytes.
+ * @return uint16_t CRC16 value.
+ */
+uint16_t crc16_ccitt_slice4(const uint8_t* data, size_t len);
+
+/**
+ * @brief CRC16-CCITT processing 8 bytes per iteration.
+ *
+ * @param data Pointer to the data.
+ * @param len Number of bytes.
+ * @return uint16_t CRC16 value.
+ */
+uint16_t crc16_ccitt_slice8(const uint8_t* data, size_t len);
+
+/**
+ * @brief Start an incremental CRC16-CCITT computation.
+ *
+ * @return uint16_t Initial CRC state.
+ */
+uint16_t crc16_ccitt_init(void);
+
+/**
+ * @brief Feed data to an incremental CRC16-CCITT computation.
+ *
+ * @param crc Current CRC state.
+ * @param data Pointer to the data.
+ * @param len Number of bytes.
+ * @return uint16_t Updated CRC state.
+ */
+uint16_t crc16_ccitt_update(uint16_t crc, const uint8_t* data, size_t len);
+
+/**
+ * @brief Finish an incremental CRC16-CCITT computation.
+ *
+ * @param crc Current CRC state.
+ * @return uint16_t CRC16 value.
+ */
+uint16_t crc16_ccitt_final(uint16_t crc);
+
+/**
+ * @brief Compute the CRC-32/MPEG-2 of a buffer with the fastest variant compiled in.
+ *
+ * @param data Pointer to the data.
+ * @param len Number of bytes.
+ * @return uint32_t CRC32 value.
+ */
+uint32_t crc32_mpeg2(const uint8_t* data, size_t len);
+
+/**
+ * @brief Reference CRC-32/MPEG-2, computed bit by bit.
+ *
+ * @param data Pointer to the data.
+ * @param len Number of bytes.
+ * @return uint32_t CRC32 value.
+ */
+uint32_t crc32_mpeg2_bitwise(const uint8_t* data, size_t len);
+
+/**
+ * @brief CRC-32/MPEG-2 using one table lookup per byte (per nibble with CRC_SMALL_TABLE).
+ *
+ * @param data Pointer to the data.
+ * @param len Number of bytes.
+ * @return uint32_t CRC32 value.
+ */
+uint32_t crc32_mpeg2_table(const uint8_t* data, size_t len);
+
+/**
+ * @brief CRC-32/MPEG-2 processing 4 bytes per iteration.
+ *
+ * @param data Pointer to the data.
+ * @param len Number of bytes.
+ * @return uint32_t CRC32 value.
+ */
+uint32_t crc32_mpeg2_slice4(const uint8_t* data, size_t len);
+
+/**
+ * @brief CRC-32/MPEG-2 processing 8 bytes per iteration.
+ *
+ * @param data Pointer to the data.
+ * @param len Number of bytes.
+ * @return uint32_t CRC32 value.
+ */
+uint32_t crc32_mpeg2_slice8(const uint8_t* data, size_t len);
+
+/**
+ * @brief Start an incremental CRC-32/MPEG-2 computation.
+ *
+ * @return uint32_t Initial CRC state.
+ */
+uint32_t crc32_mpeg2_init(void);
+
+/**
+ * @brief Feed data to an incremental CRC-32/MPEG-2 computation.
+ *
+ * @param crc Current CRC state.
+ * @param data Pointer to the data.
+ * @param len Number of bytes.
+ * @return uint32_t Updated CRC state.
+ */
+uint32_t crc32_mpeg2_update(uint32_t crc, const uint8_t* data, size_t len);
+
+/**
+ * @brief Finish an incremental CRC-32/MPEG-2 computation.
+ *
+ * @param crc Current CRC state.
+ * @return uint32_t CRC32 value.
+ */
+uint32_t crc32_mpeg2_final(uint32_t crc);
+
+/**
+ * @brief Software model of the STM32 CRC unit, feeds 32 bits words to a CRC-32/MPEG-2 state.
+ *
+ * @param crc Current CRC state, crc32_mpeg2_init() after a CRC unit reset.
+ * @param words Pointer to the words.
+ * @param num_words Number of words.
+ * @return uint32_t Updated CRC state, the value read back from the CRC data register.
+ */
+uint32_t crc32_stm32_update(uint32_t crc, const uint32_t* words, size_t num_words);
+
+/**
+ * @brief Compute the CRC32 the STM32 CRC unit returns for a buffer.
+ *
+ * The buffer is processed as little-endian words, a partial last word is padded with 0xFF.
+ *
+ * @param data Pointer to the data.
+ * @param len Number of bytes.
+ * @return uint32_t CRC32 value.
+ */
+uint32_t crc32_stm32(const uint8_t* data, size_t len);
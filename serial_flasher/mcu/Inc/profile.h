@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @brief Hot paths timed by the profiler, reported by CMD_GET_STATS.
+ *
+ * The values are sent on the wire, keep serial_flasher.py in sync.
+ */
+typedef enum
+{
+    PROF_RECV_FRAME = 0,    /**< recv_frame(), waiting for the link included */
+    PROF_FRAME_CRC = 1,     /**< CRC16 of the received bytes in the frame parser */
+    PROF_STAGING_COPY = 2,  /**< Copy of DATA chunks into the flash staging buffers */
+    PROF_STAGING_WAIT = 3,  /**< Wait for a staging buffer still being programmed */
+    PROF_ERASE = 4,         /**< Sector erased while the DATA stream waits */
+    PROF_ERASE_AHEAD = 5,   /**< Background erase run, from the start to the last sector erased */
+    PROF_PROGRAM = 6,       /**< Programming engine job, a staging buffer or a journal entry */
+    PROF_CONSOLE = 7,       /**< Console output written by printf() */
+    PROF_COUNT,
+} prof_id_t;
+
+/**
+ * @brief Aggregated durations of one timer, in ticks of prof_clock_hz().
+ */
+typedef struct
+{
+    uint32_t count; /**< Completed measurements */
+    uint32_t min;   /**< Shortest measurement */
+    uint32_t max;   /**< Longest measurement */
+    uint64_t total; /**< Sum of the measurements */
+    uint32_t start; /**< Start of the measurement in progress */
+} prof_entry_t;
+
+#ifdef PROFILE
+
+/**
+ * @brief Start the clock of the profiler, implemented by the port.
+ *
+ * The bootloader counts core cycles with the DWT cycle counter, host builds (PROFILE_HOST) read a monotonic clock.
+ */
+void prof_clock_init(void);
+
+/**
+ * @brief Read the clock of the profiler, implemented by the port.
+ *
+ * @return uint32_t Current tick count, wrapping around.
+ */
+uint32_t prof_clock_now(void);
+
+/**
+ * @brief Get the clock rate of the profiler, implemented by the port.
+ *
+ * @return uint32_t Ticks per second.
+ */
+uint32_t prof_clock_hz(void);
+
+/**
+ * @brief Start a measurement.
+ *
+ * A timer measures one thing at a time, starting it again drops the measurement in progress.
+ * Starting and stopping may happen in different contexts, e.g. a job started by the main loop and completed by an interrupt.
+ *
+ * @param id Timer to start.
+ */
+void prof_start(prof_id_t id);
+
+/**
+ * @brief Stop the measurement in progress and add it to the statistics of the timer.
+ *
+ * @param id Timer to stop.
+ */
+void prof_stop(prof_id_t id);
+
+/**
+ * @brief Clear the statistics of every timer.
+ */
+void prof_reset(void);
+
+/**
+ * @brief Get the statistics table.
+ *
+ * @return const prof_entry_t* PROF_COUNT entries indexed by prof_id_t.
+ */
+const prof_entry_t* prof_table(void);
+
+// the variable only carries the id to the cleanup function
+static inline void prof_scope_end(const prof_id_t* id)
+{
+    prof_stop(*id);
+}
+
+#define PROF_SCOPE_NAME(line)  PROF_SCOPE_NAME_(line)
+#define PROF_SCOPE_NAME_(line) prof_scope_##line
+
+/**
+ * @brief Time the rest of the enclosing block with the timer id.
+ */
+#define PROF_SCOPE(id)                                                                              \
+    const prof_id_t PROF_SCOPE_NAME(__LINE__) __attribute__((cleanup(prof_scope_end), unused)) = (id); \
+    prof_start(id)
+
+#else
+
+// Release builds compile the profiler out
+#define prof_clock_init() ((void) 0)
+#define prof_start(id)    ((void) 0)
+#define prof_stop(id)     ((void) 0)
+#define prof_reset()      ((void) 0)
+#define PROF_SCOPE(id)    ((void) 0)
+
+#endif
@@ -4,6 +4,64 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/**
+ * @brief Firmware image description announced by the host in CMD_START.
+ */
+typedef struct
+{
+    size_t fw_size;  /**< Firmware size in bytes */
+    uint16_t crc16;  /**< CRC16-CCITT of the firmware */
+    uint32_t crc32;  /**< CRC32 of the firmware as computed by the STM32 CRC unit */
+    bool has_crc32;  /**< The host sent crc32, verify with the CRC unit */
+} fw_image_info_t;
+
+/**
+ * @brief Checksum of the image bytes held by one application sector.
+ */
+typedef struct
+{
+    uint32_t size;  /**< Image bytes in the sector, the firmware header is not included */
+    uint32_t crc32; /**< CRC32 of those bytes as computed by the STM32 CRC unit */
+    bool keepable;  /**< The sector can be kept, false when it is rewritten anyway */
+} flash_sector_hash_t;
+
+/**
+ * @brief Progress of an interrupted update, restored by CMD_RESUME.
+ */
+typedef struct
+{
+    size_t offset;      /**< Image bytes already programmed, the DATA stream continues there */
+    size_t feed_size;   /**< Image bytes fed to the flash, fw_size minus the kept sectors */
+    uint32_t keep_mask; /**< Sectors kept by the interrupted update */
+} fw_resume_info_t;
+
+/**
+ * @def FLASH_LAYOUT_SECTORS_MAX
+ * @brief Maximum number of sectors reported by CMD_GET_INFO.
+ */
+#define FLASH_LAYOUT_SECTORS_MAX (8u)
+
+/**
+ * @brief Flash sector holding firmware.
+ */
+typedef struct
+{
+    uint32_t address; /**< First byte of the sector */
+    uint32_t size;    /**< Sector size in bytes */
+} flash_sector_t;
+
+/**
+ * @brief Flash layout and installed firmware reported by CMD_GET_INFO.
+ */
+typedef struct
+{
+    size_t chunk_size;                                /**< DATA chunk size received in place, 0 when any size is */
+    size_t sector_count;                              /**< Number of entries in sectors */
+    flash_sector_t sectors[FLASH_LAYOUT_SECTORS_MAX]; /**< Application sectors in flashing order */
+    bool installed;                                   /**< The flash holds a firmware header, image describes it */
+    fw_image_info_t image;                            /**< Installed firmware, has_crc32 when the header holds a crc32 */
+} flash_layout_t;
+
 /**
  * @brief Function pointer type for sending data over UART.
  *
@@ -45,23 +103,132 @@ typedef int (*flash_flush_t)(void);
  */
 typedef void (*flash_reset_t)(void);
 
+/**
+ * @brief Function pointer type for reserving flash staging memory to receive data in place.
+ *
+ * Successive calls reserve the bytes following the ones already reserved, in pieces of
+ * contiguous memory. The first call fails unless all len bytes can be reserved, the next
+ * ones must then succeed.
+ *
+ * @param len In: bytes left to reserve. Out: contiguous bytes granted at the returned pointer.
+ * @return uint8_t* Destination of the granted bytes, NULL if not available.
+ */
+typedef uint8_t* (*flash_reserve_t)(size_t* len);
+
+/**
+ * @brief Function pointer type for committing data received in place into reserved memory.
+ *
+ * @param len Number of bytes to commit, every byte reserved so far.
+ * @return int Status code (0 for success, negative for error).
+ */
+typedef int (*flash_commit_t)(size_t len);
+
+/**
+ * @brief Function pointer type for giving back reserved memory.
+ *
+ * @param len Number of bytes that were reserved.
+ */
+typedef void (*flash_rollback_t)(size_t len);
+
+/**
+ * @brief Function pointer type for checking whether the link can run at a baud rate.
+ *
+ * @param baudrate Baud rate to check, 0 for the link default.
+ * @return true If the baud rate is supported.
+ */
+typedef bool (*uart_baudrate_supported_t)(uint32_t baudrate);
+
+/**
+ * @brief Function pointer type for switching the link baud rate.
+ *
+ * Must not return before the bytes already sent left the transmitter.
+ *
+ * @param baudrate New baud rate, 0 for the link default.
+ * @return int Status code (0 for success, negative for error).
+ */
+typedef int (*uart_set_baudrate_t)(uint32_t baudrate);
+
 /**
  * @brief Function pointer type for checking firmware CRC.
  *
- * @param crc_recv CRC value received for comparison.
- * @param fw_len Length of the firmware in bytes.
+ * @param info Firmware image description received from the host.
  * @return true If CRC matches, false otherwise.
  */
-typedef bool (*fw_crc_check_t)(uint16_t crc_recv, size_t fw_len);
+typedef bool (*fw_crc_check_t)(const fw_image_info_t* info);
 
 /**
  * @brief Function pointer type for writing the firmware header.
  *
- * @param crc_recv CRC value of the firmware.
- * @param fw_len Length of the firmware in bytes.
+ * @param info Firmware image description received from the host.
  * @return int Status code (0 for success, negative for error).
  */
-typedef int (*fw_write_header_t)(uint16_t crc_recv, size_t fw_len);
+typedef int (*fw_write_header_t)(const fw_image_info_t* info);
+
+/**
+ * @brief Function pointer type for computing the checksum of every application sector.
+ *
+ * @param hashes Array receiving one entry per sector, in flashing order.
+ * @param max Number of entries hashes can hold.
+ * @return size_t Number of sectors.
+ */
+typedef size_t (*flash_sector_hashes_t)(flash_sector_hash_t* hashes, size_t max);
+
+/**
+ * @brief Function pointer type for keeping unchanged sectors during the next update.
+ *
+ * Called after flash_reset. Kept sectors are neither erased nor fed, only sectors
+ * reported keepable by sector_hashes are in the mask.
+ *
+ * @param mask Bit i set keeps sector i.
+ * @param fw_size Size of the new firmware.
+ * @return size_t Number of firmware bytes the kept sectors provide.
+ */
+typedef size_t (*flash_keep_sectors_t)(uint32_t mask, size_t fw_size);
+
+/**
+ * @brief Function pointer type for erasing the sectors of the new firmware in the background.
+ *
+ * Called once CMD_START is acknowledged, the erases overlap with the DATA transfer.
+ *
+ * @param fw_size Size of the new firmware.
+ */
+typedef void (*flash_erase_ahead_t)(size_t fw_size);
+
+/**
+ * @brief Function pointer type for locating the installed firmware a delta update applies to.
+ *
+ * @param base Installed image description announced by the host.
+ * @return const uint8_t* Start of the installed image if its header matches base and the image verifies, NULL otherwise.
+ */
+typedef const uint8_t* (*fw_base_image_t)(const fw_image_info_t* base);
+
+/**
+ * @brief Function pointer type for telling which part of the installed image was not overwritten yet.
+ *
+ * @return size_t First image offset still holding the installed firmware.
+ */
+typedef size_t (*fw_base_intact_t)(void);
+
+/**
+ * @brief Function pointer type for resuming an interrupted update of the same image.
+ *
+ * Called after flash_reset. When the flash holds a partial update of info, the flash state
+ * is restored so that the next fed byte lands right after the last programmed one.
+ *
+ * @param info Firmware image description received from the host.
+ * @param resume Filled with the progress of the interrupted update.
+ * @return true If the update can be resumed, false to start over.
+ */
+typedef bool (*fw_resume_t)(const fw_image_info_t* info, fw_resume_info_t* resume);
+
+/**
+ * @brief Function pointer type for describing the flash layout and the installed firmware.
+ *
+ * The installed firmware is described as its header announces it, the image is not verified.
+ *
+ * @param layout Filled with the layout reported by CMD_GET_INFO.
+ */
+typedef void (*flash_layout_get_t)(flash_layout_t* layout);
 
 /**
  * @brief API structure used by the serial flasher state machine.
@@ -72,14 +239,26 @@ typedef int (*fw_write_header_t)(uint16_t crc_recv, size_t fw_len);
  */
 typedef struct
 {
-    uart_send_t send;                  /**< Function to send data over UART */
-    uart_recv_t recv;                  /**< Function to receive data over UART */
-    flash_feed_t flash_feed;           /**< Function to feed data to flash memory */
-    flash_flush_t flash_flush;         /**< Function to flush flash memory writes */
-    flash_reset_t flash_reset;         /**< Function to reset flash memory or device */
-    fw_crc_check_t fw_crc_check;       /**< Function to check firmware CRC */
-    fw_write_header_t fw_write_header; /**< Function to write firmware header */
-    size_t max_fw_size;                /**< Maximum firmware size supported */
+    uart_send_t send;                             /**< Function to send data over UART */
+    uart_recv_t recv;                             /**< Function to receive data over UART */
+    flash_feed_t flash_feed;                      /**< Function to feed data to flash memory */
+    flash_flush_t flash_flush;                    /**< Function to flush flash memory writes */
+    flash_reset_t flash_reset;                    /**< Function to reset flash memory or device */
+    fw_crc_check_t fw_crc_check;                  /**< Function to check firmware CRC */
+    fw_write_header_t fw_write_header;            /**< Function to write firmware header */
+    size_t max_fw_size;                           /**< Maximum firmware size supported */
+    flash_reserve_t flash_reserve;                /**< Optional, reserve staging memory to receive DATA in place */
+    flash_commit_t flash_commit;                  /**< Optional, commit data received in place */
+    flash_rollback_t flash_rollback;              /**< Optional, give back reserved staging memory */
+    uart_baudrate_supported_t baudrate_supported; /**< Optional, check a baud rate requested with CMD_SET_BAUD */
+    uart_set_baudrate_t set_baudrate;             /**< Optional, switch the baud rate for CMD_SET_BAUD */
+    fw_base_image_t fw_base_image;                /**< Optional, installed image to apply delta updates to */
+    fw_base_intact_t fw_base_intact;              /**< Optional, installed image bytes not overwritten yet */
+    flash_sector_hashes_t sector_hashes;          /**< Optional, sector checksums for CMD_SECTOR_HASH */
+    flash_keep_sectors_t keep_sectors;            /**< Optional, keep the sectors CMD_SECTOR_HASH found unchanged */
+    flash_erase_ahead_t flash_erase_ahead;        /**< Optional, erase the firmware sectors while DATA arrives */
+    fw_resume_t fw_resume;                        /**< Optional, resume an interrupted update with CMD_RESUME */
+    flash_layout_get_t flash_layout;              /**< Optional, flash layout and installed firmware for CMD_GET_INFO */
 } serial_api_t;
 
 /**
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Trace event identifiers, listed in trace_events.h.
+ */
+typedef enum
+{
+    TRACE_NONE = 0,
+#define TRACE_EVENT(name, format) name,
+#include "trace_events.h"
+#undef TRACE_EVENT
+    TRACE_EVENT_COUNT,
+} trace_event_t;
+
+/**
+ * @name Trace record
+ *
+ * A record is a header word followed by its arguments, 32 bits little-endian words:
+ * | 0xA0 + argc (1) | id (1) | time in ms (2) | argc x argument (4) |
+ * The first byte never is ASCII, a decoder can tell records from plain text on the same link.
+ * @{
+ */
+#define TRACE_ARGS_MAX    (4u)
+#define TRACE_RECORD_MARK (0xA0u)
+/** @} */
+
+/**
+ * @brief Append an event to the trace ring.
+ *
+ * Lock-free, callable from any context including interrupts. The event is dropped when the ring is full,
+ * a TRACE_LOST event tells how many were dropped once there is room again.
+ *
+ * @param id Event identifier.
+ * @param argc Number of arguments, up to TRACE_ARGS_MAX.
+ * @param args Arguments, formatted by the host decoder.
+ */
+void trace_record(trace_event_t id, size_t argc, const uint32_t* args);
+
+/**
+ * @brief Record an event without arguments.
+ */
+#define TRACE0(id) trace_record((id), 0, NULL)
+
+/**
+ * @brief Record an event with up to TRACE_ARGS_MAX arguments, converted to uint32_t.
+ */
+#define TRACE(id, ...) \
+    trace_record((id), sizeof((const uint32_t[]) {__VA_ARGS__}) / sizeof(uint32_t), (const uint32_t[]) {__VA_ARGS__})
+
+/**
+ * @brief Hand the committed records to the port, called when idle.
+ *
+ * Does nothing while a previous transfer is in progress, trace_sent() continues from there.
+ */
+void trace_poll(void);
+
+/**
+ * @brief Complete the transfer started by trace_port_send(), called by the port (interrupt context).
+ *
+ * Frees the sent records and starts the next transfer.
+ */
+void trace_sent(void);
+
+/**
+ * @brief Wait until every record committed so far has been sent.
+ *
+ * Needs the port completion interrupt, used before a reset.
+ */
+void trace_flush(void);
+
+/**
+ * @brief Start sending part of the ring, implemented by the port.
+ *
+ * The port calls trace_sent() once the bytes left, the memory stays untouched until then.
+ *
+ * @param data Records to send.
+ * @param len Number of bytes, a multiple of 4.
+ * @return true If the transfer started.
+ */
+bool trace_port_send(const uint8_t* data, size_t len);
+
+/**
+ * @brief Get the time stamp of a record, implemented by the port.
+ *
+ * @return uint32_t Milliseconds, only the low 16 bits are recorded.
+ */
+uint32_t trace_port_time_ms(void);
@@ -0,0 +1,19 @@
+/* Trace events, included by trace.h with TRACE_EVENT(name, format) defined.
+ * The ids follow the order starting at 1, append new events at the end. The format is printf-like and
+ * only takes 32 bits integer conversions, %{enum_t} prints the enumerator name of a typedef'd enum.
+ * scripts/gen_trace_table.py turns this list into the table serial_flasher/python/trace_decode.py reads.
+ */
+TRACE_EVENT(TRACE_LOST, "trace: %u events lost")
+TRACE_EVENT(TRACE_FRAME, "ver 0x%x, cmd %{serial_cmd_t}, len 0x%x")
+TRACE_EVENT(TRACE_STATE, "Serial state change, new state: %{serial_state_t}->%{serial_state_t}")
+TRACE_EVENT(TRACE_PROTOCOL, "protocol version 0x%x, window %u")
+TRACE_EVENT(TRACE_FRAME_SIZE, "protocol version 0x%x, window %u, max payload %u")
+TRACE_EVENT(TRACE_BAUD_REFUSED, "baudrate %u not supported")
+TRACE_EVENT(TRACE_SECTOR_HASH, "sectors %u, keep mask 0x%x")
+TRACE_EVENT(TRACE_RESUME, "resuming at 0x%x of 0x%x, keep mask 0x%x")
+TRACE_EVENT(TRACE_START, "fw_size 0x%x, max_fw_size 0x%x, crc 0x%x, crc32 0x%x")
+TRACE_EVENT(TRACE_SECTOR_WRITE, "Writting sector ADDR: 0x%08x SIZE: %u bytes")
+TRACE_EVENT(TRACE_SECTORS_DONE, "ALL SECTORS HAVE BEEN FLASHED")
+TRACE_EVENT(TRACE_WRITE_FAILED, "WRITING IN SECTOR FAILED")
+TRACE_EVENT(TRACE_FLUSH, "FLUSHING SECTOR")
+TRACE_EVENT(TRACE_KEEP_SECTOR, "KEEPING SECTOR ADDR: 0x%08x")
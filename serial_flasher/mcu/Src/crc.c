@@ -0,0 +1,319 @@
+#include "crc.h"
+
+#include <stdbool.h>
+
+#define CRC16_POLY 0x1021
+#define CRC16_INIT 0xFFFF
+#define CRC32_POLY 0x04C11DB7u
+#define CRC32_INIT 0xFFFFFFFFu
+
+uint16_t crc16_ccitt_bitwise(const uint8_t* data, size_t len)
+{
+    uint16_t crc = CRC16_INIT;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= (uint16_t) data[i] << 8;
+        for (uint8_t j = 0; j < 8; j++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ CRC16_POLY : crc << 1;
+    }
+    return crc;
+}
+
+uint32_t crc32_mpeg2_bitwise(const uint8_t* data, size_t len)
+{
+    uint32_t crc = CRC32_INIT;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= (uint32_t) data[i] << 24;
+        for (uint8_t j = 0; j < 8; j++)
+            crc = (crc & 0x80000000u) ? (crc << 1) ^ CRC32_POLY : crc << 1;
+    }
+    return crc;
+}
+
+#ifdef CRC_SMALL_TABLE
+
+// crc of each nibble value shifted to the top of the register
+static const uint16_t crc16_nibble_table[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7, 0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF};
+
+static const uint32_t crc32_nibble_table[16] = {0x00000000,
+                                                0x04C11DB7,
+                                                0x09823B6E,
+                                                0x0D4326D9,
+                                                0x130476DC,
+                                                0x17C56B6B,
+                                                0x1A864DB2,
+                                                0x1E475005,
+                                                0x2608EDB8,
+                                                0x22C9F00F,
+                                                0x2F8AD6D6,
+                                                0x2B4BCB61,
+                                                0x350C9B64,
+                                                0x31CD86D3,
+                                                0x3C8EA00A,
+                                                0x384FBDBD};
+
+static uint16_t crc16_update_table(uint16_t crc, const uint8_t* data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        crc = (crc << 4) ^ crc16_nibble_table[(crc >> 12) ^ (data[i] >> 4)];
+        crc = (crc << 4) ^ crc16_nibble_table[(crc >> 12) ^ (data[i] & 0x0F)];
+    }
+    return crc;
+}
+
+static uint32_t crc32_update_table(uint32_t crc, const uint8_t* data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        crc = (crc << 4) ^ crc32_nibble_table[(crc >> 28) ^ (data[i] >> 4)];
+        crc = (crc << 4) ^ crc32_nibble_table[(crc >> 28) ^ (data[i] & 0x0F)];
+    }
+    return crc;
+}
+
+// no slicing tables in the small configuration
+#define crc16_update_slice4 crc16_update_table
+#define crc16_update_slice8 crc16_update_table
+#define crc32_update_slice4 crc32_update_table
+#define crc32_update_slice8 crc32_update_table
+
+#else
+
+#define CRC_SLICES (8u)
+
+// crc16_table[k][i]: crc of byte i followed by k zero bytes
+static uint16_t crc16_table[CRC_SLICES][256];
+static bool crc16_table_ready = false;
+static uint32_t crc32_table[CRC_SLICES][256];
+static bool crc32_table_ready = false;
+
+static void crc16_table_init(void)
+{
+    if (crc16_table_ready)
+    {
+        return;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint16_t crc = (uint16_t) (i << 8);
+        for (uint8_t j = 0; j < 8; j++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ CRC16_POLY : crc << 1;
+        crc16_table[0][i] = crc;
+    }
+    for (uint32_t k = 1; k < CRC_SLICES; k++)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            const uint16_t prev = crc16_table[k - 1][i];
+            crc16_table[k][i] = (prev << 8) ^ crc16_table[0][prev >> 8];
+        }
+    }
+    crc16_table_ready = true;
+}
+
+static void crc32_table_init(void)
+{
+    if (crc32_table_ready)
+    {
+        return;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i << 24;
+        for (uint8_t j = 0; j < 8; j++)
+            crc = (crc & 0x80000000u) ? (crc << 1) ^ CRC32_POLY : crc << 1;
+        crc32_table[0][i] = crc;
+    }
+    for (uint32_t k = 1; k < CRC_SLICES; k++)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            const uint32_t prev = crc32_table[k - 1][i];
+            crc32_table[k][i] = (prev << 8) ^ crc32_table[0][prev >> 24];
+        }
+    }
+    crc32_table_ready = true;
+}
+
+static uint16_t crc16_update_table(uint16_t crc, const uint8_t* data, size_t len)
+{
+    crc16_table_init();
+    for (size_t i = 0; i < len; i++)
+    {
+        crc = (crc << 8) ^ crc16_table[0][(crc >> 8) ^ data[i]];
+    }
+    return crc;
+}
+
+static uint16_t crc16_update_slice4(uint16_t crc, const uint8_t* data, size_t len)
+{
+    crc16_table_init();
+    while (len >= 4)
+    {
+        crc = crc16_table[3][(crc >> 8) ^ data[0]] ^ crc16_table[2][(crc & 0xFF) ^ data[1]] ^ crc16_table[1][data[2]]
+              ^ crc16_table[0][data[3]];
+        data += 4;
+        len -= 4;
+    }
+    return crc16_update_table(crc, data, len);
+}
+
+static uint16_t crc16_update_slice8(uint16_t crc, const uint8_t* data, size_t len)
+{
+    crc16_table_init();
+    while (len >= 8)
+    {
+        crc = crc16_table[7][(crc >> 8) ^ data[0]] ^ crc16_table[6][(crc & 0xFF) ^ data[1]] ^ crc16_table[5][data[2]]
+              ^ crc16_table[4][data[3]] ^ crc16_table[3][data[4]] ^ crc16_table[2][data[5]] ^ crc16_table[1][data[6]]
+              ^ crc16_table[0][data[7]];
+        data += 8;
+        len -= 8;
+    }
+    return crc16_update_table(crc, data, len);
+}
+
+static uint32_t crc32_update_table(uint32_t crc, const uint8_t* data, size_t len)
+{
+    crc32_table_init();
+    for (size_t i = 0; i < len; i++)
+    {
+        crc = (crc << 8) ^ crc32_table[0][(crc >> 24) ^ data[i]];
+    }
+    return crc;
+}
+
+static uint32_t crc32_update_slice4(uint32_t crc, const uint8_t* data, size_t len)
+{
+    crc32_table_init();
+    while (len >= 4)
+    {
+        crc = crc32_table[3][(crc >> 24) ^ data[0]] ^ crc32_table[2][((crc >> 16) & 0xFF) ^ data[1]]
+              ^ crc32_table[1][((crc >> 8) & 0xFF) ^ data[2]] ^ crc32_table[0][(crc & 0xFF) ^ data[3]];
+        data += 4;
+        len -= 4;
+    }
+    return crc32_update_table(crc, data, len);
+}
+
+static uint32_t crc32_update_slice8(uint32_t crc, const uint8_t* data, size_t len)
+{
+    crc32_table_init();
+    while (len >= 8)
+    {
+        crc = crc32_table[7][(crc >> 24) ^ data[0]] ^ crc32_table[6][((crc >> 16) & 0xFF) ^ data[1]]
+              ^ crc32_table[5][((crc >> 8) & 0xFF) ^ data[2]] ^ crc32_table[4][(crc & 0xFF) ^ data[3]] ^ crc32_table[3][data[4]]
+              ^ crc32_table[2][data[5]] ^ crc32_table[1][data[6]] ^ crc32_table[0][data[7]];
+        data += 8;
+        len -= 8;
+    }
+    return crc32_update_table(crc, data, len);
+}
+
+#endif
+
+uint16_t crc16_ccitt_table(const uint8_t* data, size_t len)
+{
+    return crc16_update_table(CRC16_INIT, data, len);
+}
+
+uint16_t crc16_ccitt_slice4(const uint8_t* data, size_t len)
+{
+    return crc16_update_slice4(CRC16_INIT, data, len);
+}
+
+uint16_t crc16_ccitt_slice8(const uint8_t* data, size_t len)
+{
+    return crc16_update_slice8(CRC16_INIT, data, len);
+}
+
+uint16_t crc16_ccitt_init(void)
+{
+    return CRC16_INIT;
+}
+
+uint16_t crc16_ccitt_update(uint16_t crc, const uint8_t* data, size_t len)
+{
+    return crc16_update_slice8(crc, data, len);
+}
+
+uint16_t crc16_ccitt_final(uint16_t crc)
+{
+    // ccitt-false has no final xor
+    return crc;
+}
+
+uint16_t crc16_ccitt(const uint8_t* data, size_t len)
+{
+    return crc16_ccitt_final(crc16_ccitt_update(crc16_ccitt_init(), data, len));
+}
+
+uint32_t crc32_mpeg2_table(const uint8_t* data, size_t len)
+{
+    return crc32_update_table(CRC32_INIT, data, len);
+}
+
+uint32_t crc32_mpeg2_slice4(const uint8_t* data, size_t len)
+{
+    return crc32_update_slice4(CRC32_INIT, data, len);
+}
+
+uint32_t crc32_mpeg2_slice8(const uint8_t* data, size_t len)
+{
+    return crc32_update_slice8(CRC32_INIT, data, len);
+}
+
+uint32_t crc32_mpeg2_init(void)
+{
+    return CRC32_INIT;
+}
+
+uint32_t crc32_mpeg2_update(uint32_t crc, const uint8_t* data, size_t len)
+{
+    return crc32_update_slice8(crc, data, len);
+}
+
+uint32_t crc32_mpeg2_final(uint32_t crc)
+{
+    // MPEG-2 variant has no final xor
+    return crc;
+}
+
+uint32_t crc32_mpeg2(const uint8_t* data, size_t len)
+{
+    return crc32_mpeg2_final(crc32_mpeg2_update(crc32_mpeg2_init(), data, len));
+}
+
+uint32_t crc32_stm32_update(uint32_t crc, const uint32_t* words, size_t num_words)
+{
+    for (size_t i = 0; i < num_words; i++)
+    {
+        const uint32_t word = words[i];
+        const uint8_t bytes[4] = {word >> 24, (word >> 16) & 0xFF, (word >> 8) & 0xFF, word & 0xFF};
+        crc = crc32_mpeg2_update(crc, bytes, sizeof(bytes));
+    }
+    return crc;
+}
+
+uint32_t crc32_stm32(const uint8_t* data, size_t len)
+{
+    uint32_t crc = crc32_mpeg2_init();
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4)
+    {
+        const uint8_t bytes[4] = {data[i + 3], data[i + 2], data[i + 1], data[i]};
+        crc = crc32_mpeg2_update(crc, bytes, sizeof(bytes));
+    }
+    if (i < len)
+    {
+        uint8_t bytes[4] = {0xFF, 0xFF, 0xFF, 0xFF};
+        for (size_t j = 0; i + j < len; j++)
+        {
+            bytes[3 - j] = data[i + j];
+        }
+        crc = crc32_mpeg2_update(crc, bytes, sizeof(bytes));
+    }
+    return crc32_mpeg2_final(crc);
+}
@@ -0,0 +1,167 @@
+#include "fw_delta.h"
+
+#include <string.h>
+
+#define DELTA_OP_COPY   (0x00u)
+#define DELTA_OP_INSERT (0x01u)
+
+// base bytes are read into a bounce buffer first, the output may erase the sector they come from
+#define DELTA_COPY_STEP (64u)
+// a 32 bits varint takes at most 5 bytes
+#define VARINT_SHIFT_MAX (28u)
+
+typedef enum
+{
+    DELTA_OP,
+    DELTA_COPY_SRC,
+    DELTA_COPY_LEN,
+    DELTA_INSERT_LEN,
+    DELTA_INSERT_BYTES,
+    DELTA_ERROR,
+} fw_delta_state_t;
+
+void fw_delta_init(fw_delta_t* delta, const uint8_t* base, size_t base_size, size_t limit, fw_delta_output_t output, fw_delta_intact_t intact)
+{
+    delta->state = DELTA_OP;
+    delta->op = 0;
+    delta->varint = 0;
+    delta->varint_shift = 0;
+    delta->src = 0;
+    delta->len = 0;
+    delta->base = base;
+    delta->base_size = base_size;
+    delta->total = 0;
+    delta->limit = limit;
+    delta->output = output;
+    delta->intact = intact;
+}
+
+// returns true once the varint is complete
+static bool delta_varint(fw_delta_t* delta, uint8_t value)
+{
+    delta->varint |= (uint32_t) (value & 0x7F) << delta->varint_shift;
+    if (value & 0x80)
+    {
+        delta->varint_shift += 7;
+        if (delta->varint_shift > VARINT_SHIFT_MAX)
+        {
+            delta->state = DELTA_ERROR;
+        }
+        return false;
+    }
+    delta->varint_shift = 0;
+    return true;
+}
+
+static fw_delta_state_t delta_copy(fw_delta_t* delta)
+{
+    if (delta->len > delta->limit - delta->total || delta->src > delta->base_size || delta->len > delta->base_size - delta->src)
+    {
+        return DELTA_ERROR;
+    }
+    uint8_t bounce[DELTA_COPY_STEP];
+    while (delta->len > 0)
+    {
+        if (delta->src < delta->intact())
+        {
+            // the base bytes were already replaced by the new image
+            return DELTA_ERROR;
+        }
+        const size_t count = delta->len < DELTA_COPY_STEP ? delta->len : DELTA_COPY_STEP;
+        memcpy(bounce, &delta->base[delta->src], count);
+        if (delta->output(bounce, count))
+        {
+            return DELTA_ERROR;
+        }
+        delta->src += count;
+        delta->len -= count;
+        delta->total += count;
+    }
+    return DELTA_OP;
+}
+
+int fw_delta_feed(fw_delta_t* delta, const uint8_t* data, size_t len)
+{
+    size_t pos = 0;
+    while (pos < len && delta->state != DELTA_ERROR)
+    {
+        switch (delta->state)
+        {
+            case DELTA_OP:
+                if (delta->total == delta->limit)
+                {
+                    // data after the end of the image
+                    delta->state = DELTA_ERROR;
+                    break;
+                }
+                delta->op = data[pos++];
+                delta->varint = 0;
+                if (delta->op == DELTA_OP_COPY)
+                {
+                    delta->state = DELTA_COPY_SRC;
+                }
+                else if (delta->op == DELTA_OP_INSERT)
+                {
+                    delta->state = DELTA_INSERT_LEN;
+                }
+                else
+                {
+                    delta->state = DELTA_ERROR;
+                }
+                break;
+            case DELTA_COPY_SRC:
+                if (delta_varint(delta, data[pos++]))
+                {
+                    delta->src = delta->varint;
+                    delta->varint = 0;
+                    delta->state = DELTA_COPY_LEN;
+                }
+                break;
+            case DELTA_COPY_LEN:
+                if (delta_varint(delta, data[pos++]))
+                {
+                    delta->len = delta->varint;
+                    delta->state = delta_copy(delta);
+                }
+                break;
+            case DELTA_INSERT_LEN:
+                if (delta_varint(delta, data[pos++]))
+                {
+                    delta->len = delta->varint;
+                    if (delta->len > delta->limit - delta->total)
+                    {
+                        delta->state = DELTA_ERROR;
+                        break;
+                    }
+                    delta->state = delta->len > 0 ? DELTA_INSERT_BYTES : DELTA_OP;
+                }
+                break;
+            case DELTA_INSERT_BYTES:
+            {
+                size_t count = len - pos;
+                count = count < delta->len ? count : delta->len;
+                if (delta->output(&data[pos], count))
+                {
+                    delta->state = DELTA_ERROR;
+                    break;
+                }
+                pos += count;
+                delta->len -= count;
+                delta->total += count;
+                if (delta->len == 0)
+                {
+                    delta->state = DELTA_OP;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    return delta->state == DELTA_ERROR ? -1 : 0;
+}
+
+bool fw_delta_done(const fw_delta_t* delta)
+{
+    return delta->state == DELTA_OP && delta->total == delta->limit;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Function pointer type receiving the rebuilt image.
+ *
+ * @param buf Pointer to the image bytes.
+ * @param len Number of bytes.
+ * @return int Status code (0 for success, negative for error).
+ */
+typedef int (*fw_delta_output_t)(const uint8_t* buf, size_t len);
+
+/**
+ * @brief Function pointer type returning the first base image offset that was not overwritten yet.
+ *
+ * The new image is programmed over the base image, bytes of the base before this offset are gone.
+ *
+ * @return size_t Offset into the base image.
+ */
+typedef size_t (*fw_delta_intact_t)(void);
+
+/**
+ * @brief Streaming applier of a delta against the installed image.
+ *
+ * The delta is a sequence of operations, lengths and offsets are LEB128 varints:
+ * - COPY (0x00) | src | len: copy len bytes of the base image starting at src
+ * - INSERT (0x01) | len | bytes: append len bytes from the delta
+ */
+typedef struct
+{
+    uint8_t state;
+    uint8_t op;
+    uint32_t varint;          /**< Varint being decoded */
+    uint8_t varint_shift;
+    uint32_t src;             /**< COPY source offset */
+    uint32_t len;             /**< Bytes left in the current operation */
+    const uint8_t* base;      /**< Installed image */
+    size_t base_size;
+    size_t total;             /**< Bytes of the new image produced so far */
+    size_t limit;             /**< Size of the new image */
+    fw_delta_output_t output;
+    fw_delta_intact_t intact;
+} fw_delta_t;
+
+/**
+ * @brief Initialize an applier.
+ *
+ * @param delta Applier to initialize.
+ * @param base Installed image the delta was made against.
+ * @param base_size Size of the installed image.
+ * @param limit Size of the new image.
+ * @param output Callback receiving the new image in order.
+ * @param intact Callback telling which part of the base is still readable.
+ */
+void fw_delta_init(fw_delta_t* delta, const uint8_t* base, size_t base_size, size_t limit, fw_delta_output_t output, fw_delta_intact_t intact);
+
+/**
+ * @brief Apply the next part of the delta stream.
+ *
+ * @param delta Applier.
+ * @param data Delta bytes.
+ * @param len Number of bytes.
+ * @return int 0 on success, negative if the delta is corrupted, reads overwritten base bytes or the output failed.
+ */
+int fw_delta_feed(fw_delta_t* delta, const uint8_t* data, size_t len);
+
+/**
+ * @brief Check whether the whole new image was produced.
+ *
+ * @param delta Applier.
+ * @return true If limit bytes were produced and no operation is pending.
+ */
+bool fw_delta_done(const fw_delta_t* delta);
@@ -0,0 +1,207 @@
+#include "lz4_stream.h"
+
+#include <string.h>
+
+/*
+LZ4 block format, a sequence is:
+| token | literal length (0-n) | literals | offset (2, LE) | match length (0-n) |
+- token: high nibble literal length, low nibble match length - 4, 15 means more length bytes follow
+- length bytes: added to the nibble until a byte smaller than 255
+- the last sequence only holds literals
+*/
+
+#define LZ4_MIN_MATCH  (4u)
+#define LZ4_NIBBLE_MAX (15u)
+
+typedef enum
+{
+    LZ4_TOKEN,
+    LZ4_LITERAL_LEN,
+    LZ4_LITERALS,
+    LZ4_OFFSET_LO,
+    LZ4_OFFSET_HI,
+    LZ4_MATCH_LEN,
+    LZ4_ERROR,
+} lz4_state_t;
+
+void lz4_stream_init(lz4_stream_t* stream, uint8_t* window, size_t window_size, size_t limit, lz4_output_t output)
+{
+    stream->state = LZ4_TOKEN;
+    stream->window = window;
+    stream->window_size = window_size;
+    stream->total = 0;
+    stream->flushed = 0;
+    stream->limit = limit;
+    stream->literal_len = 0;
+    stream->match_len = 0;
+    stream->offset = 0;
+    stream->output = output;
+}
+
+static int lz4_flush(lz4_stream_t* stream)
+{
+    // the pending bytes never span the end of the ring, the ring is flushed when it wraps
+    const size_t len = stream->total - stream->flushed;
+    if (len == 0)
+    {
+        return 0;
+    }
+    const size_t start = stream->flushed & (stream->window_size - 1);
+    stream->flushed = stream->total;
+    return stream->output(&stream->window[start], len);
+}
+
+static int lz4_wrap(lz4_stream_t* stream)
+{
+    if ((stream->total & (stream->window_size - 1)) == 0)
+    {
+        return lz4_flush(stream);
+    }
+    return 0;
+}
+
+static int lz4_copy_literals(lz4_stream_t* stream, const uint8_t* data, size_t len)
+{
+    while (len > 0)
+    {
+        const size_t pos = stream->total & (stream->window_size - 1);
+        size_t count = stream->window_size - pos;
+        count = count < len ? count : len;
+        memcpy(&stream->window[pos], data, count);
+        stream->total += count;
+        data += count;
+        len -= count;
+        if (lz4_wrap(stream))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int lz4_copy_match(lz4_stream_t* stream)
+{
+    const size_t mask = stream->window_size - 1;
+    for (size_t i = 0; i < stream->match_len; i++)
+    {
+        // byte by byte, a match may overlap the bytes it produces
+        stream->window[stream->total & mask] = stream->window[(stream->total - stream->offset) & mask];
+        stream->total++;
+        if (lz4_wrap(stream))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static lz4_state_t lz4_end_literals(lz4_stream_t* stream)
+{
+    // the last sequence has no match
+    return stream->total == stream->limit ? LZ4_TOKEN : LZ4_OFFSET_LO;
+}
+
+static lz4_state_t lz4_end_match(lz4_stream_t* stream)
+{
+    if (stream->match_len > stream->limit - stream->total || lz4_copy_match(stream))
+    {
+        return LZ4_ERROR;
+    }
+    return LZ4_TOKEN;
+}
+
+int lz4_stream_feed(lz4_stream_t* stream, const uint8_t* data, size_t len)
+{
+    size_t pos = 0;
+    while (pos < len && stream->state != LZ4_ERROR)
+    {
+        switch (stream->state)
+        {
+            case LZ4_TOKEN:
+            {
+                if (stream->total == stream->limit)
+                {
+                    // data after the end of the image
+                    stream->state = LZ4_ERROR;
+                    break;
+                }
+                const uint8_t token = data[pos++];
+                stream->literal_len = token >> 4;
+                stream->match_len = (token & 0x0F) + LZ4_MIN_MATCH;
+                if (stream->literal_len == LZ4_NIBBLE_MAX)
+                {
+                    stream->state = LZ4_LITERAL_LEN;
+                }
+                else
+                {
+                    stream->state = stream->literal_len > 0 ? LZ4_LITERALS : lz4_end_literals(stream);
+                }
+                break;
+            }
+            case LZ4_LITERAL_LEN:
+            {
+                const uint8_t value = data[pos++];
+                stream->literal_len += value;
+                if (value != 0xFF)
+                {
+                    stream->state = LZ4_LITERALS;
+                }
+                break;
+            }
+            case LZ4_LITERALS:
+            {
+                size_t count = len - pos;
+                count = count < stream->literal_len ? count : stream->literal_len;
+                if (count > stream->limit - stream->total || lz4_copy_literals(stream, &data[pos], count))
+                {
+                    stream->state = LZ4_ERROR;
+                    break;
+                }
+                pos += count;
+                stream->literal_len -= count;
+                if (stream->literal_len == 0)
+                {
+                    stream->state = lz4_end_literals(stream);
+                }
+                break;
+            }
+            case LZ4_OFFSET_LO:
+                stream->offset = data[pos++];
+                stream->state = LZ4_OFFSET_HI;
+                break;
+            case LZ4_OFFSET_HI:
+                stream->offset |= (size_t) data[pos++] << 8;
+                if (stream->offset == 0 || stream->offset > stream->window_size || stream->offset > stream->total)
+                {
+                    stream->state = LZ4_ERROR;
+                    break;
+                }
+                stream->state = (stream->match_len == LZ4_NIBBLE_MAX + LZ4_MIN_MATCH) ? LZ4_MATCH_LEN : lz4_end_match(stream);
+                break;
+            case LZ4_MATCH_LEN:
+            {
+                const uint8_t value = data[pos++];
+                stream->match_len += value;
+                if (value != 0xFF)
+                {
+                    stream->state = lz4_end_match(stream);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    if (stream->state == LZ4_ERROR || lz4_flush(stream))
+    {
+        stream->state = LZ4_ERROR;
+        return -1;
+    }
+    return 0;
+}
+
+bool lz4_stream_done(const lz4_stream_t* stream)
+{
+    return stream->state == LZ4_TOKEN && stream->total == stream->limit && stream->flushed == stream->total;
+}
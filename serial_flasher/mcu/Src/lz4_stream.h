@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Function pointer type receiving decompressed data.
+ *
+ * @param buf Pointer to the decompressed bytes.
+ * @param len Number of bytes.
+ * @return int Status code (0 for success, negative for error).
+ */
+typedef int (*lz4_output_t)(const uint8_t* buf, size_t len);
+
+/**
+ * @brief Streaming decoder of a single LZ4 block.
+ *
+ * The compressed stream can be pushed in chunks of any size. Match offsets must stay within
+ * the history window, so the compressor has to be told the window size. Decompressed bytes
+ * are written to the window ring and handed to the output callback whenever the ring wraps
+ * and at the end of every lz4_stream_feed() call.
+ */
+typedef struct
+{
+    uint8_t state;
+    uint8_t* window;     /**< History ring, also used as output buffer */
+    size_t window_size;  /**< Power of two */
+    size_t total;        /**< Bytes decompressed so far */
+    size_t flushed;      /**< Bytes handed to the output callback so far */
+    size_t limit;        /**< Expected decompressed size */
+    size_t literal_len;  /**< Literals left in the current sequence */
+    size_t match_len;    /**< Match length of the current sequence */
+    size_t offset;       /**< Match offset of the current sequence */
+    lz4_output_t output;
+} lz4_stream_t;
+
+/**
+ * @brief Initialize a decoder.
+ *
+ * @param stream Decoder to initialize.
+ * @param window History ring of window_size bytes.
+ * @param window_size Size of the ring, a power of two, the largest match offset the stream may use.
+ * @param limit Decompressed size, decoding past it is an error.
+ * @param output Callback receiving the decompressed bytes in order.
+ */
+void lz4_stream_init(lz4_stream_t* stream, uint8_t* window, size_t window_size, size_t limit, lz4_output_t output);
+
+/**
+ * @brief Decompress the next part of the compressed stream.
+ *
+ * @param stream Decoder.
+ * @param data Compressed bytes.
+ * @param len Number of bytes.
+ * @return int 0 on success, negative if the stream is corrupted or the output callback failed.
+ */
+int lz4_stream_feed(lz4_stream_t* stream, const uint8_t* data, size_t len);
+
+/**
+ * @brief Check whether the whole image was decompressed.
+ *
+ * @param stream Decoder.
+ * @return true If limit bytes were decompressed and no sequence is pending.
+ */
+bool lz4_stream_done(const lz4_stream_t* stream);
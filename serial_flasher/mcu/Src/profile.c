@@ -0,0 +1,47 @@
+#include "profile.h"
+
+#ifdef PROFILE
+
+#include <string.h>
+
+static prof_entry_t table[PROF_COUNT];
+
+void prof_start(prof_id_t id)
+{
+    table[id].start = prof_clock_now();
+}
+
+void prof_stop(prof_id_t id)
+{
+    prof_entry_t* entry = &table[id];
+    // unsigned arithmetic survives one wrap of the clock
+    const uint32_t ticks = prof_clock_now() - entry->start;
+    if (entry->count == 0 || ticks < entry->min)
+    {
+        entry->min = ticks;
+    }
+    if (ticks > entry->max)
+    {
+        entry->max = ticks;
+    }
+    entry->total += ticks;
+    entry->count++;
+}
+
+void prof_reset(void)
+{
+    // measurements in progress are kept, a job started before the reset still completes
+    for (size_t i = 0; i < PROF_COUNT; i++)
+    {
+        const uint32_t start = table[i].start;
+        memset(&table[i], 0, sizeof(table[i]));
+        table[i].start = start;
+    }
+}
+
+const prof_entry_t* prof_table(void)
+{
+    return table;
+}
+
+#endif
@@ -1,26 +1,164 @@
 #include "serial_flasher.h"
 
+#include "fw_delta.h"
+#include "lz4_stream.h"
+#include "profile.h"
 #include "serial_api.h"
+#include "serial_frame_parser.h"
 #include "serial_process_frame.h"
+#include "trace.h"
 
 #include <stdbool.h>
-#include <stdio.h>
 #include <string.h>
 
 /*
 
-| Command | Direction  | Description              |
-| ------- | ---------- | ------------------------ |
-| PING    | Host → MCU | Check bootloader alive   |
-| START   | Host → MCU | Begin update (size, CRC) |
-| DATA    | Host → MCU | Firmware chunk           |
-| END     | Host → MCU | Finish & verify          |
-| RESET   | Host → MCU | Reboot into app          |
-| ACK     | MCU → Host | Command OK               |
-| NACK    | MCU → Host | Error code               |
+| Command     | Direction  | Description              |
+| ----------- | ---------- | ------------------------ |
+| PING        | Host → MCU | Check bootloader alive   |
+| START       | Host → MCU | Begin update (size, CRC) |
+| DATA        | Host → MCU | Firmware chunk           |
+| END         | Host → MCU | Finish & verify          |
+| RESET       | Host → MCU | Reboot into app          |
+| SET_BAUD    | Host → MCU | Switch link baud rate    |
+| SECTOR_HASH | Host → MCU | Sector checksums         |
+| RESUME      | Host → MCU | Continue an update       |
+| GET_INFO    | Host → MCU | Bootloader capabilities  |
+| GET_STATS   | Host → MCU | Hot path timers          |
+| ACK         | MCU → Host | Command OK               |
+| NACK        | MCU → Host | Error code               |
 
+Protocol version 2 (negotiated by the VER field of PING):
+- PING payload: requested window (1 byte), ACK payload: granted window (1 byte)
+- DATA payload: firmware offset (4 bytes, little-endian) | chunk
+- DATA/END responses carry the next expected firmware offset (4 bytes, little-endian).
+  ACK is cumulative, NACK asks the host to retransmit from that offset.
+- START ACK payload: window (1 byte). Compressed streams get a smaller window than the PING one,
+  the host keeps the smaller of both.
+
+Large frames (version 2), PING payload: | window (1) | max frame payload (2) |
+ACK payload: | window (1) | max frame payload (2) | block size (2) |
+The granted payload is clamped to 256 B..4 KB and the window to the DATA bytes the MCU can buffer.
+From the next frame on, a payload longer than the block size is sent as blocks of that size, each
+one followed by the CRC of the frame up to its end (the last one by the usual frame CRC):
+| SOF | VER | CMD | LEN | block | CRC | block | CRC | ... | last block | CRC |
+Every block is checked and written on its own, a DATA frame is still answered once. When a block
+fails its CRC the blocks before it are kept, the NACK offset points right after them.
+
+SET_BAUD (after PING, before START), payload: baud rate (4 bytes, little-endian)
+- NACK: rate not supported, the session is reset
+- ACK (sent at the old rate): the MCU switches and waits for a PING at the new rate.
+  It answers the PING with ACK, or goes back to the old rate when no PING arrives in time.
+
+SECTOR_HASH (after PING, before START), payload: nothing or the expected crc32 of each sector
+(4 bytes each, little-endian). ACK payload: | count (1) | keep_mask (1) | count x (size (4) | crc32 (4)) |
+Sizes and CRCs cover the image bytes of each sector of the slot the update writes, the first one
+without the header. That is the slot not running, it holds the image before the running one, so
+sectors match when the update goes back to that image, or flashes again one that was interrupted.
+keep_mask has a bit set for each sector matching the expected crc32. The next START keeps those
+sectors: their bytes are left out of the DATA stream and they are not erased, except the first one
+which is rebuilt around the new header.
+
+RESUME (version 2, after PING, before START), payload: the START payload of the interrupted update.
+ACK payload: | offset (4) | keep_mask (1) |
+offset is the DATA stream offset programmed so far, the session goes on with DATA from there and
+keep_mask tells which sectors the interrupted update kept. The progress survives a reset or power
+loss. offset 0 means nothing to resume (another image, compressed or delta codec), the session
+waits for START as usual.
+
+GET_INFO (after PING, before START), no payload. ACK payload: | info_version (1) | TLV entries |
+Each entry is | type (1) | len (1) | value (len) |, integers are little-endian. Hosts skip the
+types they do not know and fall back to their defaults for the ones not sent. info_version 1:
+- 0x01 protocol: highest protocol version (1) | maximum DATA window (1)
+- 0x02 frame: maximum frame payload (2) | DATA chunk size received without copy, 0 if any (2) |
+  block size of large frames, 0 if not negotiated (2)
+- 0x03 firmware: maximum firmware size (4)
+- 0x04 codecs: bit n set for codec n (1) | maximum LZ4 window_log2 (1)
+- 0x05 crc: bit 0 CRC16-CCITT, bit 1 CRC32 of the STM32 CRC unit (1)
+- 0x06 commands: bit n set when command n is handled (2)
+- 0x07 sectors: count x (address (4) | size (4)), application sectors in SECTOR_HASH order
+- 0x08 image: fw_size (4) | crc16 (2) | crc32 (4) | flags (1), header of the installed firmware,
+  flags bit 0 tells crc32 is valid. Not sent when no header is present.
+
+GET_STATS (after PING, or between DATA frames), no payload. Builds without the profiler NACK it.
+ACK payload: | stats_version (1) | clock_hz (4) | count x (id (1) | count (4) | min (4) | max (4) | total (8)) |
+Durations are in ticks of clock_hz (core cycles on the target), integers are little-endian. Only the
+timers measured at least once are sent, see prof_id_t for the ids. The timers restart on START and RESUME.
+
+START payload (little-endian), any version:
+| fw_size (4) | crc16 (2) | codec (1) | window_log2 (1) | crc32 (4, optional) | stream_size (4, codec != 0) |
+crc32 is the CRC of the STM32 CRC unit, when present the image is verified in hardware.
+codec 0 sends the image as is. codec 1 sends it as one LZ4 block whose match offsets stay
+within 1 << window_log2 bytes, stream_size is the size of the compressed stream. DATA offsets
+count stream bytes, fw_size and the CRCs describe the decompressed image.
+codec 2 sends a delta against the installed image (window_log2 unused), followed by:
+| base_size (4) | base_crc16 (2) | reserved (2) | base_crc32 (4) |
+The START is refused when the installed image does not match the base. The delta is a
+sequence of COPY (from the installed image) and INSERT operations, see fw_delta.h. COPY
+may only read bytes of sectors the new image has not reached yet.
 */
 
+// maximum number of DATA frames the host may have in flight
+#define SERIAL_WINDOW_MAX (4u)
+// DATA payload in flight, the 8 KB receive ring holds it with the frame headers and CRCs while the MCU waits for the flash
+#define SERIAL_INFLIGHT_MAX (4096u)
+// PING payload: window | max frame payload, ACK payload: window | max frame payload | block size
+#define PING_FRAME_SIZE_PAYLOAD_SIZE (3u)
+#define PING_FRAME_SIZE_ACK_SIZE     (5u)
+// DATA frame offset field size in protocol version 2
+#define DATA_OFFSET_SIZE (4u)
+// consecutive version 2 DATA frames lost before the host is considered gone, about 2 s of silence
+#define DATA_LOST_FRAMES_MAX (20u)
+// SET_BAUD payload: baud rate
+#define SET_BAUD_PAYLOAD_SIZE (4u)
+// SECTOR_HASH ACK payload: count | keep_mask | count x (size | crc32)
+#define SECTOR_HASH_MAX         (8u)
+#define SECTOR_HASH_HEADER_SIZE (2u)
+#define SECTOR_HASH_ENTRY_SIZE  (8u)
+// recv_frame timeouts to wait for the verify PING after a baud rate switch
+#define BAUD_VERIFY_TRIES (10u)
+// fw_size | crc16
+#define START_PAYLOAD_MIN_SIZE (6u)
+// fw_size | crc16 | codec | window_log2
+#define START_PAYLOAD_CODEC_SIZE (8u)
+// fw_size | crc16 | codec | window_log2 | crc32
+#define START_PAYLOAD_CRC32_SIZE (12u)
+// fw_size | crc16 | codec | window_log2 | crc32 | stream_size
+#define START_PAYLOAD_STREAM_SIZE (16u)
+// RESUME ACK payload: offset | keep_mask
+#define RESUME_PAYLOAD_SIZE (5u)
+// ... | stream_size | base_size | base_crc16 | reserved | base_crc32
+#define START_PAYLOAD_DELTA_SIZE (28u)
+// GET_STATS ACK payload: stats_version | clock_hz | count x (id | count | min | max | total)
+#define STATS_VERSION     (1u)
+#define STATS_HEADER_SIZE (5u)
+#define STATS_ENTRY_SIZE  (21u)
+// GET_INFO ACK payload: info_version | TLV entries (type | len | value)
+#define INFO_VERSION          (1u)
+#define INFO_TLV_HEADER_SIZE  (2u)
+#define INFO_PAYLOAD_MAX_SIZE (128u)
+#define INFO_SECTOR_SIZE      (8u)
+
+#define INFO_TYPE_PROTOCOL (0x01u)
+#define INFO_TYPE_FRAME    (0x02u)
+#define INFO_TYPE_FIRMWARE (0x03u)
+#define INFO_TYPE_CODECS   (0x04u)
+#define INFO_TYPE_CRC      (0x05u)
+#define INFO_TYPE_COMMANDS (0x06u)
+#define INFO_TYPE_SECTORS  (0x07u)
+#define INFO_TYPE_IMAGE    (0x08u)
+
+#define INFO_CRC16           (1u << 0)
+#define INFO_CRC32           (1u << 1)
+#define INFO_IMAGE_HAS_CRC32 (1u << 0)
+
+#define FW_CODEC_RAW (0u)
+#define FW_CODEC_LZ4 (1u)
+#define FW_CODEC_DELTA (2u)
+// decompression history kept in RAM, the host must not use longer match offsets
+#define LZ4_WINDOW_LOG2_MIN (4u)
+#define LZ4_WINDOW_LOG2_MAX (12u)
+
 typedef enum
 {
     PING_STATE,
@@ -30,40 +168,251 @@ typedef enum
     RESET_STATE,
 } serial_state_t;
 
-static const char* get_serial_state_str(const serial_state_t serial_state)
+typedef struct
+{
+    fw_image_info_t image;
+    uint8_t version;    /**< Protocol version negotiated on PING */
+    uint8_t window;     /**< Number of DATA frames the host may have in flight */
+    size_t offset;      /**< Next expected DATA stream offset */
+    uint32_t baudrate;  /**< Baud rate set with CMD_SET_BAUD, 0 for the link default */
+    uint8_t codec;      /**< Encoding of the DATA stream */
+    size_t stream_size; /**< Size of the DATA stream, fw_size unless compressed */
+    size_t feed_size;   /**< Image bytes fed to the flash, fw_size minus the kept sectors */
+    uint8_t keep_mask;  /**< Sectors found unchanged by CMD_SECTOR_HASH */
+    size_t max_payload; /**< Frame payload limit negotiated on PING, 0 if not negotiated */
+    size_t block_next;  /**< Frame position of the next DATA block continuing the stream, 0 if none */
+    bool block_ack;     /**< Answer of the DATA frame whose blocks are ignored, ACK for a retransmission */
+    size_t lost_frames; /**< Consecutive DATA frames lost or corrupted, version 2 */
+    lz4_stream_t lz4;   /**< Decoder of a FW_CODEC_LZ4 stream */
+    fw_delta_t delta;   /**< Applier of a FW_CODEC_DELTA stream */
+} serial_session_t;
+
+static uint8_t lz4_window[1u << LZ4_WINDOW_LOG2_MAX];
+
+static uint8_t* data_sink_reserve(const serial_frame_t* frame, size_t pos, size_t* len);
+static void data_sink_rollback(const serial_frame_t* frame, size_t len);
+
+// receives in order v2 DATA chunks straight into the flash staging buffer
+static const frame_sink_t data_sink = {DATA_OFFSET_SIZE, data_sink_reserve, data_sink_rollback};
+static const serial_session_t* sink_session = NULL;
+
+static uint32_t get_u32_le(const uint8_t* payload)
+{
+    return (uint32_t) payload[0] | ((uint32_t) payload[1] << 8) | ((uint32_t) payload[2] << 16) | ((uint32_t) payload[3] << 24);
+}
+
+static uint16_t get_u16_le(const uint8_t* payload)
 {
-    switch (serial_state)
+    return (uint16_t) (payload[0] | (payload[1] << 8));
+}
+
+static bool get_fw_image_info(const uint8_t* payload, size_t len, fw_image_info_t* image)
+{
+    if (len < START_PAYLOAD_MIN_SIZE)
     {
-        case PING_STATE:
-            return "PING_STATE";
-        case START_STATE:
-            return "START_STATE";
-        case DATA_STATE:
-            return "DATA_STATE";
-        case END_STATE:
-            return "END_STATE";
-        case RESET_STATE:
-            return "RESET_STATE";
-        default:
-            return "UNKNOWN_STATE";
+        return false;
     }
+    image->fw_size = get_u32_le(payload);
+    image->crc16 = get_u16_le(payload + 4);
+    image->has_crc32 = len >= START_PAYLOAD_CRC32_SIZE;
+    image->crc32 = image->has_crc32 ? get_u32_le(payload + 8) : 0;
+    return true;
 }
 
-static size_t get_fw_size(uint8_t* payload)
+static bool get_delta_info(const uint8_t* payload, size_t len, serial_session_t* session)
 {
-    // host and target have the same endianess
-    const size_t* fw_size = (const size_t*) payload;
-    return *fw_size;
+    serial_api_t* serial_api = get_serial_api();
+    // a delta rebuilds the whole image from the installed one, kept sectors would be overwritten
+    if (len < START_PAYLOAD_DELTA_SIZE || session->keep_mask != 0 || serial_api->fw_base_image == NULL
+        || serial_api->fw_base_intact == NULL)
+    {
+        return false;
+    }
+    const fw_image_info_t base = {
+        .fw_size = get_u32_le(payload + 16),
+        .crc16 = get_u16_le(payload + 20),
+        .crc32 = get_u32_le(payload + 24),
+        .has_crc32 = true,
+    };
+    // checked before anything is written, the base is still complete
+    const uint8_t* base_image = serial_api->fw_base_image(&base);
+    if (base_image == NULL)
+    {
+        return false;
+    }
+    session->stream_size = get_u32_le(payload + 12);
+    fw_delta_init(&session->delta, base_image, base.fw_size, session->image.fw_size, serial_api->flash_feed, serial_api->fw_base_intact);
+    return true;
 }
 
-static uint32_t get_fw_crc(uint8_t* payload)
+static bool get_stream_info(const uint8_t* payload, size_t len, serial_session_t* session)
 {
-    // host and target have the same endianess
-    const uint32_t* fw_crc = (const uint32_t*) (payload + 4);
-    return *fw_crc;
+    // older hosts send zeroes or nothing in the codec field
+    session->codec = len >= START_PAYLOAD_CODEC_SIZE ? payload[6] : FW_CODEC_RAW;
+    session->stream_size = session->feed_size;
+    if (session->codec == FW_CODEC_RAW)
+    {
+        return true;
+    }
+
+    serial_api_t* serial_api = get_serial_api();
+    if (session->codec == FW_CODEC_DELTA)
+    {
+        return get_delta_info(payload, len, session);
+    }
+    const uint8_t window_log2 = payload[7];
+    if (session->codec != FW_CODEC_LZ4 || len < START_PAYLOAD_STREAM_SIZE || window_log2 < LZ4_WINDOW_LOG2_MIN
+        || window_log2 > LZ4_WINDOW_LOG2_MAX)
+    {
+        return false;
+    }
+    session->stream_size = get_u32_le(payload + 12);
+    lz4_stream_init(&session->lz4, lz4_window, 1u << window_log2, session->feed_size, serial_api->flash_feed);
+    return true;
 }
 
-serial_state_t process_ping_state()
+// a compressed stream is programmed slower than it arrives: its window counts the decompressed bytes, so that the
+// frames received while the MCU waits for the flash still fit the receive ring
+static void limit_stream_window(serial_session_t* session)
+{
+    if (session->codec == FW_CODEC_RAW || session->stream_size == 0)
+    {
+        return;
+    }
+    const size_t max_payload = session->max_payload != 0 ? session->max_payload : FRAME_PAYLOAD_MAX_SIZE;
+    size_t expansion = (session->feed_size + session->stream_size - 1) / session->stream_size;
+    expansion = expansion > 0 ? expansion : 1;
+    size_t window = SERIAL_INFLIGHT_MAX / ((max_payload - DATA_OFFSET_SIZE) * expansion);
+    window = window > 0 ? window : 1;
+    if (session->window > window)
+    {
+        session->window = window;
+    }
+}
+
+static int session_feed(serial_session_t* session, const uint8_t* buf, size_t len)
+{
+    if (session->codec == FW_CODEC_LZ4)
+    {
+        // decompressed bytes go to flash_feed as the ring fills
+        return lz4_stream_feed(&session->lz4, buf, len);
+    }
+    if (session->codec == FW_CODEC_DELTA)
+    {
+        return fw_delta_feed(&session->delta, buf, len);
+    }
+    return get_serial_api()->flash_feed(buf, len);
+}
+
+static bool session_complete(const serial_session_t* session)
+{
+    if (session->codec == FW_CODEC_LZ4)
+    {
+        return lz4_stream_done(&session->lz4);
+    }
+    if (session->codec == FW_CODEC_DELTA)
+    {
+        return fw_delta_done(&session->delta);
+    }
+    return true;
+}
+
+static void put_u32_le(uint8_t* payload, uint32_t value)
+{
+    payload[0] = value & 0xFF;
+    payload[1] = (value >> 8) & 0xFF;
+    payload[2] = (value >> 16) & 0xFF;
+    payload[3] = (value >> 24) & 0xFF;
+}
+
+static void put_u16_le(uint8_t* payload, uint16_t value)
+{
+    payload[0] = value & 0xFF;
+    payload[1] = (value >> 8) & 0xFF;
+}
+
+static uint8_t* data_sink_reserve(const serial_frame_t* frame, size_t pos, size_t* len)
+{
+    serial_api_t* serial_api = get_serial_api();
+    if (pos != 0)
+    {
+        // the rest of a reservation already accepted
+        return serial_api->flash_reserve(len);
+    }
+    if (sink_session == NULL || frame->cmd != CMD_DATA || frame->version != SERIAL_PROTOCOL_V2)
+    {
+        return NULL;
+    }
+    // only the next expected chunk may land in the staging buffer, anything else is copied or dropped
+    if (frame->block_pos == 0 ? get_u32_le(frame->payload) != sink_session->offset : frame->block_pos != sink_session->block_next)
+    {
+        return NULL;
+    }
+    if (sink_session->offset + *len > sink_session->stream_size)
+    {
+        return NULL;
+    }
+    return serial_api->flash_reserve(len);
+}
+
+static void data_sink_rollback(const serial_frame_t* frame, size_t len)
+{
+    get_serial_api()->flash_rollback(len);
+}
+
+static void update_data_sink(const serial_session_t* session, serial_state_t serial_state)
+{
+    serial_api_t* serial_api = get_serial_api();
+    // compressed and delta chunks have to go through the decoder
+    const bool in_place = serial_state == DATA_STATE && session->version == SERIAL_PROTOCOL_V2 && session->codec == FW_CODEC_RAW
+                          && serial_api->flash_reserve != NULL
+                          && serial_api->flash_commit != NULL && serial_api->flash_rollback != NULL;
+    sink_session = in_place ? session : NULL;
+    frame_parser_set_sink(in_place ? &data_sink : NULL);
+}
+
+static void send_offset_ack(const serial_session_t* session)
+{
+    uint8_t payload[DATA_OFFSET_SIZE];
+    put_u32_le(payload, session->offset);
+    send_ack_payload(payload, sizeof(payload));
+}
+
+static void send_offset_nack(const serial_session_t* session)
+{
+    uint8_t payload[DATA_OFFSET_SIZE];
+    put_u32_le(payload, session->offset);
+    send_nack_payload(payload, sizeof(payload));
+}
+
+static serial_state_t negotiate_frame_size(serial_session_t* session, size_t requested)
+{
+    size_t max_payload = requested < FRAME_LARGE_PAYLOAD_MIN_SIZE ? FRAME_LARGE_PAYLOAD_MIN_SIZE : requested;
+    // a single frame in flight must fit the receive ring too
+    if (max_payload > SERIAL_INFLIGHT_MAX)
+    {
+        max_payload = SERIAL_INFLIGHT_MAX;
+    }
+    // larger frames get a smaller window, the bytes in flight stay the same
+    size_t window = SERIAL_INFLIGHT_MAX / max_payload;
+    if (session->window > window)
+    {
+        session->window = window;
+    }
+    session->max_payload = max_payload;
+    TRACE(TRACE_FRAME_SIZE, session->version, session->window, session->max_payload);
+
+    uint8_t response[PING_FRAME_SIZE_ACK_SIZE];
+    response[0] = session->window;
+    put_u16_le(response + 1, session->max_payload);
+    put_u16_le(response + 3, FRAME_BLOCK_SIZE);
+    send_ack_payload(response, sizeof(response));
+    // the frames following the answer use the new limits
+    frame_parser_set_limits(session->max_payload, FRAME_BLOCK_SIZE);
+    return START_STATE;
+}
+
+serial_state_t process_ping_state(serial_session_t* session)
 {
     int ret = 0;
     serial_cmd_t cmd = CMD_UNKNOWN;
@@ -80,7 +429,24 @@ serial_state_t process_ping_state()
     switch (cmd)
     {
         case CMD_PING:
-            send_ack();
+            session->version = get_frame_version();
+            set_protocol_version(session->version);
+            if (session->version == SERIAL_PROTOCOL_V1)
+            {
+                send_ack();
+                return START_STATE;
+            }
+            session->window = (len > 0 && payload[0] > 0) ? payload[0] : 1;
+            if (session->window > SERIAL_WINDOW_MAX)
+            {
+                session->window = SERIAL_WINDOW_MAX;
+            }
+            if (len >= PING_FRAME_SIZE_PAYLOAD_SIZE)
+            {
+                return negotiate_frame_size(session, get_u16_le(payload + 1));
+            }
+            TRACE(TRACE_PROTOCOL, session->version, session->window);
+            send_ack_payload(&session->window, sizeof(session->window));
             return START_STATE;
         default:
             send_nack();
@@ -88,7 +454,258 @@ serial_state_t process_ping_state()
     }
 }
 
-serial_state_t process_start_state(size_t* fw_size, uint16_t* fw_crc)
+static bool wait_baud_verify_ping(void)
+{
+    for (size_t i = 0; i < BAUD_VERIFY_TRIES; i++)
+    {
+        serial_cmd_t cmd = CMD_UNKNOWN;
+        size_t len = 0;
+        uint8_t* payload;
+        if (recv_frame(&cmd, &payload, &len) && cmd == CMD_PING)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static serial_state_t process_set_baud(serial_session_t* session, const uint8_t* payload, size_t len)
+{
+    serial_api_t* serial_api = get_serial_api();
+    if (len < SET_BAUD_PAYLOAD_SIZE || serial_api->baudrate_supported == NULL || serial_api->set_baudrate == NULL)
+    {
+        send_nack();
+        return RESET_STATE;
+    }
+    const uint32_t baudrate = get_u32_le(payload);
+    if (!serial_api->baudrate_supported(baudrate))
+    {
+        TRACE(TRACE_BAUD_REFUSED, baudrate);
+        send_nack();
+        return RESET_STATE;
+    }
+
+    // acknowledge at the old rate, then both ends switch
+    send_ack_payload(payload, SET_BAUD_PAYLOAD_SIZE);
+    if (serial_api->set_baudrate(baudrate))
+    {
+        serial_api->set_baudrate(session->baudrate);
+        return RESET_STATE;
+    }
+    frame_parser_reset();
+
+    if (!wait_baud_verify_ping())
+    {
+        // the host did not come up at the new rate, it falls back too
+        serial_api->set_baudrate(session->baudrate);
+        frame_parser_reset();
+        return RESET_STATE;
+    }
+    session->baudrate = baudrate;
+    send_ack();
+    return START_STATE;
+}
+
+static serial_state_t process_sector_hash(serial_session_t* session, const uint8_t* payload, size_t len)
+{
+    serial_api_t* serial_api = get_serial_api();
+    if (serial_api->sector_hashes == NULL || serial_api->keep_sectors == NULL)
+    {
+        send_nack();
+        return RESET_STATE;
+    }
+    flash_sector_hash_t hashes[SECTOR_HASH_MAX];
+    const size_t count = serial_api->sector_hashes(hashes, SECTOR_HASH_MAX);
+    const bool expected = len >= count * sizeof(uint32_t);
+
+    uint8_t response[SECTOR_HASH_HEADER_SIZE + SECTOR_HASH_MAX * SECTOR_HASH_ENTRY_SIZE];
+    session->keep_mask = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (expected && hashes[i].keepable && get_u32_le(payload + i * sizeof(uint32_t)) == hashes[i].crc32)
+        {
+            session->keep_mask |= 1u << i;
+        }
+        uint8_t* entry = &response[SECTOR_HASH_HEADER_SIZE + i * SECTOR_HASH_ENTRY_SIZE];
+        put_u32_le(entry, hashes[i].size);
+        put_u32_le(entry + 4, hashes[i].crc32);
+    }
+    response[0] = count;
+    response[1] = session->keep_mask;
+    TRACE(TRACE_SECTOR_HASH, count, session->keep_mask);
+    send_ack_payload(response, SECTOR_HASH_HEADER_SIZE + count * SECTOR_HASH_ENTRY_SIZE);
+    return START_STATE;
+}
+
+static serial_state_t process_resume(serial_session_t* session, const uint8_t* payload, size_t len)
+{
+    serial_api_t* serial_api = get_serial_api();
+    if (serial_api->fw_resume == NULL)
+    {
+        send_nack();
+        return RESET_STATE;
+    }
+    uint8_t response[RESUME_PAYLOAD_SIZE] = {0};
+    fw_resume_info_t resume = {0};
+    // DATA offsets only map to programmed bytes in the raw stream, the decoders keep their state in RAM
+    const bool raw = len < START_PAYLOAD_CODEC_SIZE || payload[6] == FW_CODEC_RAW;
+    if (session->version != SERIAL_PROTOCOL_V2 || !raw || !get_fw_image_info(payload, len, &session->image)
+        || session->image.fw_size > serial_api->max_fw_size)
+    {
+        send_ack_payload(response, sizeof(response));
+        return START_STATE;
+    }
+    serial_api->flash_reset();
+    if (!serial_api->fw_resume(&session->image, &resume))
+    {
+        // nothing to resume, the host sends START
+        send_ack_payload(response, sizeof(response));
+        return START_STATE;
+    }
+    session->codec = FW_CODEC_RAW;
+    session->offset = resume.offset;
+    session->lost_frames = 0;
+    session->feed_size = resume.feed_size;
+    session->stream_size = resume.feed_size;
+    session->keep_mask = resume.keep_mask;
+    TRACE(TRACE_RESUME, session->offset, session->stream_size, session->keep_mask);
+    put_u32_le(response, session->offset);
+    response[4] = session->keep_mask;
+    send_ack_payload(response, sizeof(response));
+    prof_reset();
+    if (serial_api->flash_erase_ahead != NULL)
+    {
+        serial_api->flash_erase_ahead(session->image.fw_size);
+    }
+    return DATA_STATE;
+}
+
+// appends a TLV entry header, returns where its value goes
+static uint8_t* put_info_entry(uint8_t* response, size_t* len, uint8_t type, size_t value_len)
+{
+    uint8_t* entry = response + *len;
+    entry[0] = type;
+    entry[1] = value_len;
+    *len += INFO_TLV_HEADER_SIZE + value_len;
+    return entry + INFO_TLV_HEADER_SIZE;
+}
+
+static uint16_t get_command_mask(void)
+{
+    serial_api_t* serial_api = get_serial_api();
+    uint16_t mask = (1u << CMD_PING) | (1u << CMD_START) | (1u << CMD_DATA) | (1u << CMD_END) | (1u << CMD_GET_INFO);
+    if (serial_api->baudrate_supported != NULL && serial_api->set_baudrate != NULL)
+    {
+        mask |= 1u << CMD_SET_BAUD;
+    }
+    if (serial_api->sector_hashes != NULL && serial_api->keep_sectors != NULL)
+    {
+        mask |= 1u << CMD_SECTOR_HASH;
+    }
+    if (serial_api->fw_resume != NULL)
+    {
+        mask |= 1u << CMD_RESUME;
+    }
+#ifdef PROFILE
+    mask |= 1u << CMD_GET_STATS;
+#endif
+    return mask;
+}
+
+static serial_state_t process_get_info(const serial_session_t* session)
+{
+    serial_api_t* serial_api = get_serial_api();
+    flash_layout_t layout = {0};
+    if (serial_api->flash_layout != NULL)
+    {
+        serial_api->flash_layout(&layout);
+    }
+    if (layout.sector_count > FLASH_LAYOUT_SECTORS_MAX)
+    {
+        layout.sector_count = FLASH_LAYOUT_SECTORS_MAX;
+    }
+
+    // every entry together stays below INFO_PAYLOAD_MAX_SIZE with FLASH_LAYOUT_SECTORS_MAX sectors
+    uint8_t response[INFO_PAYLOAD_MAX_SIZE];
+    size_t len = 0;
+    response[len++] = INFO_VERSION;
+
+    uint8_t* value = put_info_entry(response, &len, INFO_TYPE_PROTOCOL, 2);
+    value[0] = SERIAL_PROTOCOL_V2;
+    value[1] = SERIAL_WINDOW_MAX;
+
+    value = put_info_entry(response, &len, INFO_TYPE_FRAME, 6);
+    put_u16_le(value, session->max_payload != 0 ? session->max_payload : FRAME_PAYLOAD_MAX_SIZE);
+    put_u16_le(value + 2, layout.chunk_size);
+    put_u16_le(value + 4, session->max_payload != 0 ? FRAME_BLOCK_SIZE : 0);
+
+    value = put_info_entry(response, &len, INFO_TYPE_FIRMWARE, 4);
+    put_u32_le(value, serial_api->max_fw_size);
+
+    value = put_info_entry(response, &len, INFO_TYPE_CODECS, 2);
+    value[0] = (1u << FW_CODEC_RAW) | (1u << FW_CODEC_LZ4);
+    if (serial_api->fw_base_image != NULL && serial_api->fw_base_intact != NULL)
+    {
+        value[0] |= 1u << FW_CODEC_DELTA;
+    }
+    value[1] = LZ4_WINDOW_LOG2_MAX;
+
+    value = put_info_entry(response, &len, INFO_TYPE_CRC, 1);
+    value[0] = INFO_CRC16 | INFO_CRC32;
+
+    value = put_info_entry(response, &len, INFO_TYPE_COMMANDS, 2);
+    put_u16_le(value, get_command_mask());
+
+    if (layout.sector_count > 0)
+    {
+        value = put_info_entry(response, &len, INFO_TYPE_SECTORS, layout.sector_count * INFO_SECTOR_SIZE);
+        for (size_t i = 0; i < layout.sector_count; i++)
+        {
+            put_u32_le(value + i * INFO_SECTOR_SIZE, layout.sectors[i].address);
+            put_u32_le(value + i * INFO_SECTOR_SIZE + 4, layout.sectors[i].size);
+        }
+    }
+    if (layout.installed)
+    {
+        value = put_info_entry(response, &len, INFO_TYPE_IMAGE, 11);
+        put_u32_le(value, layout.image.fw_size);
+        put_u16_le(value + 4, layout.image.crc16);
+        put_u32_le(value + 6, layout.image.crc32);
+        value[10] = layout.image.has_crc32 ? INFO_IMAGE_HAS_CRC32 : 0;
+    }
+    send_ack_payload(response, len);
+    return START_STATE;
+}
+
+#ifdef PROFILE
+static void process_get_stats(void)
+{
+    const prof_entry_t* table = prof_table();
+    uint8_t response[STATS_HEADER_SIZE + PROF_COUNT * STATS_ENTRY_SIZE];
+    size_t len = 0;
+    response[len++] = STATS_VERSION;
+    put_u32_le(response + len, prof_clock_hz());
+    len += 4;
+    for (size_t i = 0; i < PROF_COUNT; i++)
+    {
+        if (table[i].count == 0)
+        {
+            continue;
+        }
+        uint8_t* entry = response + len;
+        entry[0] = i;
+        put_u32_le(entry + 1, table[i].count);
+        put_u32_le(entry + 5, table[i].min);
+        put_u32_le(entry + 9, table[i].max);
+        put_u32_le(entry + 13, (uint32_t) table[i].total);
+        put_u32_le(entry + 17, (uint32_t) (table[i].total >> 32));
+        len += STATS_ENTRY_SIZE;
+    }
+    send_ack_payload(response, len);
+}
+#endif
+
+serial_state_t process_start_state(serial_session_t* session)
 {
     int ret = 0;
     serial_cmd_t cmd = CMD_UNKNOWN;
@@ -106,53 +723,225 @@ serial_state_t process_start_state(size_t* fw_size, uint16_t* fw_crc)
     switch (cmd)
     {
         case CMD_START:
-            *fw_size = get_fw_size(payload);
-            *fw_crc = get_fw_crc(payload);
-            printf("fw_size 0x%x, max_fw_size 0x%x, crc 0x%x\n", *fw_size, serial_api->max_fw_size, *fw_crc);
-            if (*fw_size > serial_api->max_fw_size)
+            if (!get_fw_image_info(payload, len, &session->image))
+            {
+                send_nack();
+                return RESET_STATE;
+            }
+            session->offset = 0;
+            session->lost_frames = 0;
+            TRACE(TRACE_START, session->image.fw_size, serial_api->max_fw_size, session->image.crc16, session->image.crc32);
+            if (session->image.fw_size > serial_api->max_fw_size)
             {
                 send_nack();
                 return RESET_STATE;
             }
             serial_api->flash_reset();
-            ret = serial_api->fw_write_header(*fw_crc, *fw_size);
+            session->feed_size = session->image.fw_size;
+            if (session->keep_mask != 0)
+            {
+                session->feed_size -= serial_api->keep_sectors(session->keep_mask, session->image.fw_size);
+            }
+            if (!get_stream_info(payload, len, session))
+            {
+                send_nack();
+                return RESET_STATE;
+            }
+            ret = serial_api->fw_write_header(&session->image);
             if (ret)
             {
                 send_nack();
                 return RESET_STATE;
             }
-            send_ack();
+            if (session->version == SERIAL_PROTOCOL_V2)
+            {
+                limit_stream_window(session);
+                TRACE(TRACE_PROTOCOL, session->version, session->window);
+                send_ack_payload(&session->window, sizeof(session->window));
+            }
+            else
+            {
+                send_ack();
+            }
+            // the statistics describe the transfer
+            prof_reset();
+            if (serial_api->flash_erase_ahead != NULL && session->codec != FW_CODEC_DELTA)
+            {
+                // a delta still reads the installed image, its sectors are erased one by one as they are written
+                serial_api->flash_erase_ahead(session->image.fw_size);
+            }
             return DATA_STATE;
+        case CMD_SET_BAUD:
+            return process_set_baud(session, payload, len);
+        case CMD_SECTOR_HASH:
+            return process_sector_hash(session, payload, len);
+        case CMD_RESUME:
+            return process_resume(session, payload, len);
+        case CMD_GET_INFO:
+            return process_get_info(session);
+#ifdef PROFILE
+        case CMD_GET_STATS:
+            process_get_stats();
+            return START_STATE;
+#endif
         default:
             send_nack();
             return RESET_STATE;
     }
 }
 
-serial_state_t process_data_state(size_t fw_size, uint16_t fw_crc)
+// a DATA frame sent in blocks is answered once, after its last block
+static serial_state_t answer_data_frame(serial_session_t* session, bool last, bool ack)
+{
+    session->block_ack = ack;
+    if (!last)
+    {
+        return DATA_STATE;
+    }
+    if (ack)
+    {
+        send_offset_ack(session);
+    }
+    else
+    {
+        send_offset_nack(session);
+    }
+    return DATA_STATE;
+}
+
+static int write_data_chunk(serial_session_t* session, const uint8_t* chunk, size_t len)
+{
+    if (get_frame_staged())
+    {
+        // the chunk was received and crc checked in place
+        return get_serial_api()->flash_commit(len);
+    }
+    return session_feed(session, chunk, len);
+}
+
+static serial_state_t process_data_block(serial_session_t* session, const uint8_t* payload, size_t len, size_t block_pos, bool last)
+{
+    // only the blocks following an accepted one continue the stream
+    const bool next = session->block_next != 0 && block_pos == session->block_next;
+    if (!next || session->offset + len > session->stream_size)
+    {
+        if (get_frame_staged())
+        {
+            get_serial_api()->flash_rollback(len);
+        }
+        session->block_next = 0;
+        return answer_data_frame(session, last, next ? false : session->block_ack);
+    }
+    if (write_data_chunk(session, payload, len))
+    {
+        // corrupted stream, the host has to start over
+        send_offset_nack(session);
+        return RESET_STATE;
+    }
+    session->offset += len;
+    session->block_next = last ? 0 : block_pos + len;
+    return answer_data_frame(session, last, true);
+}
+
+static serial_state_t process_data_frame_v2(serial_session_t* session, const uint8_t* payload, size_t len)
+{
+    bool last = true;
+    const size_t block_pos = get_frame_block(&last);
+    if (block_pos != 0)
+    {
+        return process_data_block(session, payload, len, block_pos, last);
+    }
+    session->block_next = 0;
+    if (len < DATA_OFFSET_SIZE)
+    {
+        return answer_data_frame(session, last, false);
+    }
+    const size_t offset = get_u32_le(payload);
+    const size_t chunk_len = len - DATA_OFFSET_SIZE;
+
+    serial_api_t* serial_api = get_serial_api();
+    const bool staged = get_frame_staged();
+    if (staged && (offset != session->offset || offset + chunk_len > session->stream_size))
+    {
+        // the sink only stages the expected chunk, never keep anything else
+        serial_api->flash_rollback(chunk_len);
+        return answer_data_frame(session, last, false);
+    }
+
+    if (offset < session->offset)
+    {
+        // retransmission of data already written, acknowledge what we have
+        return answer_data_frame(session, last, true);
+    }
+    if (offset > session->offset)
+    {
+        // a previous frame was lost, ask the host to go back
+        return answer_data_frame(session, last, false);
+    }
+    if (offset + chunk_len > session->stream_size)
+    {
+        send_offset_nack(session);
+        return RESET_STATE;
+    }
+
+    if (write_data_chunk(session, payload + DATA_OFFSET_SIZE, chunk_len))
+    {
+        // corrupted stream, the host has to start over
+        send_offset_nack(session);
+        return RESET_STATE;
+    }
+    session->offset += chunk_len;
+    session->block_next = last ? 0 : len;
+    return answer_data_frame(session, last, true);
+}
+
+serial_state_t process_data_state(serial_session_t* session)
 {
     int ret = 0;
     serial_cmd_t cmd = CMD_UNKNOWN;
     size_t len = 0;
     uint8_t* payload;
     ret = recv_frame(&cmd, &payload, &len);
+    const bool windowed = session->version == SERIAL_PROTOCOL_V2;
     if (!ret)
     {
+        if (windowed && ++session->lost_frames < DATA_LOST_FRAMES_MAX)
+        {
+            // lost or corrupted frame, the host resends from the first missing offset
+            session->block_next = 0;
+            send_offset_nack(session);
+            return DATA_STATE;
+        }
+        // the host is gone, no NACKs are left queued for the next one
         send_nack();
         return RESET_STATE;
     }
+    session->lost_frames = 0;
     serial_api_t* serial_api = get_serial_api();
 
     switch (cmd)
     {
         case CMD_DATA:
-            serial_api->flash_feed(payload, len);
+            if (windowed)
+            {
+                return process_data_frame_v2(session, payload, len);
+            }
+            if (session_feed(session, payload, len))
+            {
+                send_nack();
+                return RESET_STATE;
+            }
             send_ack();
             // todo save on flash
             return DATA_STATE;
         case CMD_END:
+            if (windowed && session->offset != session->stream_size)
+            {
+                send_offset_nack(session);
+                return DATA_STATE;
+            }
             serial_api->flash_flush();
-            const bool ret = serial_api->fw_crc_check(fw_crc, fw_size);
+            const bool ret = session_complete(session) && serial_api->fw_crc_check(&session->image);
             if (ret)
             {
                 send_ack();
@@ -160,6 +949,12 @@ serial_state_t process_data_state(size_t fw_size, uint16_t fw_crc)
             }
             send_nack();
             return RESET_STATE;
+#ifdef PROFILE
+        case CMD_GET_STATS:
+            // the window is drained when the host asks, the stream goes on afterwards
+            process_get_stats();
+            return DATA_STATE;
+#endif
         default:
             send_nack();
             return RESET_STATE;
@@ -173,25 +968,32 @@ int recv_firmware()
         return -1;
     }
     serial_state_t serial_state = PING_STATE;
-    size_t fw_size = 0;
-    uint16_t fw_crc = 0;
+    serial_session_t session = {0};
 
     while (serial_state != END_STATE)
     {
         serial_state_t next_serial_state = serial_state;
+        update_data_sink(&session, serial_state);
         switch (serial_state)
         {
             case PING_STATE:
-                fw_size = 0;
-                fw_crc = 0;
-                next_serial_state = process_ping_state();
+                if (session.baudrate != 0)
+                {
+                    // a new session always starts at the default rate
+                    get_serial_api()->set_baudrate(0);
+                    frame_parser_reset();
+                }
+                session = (serial_session_t) {0};
+                set_protocol_version(SERIAL_PROTOCOL_V1);
+                frame_parser_set_limits(FRAME_PAYLOAD_MAX_SIZE, 0);
+                next_serial_state = process_ping_state(&session);
                 break;
             case START_STATE:
 
-                next_serial_state = process_start_state(&fw_size, &fw_crc);
+                next_serial_state = process_start_state(&session);
                 break;
             case DATA_STATE:
-                next_serial_state = process_data_state(fw_size, fw_crc);
+                next_serial_state = process_data_state(&session);
                 break;
             case END_STATE:
 
@@ -203,13 +1005,10 @@ int recv_firmware()
         }
         if (next_serial_state != serial_state)
         {
-            printf("Serial state change, new state: %s[%d]->%s[%d]\n",
-                   get_serial_state_str(serial_state),
-                   serial_state,
-                   get_serial_state_str(next_serial_state),
-                   next_serial_state);
+            TRACE(TRACE_STATE, serial_state, next_serial_state);
         }
         serial_state = next_serial_state;
     }
+    update_data_sink(&session, serial_state);
     return 0;
 }
@@ -0,0 +1,413 @@
+#include "serial_frame_parser.h"
+
+#include "crc.h"
+#include "profile.h"
+
+#include <string.h>
+
+#define SOF (0xA5)
+// SOF(1) | VER (1) | CMD(1) | LEN(4)
+#define HEADER_SIZE (7u)
+// CRC_L | CRC_H
+#define CRC_SIZE (2u)
+
+#define VER_OFFSET (1u)
+#define CMD_OFFSET (2u)
+#define LEN_OFFSET (3u)
+
+// payload of a large frame dropped after a bad block is read here and thrown away
+#define DISCARD_SIZE (64u)
+
+typedef enum
+{
+    PARSER_SOF,
+    PARSER_HEADER,
+    PARSER_PAYLOAD,
+    PARSER_CRC,
+} parser_state_t;
+
+typedef struct
+{
+    serial_frame_t frame;
+    uint8_t storage[FRAME_PAYLOAD_MAX_SIZE];
+} frame_slot_t;
+
+typedef struct
+{
+    parser_state_t state;
+    uint8_t header[HEADER_SIZE];
+    size_t header_pos;
+    size_t payload_len;
+    size_t payload_pos;
+    size_t max_payload; /**< Largest accepted payload */
+    size_t block_size;  /**< Payload bytes per block of a large frame, 0 for a single CRC */
+    size_t block_start; /**< Payload position of the block being received */
+    size_t block_end;   /**< Payload position of the next CRC */
+    bool discard;       /**< A block failed its CRC, the rest of the frame is thrown away */
+    uint8_t crc_bytes[CRC_SIZE];
+    size_t crc_pos;
+    uint16_t crc;
+    frame_slot_t* slot;
+    const frame_sink_t* sink;
+    uint8_t* staged;     /**< Sink memory receiving the payload after the prefix, NULL if kept in the slot */
+    size_t staged_start; /**< Payload position received at staged */
+    size_t staged_len;   /**< Bytes granted at staged */
+    size_t reserved;     /**< Bytes of the block reserved in the sink so far */
+    uint32_t errors;
+    uint32_t frames; /**< Frames received intact */
+} frame_parser_t;
+
+static frame_parser_t parser = {.max_payload = FRAME_PAYLOAD_MAX_SIZE};
+static uint8_t discard_buffer[DISCARD_SIZE];
+
+// single producer (parser) single consumer (state machine) queue
+static frame_slot_t slots[FRAME_QUEUE_SIZE];
+static volatile size_t queue_head = 0;
+static volatile size_t queue_tail = 0;
+
+static bool queue_full(void)
+{
+    return (queue_head - queue_tail) >= FRAME_QUEUE_SIZE;
+}
+
+static bool queue_empty(void)
+{
+    return queue_head == queue_tail;
+}
+
+static void parser_restart(void)
+{
+    parser.state = PARSER_SOF;
+    parser.header_pos = 0;
+    parser.payload_pos = 0;
+    parser.crc_pos = 0;
+    parser.discard = false;
+    parser.slot = NULL;
+    parser.staged = NULL;
+    parser.reserved = 0;
+}
+
+static void parser_rollback(void)
+{
+    if (parser.staged != NULL && parser.sink != NULL)
+    {
+        // give back the sink memory, nothing of this block may reach the flash
+        parser.sink->rollback(&parser.slot->frame, parser.reserved);
+    }
+    parser.staged = NULL;
+    parser.reserved = 0;
+}
+
+static void parser_drop_frame(void)
+{
+    parser_rollback();
+    parser.errors++;
+    parser_restart();
+}
+
+void frame_parser_reset(void)
+{
+    parser_rollback();
+    parser_restart();
+}
+
+void frame_parser_set_limits(size_t max_payload, size_t block_size)
+{
+    // without blocks a frame has to fit in a queue slot
+    const size_t limit = block_size != 0 ? FRAME_LARGE_PAYLOAD_MAX_SIZE : FRAME_PAYLOAD_MAX_SIZE;
+    parser.max_payload = max_payload < limit ? max_payload : limit;
+    parser.block_size = block_size < FRAME_PAYLOAD_MAX_SIZE ? block_size : FRAME_PAYLOAD_MAX_SIZE;
+}
+
+void frame_parser_set_sink(const frame_sink_t* sink)
+{
+    if (sink != parser.sink && parser.staged != NULL)
+    {
+        // the rest of the frame would land in memory the new sink does not know about
+        frame_parser_reset();
+    }
+    parser.sink = sink;
+}
+
+static void parser_resync_header(void)
+{
+    // the SOF was a stray byte, the real frame may start inside the rejected header
+    parser.errors++;
+    const uint8_t* sof = memchr(&parser.header[1], SOF, HEADER_SIZE - 1);
+    if (sof == NULL)
+    {
+        parser_restart();
+        return;
+    }
+    parser.header_pos = HEADER_SIZE - (size_t) (sof - parser.header);
+    memmove(parser.header, sof, parser.header_pos);
+}
+
+static void parser_set_block(size_t start)
+{
+    const bool blocks = parser.block_size != 0 && parser.payload_len > parser.block_size;
+    parser.block_start = start;
+    parser.block_end = (blocks && parser.payload_len - start > parser.block_size) ? start + parser.block_size : parser.payload_len;
+}
+
+// takes the next queue slot for the current block, false if the queue is full
+static bool parser_begin_block(void)
+{
+    if (queue_full())
+    {
+        return false;
+    }
+    const size_t start = parser.block_start;
+    parser.staged = NULL;
+    parser.reserved = 0;
+    parser.slot = &slots[queue_head % FRAME_QUEUE_SIZE];
+    parser.slot->frame.cmd = parser.header[CMD_OFFSET];
+    parser.slot->frame.version = parser.header[VER_OFFSET];
+    parser.slot->frame.len = parser.block_end - start;
+    parser.slot->frame.payload = parser.slot->storage;
+    parser.slot->frame.staged = false;
+    parser.slot->frame.block_pos = start;
+    parser.slot->frame.last = parser.block_end == parser.payload_len;
+    return true;
+}
+
+static void parser_header_complete(void)
+{
+    const uint8_t version = parser.header[VER_OFFSET];
+    const size_t len = (size_t) parser.header[LEN_OFFSET] | ((size_t) parser.header[LEN_OFFSET + 1] << 8)
+                       | ((size_t) parser.header[LEN_OFFSET + 2] << 16) | ((size_t) parser.header[LEN_OFFSET + 3] << 24);
+
+    if ((version != SERIAL_PROTOCOL_V1 && version != SERIAL_PROTOCOL_V2) || len > parser.max_payload)
+    {
+        parser_resync_header();
+        return;
+    }
+    parser.payload_len = len;
+    parser.payload_pos = 0;
+    parser_set_block(0);
+    if (!parser_begin_block())
+    {
+        parser_drop_frame();
+        return;
+    }
+    parser.crc = crc16_ccitt_update(crc16_ccitt_init(), parser.header, HEADER_SIZE);
+    parser.state = len > 0 ? PARSER_PAYLOAD : PARSER_CRC;
+}
+
+// asks the sink for the next part of the block once the current one is full
+static void parser_stage_next(void)
+{
+    size_t len = parser.block_end - parser.payload_pos;
+    parser.staged = parser.sink->reserve(&parser.slot->frame, parser.reserved, &len);
+    parser.staged_start = parser.payload_pos;
+    parser.staged_len = len;
+    parser.reserved += len;
+}
+
+static void parser_try_stage(void)
+{
+    const frame_sink_t* sink = parser.sink;
+    if (sink == NULL)
+    {
+        return;
+    }
+    // only the first block carries the prefix
+    const size_t prefix_len = parser.block_start == 0 ? sink->prefix_len : 0;
+    if (parser.payload_pos != parser.block_start + prefix_len || parser.block_end <= parser.payload_pos)
+    {
+        return;
+    }
+    // frames still waiting in the queue have not been committed to the sink yet
+    if (!queue_empty())
+    {
+        return;
+    }
+    parser_stage_next();
+    if (parser.staged == NULL)
+    {
+        parser.reserved = 0;
+    }
+}
+
+static void parser_crc_complete(void)
+{
+    const uint16_t crc_recv = (uint16_t) (parser.crc_bytes[0] | (parser.crc_bytes[1] << 8));
+    const bool last = parser.block_end == parser.payload_len;
+    if (parser.discard)
+    {
+        // what is left of a frame with a bad block
+    }
+    else if (crc16_ccitt_final(parser.crc) != crc_recv)
+    {
+        if (parser.block_start == 0)
+        {
+            // the header may be corrupted as well, hunt for the next SOF
+            parser_drop_frame();
+            return;
+        }
+        // the header was checked with the first block, skip the rest of the frame
+        parser_rollback();
+        parser.errors++;
+        parser.discard = true;
+    }
+    else
+    {
+        parser.slot->frame.staged = parser.staged != NULL;
+        queue_head++;
+        if (last)
+        {
+            parser.frames++;
+        }
+    }
+
+    if (last)
+    {
+        parser_restart();
+        return;
+    }
+    // the slot of the next block is taken once the consumer released this one
+    parser.slot = NULL;
+    parser.staged = NULL;
+    parser.reserved = 0;
+    parser.crc_pos = 0;
+    parser_set_block(parser.block_end);
+    parser.state = PARSER_PAYLOAD;
+}
+
+static void parser_next_block(void)
+{
+    if (!parser_begin_block())
+    {
+        // the consumer did not take the previous block
+        parser.errors++;
+        parser.discard = true;
+        return;
+    }
+    parser_try_stage();
+}
+
+uint8_t* frame_parser_next_buffer(size_t* len)
+{
+    switch (parser.state)
+    {
+        case PARSER_HEADER:
+            *len = HEADER_SIZE - parser.header_pos;
+            return &parser.header[parser.header_pos];
+        case PARSER_PAYLOAD:
+            if (parser.slot == NULL && !parser.discard)
+            {
+                parser_next_block();
+            }
+            *len = parser.block_end - parser.payload_pos;
+            if (parser.discard)
+            {
+                *len = *len < DISCARD_SIZE ? *len : DISCARD_SIZE;
+                return discard_buffer;
+            }
+            if (parser.staged != NULL)
+            {
+                *len = parser.staged_start + parser.staged_len - parser.payload_pos;
+                return &parser.staged[parser.payload_pos - parser.staged_start];
+            }
+            if (parser.sink != NULL && parser.block_start == 0 && parser.payload_pos < parser.sink->prefix_len
+                && parser.sink->prefix_len < parser.block_end)
+            {
+                // stop at the prefix so the rest can be staged
+                *len = parser.sink->prefix_len - parser.payload_pos;
+            }
+            return &parser.slot->storage[parser.payload_pos - parser.block_start];
+        case PARSER_CRC:
+            *len = CRC_SIZE - parser.crc_pos;
+            return &parser.crc_bytes[parser.crc_pos];
+        case PARSER_SOF:
+        default:
+            *len = 1;
+            return &parser.header[0];
+    }
+}
+
+void frame_parser_advance(size_t len)
+{
+    switch (parser.state)
+    {
+        case PARSER_SOF:
+            if (parser.header[0] == SOF)
+            {
+                parser.header_pos = 1;
+                parser.state = PARSER_HEADER;
+            }
+            break;
+        case PARSER_HEADER:
+            parser.header_pos += len;
+            if (parser.header_pos == HEADER_SIZE)
+            {
+                parser_header_complete();
+            }
+            break;
+        case PARSER_PAYLOAD:
+        {
+            size_t unused = 0;
+            const uint8_t* written = frame_parser_next_buffer(&unused);
+            // the crc is computed where the bytes landed, staged or not
+            prof_start(PROF_FRAME_CRC);
+            parser.crc = crc16_ccitt_update(parser.crc, written, len);
+            prof_stop(PROF_FRAME_CRC);
+            parser.payload_pos += len;
+            if (parser.payload_pos == parser.block_end)
+            {
+                parser.state = PARSER_CRC;
+            }
+            else if (parser.staged != NULL)
+            {
+                if (parser.payload_pos == parser.staged_start + parser.staged_len)
+                {
+                    parser_stage_next();
+                }
+            }
+            else if (!parser.discard)
+            {
+                parser_try_stage();
+            }
+            break;
+        }
+        case PARSER_CRC:
+            parser.crc_pos += len;
+            if (parser.crc_pos == CRC_SIZE)
+            {
+                parser_crc_complete();
+            }
+            break;
+    }
+}
+
+bool frame_parser_in_frame(void)
+{
+    return parser.state != PARSER_SOF;
+}
+
+uint32_t frame_parser_errors(void)
+{
+    return parser.errors;
+}
+
+uint32_t frame_parser_frames(void)
+{
+    return parser.frames;
+}
+
+serial_frame_t* frame_queue_peek(void)
+{
+    if (queue_empty())
+    {
+        return NULL;
+    }
+    return &slots[queue_tail % FRAME_QUEUE_SIZE].frame;
+}
+
+void frame_queue_release(void)
+{
+    if (!queue_empty())
+    {
+        queue_tail++;
+    }
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include "serial_process_frame.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Maximum payload size of a received frame, or of a block of a large frame.
+ */
+#define FRAME_PAYLOAD_MAX_SIZE (2 * 1024)
+
+/**
+ * @name Large frames
+ *
+ * A session may negotiate payloads up to FRAME_LARGE_PAYLOAD_MAX_SIZE. Their payload is split in
+ * blocks of FRAME_BLOCK_SIZE bytes, each one followed by the CRC of the frame so far, so every block
+ * is checked and handed over on its own and no buffer holds the whole frame.
+ * @{
+ */
+#define FRAME_LARGE_PAYLOAD_MIN_SIZE (256u)
+#define FRAME_LARGE_PAYLOAD_MAX_SIZE (16u * 1024u)
+#define FRAME_BLOCK_SIZE             (1024u)
+/** @} */
+
+/**
+ * @brief Number of validated frames the queue can hold.
+ */
+#define FRAME_QUEUE_SIZE (2u)
+
+/**
+ * @brief A validated frame stored in the frame queue.
+ */
+typedef struct
+{
+    serial_cmd_t cmd;
+    uint8_t version;
+    size_t len;       /**< Payload bytes of the frame, or of the block for a large frame */
+    uint8_t* payload; /**< Points to storage owned by the queue slot */
+    bool staged;      /**< Payload after the sink prefix was received in place into the sink memory */
+    size_t block_pos; /**< Position of the block in the frame payload, 0 for the first block or a whole frame */
+    bool last;        /**< The block ends the frame, always set for a whole frame */
+} serial_frame_t;
+
+/**
+ * @brief Destination for payload bytes that should not go through the frame queue.
+ *
+ * Once the first prefix_len payload bytes of a frame are in the queue slot, reserve() may hand
+ * out memory for the rest of the payload, which is then received and CRC checked in place.
+ * A frame that fails validation is given back with rollback(). A frame that passes is queued
+ * with staged set and the consumer commits it to the sink. Each block of a large frame is
+ * reserved the same way, only the first one has a prefix.
+ */
+typedef struct
+{
+    size_t prefix_len; /**< Payload bytes kept in the queue slot before reserving */
+    /**
+     * @brief Reserve memory for the rest of the payload.
+     *
+     * Called with pos 0 to decide whether the remaining bytes are received in place. Once the
+     * sink accepted, it is called again with the bytes handed out so far until all of them are
+     * reserved, it has to grant them.
+     *
+     * @param frame Frame being received, its payload holds the prefix.
+     * @param pos Bytes already reserved for this frame.
+     * @param len In: bytes left to reserve. Out: contiguous bytes granted, at least 1.
+     * @return uint8_t* Destination of the granted bytes, NULL to keep the payload in the queue slot.
+     */
+    uint8_t* (*reserve)(const serial_frame_t* frame, size_t pos, size_t* len);
+    /**
+     * @brief Give back reserved memory of a frame that failed validation.
+     *
+     * @param frame Frame that was dropped.
+     * @param len Number of bytes that were reserved.
+     */
+    void (*rollback)(const serial_frame_t* frame, size_t len);
+} frame_sink_t;
+
+/**
+ * @brief Reset the parser and drop any partially received frame.
+ *
+ * Frames already in the queue are kept.
+ */
+void frame_parser_reset(void);
+
+/**
+ * @brief Set the payload limit negotiated for the session.
+ *
+ * Frames longer than block_size carry a CRC after every block_size payload bytes and are
+ * queued block by block. The limits are kept across frame_parser_reset().
+ *
+ * @param max_payload Largest accepted payload, FRAME_PAYLOAD_MAX_SIZE when nothing was negotiated.
+ * @param block_size Payload bytes per block, at most FRAME_PAYLOAD_MAX_SIZE, 0 for frames with a single CRC.
+ */
+void frame_parser_set_limits(size_t max_payload, size_t block_size);
+
+/**
+ * @brief Set the sink receiving payloads in place.
+ *
+ * A frame being received into the previous sink is dropped.
+ *
+ * @param sink Sink to use, NULL to keep every payload in the frame queue.
+ */
+void frame_parser_set_sink(const frame_sink_t* sink);
+
+/**
+ * @brief Get where the next received bytes must be written.
+ *
+ * Together with frame_parser_advance() this lets the link copy bytes straight to their
+ * final place, the frame header, a queue slot or the sink memory.
+ *
+ * @param len Number of bytes that can be written, at least 1.
+ * @return uint8_t* Destination of the next bytes.
+ */
+uint8_t* frame_parser_next_buffer(size_t* len);
+
+/**
+ * @brief Process bytes written to the buffer returned by frame_parser_next_buffer().
+ *
+ * @param len Number of bytes written, at most the length returned with the buffer.
+ */
+void frame_parser_advance(size_t len);
+
+/**
+ * @brief Check whether the parser holds a partially received frame.
+ *
+ * @return true If a header was started and the frame is not complete yet.
+ */
+bool frame_parser_in_frame(void);
+
+/**
+ * @brief Number of frames dropped because of a bad header, a CRC mismatch or a full queue.
+ *
+ * A large frame is dropped from the first block failing its CRC, the blocks before it were queued.
+ *
+ * @return uint32_t Errors since start.
+ */
+uint32_t frame_parser_errors(void);
+
+/**
+ * @brief Number of frames received with every CRC matching.
+ *
+ * @return uint32_t Frames since start, a large frame counts once.
+ */
+uint32_t frame_parser_frames(void);
+
+/**
+ * @brief Take the oldest frame out of the queue.
+ *
+ * The frame payload stays valid until frame_queue_release() is called.
+ *
+ * @return serial_frame_t* Oldest frame, NULL if the queue is empty.
+ */
+serial_frame_t* frame_queue_peek(void);
+
+/**
+ * @brief Release the oldest frame so its slot can be reused.
+ */
+void frame_queue_release(void);
@@ -1,7 +1,11 @@
 #include "serial_process_frame.h"
 
+#include "crc.h"
+#include "profile.h"
 #include "serial_api.h"
+#include "serial_frame_parser.h"
 #include "serial_flasher.h"
+#include "trace.h"
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -23,160 +27,159 @@ Prototol Package
 - LEN: payload length (little-endian)
 
 - CRC: CRC16-CCITT over SOF..PAYLOAD
+
+Responses (MCU -> Host) use a 2 bytes LEN and the CRC does not cover the SOF
++--------+--------+--------+--------+--------+--------+--------+
+| SOF    | VER    | CMD    | LEN    | PAYLOAD| CRC_L  | CRC_H  |
++--------+--------+--------+--------+--------+--------+--------+
+ 1 byte   1 byte   1 byte   2 bytes  N bytes   1 byte  1 byte
 */
 
-#define SOF             0xA5
-#define VERSION         0x01
-#define BUFFER_MAX_SIZE (2 * 1024)
-#define TIMEOUT_MS      100
-// SOF(1) | VER (1) | CMD(1) | LEN(4)
-#define HEADER_SIZE (7u)
+#define SOF        0xA5
+#define TIMEOUT_MS 100
 // CRC_L | CRC_H
 #define CRC_SIZE (2u)
-
-#define SOF_OFFSET     (0u)
-#define VER_OFFSET     (1u)
-#define CMD_OFFSET     (2u)
-#define LEN_OFFSET     (3u)
-#define PAYLOAD_OFFSET (HEADER_SIZE)
-
-static uint8_t buffer[BUFFER_MAX_SIZE];
-
-static void print_frame(const uint8_t* frame, size_t len)
-{
-    printf("Frame Received: ");
-    for (size_t i = 0; i < len; i++)
-    {
-        printf("0x%x ", frame[i]);
-    }
-    printf("\n");
-}
-
-static uint16_t crc16_ccitt(const uint8_t* data, size_t len)
-{
-    uint16_t crc = 0xFFFF;
-    for (uint16_t i = 0; i < len; i++)
-    {
-        crc ^= (uint16_t) data[i] << 8;
-        for (uint8_t j = 0; j < 8; j++)
-            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
-    }
-    return crc;
-}
-
-static const char* get_cmd_str(const serial_cmd_t cmd)
-{
-    switch (cmd)
-    {
-        case CMD_UNKNOWN:
-            return "CMD_UNKNOWN";
-        case CMD_PING:
-            return "CMD_PING";
-        case CMD_START:
-            return "CMD_START";
-        case CMD_DATA:
-            return "CMD_DATA";
-        case CMD_END:
-            return "CMD_END";
-        case CMD_RESET:
-            return "CMD_RESET";
-        case CMD_ACK:
-            return "CMD_ACK";
-        case CMD_NACK:
-            return "CMD_NACK";
-        default:
-            return "NOT_A_CMD";
-    }
-}
+// consecutive receive timeouts after which a partial frame is dropped
+#define FRAME_STALL_TIMEOUTS (3u)
+
+// SOF(1) | VER (1) | CMD(1) | LEN(2)
+#define RESPONSE_HEADER_SIZE (5u)
+// the GET_STATS answer is the largest response
+#define RESPONSE_PAYLOAD_MAX_SIZE (192u)
+
+static uint8_t tx_buffer[RESPONSE_HEADER_SIZE + RESPONSE_PAYLOAD_MAX_SIZE + CRC_SIZE];
+static uint8_t frame_version = SERIAL_PROTOCOL_V1;
+static uint8_t protocol_version = SERIAL_PROTOCOL_V1;
+static bool frame_held = false;
+static bool frame_staged = false;
+static size_t frame_block_pos = 0;
+static bool frame_last = true;
+static size_t stalled_timeouts = 0;
 
 bool recv_frame(serial_cmd_t* cmd, uint8_t** payload, size_t* len)
 {
+    PROF_SCOPE(PROF_RECV_FRAME);
     if (!check_valid_api())
     {
         return false;
     }
     serial_api_t* serial_api = get_serial_api();
-    // seach for header
-    uint8_t* header = buffer;
-    size_t pivot = 0;
-    int ret = -1;
-    while (pivot < HEADER_SIZE)
+
+    // the previous frame has been processed by now
+    if (frame_held)
     {
-        ret = serial_api->recv(&header[pivot], 1, TIMEOUT_MS);
+        frame_queue_release();
+        frame_held = false;
+    }
+
+    serial_frame_t* frame = frame_queue_peek();
+    while (frame == NULL)
+    {
+        // receive straight into the header, the queue slot or the sink memory, never past the current frame
+        size_t wanted = 0;
+        uint8_t* dest = frame_parser_next_buffer(&wanted);
+        // waiting for the link is the idle time of the bootloader
+        trace_poll();
+        const int ret = serial_api->recv(dest, wanted, TIMEOUT_MS);
         if (ret <= 0)
         {
+            // keep a partial frame across a short gap, drop it once the link has stalled
+            if (frame_parser_in_frame() && ++stalled_timeouts >= FRAME_STALL_TIMEOUTS)
+            {
+                frame_parser_reset();
+                stalled_timeouts = 0;
+            }
             return false;
         }
-        if (pivot == 0 && header[pivot] != SOF)
+        stalled_timeouts = 0;
+
+        const uint32_t errors = frame_parser_errors();
+        frame_parser_advance((size_t) ret);
+        frame = frame_queue_peek();
+        if (frame == NULL && frame_parser_errors() != errors)
         {
-            continue;
+            // bad header or crc, let the state machine answer right away
+            return false;
         }
-        pivot++;
     }
 
-    // print_frame(header,HEADER_SIZE);
-    *cmd = header[CMD_OFFSET];
-    *len = *((size_t*) (header + LEN_OFFSET));
-    printf("SOF:0x%x, ver 0x%x, cmd %s[0x%x], len 0x%x\n", header[SOF_OFFSET], header[VER_OFFSET], get_cmd_str(*cmd), *cmd, *len);
+    frame_held = true;
+    frame_version = frame->version;
+    frame_staged = frame->staged;
+    frame_block_pos = frame->block_pos;
+    frame_last = frame->last;
+    *cmd = frame->cmd;
+    *len = frame->len;
+    *payload = frame->payload;
+    TRACE(TRACE_FRAME, frame->version, *cmd, *len);
+    return true;
+}
 
-    // remove header space and crc space
-    if (*len > BUFFER_MAX_SIZE - HEADER_SIZE - CRC_SIZE)
-    {
-        printf("Payload Bigger than allocated buffer\n");
-        return false;
-    }
+uint8_t get_frame_version()
+{
+    return frame_version;
+}
 
-    if (*len > 0)
-    {
-        uint8_t* payload_internal = &buffer[PAYLOAD_OFFSET];
-        *payload = payload_internal;
-        ret = serial_api->recv(payload_internal, *len, TIMEOUT_MS);
-        if (ret <= 0)
-        {
-            printf("Timeout on recevining payload");
-            return false;
-        }
+bool get_frame_staged()
+{
+    return frame_staged;
+}
 
-        // print_frame(payload_internal,*len);
-    }
+size_t get_frame_block(bool* last)
+{
+    *last = frame_last;
+    return frame_block_pos;
+}
 
-    uint8_t* crc_buffer = &buffer[PAYLOAD_OFFSET + (*len)];
-    ret = serial_api->recv(crc_buffer, CRC_SIZE, TIMEOUT_MS);
-    if (ret <= 0)
-    {
-        printf("Timeout on recevining crc");
-        return -1;
-    }
-    // print_frame(crc_buffer,CRC_SIZE);
-    uint16_t crc_recv = *((uint16_t*) crc_buffer);
-    uint8_t* crcable_buffer = &buffer[0];
-    size_t crcable_buffer_size = *len + HEADER_SIZE;
-    uint16_t crc_calc = crc16_ccitt(crcable_buffer, crcable_buffer_size);
-    // print_frame(crcable_buffer, crcable_buffer_size);
-    // printf("crc_calc: %0x, crc_recv: %x\n",crc_calc,crc_recv);
-    return crc_calc == crc_recv;
+void set_protocol_version(uint8_t version)
+{
+    protocol_version = version;
 }
 
-static void send_ack_or_nack(serial_cmd_t cmd)
+static void send_response(serial_cmd_t cmd, const uint8_t* payload, size_t len)
 {
     if (!check_valid_api())
     {
         return;
     }
+    if (len > RESPONSE_PAYLOAD_MAX_SIZE)
+    {
+        printf("Response payload bigger than allocated buffer\n");
+        return;
+    }
     serial_api_t* serial_api = get_serial_api();
-    uint8_t frame[] = {SOF, VERSION, cmd, 0, 0, 0x00, 0x00};
-    uint16_t crc = crc16_ccitt(&frame[1], 4);
-    frame[5] = crc & 0xFF;
-    frame[6] = crc >> 8;
-    serial_api->send(frame, sizeof(frame));
+    tx_buffer[0] = SOF;
+    tx_buffer[1] = protocol_version;
+    tx_buffer[2] = cmd;
+    tx_buffer[3] = len & 0xFF;
+    tx_buffer[4] = (len >> 8) & 0xFF;
+    if (len > 0)
+    {
+        memcpy(&tx_buffer[RESPONSE_HEADER_SIZE], payload, len);
+    }
+    // the response crc does not cover the SOF
+    const uint16_t crc = crc16_ccitt(&tx_buffer[1], RESPONSE_HEADER_SIZE - 1 + len);
+    tx_buffer[RESPONSE_HEADER_SIZE + len] = crc & 0xFF;
+    tx_buffer[RESPONSE_HEADER_SIZE + len + 1] = crc >> 8;
+    serial_api->send(tx_buffer, RESPONSE_HEADER_SIZE + len + CRC_SIZE);
 }
 
 void send_ack()
 {
-    send_ack_or_nack(CMD_ACK);
+    send_response(CMD_ACK, NULL, 0);
 }
 
 void send_nack()
 {
-    send_ack_or_nack(CMD_NACK);
+    send_response(CMD_NACK, NULL, 0);
+}
+
+void send_ack_payload(const uint8_t* payload, size_t len)
+{
+    send_response(CMD_ACK, payload, len);
+}
+
+void send_nack_payload(const uint8_t* payload, size_t len)
+{
+    send_response(CMD_NACK, payload, len);
 }
@@ -12,17 +12,33 @@
  */
 typedef enum
 {
-    CMD_UNKNOWN = 0,  /**< Unknown or invalid command */
-    CMD_PING = 0x01,  /**< Ping command to start communication */
-    CMD_START = 0x02, /**< Start of firmware transmission */
-    CMD_DATA = 0x03,  /**< Firmware data packet */
-    CMD_END = 0x04,   /**< End of firmware transmission */
-    CMD_RESET = 0x05, /**< Reset command after flashing */
+    CMD_UNKNOWN = 0,        /**< Unknown or invalid command */
+    CMD_PING = 0x01,        /**< Ping command to start communication */
+    CMD_START = 0x02,       /**< Start of firmware transmission */
+    CMD_DATA = 0x03,        /**< Firmware data packet */
+    CMD_END = 0x04,         /**< End of firmware transmission */
+    CMD_RESET = 0x05,       /**< Reset command after flashing */
+    CMD_SET_BAUD = 0x06,    /**< Switch the link to another baud rate */
+    CMD_SECTOR_HASH = 0x07, /**< Query the application sector checksums */
+    CMD_RESUME = 0x08,      /**< Continue an interrupted update */
+    CMD_GET_INFO = 0x09,    /**< Query the bootloader capabilities */
+    CMD_GET_STATS = 0x0A,   /**< Query the hot path timers */
 
     CMD_ACK = 0x7F,  /**< Acknowledge command */
     CMD_NACK = 0x7E, /**< Negative acknowledge command */
 } serial_cmd_t;
 
+/**
+ * @name Serial protocol versions
+ *
+ * Version 1 is the original stop-and-wait protocol. Version 2 adds a negotiated
+ * window of outstanding CMD_DATA frames, each one tagged with its firmware byte offset.
+ * @{
+ */
+#define SERIAL_PROTOCOL_V1 0x01
+#define SERIAL_PROTOCOL_V2 0x02
+/** @} */
+
 /**
  * @brief Receive a framed serial command.
  *
@@ -39,6 +55,41 @@ typedef enum
  */
 bool recv_frame(serial_cmd_t* cmd, uint8_t** payload, size_t* len);
 
+/**
+ * @brief Get the protocol version of the last received frame.
+ *
+ * @return uint8_t VER field of the last frame accepted by recv_frame().
+ */
+uint8_t get_frame_version(void);
+
+/**
+ * @brief Check whether the last received frame was staged in place by the frame sink.
+ *
+ * When true the payload returned by recv_frame() only holds the sink prefix, the rest
+ * of the payload already sits in the sink memory and must be committed there.
+ *
+ * @return true If the payload after the prefix was received into the sink.
+ */
+bool get_frame_staged(void);
+
+/**
+ * @brief Get the position of the last received block in its frame.
+ *
+ * Large frames are returned block by block by successive recv_frame() calls, the first
+ * block starts with the beginning of the payload.
+ *
+ * @param[out] last Set when the block ends the frame, always for a frame without blocks.
+ * @return size_t Position of the block in the frame payload, 0 for the first block or a whole frame.
+ */
+size_t get_frame_block(bool* last);
+
+/**
+ * @brief Set the protocol version used in the VER field of outgoing frames.
+ *
+ * @param version One of SERIAL_PROTOCOL_V1 or SERIAL_PROTOCOL_V2.
+ */
+void set_protocol_version(uint8_t version);
+
 /**
  * @brief Send an acknowledge (ACK) response.
  *
@@ -54,3 +105,19 @@ void send_ack(void);
  * of the last command.
  */
 void send_nack(void);
+
+/**
+ * @brief Send an acknowledge (ACK) response carrying a payload.
+ *
+ * @param payload Pointer to the payload to send.
+ * @param len Payload length in bytes.
+ */
+void send_ack_payload(const uint8_t* payload, size_t len);
+
+/**
+ * @brief Send a negative acknowledge (NACK) response carrying a payload.
+ *
+ * @param payload Pointer to the payload to send.
+ * @param len Payload length in bytes.
+ */
+void send_nack_payload(const uint8_t* payload, size_t len);
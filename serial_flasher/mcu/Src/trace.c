@@ -0,0 +1,114 @@
+#include "trace.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+// power of two, the indexes below are free running word counts
+#define TRACE_RING_WORDS (512u)
+
+// zero until the header is committed, the words are cleared again once sent
+static volatile uint32_t ring[TRACE_RING_WORDS];
+static _Atomic uint32_t head = 0;      // next word to reserve, advanced by the producers
+static volatile uint32_t tail = 0;     // first word not sent yet, advanced once a transfer completed
+static uint32_t scan = 0;              // end of the committed records found by trace_poll()
+static volatile uint32_t sending = 0;  // words of the transfer in progress, 0 when idle
+static _Atomic uint32_t lost = 0;      // events dropped since the last TRACE_LOST
+
+static bool trace_commit(trace_event_t id, size_t argc, const uint32_t* args)
+{
+    const uint32_t words = 1 + argc;
+    uint32_t reserved = atomic_load_explicit(&head, memory_order_relaxed);
+    do
+    {
+        if (reserved + words - tail > TRACE_RING_WORDS)
+        {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&head, &reserved, reserved + words, memory_order_relaxed, memory_order_relaxed));
+
+    for (size_t i = 0; i < argc; i++)
+    {
+        ring[(reserved + 1 + i) % TRACE_RING_WORDS] = args[i];
+    }
+    // the header commits the record, the consumer must not see it before the arguments
+    atomic_thread_fence(memory_order_release);
+    ring[reserved % TRACE_RING_WORDS] = (TRACE_RECORD_MARK | argc) | ((uint32_t) id << 8) | (trace_port_time_ms() << 16);
+    return true;
+}
+
+void trace_record(trace_event_t id, size_t argc, const uint32_t* args)
+{
+    if (argc > TRACE_ARGS_MAX)
+    {
+        argc = TRACE_ARGS_MAX;
+    }
+    if (!trace_commit(id, argc, args))
+    {
+        atomic_fetch_add_explicit(&lost, 1, memory_order_relaxed);
+    }
+}
+
+static void trace_report_lost(void)
+{
+    const uint32_t count = atomic_exchange_explicit(&lost, 0, memory_order_relaxed);
+    if (count == 0)
+    {
+        return;
+    }
+    const uint32_t args[] = {count};
+    if (!trace_commit(TRACE_LOST, 1, args))
+    {
+        // still no room, the count shows up in the next report
+        atomic_fetch_add_explicit(&lost, count, memory_order_relaxed);
+    }
+}
+
+void trace_poll(void)
+{
+    // a transfer in progress continues from trace_sent()
+    if (sending != 0)
+    {
+        return;
+    }
+    trace_report_lost();
+    const uint32_t reserved = atomic_load_explicit(&head, memory_order_acquire);
+    while (scan != reserved)
+    {
+        const uint32_t header = ring[scan % TRACE_RING_WORDS];
+        if (header == 0)
+        {
+            // reserved but not committed yet
+            break;
+        }
+        scan += 1 + (header & 0x0Fu);
+    }
+    if (scan == tail)
+    {
+        return;
+    }
+    // a record wrapping around the end of the ring goes in two transfers
+    const uint32_t start = tail % TRACE_RING_WORDS;
+    const uint32_t words = (scan - tail < TRACE_RING_WORDS - start) ? scan - tail : TRACE_RING_WORDS - start;
+    sending = words;
+    if (!trace_port_send((const uint8_t*) &ring[start], words * sizeof(uint32_t)))
+    {
+        sending = 0;
+    }
+}
+
+void trace_sent(void)
+{
+    const uint32_t start = tail % TRACE_RING_WORDS;
+    memset((void*) &ring[start], 0, sending * sizeof(uint32_t));
+    tail += sending;
+    sending = 0;
+    trace_poll();
+}
+
+void trace_flush(void)
+{
+    do
+    {
+        trace_poll();
+    } while (sending != 0 || scan != tail);
+}
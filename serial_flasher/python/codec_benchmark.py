@@ -0,0 +1,65 @@
+"""Compression ratio and effective transfer throughput of firmware images.
+
+Wire time is modelled from the frame format: 10 bits per byte (8N1), every DATA frame carries
+SOF | VER | CMD | LEN(4) | offset(4) | chunk | CRC(2) and is answered by an 11 bytes ACK.
+Whatever the link, the MCU programs the decompressed image one word at a time, which caps both transfers
+at about 250 KB/s with the 16 us word programming time of the datasheet. Erases and the latency of the
+host serial adapter are left out, bootloader_sim measures them (see frame_benchmark.py).
+"""
+import argparse
+import time
+
+import lz4_block
+from serial_flasher import BAUDRATES, LZ4_WINDOW_LOG2_MAX
+
+BITS_PER_BYTE = 10
+DATA_FRAME_OVERHEAD = 7 + 4 + 2
+ACK_FRAME_SIZE = 5 + 4 + 2
+FLASH_WORD_SIZE = 4
+
+
+def wire_time(stream_size, chunk_size, baudrate):
+    frames = -(-stream_size // chunk_size)
+    # the host and the MCU talk full duplex, the longer direction bounds the transfer
+    host_bytes = stream_size + frames * DATA_FRAME_OVERHEAD
+    mcu_bytes = frames * ACK_FRAME_SIZE
+    return max(host_bytes, mcu_bytes) * BITS_PER_BYTE / baudrate
+
+
+def transfer_time(firmware_size, stream_size, chunk_size, baudrate, word_program_s):
+    # the staging buffers are programmed while the next frames arrive, the slower of both bounds the transfer
+    program_s = -(-firmware_size // FLASH_WORD_SIZE) * word_program_s
+    return max(wire_time(stream_size, chunk_size, baudrate), program_s)
+
+
+def benchmark(path, window_log2, chunk_size, baudrates, word_program_s):
+    with open(path, "rb") as f:
+        firmware = f.read()
+
+    start = time.perf_counter()
+    stream = lz4_block.compress(firmware, 1 << window_log2)
+    compress_s = time.perf_counter() - start
+    if lz4_block.decompress(stream, len(firmware)) != firmware:
+        raise RuntimeError(f"{path}: round trip mismatch")
+
+    ratio = len(firmware) / len(stream) if stream else 0
+    print(f"{path}: {len(firmware)} -> {len(stream)} bytes, ratio {ratio:.2f}, "
+          f"window {1 << window_log2} bytes, compressed in {compress_s * 1000:.0f} ms")
+    for baudrate in baudrates:
+        raw_s = transfer_time(len(firmware), len(firmware), chunk_size, baudrate, word_program_s)
+        lz4_s = transfer_time(len(firmware), len(stream), chunk_size, baudrate, word_program_s)
+        print(f"  {baudrate:>8} baud: raw {raw_s:6.2f} s {len(firmware) / raw_s / 1024:7.1f} KiB/s | "
+              f"lz4 {lz4_s:6.2f} s {len(firmware) / lz4_s / 1024:7.1f} KiB/s effective")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description='LZ4 compression benchmark for firmware images')
+    parser.add_argument('firmware_paths', type=str, nargs='+', help='Firmware binaries')
+    parser.add_argument('--window-log2', type=int, default=LZ4_WINDOW_LOG2_MAX, help=f"LZ4 window [{LZ4_WINDOW_LOG2_MAX}]")
+    parser.add_argument('--chunk-size', type=int, default=1024, help="DATA chunk size [1024]")
+    parser.add_argument('--baudrates', type=int, nargs='+', default=[115200] + list(BAUDRATES[::-1]),
+                        help="Baud rates to model")
+    parser.add_argument('--word-program-us', type=float, default=16.0, help="Flash word programming time [16]")
+    args = parser.parse_args()
+    for path in args.firmware_paths:
+        benchmark(path, args.window_log2, args.chunk_size, args.baudrates, args.word_program_us / 1e6)
@@ -0,0 +1,104 @@
+"""Measured transfer throughput of version 2 DATA frames against the negotiated frame size.
+
+Each frame size is flashed by serial_flasher.py into bootloader_sim, which holds the bytes for their time on the wire,
+drops what overruns its 8 KB receive ring and programs the flash at the datasheet timing (--flash-timing). The table
+shows the frame payload and window the MCU granted, the transfer time and throughput reported by the simulator, and
+the bytes it dropped. The latency of a USB serial adapter is not part of the measurement, the pseudo-terminal of the
+simulator has next to none.
+"""
+import argparse
+import os
+import random
+import re
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+from serial_flasher import BAUDRATES, FRAME_SIZE_MAX, FRAME_SIZE_MIN
+
+SLOT_A_ADDR = 0x08008000
+FW_HEADER_SIZE = 0x200
+STACK_TOP = 0x20018000
+FLASHER = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'serial_flasher.py')
+
+
+def make_image(path, size):
+    """Random image linked for slot A, random bytes do not compress"""
+    body = random.Random(size).randbytes(size - 8)
+    with open(path, 'wb') as f:
+        f.write(struct.pack('<II', STACK_TOP, SLOT_A_ADDR + FW_HEADER_SIZE + 0x1c1) + body)
+
+
+def measure(sim, workdir, image, frame_size, baudrate, flash_timing):
+    """One update of an erased flash, returns the simulator report as a dict, None when the update failed"""
+    flash = os.path.join(workdir, 'flash.bin')
+    link = os.path.join(workdir, 'uart')
+    for path in (flash, link):
+        if os.path.lexists(path):
+            os.remove(path)
+    log_path = os.path.join(workdir, 'sim.log')
+    with open(log_path, 'wb') as log:
+        proc = subprocess.Popen([sim, '--link', link, '--flash-timing', str(flash_timing), flash],
+                                stdout=log, stderr=subprocess.STDOUT)
+    while not os.path.lexists(link) and proc.poll() is None:
+        time.sleep(0.01)
+    host = subprocess.run([sys.executable, FLASHER, '--tty_port', link, '--frame-size', str(frame_size),
+                           '--max-baudrate', str(baudrate), image],
+                          capture_output=True, text=True, errors='replace', timeout=300)
+    try:
+        proc.wait(10)
+    except subprocess.TimeoutExpired:
+        proc.terminate()
+    proc.wait()
+    with open(log_path, 'rb') as f:
+        output = f.read().decode(errors='replace')
+    if host.returncode != 0 or proc.returncode != 0:
+        return None
+    granted = re.search(r'window: (\d+) frame payload: (\d+)', host.stdout)
+    transfer = re.search(r'transfer ([\d.]+) s at (\d+) baud', output)
+    dropped = re.search(r'dropped (\d+) B', output)
+    errors = re.search(r'frame errors (\d+)', output)
+    return {
+        'window': int(granted.group(1)),
+        'payload': int(granted.group(2)),
+        'seconds': float(transfer.group(1)),
+        'baudrate': int(transfer.group(2)),
+        'dropped': int(dropped.group(1)),
+        'errors': int(errors.group(1)),
+    }
+
+
+def benchmark(sim, image_size, frame_sizes, baudrates, flash_timing):
+    print(f"image {image_size} bytes, flash timing x{flash_timing}")
+    with tempfile.TemporaryDirectory(prefix='frame_benchmark.') as workdir:
+        image = os.path.join(workdir, 'fw.bin')
+        make_image(image, image_size)
+        for baudrate in baudrates:
+            print(f"  {baudrate:>8} baud:")
+            for frame_size in frame_sizes:
+                report = measure(sim, workdir, image, frame_size, baudrate, flash_timing)
+                if report is None:
+                    print(f"    frame {frame_size:>5} B: update failed")
+                    continue
+                print(f"    frame {frame_size:>5} B granted {report['payload']:>5} B window {report['window']}: "
+                      f"{report['seconds']:6.2f} s "
+                      f"{image_size / report['seconds'] / 1024:7.1f} KiB/s at {report['baudrate']} baud, "
+                      f"dropped {report['dropped']} B, frame errors {report['errors']}")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description='Throughput of DATA frames against the negotiated frame size')
+    parser.add_argument('sim', help="bootloader_sim executable")
+    parser.add_argument('--image-size', type=int, default=64 * 1024, help="Firmware size [65536]")
+    parser.add_argument('--frame-sizes', type=int, nargs='+', default=[256, 512, 1024, 2048, 4096, 8192, 16384],
+                        help=f"DATA frame payloads to request, {FRAME_SIZE_MIN} to {FRAME_SIZE_MAX}")
+    parser.add_argument('--baudrates', type=int, nargs='+', default=[115200, BAUDRATES[0]],
+                        help=f"Baud rates to measure [115200 {BAUDRATES[0]}]")
+    parser.add_argument('--flash-timing', type=float, default=1.0, help="Flash timing scale of the simulator [1]")
+    args = parser.parse_args()
+    for size in args.frame_sizes:
+        if not FRAME_SIZE_MIN <= size <= FRAME_SIZE_MAX:
+            parser.error(f"frame size {size} out of {FRAME_SIZE_MIN}..{FRAME_SIZE_MAX}")
+    benchmark(args.sim, args.image_size, args.frame_sizes, args.baudrates, args.flash_timing)
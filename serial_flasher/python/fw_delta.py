@@ -0,0 +1,203 @@
+"""Delta of a firmware image against the installed one, applied in place by the bootloader.
+
+The delta is a sequence of operations, offsets and lengths are LEB128 varints:
+- COPY (0x00) | src | len: copy len bytes of the installed image starting at src
+- INSERT (0x01) | len | bytes: append len bytes
+
+The new image is programmed over the installed one a sector at a time, so a COPY may only read
+installed bytes of sectors the new image has not reached yet: the last byte it produces has to
+sit in a sector no later than the sector of its source.
+"""
+import argparse
+
+OP_COPY = 0x00
+OP_INSERT = 0x01
+
+# firmware header in front of the image, shares the first sector with it
+FW_HEADER_SIZE = 0x200
+# application sectors 2, 3 and 4 in flashing order
+SECTOR_SIZES = (16 * 1024, 16 * 1024, 64 * 1024)
+# bytes the bootloader copies at once, the intact check runs before each step
+COPY_STEP = 64
+
+# bytes hashed to find copy candidates
+BLOCK = 8
+# a COPY costs up to 11 bytes, shorter matches are inserted
+MIN_COPY = 12
+# candidates followed per position
+MAX_CHAIN = 16
+
+
+def _sector_ends():
+    """Image offset where each sector ends"""
+    ends = []
+    end = -FW_HEADER_SIZE
+    for size in SECTOR_SIZES:
+        end += size
+        ends.append(end)
+    return ends
+
+
+SECTOR_ENDS = _sector_ends()
+
+
+def copy_limit(src: int) -> int:
+    """Image offset up to which the new image may be produced with bytes read at src"""
+    for end in SECTOR_ENDS:
+        if src < end:
+            return end
+    return 1 << 32
+
+
+def intact(written: int) -> int:
+    """First installed image offset not yet overwritten once `written` bytes of the new image were produced"""
+    done = 0
+    for end in SECTOR_ENDS:
+        if written < end:
+            break
+        done = end
+    return done
+
+
+def _put_varint(out: bytearray, value: int):
+    while value >= 0x80:
+        out.append((value & 0x7F) | 0x80)
+        value >>= 7
+    out.append(value)
+
+
+def _get_varint(data: bytes, i: int):
+    value = 0
+    shift = 0
+    while True:
+        b = data[i]
+        i += 1
+        value |= (b & 0x7F) << shift
+        if not b & 0x80:
+            return value, i
+        shift += 7
+
+
+def _put_insert(out: bytearray, literals: bytes):
+    if literals:
+        out.append(OP_INSERT)
+        _put_varint(out, len(literals))
+        out += literals
+
+
+def make_delta(base: bytes, image: bytes) -> bytes:
+    """Delta rebuilding `image` from `base` in place"""
+    index = {}
+    for i in range(len(base) - BLOCK + 1):
+        index.setdefault(base[i:i + BLOCK], []).append(i)
+
+    out = bytearray()
+    n = len(image)
+    anchor = 0
+    pos = 0
+    # the next base byte after the previous copy, most edits keep the surrounding code aligned
+    follow = -1
+    while pos < n:
+        candidates = index.get(image[pos:pos + BLOCK], [])[-MAX_CHAIN:]
+        if 0 <= follow < len(base):
+            candidates = [follow] + candidates
+        best_len = 0
+        best_src = 0
+        for src in candidates:
+            limit = min(copy_limit(src) - pos, len(base) - src, n - pos)
+            length = 0
+            while length < limit and base[src + length] == image[pos + length]:
+                length += 1
+            if length > best_len:
+                best_len = length
+                best_src = src
+        if best_len < MIN_COPY:
+            pos += 1
+            if follow >= 0:
+                follow += 1
+            continue
+
+        _put_insert(out, image[anchor:pos])
+        out.append(OP_COPY)
+        _put_varint(out, best_src)
+        _put_varint(out, best_len)
+        pos += best_len
+        anchor = pos
+        follow = best_src + best_len
+
+    _put_insert(out, image[anchor:])
+    return bytes(out)
+
+
+def apply_delta(base: bytes, delta: bytes, size: int) -> bytes:
+    """Apply like the bootloader: the installed image is overwritten a sector at a time while reading it"""
+    flash = bytearray(base) + b'\xff' * max(0, SECTOR_ENDS[-1] - len(base))
+    out = bytearray()
+
+    def emit(data):
+        done = intact(len(out))
+        out.extend(data)
+        # the sectors completed by these bytes are erased and programmed with the new image
+        flash[done:intact(len(out))] = out[done:intact(len(out))]
+
+    i = 0
+    while i < len(delta):
+        if len(out) >= size:
+            raise ValueError("data after the end of the image")
+        op = delta[i]
+        i += 1
+        if op == OP_COPY:
+            src, i = _get_varint(delta, i)
+            length, i = _get_varint(delta, i)
+            if src + length > len(base) or len(out) + length > size:
+                raise ValueError("copy out of bounds")
+            while length:
+                if src < intact(len(out)):
+                    raise ValueError(f"copy from overwritten offset {src:#x}")
+                step = min(length, COPY_STEP)
+                emit(bytes(flash[src:src + step]))
+                src += step
+                length -= step
+        elif op == OP_INSERT:
+            length, i = _get_varint(delta, i)
+            if i + length > len(delta) or len(out) + length > size:
+                raise ValueError("insert out of bounds")
+            emit(delta[i:i + length])
+            i += length
+        else:
+            raise ValueError(f"unknown operation {op:#x}")
+    if len(out) != size:
+        raise ValueError("delta ended early")
+    return bytes(out)
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description='Firmware delta generator')
+    sub = parser.add_subparsers(dest='command', required=True)
+    make = sub.add_parser('make', help='Make a delta from the installed image to a new one')
+    make.add_argument('base_path', type=str, help='Installed firmware')
+    make.add_argument('image_path', type=str, help='New firmware')
+    make.add_argument('delta_path', type=str, help='Output delta')
+    apply = sub.add_parser('apply', help='Rebuild a new image from the installed one and a delta')
+    apply.add_argument('base_path', type=str, help='Installed firmware')
+    apply.add_argument('delta_path', type=str, help='Delta')
+    apply.add_argument('size', type=int, help='Size of the new firmware')
+    apply.add_argument('image_path', type=str, help='Output firmware')
+    args = parser.parse_args()
+
+    with open(args.base_path, "rb") as f:
+        base = f.read()
+    if args.command == 'make':
+        with open(args.image_path, "rb") as f:
+            image = f.read()
+        delta = make_delta(base, image)
+        if apply_delta(base, delta, len(image)) != image:
+            raise RuntimeError("delta round trip mismatch")
+        with open(args.delta_path, "wb") as f:
+            f.write(delta)
+        print(f"{len(image)} bytes -> {len(delta)} bytes delta")
+    else:
+        with open(args.delta_path, "rb") as f:
+            delta = f.read()
+        with open(args.image_path, "wb") as f:
+            f.write(apply_delta(base, delta, args.size))
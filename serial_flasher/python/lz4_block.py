@@ -0,0 +1,115 @@
+"""LZ4 block format with match offsets bounded by a power of two window.
+
+The bootloader keeps only the last `window` decompressed bytes, so matches must not reach further back.
+The output is a plain LZ4 block that any LZ4 block decoder accepts.
+"""
+
+MIN_MATCH = 4
+# the last match must start at least 12 bytes before the end, the last 5 bytes are literals (LZ4 block rules)
+MF_LIMIT = 12
+LAST_LITERALS = 5
+# candidates followed per position, trades compression ratio for speed
+MAX_CHAIN = 32
+
+
+def _put_length(out: bytearray, length: int):
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def _put_sequence(out: bytearray, literals: bytes, offset=0, match_len=0):
+    lit_len = len(literals)
+    token_lit = min(lit_len, 15)
+    token_match = min(match_len - MIN_MATCH, 15) if match_len else 0
+    out.append((token_lit << 4) | token_match)
+    if lit_len >= 15:
+        _put_length(out, lit_len - 15)
+    out += literals
+    if match_len:
+        out += offset.to_bytes(2, 'little')
+        if match_len - MIN_MATCH >= 15:
+            _put_length(out, match_len - MIN_MATCH - 15)
+
+
+def compress(data: bytes, window: int = 4096) -> bytes:
+    """Compress data into one LZ4 block whose match offsets are at most `window` (and 65535)"""
+    max_offset = min(window, 0xFFFF)
+    out = bytearray()
+    n = len(data)
+    match_end = n - MF_LIMIT
+    # last positions seen for every 4 bytes key, newest last
+    chains = {}
+    anchor = 0
+    pos = 0
+    while pos < match_end:
+        key = data[pos:pos + MIN_MATCH]
+        candidates = chains.get(key)
+        best_len = 0
+        best_offset = 0
+        if candidates:
+            limit = n - LAST_LITERALS
+            for cand in reversed(candidates[-MAX_CHAIN:]):
+                offset = pos - cand
+                if offset > max_offset:
+                    break
+                length = MIN_MATCH
+                while pos + length < limit and data[cand + length] == data[pos + length]:
+                    length += 1
+                if length > best_len:
+                    best_len = length
+                    best_offset = offset
+                    if pos + length >= limit:
+                        break
+            if len(candidates) > 4 * MAX_CHAIN:
+                del candidates[:-MAX_CHAIN]
+        chains.setdefault(key, []).append(pos)
+
+        if best_len < MIN_MATCH:
+            pos += 1
+            continue
+
+        _put_sequence(out, data[anchor:pos], best_offset, best_len)
+        # index the matched bytes too, long runs then keep matching themselves
+        for p in range(pos + 1, min(pos + best_len, match_end)):
+            chains.setdefault(data[p:p + MIN_MATCH], []).append(p)
+        pos += best_len
+        anchor = pos
+
+    _put_sequence(out, data[anchor:])
+    return bytes(out)
+
+
+def decompress(block: bytes, size: int) -> bytes:
+    """Reference decoder, used to check the compressor"""
+    out = bytearray()
+    i = 0
+    while i < len(block):
+        token = block[i]
+        i += 1
+        lit_len = token >> 4
+        if lit_len == 15:
+            while True:
+                b = block[i]
+                i += 1
+                lit_len += b
+                if b != 255:
+                    break
+        out += block[i:i + lit_len]
+        i += lit_len
+        if len(out) >= size:
+            break
+        offset = block[i] | (block[i + 1] << 8)
+        i += 2
+        match_len = (token & 0x0F) + MIN_MATCH
+        if match_len == 15 + MIN_MATCH:
+            while True:
+                b = block[i]
+                i += 1
+                match_len += b
+                if b != 255:
+                    break
+        for _ in range(match_len):
+            out.append(out[-offset])
+    return bytes(out)
@@ -1,8 +1,14 @@
+import array
+import functools
 import struct
+import time
 import serial
 import crcmod
 
+import fw_delta
+import lz4_block
 import serial_process_frame
+from serial_process_frame import FrameError
 
 from enum import Enum
 import argparse
@@ -17,66 +23,602 @@ class State(Enum):
 
 
 
-crc16_ccitt = crcmod.predefined.mkCrcFun('ccitt-false')
+crc16_ccitt_uncached = crcmod.predefined.mkCrcFun('ccitt-false')
+crc32_mpeg = crcmod.predefined.mkCrcFun('crc-32-mpeg')
+
+
+# the MCU waits at most 100 ms for the next frame, the image CRCs are computed once before the session starts
+@functools.lru_cache(maxsize=16)
+def crc16_ccitt(data: bytes):
+    return crc16_ccitt_uncached(data)
+
+
+@functools.lru_cache(maxsize=16)
+def crc32_stm32(data: bytes):
+    """CRC32 of the STM32 CRC unit: little-endian words, last word padded with 0xFF like the erased flash"""
+    words = array.array('I', data + b'\xff' * (-len(data) % 4))
+    if words.itemsize != 4:
+        raise RuntimeError("array 'I' items are not 32 bits wide")
+    words.byteswap()
+    return crc32_mpeg(words.tobytes())
+
+# rates probed with SET_BAUD, highest first
+BAUDRATES = (2000000, 1000000, 921600, 460800, 230400)
+
+# START codec field
+CODEC_RAW = 0
+CODEC_LZ4 = 1
+CODEC_DELTA = 2
+# LZ4 histories the bootloader accepts, the largest one is what it keeps
+LZ4_WINDOW_LOG2_MIN = 4
+LZ4_WINDOW_LOG2_MAX = 12
+# DATA chunk size used when the MCU does not answer CMD_GET_INFO
+DEFAULT_CHUNK_SIZE = 1024
+# DATA frame payloads that may be negotiated with PING, offset included
+FRAME_SIZE_MIN = 256
+FRAME_SIZE_MAX = 16 * 1024
+# offset field of version 2 DATA frames
+DATA_OFFSET_SIZE = 4
+
+# CMD_GET_INFO TLV types, info_version 1
+INFO_PROTOCOL = 0x01
+INFO_FRAME = 0x02
+INFO_FIRMWARE = 0x03
+INFO_CODECS = 0x04
+INFO_CRC = 0x05
+INFO_COMMANDS = 0x06
+INFO_SECTORS = 0x07
+INFO_IMAGE = 0x08
+
+# CMD_GET_STATS timers, prof_id_t in serial_flasher/mcu/Inc/profile.h
+STATS_TIMERS = ('recv_frame', 'frame crc', 'staging copy', 'staging wait', 'erase', 'erase ahead', 'program job', 'console')
+STATS_ENTRY_SIZE = 21
+
+
+def parse_info(payload: bytes):
+    """Decode the CMD_GET_INFO answer, the types this host does not know are skipped"""
+    info = {}
+    pos = 1
+    while pos + 2 <= len(payload):
+        kind, length = payload[pos], payload[pos + 1]
+        value = payload[pos + 2:pos + 2 + length]
+        pos += 2 + length
+        if len(value) < length:
+            break
+        if kind == INFO_PROTOCOL and length >= 2:
+            info['version_max'], info['window_max'] = value[0], value[1]
+        elif kind == INFO_FRAME and length >= 4:
+            info['payload_max'], info['chunk_size'] = struct.unpack_from('<HH', value)
+            if length >= 6:
+                info['block_size'] = struct.unpack_from('<H', value, 4)[0]
+        elif kind == INFO_FIRMWARE and length >= 4:
+            info['max_fw_size'] = struct.unpack_from('<I', value)[0]
+        elif kind == INFO_CODECS and length >= 2:
+            info['codecs'], info['lz4_window_log2_max'] = value[0], value[1]
+        elif kind == INFO_CRC and length >= 1:
+            info['crc'] = value[0]
+        elif kind == INFO_COMMANDS and length >= 2:
+            info['commands'] = struct.unpack_from('<H', value)[0]
+        elif kind == INFO_SECTORS:
+            info['sectors'] = [struct.unpack_from('<II', value, i) for i in range(0, length - 7, 8)]
+        elif kind == INFO_IMAGE and length >= 11:
+            fw_size, crc16, crc32, flags = struct.unpack_from('<IHIB', value)
+            info['image'] = {'fw_size': fw_size, 'crc16': crc16, 'crc32': crc32 if flags & 1 else None}
+    return info
+
+
+def print_stats(payload: bytes):
+    """Pretty-print the CMD_GET_STATS answer, stats_version 1"""
+    clock_hz = struct.unpack_from('<I', payload, 1)[0]
+    print(f"MCU timers, clock {clock_hz / 1e6:g} MHz:")
+    print(f"{'timer':<14} {'count':>8} {'min us':>10} {'avg us':>10} {'max us':>10} {'total ms':>10}")
+    for pos in range(5, len(payload) - STATS_ENTRY_SIZE + 1, STATS_ENTRY_SIZE):
+        timer, count, low, high, total = struct.unpack_from('<BIIIQ', payload, pos)
+        name = STATS_TIMERS[timer] if timer < len(STATS_TIMERS) else f"timer {timer}"
+        us = 1e6 / clock_hz
+        print(f"{name:<14} {count:>8} {low * us:>10.1f} {total / count * us:>10.1f} {high * us:>10.1f} {total * us / 1e3:>10.1f}")
+
+
+# PING period while waiting for the bootloader entry window, a few tries fit in its default 100 ms
+DFU_PING_PERIOD_S = 0.02
+
+
+def wait_for_dfu(frame_processor, seconds: float):
+    """PING until the bootloader answers, reset the MCU meanwhile: a PING in its entry window starts DFU mode"""
+    ser = frame_processor.ser
+    timeout = ser.timeout
+    ser.timeout = DFU_PING_PERIOD_S
+    deadline = time.monotonic() + seconds
+    try:
+        while time.monotonic() < deadline:
+            frame_processor.send_frame(frame_processor.CMD_PING)
+            try:
+                frame_processor.recv_frame()
+            except FrameError:
+                continue
+            # the PINGs sent meanwhile are answered as well, drop their responses before the session starts over
+            time.sleep(0.2)
+            ser.reset_input_buffer()
+            return
+    finally:
+        ser.timeout = timeout
+    raise RuntimeError(f"MCU did not enter DFU mode within {seconds} s")
+
 
 class FirmwareUpdater:
-    def __init__(self, frame_processor,firmware: bytes, chunk_size=256):
+    # consecutive timeouts tolerated while streaming DATA frames
+    MAX_RETRIES = 5
+    # frames a PING answer may come after: the answers to the DATA frames a lost session left in flight, one idle NACK
+    PING_STALE_MAX = 16
+    # sessions started again with CMD_RESUME after the link was lost
+    MAX_RECONNECTS = 5
+    # serial timeout while waiting for the verify PING answer at a new baud rate
+    BAUD_VERIFY_TIMEOUT_S = 0.5
+    # the MCU waits ~1 s for the verify PING, then falls back and resets the session
+    BAUD_FALLBACK_S = 1.5
+
+    def __init__(self, frame_processor, firmware: bytes, chunk_size=256, window=1, baudrates=(), lz4_window_log2=0, base=None,
+                 skip_unchanged=False, resume=False, frame_size=0, stats=False, slot_images=()):
         self.frame_processor = frame_processor
+        self.link_baudrate = frame_processor.ser.baudrate
         self.fw = firmware
-        self.chunk_size = chunk_size
+        # the same firmware linked for the other slots, the one matching the slot the MCU writes is sent
+        self.slot_images = tuple(slot_images)
+        self.lz4_window_log2 = lz4_window_log2
+        self.base = base
+        # a delta already rebuilds unchanged sectors from flash
+        self.skip_unchanged = skip_unchanged and base is None
+        # only the raw stream can be resumed, the MCU decoders keep their state in RAM
+        self.resume = resume and base is None and not lz4_window_log2
+        self.keep_mask = 0
+        self.sector_sizes = []
+        # the MCU drops a session after 100 ms of silence, the images of the other slots are encoded before it starts
+        self.slot_streams = []
+        for image in self.slot_images:
+            self.encode(image)
+            self.slot_streams.append((self.codec, self.stream))
+        self.encode(firmware)
+        for image in (firmware, base) + self.slot_images:
+            if image is not None:
+                crc16_ccitt(image)
+                crc32_stm32(image)
+        # 0 picks the chunk size from CMD_GET_INFO
+        self.chunk_auto = chunk_size == 0
+        self.chunk_size = chunk_size or DEFAULT_CHUNK_SIZE
+        # capabilities reported by CMD_GET_INFO, None when the MCU does not know the command
+        self.info = None
+        self.window = window
+        # DATA frame payload requested at PING, 0 keeps the default frames
+        self.frame_size = frame_size
+        self.baudrates = baudrates
+        # print the MCU timers once the DATA stream is acknowledged
+        self.stats = stats
         self.offset = 0
         self.state = State.PING
 
+    def encode(self, feed: bytes):
+        """DATA carries the fed bytes as is, compressed or as a delta against the installed image, offsets count stream bytes"""
+        if self.base is not None:
+            self.codec = CODEC_DELTA
+            self.stream = fw_delta.make_delta(self.base, feed)
+            if fw_delta.apply_delta(self.base, self.stream, len(feed)) != feed:
+                raise RuntimeError("delta round trip mismatch")
+            print(f"delta {len(feed)} -> {len(self.stream)} bytes")
+        elif self.lz4_window_log2 and feed:
+            self.codec = CODEC_LZ4
+            self.stream = lz4_block.compress(feed, 1 << self.lz4_window_log2)
+            print(f"compressed {len(feed)} -> {len(self.stream)} bytes")
+        else:
+            self.codec = CODEC_RAW
+            self.stream = feed
+
+    def supports(self, cmd):
+        """Whether the MCU handles an optional command, assumed when it did not report its commands"""
+        if self.info is None or 'commands' not in self.info:
+            return True
+        return bool(self.info['commands'] & (1 << cmd))
+
+    def query_info(self):
+        """Read the MCU capabilities and tune the transfer to them"""
+        fp = self.frame_processor
+        fp.send_frame(fp.CMD_GET_INFO)
+        cmd, payload = fp.recv_frame()
+        if cmd != fp.CMD_ACK or len(payload) < 1:
+            # CMD_GET_INFO unknown, the MCU reset the session, keep the defaults
+            self.info = None
+            self.ping()
+            return
+        self.info = parse_info(payload)
+        info = self.info
+        self.pick_slot_image(info.get('sectors'))
+
+        if len(self.fw) > info.get('max_fw_size', len(self.fw)):
+            raise RuntimeError(f"firmware of {len(self.fw)} bytes does not fit in {info['max_fw_size']} bytes")
+        codecs = info.get('codecs', 1 << CODEC_RAW | 1 << CODEC_LZ4)
+        if self.base is not None and not codecs & (1 << CODEC_DELTA):
+            raise RuntimeError("MCU does not apply delta updates")
+        if self.lz4_window_log2 and not codecs & (1 << CODEC_LZ4):
+            print("MCU does not decompress LZ4, sending the image as is")
+            self.lz4_window_log2 = 0
+            self.encode(self.fw)
+        elif self.lz4_window_log2 > info.get('lz4_window_log2_max', self.lz4_window_log2):
+            # a longer history than the MCU keeps would be refused at START
+            self.lz4_window_log2 = info['lz4_window_log2_max']
+            self.encode(self.fw)
+
+        if 'payload_max' in info:
+            windowed = fp.version == fp.VER_WINDOWED
+            largest = info['payload_max'] - (DATA_OFFSET_SIZE if windowed else 0)
+            # raw chunks of the staging size land in place on the MCU, anything else is copied anyway,
+            # the blocks of large frames are handed over one by one whatever the chunk size
+            in_place = (windowed and self.codec == CODEC_RAW and 0 < info.get('chunk_size', 0) <= largest
+                        and not info.get('block_size'))
+            if self.chunk_auto:
+                self.chunk_size = info['chunk_size'] if in_place else largest
+            self.chunk_size = min(self.chunk_size, largest)
+        print(f"MCU info: chunk {self.chunk_size}, max firmware {info.get('max_fw_size')}, codecs {codecs:#x}")
+
+    def pick_slot_image(self, sectors):
+        """Send the image linked for the slot the MCU writes, its reset vector points into the reported sectors"""
+        if not self.slot_images or not sectors:
+            return
+        start, end = sectors[0][0], sectors[-1][0] + sectors[-1][1]
+        linked = [len(image) >= 8 and start <= struct.unpack_from('<I', image, 4)[0] < end
+                  for image in (self.fw,) + self.slot_images]
+        if not any(linked):
+            raise RuntimeError(f"none of the images is linked for the slot at {start:#010x}")
+        print(f"MCU updates the slot at {start:#010x}")
+        if not linked[0]:
+            index = linked.index(True) - 1
+            self.fw = self.slot_images[index]
+            self.codec, self.stream = self.slot_streams[index]
+
+    def query_stats(self):
+        """Read and print the MCU timers, they cover the transfer up to the last DATA frame"""
+        fp = self.frame_processor
+        self.stats = False
+        # an unknown command in DATA state ends the session, only ask a MCU that reported it
+        if self.info is None or not self.info.get('commands', 0) & (1 << fp.CMD_GET_STATS):
+            print("MCU does not report timers, Release build or older bootloader")
+            return
+        fp.send_frame(fp.CMD_GET_STATS)
+        cmd, payload = fp.recv_frame()
+        while fp.version == fp.VER_WINDOWED and len(payload) == DATA_OFFSET_SIZE:
+            # answer to a DATA frame resent after a loss
+            cmd, payload = fp.recv_frame()
+        if cmd != fp.CMD_ACK or len(payload) < 5:
+            raise RuntimeError("MCU NACK")
+        print_stats(payload)
+
+    def sector_ranges(self):
+        """(offset, size) of the image bytes held by each sector reported by CMD_SECTOR_HASH"""
+        offset = 0
+        for size in self.sector_sizes:
+            yield offset, size
+            offset += size
+
+    def query_sectors(self):
+        """Find the sectors of the written slot that already hold the new image, the MCU keeps them at START
+
+        The MCU writes the slot that is not running, so this only finds sectors when going back to the image before
+        the running one, or when flashing again an image whose update did not complete.
+        """
+        fp = self.frame_processor
+        fp.send_frame(fp.CMD_SECTOR_HASH)
+        cmd, payload = fp.recv_frame()
+        if cmd != fp.CMD_ACK or len(payload) < 2:
+            # CMD_SECTOR_HASH unknown, the MCU reset the session
+            self.ping()
+            return
+        count = payload[0]
+        self.sector_sizes = [struct.unpack_from('<I', payload, 2 + 8 * i)[0] for i in range(count)]
+
+        # the flashed image is padded with 0xFF up to the end of its last sector
+        expected = b''
+        for offset, size in self.sector_ranges():
+            part = self.fw[offset:offset + size]
+            expected += struct.pack('<I', crc32_stm32(part + b'\xff' * (size - len(part))))
+        fp.send_frame(fp.CMD_SECTOR_HASH, expected)
+        payload = self.wait_ack()
+        self.keep_mask = payload[1]
+        unchanged = [i for i in range(count) if self.keep_mask & (1 << i)]
+        print(f"unchanged sectors of the written slot: {unchanged} of {count}")
+        if self.keep_mask:
+            self.encode(self.fed_image())
+
+    def fed_image(self):
+        """Image bytes of the sectors the MCU does not keep"""
+        return b''.join(self.fw[offset:offset + size] for i, (offset, size) in enumerate(self.sector_ranges())
+                        if not self.keep_mask & (1 << i))
+
+    def start_payload(self):
+        """fw_size | crc16 | codec | window_log2 | crc32 [| stream_size], older bootloaders only read the first 6 bytes"""
+        payload = struct.pack('<IHBBI', len(self.fw), crc16_ccitt(self.fw), self.codec, self.lz4_window_log2, crc32_stm32(self.fw))
+        if self.codec != CODEC_RAW:
+            payload += struct.pack('<I', len(self.stream))
+        if self.codec == CODEC_DELTA:
+            # base_size | base_crc16 | reserved | base_crc32, the MCU refuses a different installed image
+            payload += struct.pack('<IHHI', len(self.base), crc16_ccitt(self.base), 0, crc32_stm32(self.base))
+        return payload
+
+    def try_resume(self):
+        """Ask the MCU how much of this image an interrupted update programmed, returns the next state"""
+        fp = self.frame_processor
+        if not self.resume or fp.version != fp.VER_WINDOWED or not self.supports(fp.CMD_RESUME):
+            return State.START
+        fp.send_frame(fp.CMD_RESUME, self.start_payload())
+        cmd, payload = fp.recv_frame()
+        if cmd != fp.CMD_ACK or len(payload) < 5:
+            # CMD_RESUME unknown, the MCU reset the session to the link default rate
+            self.resume = False
+            fp.ser.baudrate = self.link_baudrate
+            fp.ser.reset_input_buffer()
+            return State.PING
+        offset, keep_mask = struct.unpack_from('<IB', payload)
+        if offset == 0:
+            return State.START
+        if keep_mask and not self.sector_sizes:
+            # the stream cannot leave out the kept sectors without their sizes, end the session and start over
+            print("resume needs the sector layout, starting over")
+            self.resume = False
+            self.reconnect()
+            return State.PING
+        if keep_mask != self.keep_mask:
+            self.keep_mask = keep_mask
+            self.encode(self.fed_image())
+        self.offset = offset
+        print(f"resuming at {offset}/{len(self.stream)}")
+        return State.DATA
+
+    def reconnect(self):
+        """End the MCU session at the current rate, the next PING starts a new one at the link default rate"""
+        fp = self.frame_processor
+        try:
+            # outside PING the MCU answers NACK and resets the session, nothing arrives if it restarted meanwhile
+            fp.send_frame(fp.CMD_PING)
+            fp.recv_frame()
+        except FrameError:
+            pass
+        fp.ser.baudrate = self.link_baudrate
+
     def wait_ack(self):
         cmd, payload = self.frame_processor.recv_frame()
         if cmd == self.frame_processor.CMD_ACK:
-            return True
+            return payload
         if cmd == self.frame_processor.CMD_NACK:
             raise RuntimeError("MCU NACK")
         raise RuntimeError(f"Unexpected CMD {cmd}")
 
-    def run(self):
-        while self.state != State.DONE:
+    def wait_ping_ack(self):
+        """ACK of a PING, an idle MCU NACKs every 100 ms and that NACK may cross the PING on the wire"""
+        fp = self.frame_processor
+        nacks = 0
+        for _ in range(self.PING_STALE_MAX):
+            cmd, payload = fp.recv_frame()
+            if cmd in (fp.CMD_ACK, fp.CMD_NACK) and len(payload) == DATA_OFFSET_SIZE:
+                # answer to a DATA frame of a lost session, still queued on the link
+                continue
+            if cmd == fp.CMD_NACK and nacks == 0:
+                # the PING answer follows within a few ms, a rejected PING gets the next idle NACK
+                nacks += 1
+                continue
+            if cmd == fp.CMD_ACK:
+                return payload
+            raise RuntimeError("MCU NACK" if cmd == fp.CMD_NACK else f"Unexpected CMD {cmd}")
+        raise RuntimeError("no PING answer")
 
-            # ---- PING ----
-            if self.state == State.PING:
-                self.frame_processor.send_frame(self.frame_processor.CMD_PING)
-                self.wait_ack()
-                self.state = State.START
-
-            # ---- START ----
-            elif self.state == State.START:
-                fw_crc = crc16_ccitt(self.fw)
-                print(f"len: {len(self.fw):#02x} fw_crc: {fw_crc:#02x}")
-                payload = struct.pack('<I', len(self.fw)) + struct.pack('<H', fw_crc)
-                self.frame_processor.send_frame(self.frame_processor.CMD_START, payload)
-                self.wait_ack()
-                self.state = State.DATA
+    def wait_offset(self):
+        """Wait for a version 2 ACK/NACK, returns (acked, next expected offset)"""
+        cmd, payload = self.frame_processor.recv_frame()
+        if cmd not in (self.frame_processor.CMD_ACK, self.frame_processor.CMD_NACK):
+            raise RuntimeError(f"Unexpected CMD {cmd}")
+        if len(payload) < 4:
+            raise RuntimeError("MCU response without offset")
+        offset = struct.unpack('<I', payload[:4])[0]
+        return cmd == self.frame_processor.CMD_ACK, offset
 
-            # ---- DATA ----
-            elif self.state == State.DATA:
-                if self.offset >= len(self.fw):
-                    self.state = State.END
-                    continue
+    def ping(self):
+        fp = self.frame_processor
+        # a new session starts with the default frames
+        fp.block_size = 0
+        if self.window <= 1 and not self.frame_size:
+            fp.send_frame(fp.CMD_PING)
+            self.wait_ping_ack()
+            return
 
-                chunk = self.fw[self.offset:self.offset + self.chunk_size]
-                self.frame_processor.send_frame(self.frame_processor.CMD_DATA, chunk)
+        request = struct.pack('<B', max(self.window, 1))
+        if self.frame_size:
+            # window | max frame payload, older bootloaders only read the window
+            request += struct.pack('<H', self.frame_size)
+        fp.send_frame(fp.CMD_PING, request, version=fp.VER_WINDOWED)
+        payload = self.wait_ping_ack()
+        if fp.last_version == fp.VER_WINDOWED and len(payload) >= 1:
+            fp.version = fp.VER_WINDOWED
+            self.window = payload[0]
+        else:
+            # bootloader only speaks version 1, fall back to stop-and-wait
+            self.window = 1
+        if fp.version == fp.VER_WINDOWED and len(payload) >= 5:
+            # window | max frame payload | block size, the window shrinks as the frames grow
+            payload_max, fp.block_size = struct.unpack_from('<HH', payload, 1)
+            largest = payload_max - DATA_OFFSET_SIZE
+            self.chunk_size = largest if self.chunk_auto else min(self.chunk_size, largest)
+            print(f"protocol version: {fp.version} window: {self.window} frame payload: {payload_max} block: {fp.block_size}")
+            return
+        print(f"protocol version: {fp.version} window: {self.window}")
+
+    def negotiate_baudrate(self):
+        """Switch to the highest rate from self.baudrates both ends support, stay at the current rate otherwise"""
+        fp = self.frame_processor
+        ser = fp.ser
+        for rate in sorted(self.baudrates, reverse=True):
+            if rate <= ser.baudrate:
+                break
+            fp.send_frame(fp.CMD_SET_BAUD, struct.pack('<I', rate))
+            cmd, _ = fp.recv_frame()
+            if cmd != fp.CMD_ACK:
+                # rate not supported (or SET_BAUD unknown), the MCU reset the session
+                self.ping()
+                continue
+
+            old_rate, old_timeout = ser.baudrate, ser.timeout
+            ser.baudrate = rate
+            ser.timeout = self.BAUD_VERIFY_TIMEOUT_S
+            ser.reset_input_buffer()
+            try:
+                fp.send_frame(fp.CMD_PING)
                 self.wait_ack()
+                ser.timeout = old_timeout
+                print(f"baudrate: {rate}")
+                return
+            except (FrameError, RuntimeError):
+                pass
+
+            # the link did not come up, wait for the MCU to fall back as well
+            ser.baudrate = old_rate
+            ser.timeout = old_timeout
+            time.sleep(self.BAUD_FALLBACK_S)
+            self.resync()
+
+    def resync(self):
+        """PING until the MCU answers, it sends NACKs while idle after a session reset"""
+        ser = self.frame_processor.ser
+        for _ in range(self.MAX_RETRIES):
+            ser.reset_input_buffer()
+            try:
+                self.ping()
+                return
+            except (FrameError, RuntimeError):
+                time.sleep(0.1)
+        raise RuntimeError("MCU not answering")
+
+    def send_data_windowed(self):
+        """Go-back-N transfer: keep up to `window` DATA frames in flight, resend from the first missing offset"""
+        fp = self.frame_processor
+        acked = self.offset
+        in_flight = []
+        # responses still expected for frames sent before the last rewind
+        stale = 0
+        retries = 0
+        while acked < len(self.stream):
+            while len(in_flight) < self.window and self.offset < len(self.stream):
+                chunk = self.stream[self.offset:self.offset + self.chunk_size]
+                fp.send_frame(fp.CMD_DATA, struct.pack('<I', self.offset) + chunk)
+                in_flight.append(self.offset)
                 self.offset += len(chunk)
 
-                print(f"Progress: {self.offset}/{len(self.fw)}")
+            try:
+                ok, offset = self.wait_offset()
+                retries = 0
+            except FrameError:
+                retries += 1
+                if retries > self.MAX_RETRIES:
+                    raise
+                self.offset = acked
+                in_flight = []
+                stale = 0
+                continue
 
-            # ---- END ----
-            elif self.state == State.END:
-                self.frame_processor.send_frame(self.frame_processor.CMD_END)
-                self.wait_ack()
-                self.state = State.RESET
+            if ok:
+                if offset > acked:
+                    acked = offset
+                    in_flight = [o for o in in_flight if o >= acked]
+                    print(f"Progress: {acked}/{len(self.stream)}")
+                continue
+
+            if stale > 0 and offset == acked:
+                stale -= 1
+                continue
+            # rewind to the first offset the MCU is missing
+            stale = max(len(in_flight) - 1, 0)
+            acked = offset
+            self.offset = offset
+            in_flight = []
+
+    def run(self):
+        reconnects = 0
+        start = time.perf_counter()
+        while self.state != State.DONE:
+            try:
+                self.step()
+            except FrameError:
+                # the link was lost, the MCU journals what it programmed: start a new session and resume
+                reconnects += 1
+                if not self.resume or self.state not in (State.DATA, State.END) or reconnects > self.MAX_RECONNECTS:
+                    raise
+                print(f"link lost, reconnecting ({reconnects}/{self.MAX_RECONNECTS})")
+                self.reconnect()
+                # CMD_SECTOR_HASH and CMD_RESUME tell again which bytes are still missing
+                self.offset = 0
+                self.keep_mask = 0
+                self.encode(self.fw)
+                self.state = State.PING
+
+        elapsed = time.perf_counter() - start
+        print(f"Firmware update complete in {elapsed:.2f} s, {len(self.fw) / elapsed / 1024:.1f} KiB/s")
 
-            # ---- RESET ----
-            elif self.state == State.RESET:
-                self.state = State.DONE
+    def step(self):
+        """Run the current state once"""
+        # ---- PING ----
+        if self.state == State.PING:
+            # retried, the MCU may still be ending a lost session
+            self.resync()
+            self.query_info()
+            if self.supports(self.frame_processor.CMD_SET_BAUD):
+                self.negotiate_baudrate()
+            if self.skip_unchanged and self.supports(self.frame_processor.CMD_SECTOR_HASH):
+                self.query_sectors()
+            self.state = self.try_resume()
+
+        # ---- START ----
+        elif self.state == State.START:
+            print(f"len: {len(self.fw):#02x} fw_crc: {crc16_ccitt(self.fw):#02x} fw_crc32: {crc32_stm32(self.fw):#02x}")
+            self.frame_processor.send_frame(self.frame_processor.CMD_START, self.start_payload())
+            payload = self.wait_ack()
+            if self.frame_processor.version == self.frame_processor.VER_WINDOWED and len(payload) >= 1:
+                # compressed streams get a smaller window, older bootloaders answer without one
+                self.window = min(self.window, payload[0])
+                print(f"window: {self.window}")
+            self.state = State.DATA
+
+        # ---- DATA ----
+        elif self.state == State.DATA:
+            if self.offset >= len(self.stream):
+                self.state = State.END
+                return
+
+            if self.frame_processor.version == self.frame_processor.VER_WINDOWED:
+                self.send_data_windowed()
+                return
+
+            chunk = self.stream[self.offset:self.offset + self.chunk_size]
+            self.frame_processor.send_frame(self.frame_processor.CMD_DATA, chunk)
+            self.wait_ack()
+            self.offset += len(chunk)
+
+            print(f"Progress: {self.offset}/{len(self.stream)}")
+
+        # ---- END ----
+        elif self.state == State.END:
+            if self.stats:
+                self.query_stats()
+            self.frame_processor.send_frame(self.frame_processor.CMD_END)
+            cmd, payload = self.frame_processor.recv_frame()
+            while cmd == self.frame_processor.CMD_ACK and self.frame_processor.version == self.frame_processor.VER_WINDOWED and len(payload) >= 4:
+                # answer to a DATA frame resent after a loss, the END ACK carries no offset
+                cmd, payload = self.frame_processor.recv_frame()
+            if cmd == self.frame_processor.CMD_NACK and self.frame_processor.version == self.frame_processor.VER_WINDOWED and len(payload) >= 4:
+                # the MCU is still missing data, resume from the offset it reported
+                self.offset = struct.unpack('<I', payload[:4])[0]
+                self.state = State.DATA
+                return
+            if cmd != self.frame_processor.CMD_ACK:
+                raise RuntimeError("MCU NACK")
+            self.state = State.RESET
 
-        print("Firmware update complete")
+        # ---- RESET ----
+        elif self.state == State.RESET:
+            self.state = State.DONE
 
 
 if __name__ == "__main__":
@@ -84,14 +626,51 @@ if __name__ == "__main__":
     parser.add_argument('firmare_path', type=str, help='The Path to the firmware file')
     parser.add_argument('--tty_port', required=False, type=str, default='/dev/ttyUSB0', help="TTY Port used in the UUART communication[/dev/ttyUSB0]")
     parser.add_argument("--baudrate", required=False, type=int, default=115200, help="Help Baudrate used in UART [115200]")
+    parser.add_argument("--chunk-size", required=False, type=int, default=0,
+                        help="DATA chunk size, 0 picks the fastest one the MCU reports with GET_INFO [0]")
+    parser.add_argument("--window", required=False, type=int, default=4, help="DATA frames in flight, 1 disables pipelining [4]")
+    parser.add_argument("--frame-size", required=False, type=int, default=0,
+                        help=f"DATA frame payload requested from the MCU, {FRAME_SIZE_MIN} to {FRAME_SIZE_MAX}, 0 keeps the 2 KB frames [0]")
+    parser.add_argument("--compress", required=False, type=int, default=0, metavar='WINDOW_LOG2',
+                        help=f"Send the image LZ4 compressed with a 1 << WINDOW_LOG2 bytes window, {LZ4_WINDOW_LOG2_MIN} to {LZ4_WINDOW_LOG2_MAX}, 0 sends it raw [0]")
+    parser.add_argument("--slot-b", required=False, type=str, default=None, metavar='FIRMWARE_B',
+                        help="The same firmware linked for slot B, sent instead when the MCU updates slot B")
+    parser.add_argument("--base", required=False, type=str, default=None, metavar='INSTALLED_FIRMWARE',
+                        help="Send a delta against the installed firmware, exclusive with --compress")
+    parser.add_argument("--full", required=False, action='store_true', help="Rewrite every sector, even the unchanged ones")
+    parser.add_argument("--no-resume", required=False, action='store_true',
+                        help="Start over instead of continuing an interrupted update of the same image")
+    parser.add_argument("--stats", required=False, action='store_true',
+                        help="Print the MCU hot path timers before END, needs a bootloader built without Release")
+    parser.add_argument("--wait-dfu", required=False, type=float, default=0, metavar='SECONDS',
+                        help="PING until the bootloader enters DFU mode, reset the MCU meanwhile [off]")
+    parser.add_argument("--max-baudrate", required=False, type=int, default=BAUDRATES[0], help=f"Highest baud rate probed after PING, 0 keeps --baudrate [{BAUDRATES[0]}]")
     args = parser.parse_args()
+    if args.base and args.compress:
+        parser.error("--base and --compress are exclusive")
+    if args.compress and not LZ4_WINDOW_LOG2_MIN <= args.compress <= LZ4_WINDOW_LOG2_MAX:
+        parser.error(f"--compress must be between {LZ4_WINDOW_LOG2_MIN} and {LZ4_WINDOW_LOG2_MAX}")
+    if args.frame_size and not FRAME_SIZE_MIN <= args.frame_size <= FRAME_SIZE_MAX:
+        parser.error(f"--frame-size must be between {FRAME_SIZE_MIN} and {FRAME_SIZE_MAX}")
     firmware_path = args.firmare_path
     tty_port = args.tty_port
 
-    ser = serial.Serial(tty_port, 115200, timeout=5)
+    ser = serial.Serial(tty_port, args.baudrate, timeout=5)
+    baudrates = [rate for rate in BAUDRATES if rate <= args.max_baudrate]
     frame_processor = serial_process_frame.FrameProcessor(ser)
     with open(firmware_path, "rb") as f:
         firmware = f.read()
-        updater = FirmwareUpdater(frame_processor, firmware, 1024)
-        updater.run()
+    slot_images = []
+    if args.slot_b:
+        with open(args.slot_b, "rb") as f:
+            slot_images.append(f.read())
+    base = None
+    if args.base:
+        with open(args.base, "rb") as f:
+            base = f.read()
+    if args.wait_dfu:
+        wait_for_dfu(frame_processor, args.wait_dfu)
+    updater = FirmwareUpdater(frame_processor, firmware, args.chunk_size, args.window, baudrates, args.compress, base, not args.full,
+                              not args.no_resume, args.frame_size, args.stats, slot_images)
+    updater.run()
 
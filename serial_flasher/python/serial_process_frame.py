@@ -4,10 +4,16 @@ import crcmod
 
 crc16_ccitt = crcmod.predefined.mkCrcFun('ccitt-false')
 
+class FrameError(Exception):
+    pass
+
+
 class FrameProcessor(object):
    
     SOF = 0xA5
     VER = 0x01
+    VER_WINDOWED = 0x02
+    SUPPORTED_VERSIONS = (VER, VER_WINDOWED)
 
     CMD_UNKNOWN     = 0
     CMD_PING        = 0x01
@@ -15,6 +21,11 @@ class FrameProcessor(object):
     CMD_DATA        = 0x03
     CMD_END         = 0x04
     CMD_RESET       = 0x05
+    CMD_SET_BAUD    = 0x06
+    CMD_SECTOR_HASH = 0x07
+    CMD_RESUME      = 0x08
+    CMD_GET_INFO    = 0x09
+    CMD_GET_STATS   = 0x0A
     CMD_ACK         = 0x7F
     CMD_NACK        = 0x7E
 
@@ -22,18 +33,32 @@ class FrameProcessor(object):
 
     def __init__(self, ser):
         self.ser = ser
+        # version used in outgoing frames and version of the last received frame
+        self.version = self.VER
+        self.last_version = self.VER
+        # payload bytes between two CRCs of a large frame, 0 until negotiated with PING
+        self.block_size = 0
 
-    def send_frame(self, cmd, payload=b''):
+    def send_frame(self, cmd, payload=b'', version=None):
         length = len(payload)
+        if version is None:
+            version = self.version
 
         # Header: SOF(1) | VER (1) | CMD (1) | LEN (4)
-        header = struct.pack('<BBBI', self.SOF,self.VER, cmd, length)  # exactly 7 bytes
+        header = struct.pack('<BBBI', self.SOF, version, cmd, length)  # exactly 7 bytes
 
-        # CRC16 over header + payload
-        crc = crc16_ccitt(header + payload)
+        # Large frames: every block is followed by the CRC16 over the header and the payload sent so far
+        if self.block_size and length > self.block_size:
+            blocks = [payload[i:i + self.block_size] for i in range(0, length, self.block_size)]
+        else:
+            blocks = [payload]
 
         # Build final frame: SOF + header + payload + CRC16
-        frame = header + payload + struct.pack('<H', crc)
+        frame = header
+        crc = crc16_ccitt(header)
+        for block in blocks:
+            crc = crc16_ccitt(block, crc)
+            frame += block + struct.pack('<H', crc)
 
         # Send over UART
         self.ser.write(frame)
@@ -66,7 +91,7 @@ class FrameProcessor(object):
         ver, cmd, len_l, len_h = struct.unpack('<BBBB', hdr)
         length = len_l | (len_h << 8)
 
-        if ver != self.VER:
+        if ver not in self.SUPPORTED_VERSIONS:
             raise FrameError(f"Unsupported protocol version {ver}")
 
         # --- Read payload ---
@@ -85,5 +110,6 @@ class FrameProcessor(object):
                 f"CRC mismatch: calc=0x{crc_calc:04X}, rx=0x{crc_rx:04X}"
             )
 
+        self.last_version = ver
         return cmd, payload
     
\ No newline at end of file
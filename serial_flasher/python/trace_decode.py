@@ -0,0 +1,105 @@
+"""Print the console of the bootloader with its binary trace records turned back into text.
+
+The records share the link with the printf output: a record starts with 0xA0 + argc, never an ASCII byte, followed by
+the event id, the low 16 bits of the millisecond tick and argc little-endian 32 bits arguments. The formats come from
+the table scripts/gen_trace_table.py generates at build time.
+"""
+import argparse
+import json
+import re
+import struct
+import sys
+
+TRACE_RECORD_MARK = 0xA0
+TRACE_ARGS_MAX = 4
+TRACE_HEADER_SIZE = 4
+
+CONVERSION_RE = re.compile(r'%(\{\w+\}|[-+ #0]*\d*[diuxXoc%])')
+
+
+class TraceDecoder:
+    def __init__(self, table: dict):
+        self.events = {int(event_id): event for event_id, event in table['events'].items()}
+        self.enums = {name: {int(value): enumerator for value, enumerator in values.items()} for name, values in table['enums'].items()}
+        self.pending = b''
+        self.text = b''
+        self.time_ms = 0
+
+    def format(self, fmt: str, args):
+        args = list(args)
+
+        def convert(match):
+            spec = match.group(1)
+            if spec == '%':
+                return '%'
+            value = args.pop(0) if args else 0
+            if spec.startswith('{'):
+                enum = spec[1:-1]
+                return self.enums[enum].get(value, f"{enum}({value:#x})")
+            if spec[-1] in 'di':
+                value = struct.unpack('<i', struct.pack('<I', value))[0]
+            return ('%' + spec) % value
+
+        return CONVERSION_RE.sub(convert, fmt)
+
+    def record(self, event_id: int, time_ms: int, args):
+        # the tick wraps every 65.5 s, the records arrive in order
+        wrapped = (self.time_ms & ~0xFFFF) | time_ms
+        if wrapped < self.time_ms:
+            wrapped += 0x10000
+        self.time_ms = wrapped
+        event = self.events.get(event_id)
+        if event is None:
+            return f"[{self.time_ms / 1000:10.3f}] unknown event {event_id} {' '.join(f'0x{arg:x}' for arg in args)}"
+        return f"[{self.time_ms / 1000:10.3f}] {self.format(event['format'], args)}"
+
+    def feed(self, data: bytes):
+        """Lines decoded so far"""
+        lines = []
+        data = self.pending + data
+        pos = 0
+        while pos < len(data):
+            mark = data[pos]
+            if mark & 0xF0 != TRACE_RECORD_MARK or mark & 0x0F > TRACE_ARGS_MAX:
+                self.text += data[pos:pos + 1]
+                pos += 1
+                if self.text.endswith(b'\n'):
+                    lines.append(self.text.decode('utf-8', 'replace').rstrip('\n'))
+                    self.text = b''
+                continue
+            size = TRACE_HEADER_SIZE + 4 * (mark & 0x0F)
+            if pos + size > len(data):
+                break
+            _, event_id, time_ms = struct.unpack_from('<BBH', data, pos)
+            args = struct.unpack_from(f"<{mark & 0x0F}I", data, pos + TRACE_HEADER_SIZE)
+            lines.append(self.record(event_id, time_ms, args))
+            pos += size
+        self.pending = data[pos:]
+        return lines
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description='Decode the binary trace records of the bootloader console')
+    parser.add_argument('--table', type=str, required=True, help='Trace table generated by the build')
+    parser.add_argument('--file', type=str, default=None, help='Console capture to decode')
+    parser.add_argument('--tty_port', type=str, default='/dev/ttyACM0', help="TTY Port of the console USART2 [/dev/ttyACM0]")
+    parser.add_argument("--baudrate", type=int, default=115200, help="Baudrate of the console [115200]")
+    args = parser.parse_args()
+
+    with open(args.table) as f:
+        decoder = TraceDecoder(json.load(f))
+
+    if args.file:
+        with open(args.file, 'rb') as f:
+            for line in decoder.feed(f.read()):
+                print(line)
+        sys.exit(0)
+
+    import serial
+    with serial.Serial(args.tty_port, args.baudrate, timeout=0.1) as ser:
+        try:
+            while True:
+                for line in decoder.feed(ser.read(ser.in_waiting or 1)):
+                    print(line, flush=True)
+        except KeyboardInterrupt:
+            pass
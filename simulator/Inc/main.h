@@ -0,0 +1,9 @@
+#pragma once
+
+/*
+ * Simulator counterpart of Inc/main.h for the bootloader sources built on the host.
+ */
+
+#include "stm32f4xx_hal.h"
+
+void Error_Handler(void);
@@ -0,0 +1,176 @@
+#pragma once
+
+/*
+ * Host stand-in for the STM32F4 HAL, it only declares what the bootloader sources built into the
+ * simulator use. Registers are plain variables, the flash controller is modelled in sim_flash.c.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum
+{
+    HAL_OK = 0x00U,
+    HAL_ERROR = 0x01U,
+    HAL_BUSY = 0x02U,
+    HAL_TIMEOUT = 0x03U
+} HAL_StatusTypeDef;
+
+typedef enum
+{
+    SysTick_IRQn = -1,
+    FLASH_IRQn = 4,
+} IRQn_Type;
+
+/* -------------------------------------------------------------------------- */
+/* Core                                                                        */
+/* -------------------------------------------------------------------------- */
+
+typedef struct
+{
+    volatile uint32_t CTRL;
+    volatile uint32_t LOAD;
+    volatile uint32_t VAL;
+} SysTick_Type;
+
+typedef struct
+{
+    volatile uint32_t ICER[8];
+    volatile uint32_t ICPR[8];
+} NVIC_Type;
+
+typedef struct
+{
+    volatile uint32_t ICSR;
+    volatile uint32_t VTOR;
+    volatile uint32_t SHCSR;
+} SCB_Type;
+
+extern SysTick_Type sim_systick;
+extern NVIC_Type sim_nvic;
+extern SCB_Type sim_scb;
+
+#define SysTick                (&sim_systick)
+#define NVIC                   (&sim_nvic)
+#define SCB                    (&sim_scb)
+#define SCB_ICSR_PENDSTCLR_Msk (1UL << 25)
+
+/**
+ * @brief Mask the simulated interrupts, the FLASH interrupt is a signal handler.
+ */
+void __disable_irq(void);
+
+/**
+ * @brief Unmask the simulated interrupts.
+ */
+void __enable_irq(void);
+
+static inline void __DSB(void) {}
+static inline void __ISB(void) {}
+static inline void __set_MSP(uint32_t top_of_main_stack) {}
+
+void NVIC_ClearPendingIRQ(IRQn_Type irqn);
+
+/**
+ * @brief Reset the simulated MCU, ends the simulation.
+ */
+void NVIC_SystemReset(void) __attribute__((noreturn));
+
+void HAL_NVIC_SetPriority(IRQn_Type irqn, uint32_t preempt_priority, uint32_t sub_priority);
+void HAL_NVIC_EnableIRQ(IRQn_Type irqn);
+
+HAL_StatusTypeDef HAL_DeInit(void);
+HAL_StatusTypeDef HAL_RCC_DeInit(void);
+uint32_t HAL_GetTick(void);
+
+/* -------------------------------------------------------------------------- */
+/* Backup domain                                                               */
+/* -------------------------------------------------------------------------- */
+
+typedef struct
+{
+    volatile uint32_t BKP0R;
+    volatile uint32_t BKP1R;
+    volatile uint32_t BKP2R;
+    volatile uint32_t BKP3R;
+    volatile uint32_t BKP4R;
+    volatile uint32_t BKP5R;
+    volatile uint32_t BKP6R;
+} RTC_TypeDef;
+
+extern RTC_TypeDef sim_rtc;
+
+#define RTC (&sim_rtc)
+
+void HAL_PWR_EnableBkUpAccess(void);
+void HAL_PWR_DisableBkUpAccess(void);
+
+/* -------------------------------------------------------------------------- */
+/* Flash controller                                                            */
+/* -------------------------------------------------------------------------- */
+
+typedef struct
+{
+    volatile uint32_t ACR;
+    volatile uint32_t KEYR;
+    volatile uint32_t OPTKEYR;
+    volatile uint32_t SR;
+    volatile uint32_t CR;
+    volatile uint32_t OPTCR;
+} FLASH_TypeDef;
+
+extern FLASH_TypeDef sim_flash_regs;
+
+#define FLASH (&sim_flash_regs)
+
+#define FLASH_SR_EOP    (1UL << 0)
+#define FLASH_SR_SOP    (1UL << 1)
+#define FLASH_SR_WRPERR (1UL << 4)
+#define FLASH_SR_PGAERR (1UL << 5)
+#define FLASH_SR_PGPERR (1UL << 6)
+#define FLASH_SR_PGSERR (1UL << 7)
+#define FLASH_SR_RDERR  (1UL << 8)
+#define FLASH_SR_BSY    (1UL << 16)
+
+#define FLASH_CR_PG      (1UL << 0)
+#define FLASH_CR_SER     (1UL << 1)
+#define FLASH_CR_SNB_Pos (3U)
+#define FLASH_CR_SNB     (0x1FUL << FLASH_CR_SNB_Pos)
+#define FLASH_CR_PSIZE   (3UL << 8)
+#define FLASH_CR_STRT    (1UL << 16)
+#define FLASH_CR_EOPIE   (1UL << 24)
+#define FLASH_CR_ERRIE   (1UL << 25)
+#define FLASH_CR_LOCK    (1UL << 31)
+#define FLASH_PSIZE_WORD (0x00000200U)
+
+#define FLASH_ACR_DCEN  (1UL << 10)
+#define FLASH_ACR_DCRST (1UL << 12)
+
+#define FLASH_TYPEERASE_SECTORS (0x00000000U)
+#define FLASH_VOLTAGE_RANGE_3   (0x00000002U)
+
+#define FLASH_SECTOR_0 0U
+#define FLASH_SECTOR_1 1U
+#define FLASH_SECTOR_2 2U
+#define FLASH_SECTOR_3 3U
+#define FLASH_SECTOR_4 4U
+#define FLASH_SECTOR_5 5U
+#define FLASH_SECTOR_6 6U
+#define FLASH_SECTOR_7 7U
+
+typedef struct
+{
+    uint32_t TypeErase;
+    uint32_t Banks;
+    uint32_t Sector;
+    uint32_t NbSectors;
+    uint32_t VoltageRange;
+} FLASH_EraseInitTypeDef;
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void);
+HAL_StatusTypeDef HAL_FLASH_Lock(void);
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef* erase_init, uint32_t* sector_error);
+HAL_StatusTypeDef HAL_FLASHEx_Erase_IT(FLASH_EraseInitTypeDef* erase_init);
+void HAL_FLASH_IRQHandler(void);
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue);
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue);
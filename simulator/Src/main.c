@@ -0,0 +1,277 @@
+#include "main.h"
+
+#include "boot_config.h"
+#include "console.h"
+#include "crc_handler.h"
+#include "flash_handler.h"
+#include "serial_frame_parser.h"
+#include "sim_flash.h"
+#include "sim_hal.h"
+#include "sim_uart.h"
+#include "update_api.h"
+
+#include <getopt.h>
+#include <signal.h>
+#include <profile.h>
+#include <serial_flasher.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <trace.h>
+#include <unistd.h>
+
+static uint64_t boot_us = 0;
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] FLASH_FILE\n"
+            "  --link PATH          symlink to the UART1 pty, for serial_flasher.py --tty_port\n"
+            "  --no-pacing          deliver bytes immediately instead of at the baud rate\n"
+            "  --flash-timing SCALE factor on the datasheet erase and program times, 0 for instant (default 1)\n"
+            "  --power-cut-at BYTES exit with status 3 once BYTES were received\n"
+            "  --backup FILE        keep the RTC backup registers in FILE across runs\n"
+            "  --boot               run the boot check instead of DFU mode, exit with status 0 if the image starts\n"
+            "  --app-update FILE    write FILE to the slot not booted through the update API, like the application\n",
+            prog);
+}
+
+static void report(void)
+{
+    const sim_uart_stats_t* uart = sim_uart_stats();
+    const sim_flash_stats_t* flash = sim_flash_stats();
+    const double transfer_s = uart->rx_bytes ? (double) (uart->last_rx_us - uart->first_rx_us) / 1e6 : 0.0;
+    const uint32_t frames = frame_parser_frames();
+
+    fprintf(stderr, "[sim] session %.3f s, transfer %.3f s at %u baud\n", (double) (sim_now_us() - boot_us) / 1e6, transfer_s,
+            uart->baudrate);
+    fprintf(stderr, "[sim] uart rx %zu B (%.1f KiB/s), tx %zu B, dropped %zu B\n", uart->rx_bytes,
+            transfer_s > 0 ? (double) uart->rx_bytes / 1024.0 / transfer_s : 0.0, uart->tx_bytes, uart->rx_dropped);
+    fprintf(stderr, "[sim] frames %u (%.1f frames/s), frame errors %u\n", frames, transfer_s > 0 ? frames / transfer_s : 0.0,
+            frame_parser_errors());
+    fprintf(stderr, "[sim] flash words %u, NOR violations %u, rejected %u, busy %.3f s\n", flash->words_programmed, flash->nor_violations,
+            flash->rejected, (double) flash->busy_us / 1e6);
+    for (uint32_t i = 0; i < SIM_FLASH_SECTORS; i++)
+    {
+        if (flash->erases[i])
+        {
+            fprintf(stderr, "[sim] sector %u erased %u times, %u in the background\n", i, flash->erases[i], flash->background_erases[i]);
+        }
+    }
+}
+
+// the bootloader waits in DFU mode for good when the host gives up, stopping it still reports
+static void interrupted(int sig)
+{
+    report();
+    _exit(128 + sig);
+}
+
+// the trace records follow the console on stdout like they share USART2 on the target, written synchronously
+bool trace_port_send(const uint8_t* data, size_t len)
+{
+    fwrite(data, 1, len, stdout);
+    trace_sent();
+    return true;
+}
+
+uint32_t trace_port_time_ms(void)
+{
+    return HAL_GetTick();
+}
+
+// the console is stdout, printf() does not go through console_write()
+void console_flush(void)
+{
+    fflush(stdout);
+}
+
+// the bootloader resets after the update, the simulation ends with the boot check of the next start
+static void system_reset(void)
+{
+    trace_flush();
+    sim_uart_drain();
+    report();
+    const int ret = fw_check_header();
+    fprintf(stderr, "[sim] reset, firmware header %s\n", ret ? "MISMATCH" : "OK");
+    exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+// the application branch of bootloader/Src/main.c, the time is what the check adds to the boot
+static int boot(void)
+{
+    bool verified = false;
+    size_t slot = 0;
+    const uint64_t start_us = sim_now_us();
+    const int ret = fw_boot_check(&slot, &verified);
+    const uint64_t elapsed_us = sim_now_us() - start_us;
+    if (ret)
+    {
+        fprintf(stderr, "[sim] boot check FAILED in %lu us\n", (unsigned long) elapsed_us);
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "[sim] boot check OK in %lu us, slot %c, image CRC %s\n", (unsigned long) elapsed_us, slot ? 'B' : 'A',
+            verified ? "computed" : "cached");
+    return EXIT_SUCCESS;
+}
+
+// the application side of bootloader/Src/update_api.c, FILE has to be linked for the slot that is not running
+static int app_update(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    static uint8_t image[FLASH_SECTOR_5_SIZE];
+    const size_t size = file != NULL ? fread(image, 1, sizeof(image), file) : 0;
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+    bool verified = false;
+    size_t slot = 0;
+    if (size == 0 || fw_boot_check(&slot, &verified))
+    {
+        fprintf(stderr, "[sim] app update needs %s and a running image\n", path);
+        return EXIT_FAILURE;
+    }
+    bootloader_api_ptr->boot_info.boot_slot = (uint32_t) slot;
+
+    volatile update_api_t* api = &bootloader_api_ptr->update;
+    if (!UPDATE_API_HAS(api, commit))
+    {
+        fprintf(stderr, "[sim] update API missing\n");
+        return EXIT_FAILURE;
+    }
+    update_session_t session;
+    const int target = api->begin(&session, (uint32_t) size);
+    if (target < 0)
+    {
+        fprintf(stderr, "[sim] app update of %zu bytes refused\n", size);
+        return EXIT_FAILURE;
+    }
+    // one sector erased at a time ahead of the data, then the image in chunks as it would arrive
+    const uint64_t start_us = sim_now_us();
+    int ret = 0;
+    while ((ret = api->erase(&session)) > 0)
+    {
+    }
+    const uint64_t erased_us = sim_now_us();
+    for (size_t pos = 0; ret == 0 && pos < size; pos += 256)
+    {
+        ret = api->write(&session, &image[pos], size - pos < 256 ? size - pos : 256);
+    }
+    const uint64_t written_us = sim_now_us();
+    if (ret == 0)
+    {
+        ret = api->commit(&session, api->crc32(image, size));
+    }
+    fprintf(stderr, "[sim] app update of slot %c %s: erase %.3f s, write %.3f s, commit %.3f s\n", target ? 'B' : 'A', ret ? "FAILED" : "OK",
+            (double) (erased_us - start_us) / 1e6, (double) (written_us - erased_us) / 1e6, (double) (sim_now_us() - written_us) / 1e6);
+    return ret ? EXIT_FAILURE : boot();
+}
+
+int main(int argc, char* argv[])
+{
+    const char* link = NULL;
+    bool pacing = true;
+    double flash_timing = 1.0;
+    size_t power_cut_at = 0;
+    const char* backup = NULL;
+    bool boot_only = false;
+    const char* app_image = NULL;
+
+    static const struct option options[] = {
+        {"link", required_argument, NULL, 'l'},
+        {"no-pacing", no_argument, NULL, 'n'},
+        {"flash-timing", required_argument, NULL, 't'},
+        {"power-cut-at", required_argument, NULL, 'p'},
+        {"backup", required_argument, NULL, 'b'},
+        {"boot", no_argument, NULL, 'B'},
+        {"app-update", required_argument, NULL, 'a'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'l':
+                link = optarg;
+                break;
+            case 'n':
+                pacing = false;
+                break;
+            case 't':
+                flash_timing = strtod(optarg, NULL);
+                break;
+            case 'p':
+                power_cut_at = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                backup = optarg;
+                break;
+            case 'B':
+                boot_only = true;
+                break;
+            case 'a':
+                app_image = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1 || flash_timing < 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    // the bootloader console is stdout, it goes through a pipe more often than not
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    boot_us = sim_now_us();
+    if (sim_flash_init(argv[optind], flash_timing) || (backup != NULL && sim_backup_init(backup)))
+    {
+        return EXIT_FAILURE;
+    }
+    if (boot_only)
+    {
+        crc_hw_init();
+        return boot();
+    }
+    if (app_image != NULL)
+    {
+        // the flash operations of the update API complete on the interrupt clock
+        if (sim_hal_init(system_reset))
+        {
+            return EXIT_FAILURE;
+        }
+        crc_hw_init();
+        init_boot_api();
+        update_api_init(&bootloader_api_ptr->update);
+        return app_update(app_image);
+    }
+    if (sim_uart_init(link, pacing, power_cut_at) || sim_hal_init(system_reset))
+    {
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "[sim] UART1 on %s\n", sim_uart_port());
+    signal(SIGINT, interrupted);
+    signal(SIGTERM, interrupted);
+
+    prof_clock_init();
+    crc_hw_init();
+    flash_fw_init();
+    init_boot_api();
+
+    // the DFU branch of bootloader/Src/main.c, the button is always pressed
+    printf("MAGIC NUMBER: 0x%08x RESET_REASON: %s\n", bootloader_api_ptr->boot_info.magic, get_reset_reason_string());
+    printf("Entering in DFU ...\n");
+    bootloader_api_ptr->boot_info.reset_reason_uint = APPLICATION_RESET;
+    const size_t max_fw_size = get_max_fw_size();
+    serial_api_t serial_api = {
+        sim_uart_send, sim_uart_recv, flash_fw_feed, flash_fw_flush, flash_fw_reset, fw_crc_check, fw_write_header, max_fw_size,
+        flash_fw_reserve, flash_fw_commit, flash_fw_rollback, sim_uart_baudrate_supported, sim_uart_set_baudrate, fw_base_image,
+        fw_base_intact, flash_sector_hashes, flash_keep_sectors,
+        flash_fw_erase_ahead, fw_resume, flash_fw_layout};
+    set_serial_api(serial_api);
+    recv_firmware();
+    bootloader_api_ptr->reset(APPLICATION_RESET);
+}
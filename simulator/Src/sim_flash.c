@@ -0,0 +1,417 @@
+#define _GNU_SOURCE
+
+#include "sim_flash.h"
+
+#include "boot_config.h"
+#include "flash_program.h"
+#include "main.h"
+#include "sim_hal.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if !defined(__x86_64__)
+#error "the flash model single steps the trapped stores with the x86 trap flag"
+#endif
+
+#define FLASH_BASE_ADDR  FLASH_SECTOR_0_START_ADDR
+#define FLASH_TOTAL_SIZE (FLASH_SECTOR_7_START_ADDR + FLASH_SECTOR_7_SIZE - FLASH_SECTOR_0_START_ADDR)
+#define EFLAGS_TF        (0x100)  // x86 trap flag, single steps the CPU
+#define SR_ERRORS        (FLASH_SR_SOP | FLASH_SR_WRPERR | FLASH_SR_PGAERR | FLASH_SR_PGPERR | FLASH_SR_PGSERR | FLASH_SR_RDERR)
+
+typedef struct
+{
+    uint32_t start;
+    uint32_t size;
+} sim_sector_t;
+
+static const sim_sector_t sectors[SIM_FLASH_SECTORS] = {
+    {FLASH_SECTOR_0_START_ADDR, FLASH_SECTOR_0_SIZE}, {FLASH_SECTOR_1_START_ADDR, FLASH_SECTOR_1_SIZE},
+    {FLASH_SECTOR_2_START_ADDR, FLASH_SECTOR_2_SIZE}, {FLASH_SECTOR_3_START_ADDR, FLASH_SECTOR_3_SIZE},
+    {FLASH_SECTOR_4_START_ADDR, FLASH_SECTOR_4_SIZE}, {FLASH_SECTOR_5_START_ADDR, FLASH_SECTOR_5_SIZE},
+    {FLASH_SECTOR_6_START_ADDR, FLASH_SECTOR_6_SIZE}, {FLASH_SECTOR_7_START_ADDR, FLASH_SECTOR_7_SIZE},
+};
+
+// SR is write 1 to clear on the chip, the model rewrites it with the flags of every completed operation
+FLASH_TypeDef sim_flash_regs = {.CR = FLASH_CR_LOCK};
+
+static double timing_scale = 1.0;
+static size_t page_size = 0;
+// the file mapping at FLASH_BASE_ADDR is what the CPU reads, the cells hold what is really programmed
+static uint8_t* view = NULL;
+static uint32_t* cells = NULL;
+static sim_flash_stats_t stats;
+
+// page opened by a trapped CPU write, the word is programmed once the program time elapsed
+static volatile uintptr_t open_page = 0;
+static volatile bool store_pending = false;  // the store re-executes on the open page, the tick must not close it before
+static bool alarm_blocked = false;           // the interrupt mask of the store
+static uint64_t program_done_us = 0;
+static uint32_t program_error = 0;
+// completion time of the operation whose interrupt is dispatched, the operations started from the
+// interrupt begin right then so the controller keeps the datasheet pace when the ticks come late
+static uint64_t irq_event_us = 0;
+
+// HAL_FLASHEx_Erase_IT run, advanced by the tick and by HAL_FLASH_IRQHandler()
+static volatile bool erase_active = false;
+static bool erase_sector_done = false;
+static uint32_t erase_sector = 0;
+static uint32_t erase_remaining = 0;
+static uint64_t erase_done_us = 0;
+
+// sector erase started by the CPU writing SER, SNB and STRT, the update API of the application does it
+static volatile bool register_erase_active = false;
+static uint32_t register_erase_sector = 0;
+static uint64_t register_erase_done_us = 0;
+
+static uint64_t scaled_us(uint32_t typical_us)
+{
+    return (uint64_t) (typical_us * timing_scale);
+}
+
+static uint64_t operation_start_us(void)
+{
+    return irq_event_us ? irq_event_us : sim_now_us();
+}
+
+static uint64_t erase_time_us(uint32_t sector)
+{
+    switch (sectors[sector].size)
+    {
+        case 16 * 1024:
+            return scaled_us(SIM_FLASH_ERASE_16K_US);
+        case 64 * 1024:
+            return scaled_us(SIM_FLASH_ERASE_64K_US);
+        default:
+            return scaled_us(SIM_FLASH_ERASE_128K_US);
+    }
+}
+
+static void set_access(uintptr_t start, size_t len, int prot)
+{
+    if (mprotect((void*) start, len, prot))
+    {
+        perror("[sim] mprotect");
+        abort();
+    }
+}
+
+static void program_commit(void)
+{
+    const uintptr_t page = open_page;
+    volatile uint32_t* words = (volatile uint32_t*) page;
+    uint32_t* cell = &cells[(page - FLASH_BASE_ADDR) / sizeof(uint32_t)];
+    for (size_t i = 0; i < page_size / sizeof(uint32_t); i++)
+    {
+        if (words[i] == cell[i])
+        {
+            continue;
+        }
+        if (!program_error)
+        {
+            // NOR cells only go from 1 to 0, an erase is needed for the other direction
+            if (words[i] & ~cell[i])
+            {
+                stats.nor_violations++;
+            }
+            cell[i] &= words[i];
+        }
+        words[i] = cell[i];
+    }
+    set_access(page, page_size, PROT_READ);
+    open_page = 0;
+
+    if (program_error)
+    {
+        stats.rejected++;
+        FLASH->SR = program_error;
+        return;
+    }
+    stats.words_programmed++;
+    stats.busy_us += scaled_us(SIM_FLASH_WORD_PROGRAM_US);
+    FLASH->SR = (FLASH->CR & FLASH_CR_EOPIE) ? FLASH_SR_EOP : 0;
+}
+
+// CPU write to the read only mapping, the controller decides whether it programs the word
+static void write_fault(int sig, siginfo_t* info, void* context)
+{
+    const uintptr_t address = (uintptr_t) info->si_addr;
+    if (address < FLASH_BASE_ADDR || address >= FLASH_BASE_ADDR + FLASH_TOTAL_SIZE)
+    {
+        // a real crash, the access faults again with the default action
+        signal(SIGSEGV, SIG_DFL);
+        return;
+    }
+    if (open_page)
+    {
+        // the bus stalls until the previous word is programmed
+        program_commit();
+    }
+
+    const uint32_t cr = FLASH->CR;
+    program_error = 0;
+    if (!(cr & FLASH_CR_PG) || erase_active || register_erase_active)
+    {
+        program_error = FLASH_SR_PGSERR;
+        fprintf(stderr, "[sim] flash write at 0x%08lx rejected, %s\n", (unsigned long) address,
+                (erase_active || register_erase_active) ? "erase running" : "PG not set");
+    }
+    else if ((cr & FLASH_CR_PSIZE) != FLASH_PSIZE_WORD)
+    {
+        program_error = FLASH_SR_PGPERR;
+    }
+    open_page = address & ~(page_size - 1);
+    program_done_us = UINT64_MAX;
+    FLASH->SR = FLASH_SR_BSY;
+    set_access(open_page, page_size, PROT_READ | PROT_WRITE);
+
+    // single step the store with the interrupts masked, store_done() starts the program time
+    ucontext_t* uc = context;
+    alarm_blocked = sigismember(&uc->uc_sigmask, SIGALRM);
+    sigaddset(&uc->uc_sigmask, SIGALRM);
+    uc->uc_mcontext.gregs[REG_EFL] |= EFLAGS_TF;
+    store_pending = true;
+}
+
+static void store_done(int sig, siginfo_t* info, void* context)
+{
+    ucontext_t* uc = context;
+    uc->uc_mcontext.gregs[REG_EFL] &= ~EFLAGS_TF;
+    if (!alarm_blocked)
+    {
+        sigdelset(&uc->uc_sigmask, SIGALRM);
+    }
+    program_done_us = operation_start_us() + scaled_us(SIM_FLASH_WORD_PROGRAM_US);
+    store_pending = false;
+}
+
+static void erase_cells(uint32_t sector)
+{
+    const sim_sector_t* s = &sectors[sector];
+    set_access(s->start, s->size, PROT_READ | PROT_WRITE);
+    memset((void*) (uintptr_t) s->start, 0xFF, s->size);
+    memset(&cells[(s->start - FLASH_BASE_ADDR) / sizeof(uint32_t)], 0xFF, s->size);
+    set_access(s->start, s->size, PROT_READ);
+    stats.erases[sector]++;
+    stats.busy_us += erase_time_us(sector);
+}
+
+// FLASH_IRQHandler of bootloader/Src/stm32f4xx_it.c
+static void flash_interrupt(void)
+{
+    const uint32_t cr = FLASH->CR;
+    const uint32_t sr = FLASH->SR;
+    const bool pending = ((sr & FLASH_SR_EOP) && (cr & FLASH_CR_EOPIE)) || ((sr & SR_ERRORS) && (cr & FLASH_CR_ERRIE));
+    if (pending && sim_irq_enabled(FLASH_IRQn))
+    {
+        if (!flash_program_irq())
+        {
+            HAL_FLASH_IRQHandler();
+        }
+    }
+}
+
+// STRT is a plain variable, the tick notices it and runs the erase, the chip clears STRT with BSY
+static void register_erase_tick(uint64_t now)
+{
+    if (!register_erase_active)
+    {
+        const uint32_t cr = FLASH->CR;
+        if (!(cr & FLASH_CR_STRT) || erase_active || open_page)
+        {
+            return;
+        }
+        register_erase_sector = (cr & FLASH_CR_SNB) >> FLASH_CR_SNB_Pos;
+        if ((cr & FLASH_CR_LOCK) || !(cr & FLASH_CR_SER) || register_erase_sector >= SIM_FLASH_SECTORS)
+        {
+            stats.rejected++;
+            FLASH->SR = FLASH_SR_PGSERR;
+            FLASH->CR &= ~FLASH_CR_STRT;
+            return;
+        }
+        register_erase_done_us = now + erase_time_us(register_erase_sector);
+        FLASH->SR = FLASH_SR_BSY;
+        register_erase_active = true;
+        return;
+    }
+    if (now >= register_erase_done_us)
+    {
+        erase_cells(register_erase_sector);
+        FLASH->SR = (FLASH->CR & FLASH_CR_EOPIE) ? FLASH_SR_EOP : 0;
+        FLASH->CR &= ~FLASH_CR_STRT;
+        register_erase_active = false;
+    }
+}
+
+void sim_flash_tick(void)
+{
+    const uint64_t now = sim_now_us();
+    register_erase_tick(now);
+    // a late tick catches up with every word programmed meanwhile
+    while (open_page && !store_pending && now >= program_done_us)
+    {
+        irq_event_us = program_done_us;
+        program_commit();
+        flash_interrupt();
+        irq_event_us = 0;
+    }
+    if (erase_active && !erase_sector_done && now >= erase_done_us)
+    {
+        irq_event_us = erase_done_us;
+        erase_cells(erase_sector);
+        erase_sector_done = true;
+        FLASH->SR = FLASH_SR_EOP;
+        flash_interrupt();
+        irq_event_us = 0;
+    }
+}
+
+int sim_flash_init(const char* path, double scale)
+{
+    timing_scale = scale;
+    page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+    const int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st))
+    {
+        perror(path);
+        return -1;
+    }
+    const bool blank = st.st_size == 0;
+    if (!blank && st.st_size != FLASH_TOTAL_SIZE)
+    {
+        fprintf(stderr, "%s: not a %u KB flash image\n", path, FLASH_TOTAL_SIZE / 1024);
+        return -1;
+    }
+    if (blank && ftruncate(fd, FLASH_TOTAL_SIZE))
+    {
+        perror(path);
+        return -1;
+    }
+    // the bootloader dereferences the STM32 addresses, the file is mapped right there
+    view = mmap((void*) (uintptr_t) FLASH_BASE_ADDR, FLASH_TOTAL_SIZE, PROT_READ, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    close(fd);
+    if (view != (uint8_t*) (uintptr_t) FLASH_BASE_ADDR)
+    {
+        fprintf(stderr, "[sim] cannot map the flash at 0x%08x\n", FLASH_BASE_ADDR);
+        return -1;
+    }
+    if (blank)
+    {
+        set_access(FLASH_BASE_ADDR, FLASH_TOTAL_SIZE, PROT_READ | PROT_WRITE);
+        memset(view, 0xFF, FLASH_TOTAL_SIZE);
+        set_access(FLASH_BASE_ADDR, FLASH_TOTAL_SIZE, PROT_READ);
+    }
+    cells = malloc(FLASH_TOTAL_SIZE);
+    if (cells == NULL)
+    {
+        return -1;
+    }
+    memcpy(cells, view, FLASH_TOTAL_SIZE);
+
+    struct sigaction action = {0};
+    action.sa_sigaction = write_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaddset(&action.sa_mask, SIGALRM);
+    if (sigaction(SIGSEGV, &action, NULL))
+    {
+        return -1;
+    }
+    action.sa_sigaction = store_done;
+    return sigaction(SIGTRAP, &action, NULL);
+}
+
+const sim_flash_stats_t* sim_flash_stats(void)
+{
+    return &stats;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void)
+{
+    FLASH->CR &= ~FLASH_CR_LOCK;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void)
+{
+    FLASH->CR |= FLASH_CR_LOCK;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef* erase_init, uint32_t* sector_error)
+{
+    // FLASH_WaitForLastOperation()
+    while (erase_active || open_page)
+    {
+    }
+    *sector_error = 0xFFFFFFFFU;
+    if (FLASH->CR & FLASH_CR_LOCK)
+    {
+        stats.rejected++;
+        return HAL_ERROR;
+    }
+    for (uint32_t sector = erase_init->Sector; sector < erase_init->Sector + erase_init->NbSectors; sector++)
+    {
+        if (sector >= SIM_FLASH_SECTORS)
+        {
+            *sector_error = sector;
+            return HAL_ERROR;
+        }
+        // the CPU stalls on its flash fetches, interrupts keep running meanwhile
+        sim_sleep_until_us(sim_now_us() + erase_time_us(sector));
+        erase_cells(sector);
+    }
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase_IT(FLASH_EraseInitTypeDef* erase_init)
+{
+    if (erase_active || open_page)
+    {
+        return HAL_BUSY;
+    }
+    if ((FLASH->CR & FLASH_CR_LOCK) || erase_init->NbSectors == 0 || erase_init->Sector + erase_init->NbSectors > SIM_FLASH_SECTORS)
+    {
+        stats.rejected++;
+        return HAL_ERROR;
+    }
+    erase_sector = erase_init->Sector;
+    erase_remaining = erase_init->NbSectors;
+    erase_sector_done = false;
+    erase_done_us = sim_now_us() + erase_time_us(erase_sector);
+    FLASH->CR |= FLASH_CR_EOPIE | FLASH_CR_ERRIE;
+    FLASH->SR = FLASH_SR_BSY;
+    // published last, the tick picks the run up
+    erase_active = true;
+    return HAL_OK;
+}
+
+// the HAL chains the sectors of a run and reports each one, 0xFFFFFFFF after the last
+void HAL_FLASH_IRQHandler(void)
+{
+    if (!erase_active || !erase_sector_done)
+    {
+        return;
+    }
+    stats.background_erases[erase_sector]++;
+    erase_sector_done = false;
+    if (--erase_remaining)
+    {
+        const uint32_t erased = erase_sector++;
+        erase_done_us = operation_start_us() + erase_time_us(erase_sector);
+        HAL_FLASH_EndOfOperationCallback(erased);
+        return;
+    }
+    FLASH->CR &= ~(FLASH_CR_EOPIE | FLASH_CR_ERRIE);
+    erase_active = false;
+    HAL_FLASH_EndOfOperationCallback(0xFFFFFFFFU);
+}
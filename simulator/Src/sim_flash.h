@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @brief Number of sectors of the simulated STM32F401 flash.
+ */
+#define SIM_FLASH_SECTORS (8u)
+
+/**
+ * @brief Typical timings of the STM32F401 datasheet at 2.7-3.6 V, x32 parallelism.
+ */
+#define SIM_FLASH_WORD_PROGRAM_US (16u)
+#define SIM_FLASH_ERASE_16K_US    (250000u)
+#define SIM_FLASH_ERASE_64K_US    (550000u)
+#define SIM_FLASH_ERASE_128K_US   (1000000u)
+
+/**
+ * @brief Flash operation counters reported at the end of the simulation.
+ */
+typedef struct
+{
+    uint32_t erases[SIM_FLASH_SECTORS];             // all erases per sector
+    uint32_t background_erases[SIM_FLASH_SECTORS];  // of which through HAL_FLASHEx_Erase_IT()
+    uint32_t words_programmed;
+    uint32_t nor_violations;  // words programmed over bits that were already 0
+    uint32_t rejected;        // writes and erases refused by the controller
+    uint64_t busy_us;         // modelled time the controller spent erasing and programming
+} sim_flash_stats_t;
+
+/**
+ * @brief Map the flash file at its STM32 address.
+ *
+ * The file is created erased if it does not exist. The mapping is read only, writes trap into the
+ * controller model which applies NOR semantics (bits only go from 1 to 0) after the program time.
+ *
+ * @param path Flash image file, 512 KB.
+ * @param timing_scale Factor applied to the datasheet timings, 0 completes operations on the next tick.
+ * @return int Status code (0 for success, negative for error).
+ */
+int sim_flash_init(const char* path, double timing_scale);
+
+/**
+ * @brief Advance the controller, completed operations raise the FLASH interrupt (interrupt context).
+ */
+void sim_flash_tick(void);
+
+/**
+ * @brief Flash operation counters.
+ */
+const sim_flash_stats_t* sim_flash_stats(void);
@@ -0,0 +1,157 @@
+#include "sim_hal.h"
+
+#include "sim_flash.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define IRQ_LINES (32u)
+
+SysTick_Type sim_systick;
+NVIC_Type sim_nvic;
+SCB_Type sim_scb;
+RTC_TypeDef sim_rtc;
+
+static sigset_t irq_mask;
+static uint32_t irq_enabled = 0;
+static sim_reset_handler_t reset_handler = NULL;
+static const char* backup_path = NULL;
+
+// every peripheral model checks its events on each tick, like the interrupt lines of the NVIC
+static void interrupt_tick(int sig)
+{
+    const int saved_errno = errno;
+    sim_flash_tick();
+    errno = saved_errno;
+}
+
+int sim_hal_init(sim_reset_handler_t handler)
+{
+    reset_handler = handler;
+    sigemptyset(&irq_mask);
+    sigaddset(&irq_mask, SIGALRM);
+
+    struct sigaction action = {0};
+    action.sa_handler = interrupt_tick;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGALRM, &action, NULL))
+    {
+        return -1;
+    }
+    const struct itimerval period = {{0, SIM_TICK_US}, {0, SIM_TICK_US}};
+    return setitimer(ITIMER_REAL, &period, NULL);
+}
+
+static void backup_save(void)
+{
+    FILE* file = fopen(backup_path, "wb");
+    if (file == NULL || fwrite(&sim_rtc, sizeof(sim_rtc), 1, file) != 1)
+    {
+        fprintf(stderr, "[sim] cannot write the backup registers to %s\n", backup_path);
+    }
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+}
+
+int sim_backup_init(const char* path)
+{
+    backup_path = path;
+    FILE* file = fopen(path, "rb");
+    if (file != NULL)
+    {
+        const size_t read = fread(&sim_rtc, sizeof(sim_rtc), 1, file);
+        fclose(file);
+        if (read != 1)
+        {
+            fprintf(stderr, "[sim] %s does not hold the backup registers\n", path);
+            return -1;
+        }
+    }
+    return atexit(backup_save) ? -1 : 0;
+}
+
+uint64_t sim_now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000u + (uint64_t) now.tv_nsec / 1000u;
+}
+
+void sim_sleep_until_us(uint64_t deadline_us)
+{
+    const struct timespec deadline = {(time_t) (deadline_us / 1000000u), (long) (deadline_us % 1000000u) * 1000};
+    // the interrupt clock wakes the sleep up all the time
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+    {
+    }
+}
+
+bool sim_irq_enabled(IRQn_Type irqn)
+{
+    return irqn >= 0 && (uint32_t) irqn < IRQ_LINES && (irq_enabled & (1u << irqn));
+}
+
+void __disable_irq(void)
+{
+    sigprocmask(SIG_BLOCK, &irq_mask, NULL);
+}
+
+void __enable_irq(void)
+{
+    sigprocmask(SIG_UNBLOCK, &irq_mask, NULL);
+}
+
+void NVIC_ClearPendingIRQ(IRQn_Type irqn) {}
+
+void NVIC_SystemReset(void)
+{
+    __disable_irq();
+    if (reset_handler != NULL)
+    {
+        reset_handler();
+    }
+    exit(EXIT_SUCCESS);
+}
+
+void HAL_NVIC_SetPriority(IRQn_Type irqn, uint32_t preempt_priority, uint32_t sub_priority) {}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type irqn)
+{
+    if (irqn >= 0 && (uint32_t) irqn < IRQ_LINES)
+    {
+        irq_enabled |= 1u << irqn;
+    }
+}
+
+HAL_StatusTypeDef HAL_DeInit(void)
+{
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RCC_DeInit(void)
+{
+    return HAL_OK;
+}
+
+uint32_t HAL_GetTick(void)
+{
+    return (uint32_t) (sim_now_us() / 1000u);
+}
+
+void HAL_PWR_EnableBkUpAccess(void) {}
+
+void HAL_PWR_DisableBkUpAccess(void) {}
+
+void Error_Handler(void)
+{
+    __disable_irq();
+    fprintf(stderr, "[sim] Error_Handler called\n");
+    abort();
+}
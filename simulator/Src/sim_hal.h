@@ -0,0 +1,52 @@
+#pragma once
+
+#include "stm32f4xx_hal.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Period of the simulated interrupt clock in microseconds.
+ */
+#define SIM_TICK_US (10u)
+
+/**
+ * @brief Handler run by NVIC_SystemReset().
+ */
+typedef void (*sim_reset_handler_t)(void);
+
+/**
+ * @brief Start the interrupt clock.
+ *
+ * Interrupts are modelled by a SIGALRM handler firing every SIM_TICK_US, __disable_irq() blocks it.
+ *
+ * @param reset_handler Called by NVIC_SystemReset() before the simulator exits.
+ * @return int Status code (0 for success, negative for error).
+ */
+int sim_hal_init(sim_reset_handler_t reset_handler);
+
+/**
+ * @brief Keep the RTC backup registers in a file, like a VBAT supply keeps them across power cycles.
+ *
+ * The registers are read from the file if it exists and written back when the simulator exits. Without a file they
+ * start cleared, like after a power cycle without VBAT.
+ *
+ * @param path File holding the registers.
+ * @return int Status code (0 for success, negative for error).
+ */
+int sim_backup_init(const char* path);
+
+/**
+ * @brief Monotonic time in microseconds.
+ */
+uint64_t sim_now_us(void);
+
+/**
+ * @brief Sleep until a sim_now_us() deadline, interrupts keep running.
+ */
+void sim_sleep_until_us(uint64_t deadline_us);
+
+/**
+ * @brief Whether HAL_NVIC_EnableIRQ() was called for an interrupt.
+ */
+bool sim_irq_enabled(IRQn_Type irqn);
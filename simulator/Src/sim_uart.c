@@ -0,0 +1,277 @@
+#define _GNU_SOURCE
+
+#include "sim_uart.h"
+
+#include "sim_hal.h"
+#include "uart_handler.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BAUDRATE_TOLERANCE_PERMILLE (20u)  // as in uart_handler.c
+#define BITS_PER_BYTE               (10u)  // 8N1
+#define RX_CHUNK_SIZE               (32u)  // bytes paced at once
+#define DRAIN_TIMEOUT_US            (2000000u)
+#define DRAIN_SETTLE_US             (20000u)
+
+static int master = -1;
+static int slave = -1;  // kept open, the host may close and reopen the port
+static char port[64];
+static const char* link_path = NULL;
+static bool pacing = true;
+static size_t power_cut_at = 0;
+static sim_uart_stats_t stats = {.baudrate = UART1_DEFAULT_BAUDRATE};
+
+// receive ring filled by the DMA thread, the indexes wrap freely
+static uint8_t rx_ring[SIM_UART_RX_RING_SIZE];
+static size_t rx_head = 0;
+static size_t rx_tail = 0;
+// rx_head when the last response was written, the host may answer it at a new rate from there on
+static size_t rx_answered = 0;
+static pthread_mutex_t rx_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rx_cond;
+static pthread_t rx_thread;
+
+// end of the last byte on the transmit wire, the bootloader blocks until then
+static uint64_t tx_wire_us = 0;
+
+static uint64_t wire_time_us(size_t len)
+{
+    return pacing ? (uint64_t) len * BITS_PER_BYTE * 1000000u / stats.baudrate : 0;
+}
+
+static void remove_link(void)
+{
+    unlink(link_path);
+}
+
+static void* rx_dma(void* arg)
+{
+    uint64_t wire_us = 0;  // end of the last byte on the receive wire
+    uint8_t chunk[RX_CHUNK_SIZE];
+    for (;;)
+    {
+        struct pollfd pfd = {master, POLLIN, 0};
+        if (poll(&pfd, 1, -1) <= 0)
+        {
+            continue;
+        }
+        const ssize_t n = read(master, chunk, sizeof(chunk));
+        if (n <= 0)
+        {
+            // no host connected, the slave stays open so this only happens transiently
+            usleep(1000);
+            continue;
+        }
+        // the host wrote the bytes just now, they follow the previous ones back to back on the wire
+        const uint64_t now = sim_now_us();
+        wire_us = (wire_us > now ? wire_us : now) + wire_time_us((size_t) n);
+        sim_sleep_until_us(wire_us);
+
+        pthread_mutex_lock(&rx_lock);
+        for (ssize_t i = 0; i < n; i++)
+        {
+            if (rx_head - rx_tail < SIM_UART_RX_RING_SIZE)
+            {
+                rx_ring[rx_head++ % SIM_UART_RX_RING_SIZE] = chunk[i];
+            }
+            else
+            {
+                stats.rx_dropped++;
+            }
+        }
+        if (stats.rx_bytes == 0)
+        {
+            stats.first_rx_us = wire_us;
+        }
+        stats.rx_bytes += (size_t) n;
+        stats.last_rx_us = wire_us;
+        pthread_cond_broadcast(&rx_cond);
+        pthread_mutex_unlock(&rx_lock);
+
+        if (power_cut_at && stats.rx_bytes >= power_cut_at)
+        {
+            fprintf(stderr, "[sim] power cut after %zu bytes\n", stats.rx_bytes);
+            _exit(3);
+        }
+    }
+    return NULL;
+}
+
+int sim_uart_init(const char* link, bool pace, size_t cut_at)
+{
+    pacing = pace;
+    power_cut_at = cut_at;
+    if (openpty(&master, &slave, port, NULL, NULL))
+    {
+        perror("[sim] openpty");
+        return -1;
+    }
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    if (link != NULL)
+    {
+        struct stat st;
+        // only a stale link of a previous run is replaced
+        if (lstat(link, &st) == 0 && S_ISLNK(st.st_mode))
+        {
+            unlink(link);
+        }
+        if (symlink(port, link))
+        {
+            perror(link);
+            return -1;
+        }
+        link_path = link;
+        atexit(remove_link);
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&rx_cond, &attr);
+
+    // the DMA does not take interrupts, they stay with the main thread
+    sigset_t irq_mask;
+    sigset_t saved;
+    sigemptyset(&irq_mask);
+    sigaddset(&irq_mask, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &irq_mask, &saved);
+    const int ret = pthread_create(&rx_thread, NULL, rx_dma, NULL);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return ret ? -1 : 0;
+}
+
+const char* sim_uart_port(void)
+{
+    return link_path != NULL ? link_path : port;
+}
+
+int sim_uart_send(const uint8_t* buf, size_t len)
+{
+    // the blocking transmit of the bootloader holds the CPU until the last byte left
+    const uint64_t now = sim_now_us();
+    tx_wire_us = (tx_wire_us > now ? tx_wire_us : now) + wire_time_us(len);
+    sim_sleep_until_us(tx_wire_us);
+
+    // whatever arrives from now on may answer this response
+    pthread_mutex_lock(&rx_lock);
+    rx_answered = rx_head;
+    pthread_mutex_unlock(&rx_lock);
+    size_t sent = 0;
+    while (sent < len)
+    {
+        const ssize_t n = write(master, buf + sent, len - sent);
+        if (n < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+        sent += n > 0 ? (size_t) n : 0;
+    }
+    stats.tx_bytes += len;
+    return 0;
+}
+
+int sim_uart_recv(uint8_t* buf, size_t len, uint32_t timeout_ms)
+{
+    const uint64_t deadline_us = sim_now_us() + (uint64_t) timeout_ms * 1000u;
+    const struct timespec deadline = {(time_t) (deadline_us / 1000000u), (long) (deadline_us % 1000000u) * 1000};
+    size_t pivot = 0;
+    pthread_mutex_lock(&rx_lock);
+    while (pivot < len)
+    {
+        while (pivot < len && rx_tail != rx_head)
+        {
+            buf[pivot++] = rx_ring[rx_tail++ % SIM_UART_RX_RING_SIZE];
+        }
+        if (pivot == len || sim_now_us() >= deadline_us)
+        {
+            break;
+        }
+        pthread_cond_timedwait(&rx_cond, &rx_lock, &deadline);
+    }
+    pthread_mutex_unlock(&rx_lock);
+    return (int) pivot;
+}
+
+bool sim_uart_baudrate_supported(uint32_t baudrate)
+{
+    if (baudrate == 0)
+    {
+        baudrate = UART1_DEFAULT_BAUDRATE;
+    }
+    const uint32_t div = (SIM_UART_PCLK_HZ + baudrate / 2) / baudrate;
+    if (div < 8)
+    {
+        return false;
+    }
+    const uint32_t actual = SIM_UART_PCLK_HZ / div;
+    const uint32_t error = actual > baudrate ? actual - baudrate : baudrate - actual;
+    return error * 1000u <= baudrate * BAUDRATE_TOLERANCE_PERMILLE;
+}
+
+int sim_uart_set_baudrate(uint32_t baudrate)
+{
+    if (baudrate == 0)
+    {
+        baudrate = UART1_DEFAULT_BAUDRATE;
+    }
+    if (!sim_uart_baudrate_supported(baudrate))
+    {
+        return -1;
+    }
+    // the last response leaves at the old rate, bytes not read yet are dropped. The chip switches right after the
+    // last stop bit, the bytes the host sent once it got the response are kept however late this thread runs.
+    sim_sleep_until_us(tx_wire_us);
+    pthread_mutex_lock(&rx_lock);
+    // unless the reader is already past them
+    if (rx_answered - rx_tail < SIM_UART_RX_RING_SIZE)
+    {
+        rx_tail = rx_answered;
+    }
+    stats.baudrate = baudrate;
+    pthread_mutex_unlock(&rx_lock);
+    return 0;
+}
+
+void sim_uart_drain(void)
+{
+    // the pty hands the written bytes to the slave queue asynchronously, an empty queue right after the last write
+    // does not mean the host read them: it has to stay empty for a while
+    const uint64_t deadline = sim_now_us() + DRAIN_TIMEOUT_US;
+    uint64_t empty_since = sim_now_us();
+    int pending = 0;
+    while (!ioctl(slave, FIONREAD, &pending) && sim_now_us() < deadline)
+    {
+        const uint64_t now = sim_now_us();
+        if (pending > 0)
+        {
+            empty_since = now;
+        }
+        else if (now - empty_since >= DRAIN_SETTLE_US)
+        {
+            break;
+        }
+        sim_sleep_until_us(now + 1000u);
+    }
+}
+
+const sim_uart_stats_t* sim_uart_stats(void)
+{
+    return &stats;
+}
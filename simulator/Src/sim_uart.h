@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief PCLK2 of the bootloader clock tree (HSI, no PLL), it limits the UART1 baud rates.
+ */
+#define SIM_UART_PCLK_HZ (16000000u)
+
+/**
+ * @brief Size of the receive ring, the DMA ring of uart_handler.c.
+ */
+#define SIM_UART_RX_RING_SIZE (8192u)
+
+/**
+ * @brief UART traffic counters reported at the end of the simulation.
+ */
+typedef struct
+{
+    size_t rx_bytes;
+    size_t tx_bytes;
+    size_t rx_dropped;     // bytes that arrived while the receive ring was full
+    uint64_t first_rx_us;  // sim_now_us() of the first byte received
+    uint64_t last_rx_us;   // and of the last one
+    uint32_t baudrate;
+} sim_uart_stats_t;
+
+/**
+ * @brief Open the pseudo terminal standing for UART1.
+ *
+ * A thread stands for the receive DMA: it reads the pty as soon as the host writes, holds the bytes
+ * for their time on the wire and stores them into the receive ring, dropping them while it is full.
+ *
+ * @param link Optional path of a symlink to the pty slave, replaced if it already is a symlink.
+ * @param pacing Hold every byte for its time on the wire at the current baud rate.
+ * @param power_cut_at Received bytes after which the simulator exits as if powered off, 0 to disable.
+ * @return int Status code (0 for success, negative for error).
+ */
+int sim_uart_init(const char* link, bool pacing, size_t power_cut_at);
+
+/**
+ * @brief Path of the pty slave the host connects to.
+ */
+const char* sim_uart_port(void);
+
+/**
+ * @brief Same contract as uart1_send().
+ */
+int sim_uart_send(const uint8_t* buf, size_t len);
+
+/**
+ * @brief Same contract as uart1_recv(), blocks until len bytes arrived or the timeout expired.
+ */
+int sim_uart_recv(uint8_t* buf, size_t len, uint32_t timeout_ms);
+
+/**
+ * @brief Same divider check as uart1_baudrate_supported().
+ */
+bool sim_uart_baudrate_supported(uint32_t baudrate);
+
+/**
+ * @brief Same contract as uart1_set_baudrate(), changes the pacing.
+ */
+int sim_uart_set_baudrate(uint32_t baudrate);
+
+/**
+ * @brief Wait until the host read everything sent, before the pty goes away.
+ */
+void sim_uart_drain(void);
+
+/**
+ * @brief UART traffic counters.
+ */
+const sim_uart_stats_t* sim_uart_stats(void);
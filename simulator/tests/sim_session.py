@@ -0,0 +1,158 @@
+"""Runs of bootloader_sim against the host flasher, shared by the end to end tests.
+
+The tests take the simulator and the flasher script on the command line. They exit with SKIP_STATUS when the Python
+modules of the flasher are not installed.
+"""
+import argparse
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+SKIP_STATUS = 77
+# the simulator stops with this status at --power-cut-at
+POWER_CUT_STATUS = 3
+
+FW_HEADER_SIZE = 0x200
+SLOT_ADDR = {'A': 0x08008000, 'B': 0x08020000}
+STACK_TOP = 0x20018000
+
+FLASH_ADDR = 0x08000000
+FLASH_SIZE = 512 * 1024
+
+
+class Session:
+    def __init__(self, description: str):
+        parser = argparse.ArgumentParser(description=description)
+        parser.add_argument('sim', help='bootloader_sim executable')
+        parser.add_argument('flasher', help='serial_flasher.py')
+        args = parser.parse_args()
+        self.sim = args.sim
+        self.flasher = args.flasher
+        self.dir = tempfile.TemporaryDirectory(prefix='sim_test.')
+        self.flash = os.path.join(self.dir.name, 'flash.bin')
+        self.link = os.path.join(self.dir.name, 'uart')
+        self.failures = 0
+        if subprocess.run([sys.executable, '-c', 'import serial, crcmod'], capture_output=True).returncode != 0:
+            print('pyserial or crcmod missing, skipped')
+            sys.exit(SKIP_STATUS)
+
+    def check(self, condition: bool, what: str, output: str = ''):
+        print(f"{'ok  ' if condition else 'FAIL'} {what}")
+        if not condition:
+            self.failures += 1
+            # the simulator output mixes the console with the binary trace of the link
+            print('\n'.join(line for line in output.splitlines() if line.isprintable()))
+
+    def exit(self):
+        print('PASS' if self.failures == 0 else f'{self.failures} FAILED')
+        sys.exit(0 if self.failures == 0 else 1)
+
+    def path(self, name: str) -> str:
+        return os.path.join(self.dir.name, name)
+
+    def erase(self):
+        if os.path.exists(self.flash):
+            os.remove(self.flash)
+
+    def image(self, name: str, seed: int, size: int, slot: str = 'A') -> str:
+        """Random image whose reset vector points into the slot it is linked for"""
+        body = random.Random(seed).randbytes(size - 8)
+        path = self.path(f'{name}_{slot.lower()}.bin')
+        with open(path, 'wb') as f:
+            f.write(struct.pack('<II', STACK_TOP, SLOT_ADDR[slot] + FW_HEADER_SIZE + 0x1c1) + body)
+        return path
+
+    def compressible_image(self, name: str, seed: int, size: int, slot: str = 'A') -> str:
+        """Image of random runs each repeated once, about 2:1 with LZ4 like code"""
+        rnd = random.Random(seed)
+        body = bytearray()
+        while len(body) < size - 8:
+            run = rnd.randbytes(32)
+            body += run + run
+        path = self.path(f'{name}_{slot.lower()}.bin')
+        with open(path, 'wb') as f:
+            f.write(struct.pack('<II', STACK_TOP, SLOT_ADDR[slot] + FW_HEADER_SIZE + 0x1c1) + body[:size - 8])
+        return path
+
+    def start(self, sim_args=(), flash_timing: float = 0):
+        """Simulator in DFU mode on the flash file, UART1 on the link, flash timings scaled by flash_timing"""
+        if os.path.lexists(self.link):
+            os.remove(self.link)
+        # the console and the trace go to a file, a full pipe would stall the simulator
+        with open(self.path('sim.log'), 'wb') as log:
+            sim = subprocess.Popen([self.sim, '--link', self.link, '--flash-timing', str(flash_timing), *sim_args, self.flash],
+                                   stdout=log, stderr=subprocess.STDOUT)
+        while not os.path.lexists(self.link) and sim.poll() is None:
+            time.sleep(0.01)
+        return sim
+
+    def host(self, sim, image: str, host_args=(), kill_after: float = 60.0):
+        """One flasher run, killed after kill_after seconds or once the simulator stopped, returns (status, output)"""
+        with open(self.path('host.log'), 'wb') as log:
+            host = subprocess.Popen([sys.executable, self.flasher, '--tty_port', self.link, *host_args, image],
+                                    stdout=log, stderr=subprocess.STDOUT)
+        deadline = time.monotonic() + kill_after
+        while host.poll() is None and sim.poll() is None and time.monotonic() < deadline:
+            time.sleep(0.01)
+        # the simulator exits at the reset after the last frame, the host may still be printing its summary
+        try:
+            host.wait(0 if time.monotonic() >= deadline else 2)
+        except subprocess.TimeoutExpired:
+            # a host talking to a simulator that lost power only waits for its timeouts
+            host.kill()
+        return host.wait(), self.read('host.log')
+
+    def stop(self, sim):
+        """Status and output of a simulator, stopped if it is still waiting for a host"""
+        try:
+            sim.wait(10)
+        except subprocess.TimeoutExpired:
+            sim.terminate()
+        return sim.wait(), self.read('sim.log')
+
+    def read(self, name: str) -> str:
+        with open(self.path(name), 'rb') as f:
+            return f.read().decode(errors='replace')
+
+    def update(self, image: str, sim_args=(), host_args=(), flash_timing: float = 0):
+        """One DFU session, returns (host status, host output, simulator status, simulator output)"""
+        sim = self.start(sim_args, flash_timing)
+        host_status, host_out = self.host(sim, image, host_args)
+        return (host_status, host_out) + self.stop(sim)
+
+    def boot(self, sim_args=()):
+        """Boot check of the flash file, returns (status, output)"""
+        run = subprocess.run([self.sim, '--boot', *sim_args, self.flash], stdout=subprocess.PIPE,
+                             stderr=subprocess.STDOUT, text=True, errors='replace', timeout=60)
+        return run.returncode, run.stdout
+
+    def app_update(self, image: str, sim_args=()):
+        """Update of the slot not booting through the update API, then the boot check, returns (status, output)"""
+        run = subprocess.run([self.sim, '--app-update', image, *sim_args, self.flash], stdout=subprocess.PIPE,
+                             stderr=subprocess.STDOUT, text=True, errors='replace', timeout=60)
+        return run.returncode, run.stdout
+
+    def write(self, address: int, data: bytes):
+        """Flash contents written directly, the file is created erased"""
+        if not os.path.exists(self.flash):
+            with open(self.flash, 'wb') as f:
+                f.write(b'\xff' * FLASH_SIZE)
+        with open(self.flash, 'r+b') as f:
+            f.seek(address - FLASH_ADDR)
+            f.write(data)
+
+    def read_flash(self, address: int, size: int) -> bytes:
+        with open(self.flash, 'rb') as f:
+            f.seek(address - FLASH_ADDR)
+            return f.read(size)
+
+    def flip_byte(self, address: int):
+        with open(self.flash, 'r+b') as f:
+            f.seek(address - FLASH_ADDR)
+            value = f.read(1)[0]
+            f.seek(address - FLASH_ADDR)
+            f.write(bytes([value ^ 0xFF]))
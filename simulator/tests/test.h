@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <x86intrin.h>
+
+/*
+Minimal harness of the host tests, each test is an executable run by ctest
+
+- CHECK() prints the failed condition and counts it, the test goes on
+- TEST_EXIT() is the status of main(), non zero once a check failed
+- the benchmarks count time stamp counter cycles, the host clock and not the target one
+*/
+
+static int test_failures = 0;
+
+#define CHECK(cond, ...)                                              \
+    do                                                                \
+    {                                                                 \
+        if (!(cond))                                                  \
+        {                                                             \
+            printf("FAIL %s:%d: %s: ", __FILE__, __LINE__, #cond);    \
+            printf(__VA_ARGS__);                                      \
+            printf("\n");                                             \
+            test_failures++;                                          \
+        }                                                             \
+    } while (0)
+
+#define TEST_EXIT() (test_failures == 0 ? (printf("PASS\n"), 0) : (printf("%d FAILED\n", test_failures), 1))
+
+/**
+ * @brief Deterministic pseudo random bytes, the same on every run.
+ *
+ * @param buffer Filled buffer.
+ * @param len Number of bytes.
+ * @param seed Stream selector.
+ */
+static inline void test_fill(uint8_t* buffer, size_t len, uint32_t seed)
+{
+    uint32_t state = seed * 2654435761u + 1u;
+    for (size_t i = 0; i < len; i++)
+    {
+        state = state * 1664525u + 1013904223u;
+        buffer[i] = (uint8_t) (state >> 24);
+    }
+}
+
+static inline uint64_t test_cycles(void)
+{
+    return __rdtsc();
+}
+
+static inline double test_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Print the throughput of a benchmark run.
+ *
+ * @param name Variant measured.
+ * @param bytes Bytes processed.
+ * @param cycles Time stamp counter cycles spent.
+ * @param seconds Wall time spent.
+ */
+static inline void test_report(const char* name, uint64_t bytes, uint64_t cycles, double seconds)
+{
+    printf("%-24s %8.1f MB/s %6.3f bytes/cycle\n", name, (double) bytes / seconds / 1e6, (double) bytes / (double) cycles);
+}
@@ -0,0 +1,156 @@
+#include "crc.h"
+#include "test.h"
+
+// every length up to this one, the tails of the slice loops included
+#define SHORT_LEN_MAX (72u)
+#define BUFFER_SIZE   (4096u)
+// the input starts this many bytes past an 8 bytes boundary
+#define OFFSET_MAX (8u)
+#define BENCH_SIZE   (64u * 1024u)
+#define BENCH_ROUNDS (64u)
+
+typedef uint16_t (*crc16_func_t)(const uint8_t* data, size_t len);
+typedef uint32_t (*crc32_func_t)(const uint8_t* data, size_t len);
+
+typedef struct
+{
+    const char* name;
+    crc16_func_t crc16;
+    crc32_func_t crc32;
+} crc_variant_t;
+
+static const crc_variant_t variants[] = {
+    {"table", crc16_ccitt_table, crc32_mpeg2_table},
+    {"slice4", crc16_ccitt_slice4, crc32_mpeg2_slice4},
+    {"slice8", crc16_ccitt_slice8, crc32_mpeg2_slice8},
+    {"default", crc16_ccitt, crc32_mpeg2},
+};
+
+#define VARIANT_COUNT (sizeof(variants) / sizeof(variants[0]))
+
+static uint8_t buffer[BUFFER_SIZE + OFFSET_MAX] __attribute__((aligned(8)));
+static uint8_t bench_buffer[BENCH_SIZE] __attribute__((aligned(8)));
+
+static void check_length(size_t offset, size_t len)
+{
+    const uint8_t* data = buffer + offset;
+    const uint16_t crc16 = crc16_ccitt_bitwise(data, len);
+    const uint32_t crc32 = crc32_mpeg2_bitwise(data, len);
+    for (size_t v = 0; v < VARIANT_COUNT; v++)
+    {
+        CHECK(variants[v].crc16(data, len) == crc16, "crc16 %s offset %zu len %zu", variants[v].name, offset, len);
+        CHECK(variants[v].crc32(data, len) == crc32, "crc32 %s offset %zu len %zu", variants[v].name, offset, len);
+    }
+
+    // incremental computation split at an arbitrary point
+    const size_t split = len / 3;
+    uint16_t state16 = crc16_ccitt_update(crc16_ccitt_init(), data, split);
+    state16 = crc16_ccitt_update(state16, data + split, len - split);
+    CHECK(crc16_ccitt_final(state16) == crc16, "crc16 incremental offset %zu len %zu", offset, len);
+    uint32_t state32 = crc32_mpeg2_update(crc32_mpeg2_init(), data, split);
+    state32 = crc32_mpeg2_update(state32, data + split, len - split);
+    CHECK(crc32_mpeg2_final(state32) == crc32, "crc32 incremental offset %zu len %zu", offset, len);
+}
+
+// the CRC unit takes little-endian words most significant byte first, a partial word is padded with 0xFF
+static uint32_t crc32_stm32_reference(const uint8_t* data, size_t len)
+{
+    uint8_t swapped[BUFFER_SIZE + 4];
+    const size_t padded = (len + 3) & ~(size_t) 3;
+    for (size_t i = 0; i < padded; i++)
+    {
+        const size_t src = (i & ~(size_t) 3) + 3 - (i & 3);
+        swapped[i] = src < len ? data[src] : 0xFF;
+    }
+    return crc32_mpeg2_bitwise(swapped, padded);
+}
+
+static void check_stm32(size_t offset, size_t len)
+{
+    const uint8_t* data = buffer + offset;
+    CHECK(crc32_stm32(data, len) == crc32_stm32_reference(data, len), "crc32_stm32 offset %zu len %zu", offset, len);
+}
+
+static void check_stm32_words(void)
+{
+    uint32_t words[64];
+    for (size_t i = 0; i < 64; i++)
+    {
+        words[i] = (uint32_t) buffer[4 * i] | (uint32_t) buffer[4 * i + 1] << 8 | (uint32_t) buffer[4 * i + 2] << 16
+                   | (uint32_t) buffer[4 * i + 3] << 24;
+    }
+    const uint32_t crc = crc32_stm32_update(crc32_stm32_update(crc32_mpeg2_init(), words, 10), words + 10, 54);
+    CHECK(crc == crc32_stm32(buffer, sizeof(words)), "crc32_stm32_update chained");
+}
+
+static void bench(void)
+{
+    test_fill(bench_buffer, sizeof(bench_buffer), 2);
+    volatile uint32_t sink = 0;
+    const uint64_t bytes = (uint64_t) BENCH_SIZE * BENCH_ROUNDS;
+    // builds the RAM tables and brings the core clock up before anything is timed
+    for (size_t r = 0; r < BENCH_ROUNDS; r++)
+    {
+        sink += variants[r % VARIANT_COUNT].crc32(bench_buffer, BENCH_SIZE);
+    }
+    for (size_t v = 0; v < VARIANT_COUNT; v++)
+    {
+        char name[32];
+        double start = test_seconds();
+        uint64_t cycles = test_cycles();
+        for (size_t r = 0; r < BENCH_ROUNDS; r++)
+        {
+            sink += variants[v].crc16(bench_buffer, BENCH_SIZE);
+        }
+        cycles = test_cycles() - cycles;
+        snprintf(name, sizeof(name), "crc16 %s", variants[v].name);
+        test_report(name, bytes, cycles, test_seconds() - start);
+
+        start = test_seconds();
+        cycles = test_cycles();
+        for (size_t r = 0; r < BENCH_ROUNDS; r++)
+        {
+            sink += variants[v].crc32(bench_buffer, BENCH_SIZE);
+        }
+        cycles = test_cycles() - cycles;
+        snprintf(name, sizeof(name), "crc32 %s", variants[v].name);
+        test_report(name, bytes, cycles, test_seconds() - start);
+    }
+
+    // the bitwise reference is slow, a fraction of the data is enough
+    const double start = test_seconds();
+    uint64_t cycles = test_cycles();
+    sink += crc32_mpeg2_bitwise(bench_buffer, BENCH_SIZE);
+    cycles = test_cycles() - cycles;
+    test_report("crc32 bitwise", BENCH_SIZE, cycles, test_seconds() - start);
+    (void) sink;
+}
+
+int main(void)
+{
+#ifdef CRC_SMALL_TABLE
+    printf("CRC_SMALL_TABLE build\n");
+#endif
+    // catalogue check values of CRC-16/CCITT-FALSE and CRC-32/MPEG-2
+    const uint8_t check[] = "123456789";
+    CHECK(crc16_ccitt_bitwise(check, 9) == 0x29B1, "crc16 check value");
+    CHECK(crc32_mpeg2_bitwise(check, 9) == 0x0376E6E7u, "crc32 check value");
+
+    test_fill(buffer, sizeof(buffer), 1);
+    for (size_t offset = 0; offset < OFFSET_MAX; offset++)
+    {
+        for (size_t len = 0; len <= SHORT_LEN_MAX; len++)
+        {
+            check_length(offset, len);
+            check_stm32(offset, len);
+        }
+        check_length(offset, 1021);
+        check_length(offset, BUFFER_SIZE);
+        check_stm32(offset, 1021);
+        check_stm32(offset, BUFFER_SIZE);
+    }
+    check_stm32_words();
+
+    bench();
+    return TEST_EXIT();
+}
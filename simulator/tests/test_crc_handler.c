@@ -0,0 +1,106 @@
+#include "crc.h"
+#include "crc_handler.h"
+#include "test.h"
+
+#include <string.h>
+
+#define SHORT_LEN_MAX (72u)
+#define BUFFER_SIZE   (4096u)
+#define OFFSET_MAX    (4u)
+#define BENCH_SIZE    (64u * 1024u)
+#define BENCH_ROUNDS  (64u)
+
+static uint8_t buffer[BUFFER_SIZE + OFFSET_MAX] __attribute__((aligned(4)));
+static uint8_t bench_buffer[BENCH_SIZE + OFFSET_MAX] __attribute__((aligned(4)));
+
+// aligned buffers go to the model as words, the others are copied word by word
+static void check_length(size_t offset, size_t len)
+{
+    const uint8_t* data = buffer + offset;
+    CHECK(crc_hw_calculate(data, len) == crc32_stm32(data, len), "offset %zu len %zu", offset, len);
+}
+
+// the partial last word is read like the 0xFF of the erased flash that follows the image
+static void check_tail_padding(void)
+{
+    uint8_t padded[SHORT_LEN_MAX + 4] __attribute__((aligned(4)));
+    for (size_t len = 1; len <= SHORT_LEN_MAX; len++)
+    {
+        if (len % sizeof(uint32_t) == 0)
+        {
+            continue;
+        }
+        const size_t padded_len = (len + 3) & ~(size_t) 3;
+        memcpy(padded, buffer, len);
+        memset(padded + len, 0xFF, padded_len - len);
+        CHECK(crc_hw_calculate(buffer, len) == crc_hw_calculate(padded, padded_len), "tail of len %zu", len);
+    }
+}
+
+// the data register keeps its value between words, feeding the words in pieces gives the same result
+static void check_chaining(void)
+{
+    const uint32_t* words = (const uint32_t*) buffer;
+    const size_t num_words = BUFFER_SIZE / sizeof(uint32_t);
+    const uint32_t expected = crc_hw_calculate(buffer, BUFFER_SIZE);
+    for (size_t split = 0; split <= num_words; split += 97)
+    {
+        uint32_t crc = crc32_stm32_update(crc32_mpeg2_init(), words, split);
+        crc = crc32_stm32_update(crc, words + split, num_words - split);
+        CHECK(crc == expected, "split at word %zu", split);
+    }
+}
+
+static void bench_one(const char* name, const uint8_t* data)
+{
+    volatile uint32_t sink = 0;
+    const double start = test_seconds();
+    uint64_t cycles = test_cycles();
+    for (size_t r = 0; r < BENCH_ROUNDS; r++)
+    {
+        sink += crc_hw_calculate(data, BENCH_SIZE);
+    }
+    cycles = test_cycles() - cycles;
+    test_report(name, (uint64_t) BENCH_SIZE * BENCH_ROUNDS, cycles, test_seconds() - start);
+    (void) sink;
+}
+
+static void bench(void)
+{
+    test_fill(bench_buffer, sizeof(bench_buffer), 2);
+    // warm up
+    crc_hw_calculate(bench_buffer, BENCH_SIZE);
+    bench_one("crc_hw aligned", bench_buffer);
+    bench_one("crc_hw unaligned", bench_buffer + 1);
+
+    volatile uint32_t sink = 0;
+    const double start = test_seconds();
+    uint64_t cycles = test_cycles();
+    for (size_t r = 0; r < BENCH_ROUNDS; r++)
+    {
+        sink += crc32_stm32(bench_buffer, BENCH_SIZE);
+    }
+    cycles = test_cycles() - cycles;
+    test_report("crc32_stm32", (uint64_t) BENCH_SIZE * BENCH_ROUNDS, cycles, test_seconds() - start);
+    (void) sink;
+}
+
+int main(void)
+{
+    crc_hw_init();
+    test_fill(buffer, sizeof(buffer), 1);
+    for (size_t offset = 0; offset < OFFSET_MAX; offset++)
+    {
+        for (size_t len = 0; len <= SHORT_LEN_MAX; len++)
+        {
+            check_length(offset, len);
+        }
+        check_length(offset, 1021);
+        check_length(offset, BUFFER_SIZE);
+    }
+    check_tail_padding();
+    check_chaining();
+
+    bench();
+    return TEST_EXIT();
+}
@@ -0,0 +1,268 @@
+#include "crc.h"
+#include "serial_frame_parser.h"
+#include "test.h"
+
+#include <string.h>
+
+#define STREAM_MAX (4u * FRAME_LARGE_PAYLOAD_MAX_SIZE)
+
+// payloads of the blocks taken out of the queue, in order
+typedef struct
+{
+    uint8_t data[STREAM_MAX];
+    size_t len;
+    size_t blocks;
+    size_t frame_pos; // payload position of the next block of the current frame
+    uint32_t errors;  // frame_parser_errors() and frame_parser_frames() when the case started
+    uint32_t frames;
+} received_t;
+
+static received_t rx;
+static uint8_t stream[STREAM_MAX];
+static size_t stream_len;
+
+// SOF | VER | CMD | LEN(4) | payload | CRC, large frames carry the CRC of the frame so far after every block
+static void put_frame(uint8_t version, serial_cmd_t cmd, const uint8_t* payload, size_t len, size_t block_size)
+{
+    uint8_t* frame = &stream[stream_len];
+    const uint8_t header[] = {0xA5, version, cmd, (uint8_t) len, (uint8_t) (len >> 8), (uint8_t) (len >> 16), (uint8_t) (len >> 24)};
+    memcpy(frame, header, sizeof(header));
+    size_t pos = sizeof(header);
+    uint16_t crc = crc16_ccitt_update(crc16_ccitt_init(), header, sizeof(header));
+    size_t done = 0;
+    do
+    {
+        const size_t block = block_size != 0 && len - done > block_size ? block_size : len - done;
+        memcpy(&frame[pos], &payload[done], block);
+        crc = crc16_ccitt_update(crc, &payload[done], block);
+        pos += block;
+        done += block;
+        const uint16_t final = crc16_ccitt_final(crc);
+        frame[pos++] = (uint8_t) final;
+        frame[pos++] = (uint8_t) (final >> 8);
+    } while (done < len);
+    stream_len += pos;
+}
+
+static void drain(void)
+{
+    for (serial_frame_t* frame = frame_queue_peek(); frame != NULL; frame = frame_queue_peek())
+    {
+        // a frame dropped after some of its blocks is followed by the first block of the next one
+        CHECK(frame->block_pos == 0 || frame->block_pos == rx.frame_pos, "block at %zu, expected %zu", frame->block_pos,
+              rx.frame_pos);
+        memcpy(&rx.data[rx.len], frame->payload, frame->len);
+        rx.len += frame->len;
+        rx.blocks++;
+        rx.frame_pos = frame->last ? 0 : rx.frame_pos + frame->len;
+        frame_queue_release();
+    }
+}
+
+static void start_case(size_t max_payload, size_t block_size)
+{
+    while (frame_queue_peek() != NULL)
+    {
+        frame_queue_release();
+    }
+    frame_parser_reset();
+    frame_parser_set_limits(max_payload, block_size);
+    memset(&rx, 0, sizeof(rx));
+    rx.errors = frame_parser_errors();
+    rx.frames = frame_parser_frames();
+    stream_len = 0;
+}
+
+// the stream goes through the parser the way recv_frame() pulls it, at most chunk bytes per read,
+// the consumer takes the queued blocks after every read when consume is set
+static void push(size_t chunk, bool consume)
+{
+    for (size_t pos = 0; pos < stream_len;)
+    {
+        size_t wanted = 0;
+        uint8_t* dest = frame_parser_next_buffer(&wanted);
+        CHECK(wanted >= 1, "nothing wanted at %zu", pos);
+        size_t count = wanted < chunk ? wanted : chunk;
+        count = count < stream_len - pos ? count : stream_len - pos;
+        memcpy(dest, &stream[pos], count);
+        frame_parser_advance(count);
+        pos += count;
+        if (consume)
+        {
+            drain();
+        }
+    }
+}
+
+static void check_counts(const char* name, size_t chunk, uint32_t errors, uint32_t frames)
+{
+    CHECK(frame_parser_errors() - rx.errors == errors, "%s: chunk %zu, %u errors, expected %u", name, chunk,
+          (unsigned int) (frame_parser_errors() - rx.errors), (unsigned int) errors);
+    CHECK(frame_parser_frames() - rx.frames == frames, "%s: chunk %zu, %u frames, expected %u", name, chunk,
+          (unsigned int) (frame_parser_frames() - rx.frames), (unsigned int) frames);
+    CHECK(!frame_parser_in_frame(), "%s: chunk %zu, parser left in a frame", name, chunk);
+}
+
+static const size_t chunks[] = {1, 2, 3, 7, 64, 1031, STREAM_MAX};
+#define CHUNKS (sizeof(chunks) / sizeof(chunks[0]))
+
+static void test_split(void)
+{
+    static uint8_t payload[3000];
+    test_fill(payload, sizeof(payload), 1);
+
+    // an empty frame, a short one and a full slot, the payloads hold SOF bytes
+    for (size_t i = 0; i < CHUNKS; i++)
+    {
+        start_case(FRAME_PAYLOAD_MAX_SIZE, 0);
+        put_frame(SERIAL_PROTOCOL_V1, CMD_PING, payload, 0, 0);
+        put_frame(SERIAL_PROTOCOL_V2, CMD_DATA, payload, 5, 0);
+        put_frame(SERIAL_PROTOCOL_V2, CMD_DATA, payload, FRAME_PAYLOAD_MAX_SIZE, 0);
+        push(chunks[i], true);
+        check_counts("split", chunks[i], 0, 3);
+        CHECK(rx.blocks == 3 && rx.len == 5 + FRAME_PAYLOAD_MAX_SIZE && memcmp(rx.data, payload, 5) == 0
+                  && memcmp(&rx.data[5], payload, FRAME_PAYLOAD_MAX_SIZE) == 0,
+              "split: chunk %zu, %zu blocks of %zu bytes", chunks[i], rx.blocks, rx.len);
+    }
+
+    // a large frame handed over block by block, the last block shorter
+    for (size_t i = 0; i < CHUNKS; i++)
+    {
+        start_case(4096, FRAME_BLOCK_SIZE);
+        put_frame(SERIAL_PROTOCOL_V2, CMD_DATA, payload, sizeof(payload), FRAME_BLOCK_SIZE);
+        push(chunks[i], true);
+        check_counts("large frame", chunks[i], 0, 1);
+        CHECK(rx.blocks == 3 && rx.len == sizeof(payload) && memcmp(rx.data, payload, sizeof(payload)) == 0,
+              "large frame: chunk %zu, %zu blocks of %zu bytes", chunks[i], rx.blocks, rx.len);
+    }
+}
+
+static void test_stray_sof(void)
+{
+    static uint8_t payload[100];
+    test_fill(payload, sizeof(payload), 2);
+
+    for (size_t i = 0; i < CHUNKS; i++)
+    {
+        // noise ending with a SOF, the header read from it has the real SOF as version
+        start_case(FRAME_PAYLOAD_MAX_SIZE, 0);
+        const uint8_t noise[] = {0x00, 0x13, 0xA5};
+        memcpy(stream, noise, sizeof(noise));
+        stream_len = sizeof(noise);
+        put_frame(SERIAL_PROTOCOL_V2, CMD_DATA, payload, sizeof(payload), 0);
+        push(chunks[i], true);
+        check_counts("bad version", chunks[i], 1, 1);
+        CHECK(rx.blocks == 1 && rx.len == sizeof(payload) && memcmp(rx.data, payload, sizeof(payload)) == 0,
+              "bad version: chunk %zu, %zu blocks of %zu bytes", chunks[i], rx.blocks, rx.len);
+
+        // a valid version followed by the real frame, whose bytes make a length past the limit
+        start_case(FRAME_PAYLOAD_MAX_SIZE, 0);
+        stream[0] = 0xA5;
+        stream[1] = SERIAL_PROTOCOL_V1;
+        stream_len = 2;
+        put_frame(SERIAL_PROTOCOL_V2, CMD_DATA, payload, 5, 0);
+        push(chunks[i], true);
+        check_counts("bad length", chunks[i], 1, 1);
+        CHECK(rx.blocks == 1 && rx.len == 5 && memcmp(rx.data, payload, 5) == 0, "bad length: chunk %zu, %zu blocks of %zu bytes",
+              chunks[i], rx.blocks, rx.len);
+    }
+}
+
+static void test_bad_crc(void)
+{
+    static uint8_t payload[300];
+    test_fill(payload, sizeof(payload), 3);
+
+    for (size_t i = 0; i < CHUNKS; i++)
+    {
+        // in the CRC, in the payload and in the header, the next frame goes through
+        start_case(FRAME_PAYLOAD_MAX_SIZE, 0);
+        put_frame(SERIAL_PROTOCOL_V2, CMD_DATA, payload, sizeof(payload), 0);
+        stream[stream_len - 1] ^= 0x01;
+        const size_t second = stream_len;
+        put_frame(SERIAL_PROTOCOL_V2, CMD_DATA, payload, sizeof(payload), 0);
+        stream[second + 7 + 100] ^= 0x80;
+        const size_t third = stream_len;
+        put_frame(SERIAL_PROTOCOL_V2, CMD_DATA, payload, sizeof(payload), 0);
+        stream[third + 2] = CMD_GET_INFO;
+        put_frame(SERIAL_PROTOCOL_V2, CMD_PING, payload, 1, 0);
+        push(chunks[i], true);
+        check_counts("bad crc", chunks[i], 3, 1);
+        CHECK(rx.blocks == 1 && rx.len == 1 && rx.data[0] == payload[0], "bad crc: chunk %zu, %zu blocks of %zu bytes",
+              chunks[i], rx.blocks, rx.len);
+    }
+}
+
+static void test_bad_block(void)
+{
+    static uint8_t payload[3000];
+    test_fill(payload, sizeof(payload), 4);
+
+    for (size_t i = 0; i < CHUNKS; i++)
+    {
+        // the second block fails: the first one was handed over, the rest is skipped up to the next frame
+        start_case(4096, FRAME_BLOCK_SIZE);
+        put_frame(SERIAL_PROTOCOL_V2, CMD_DATA, payload, sizeof(payload), FRAME_BLOCK_SIZE);
+        stream[7 + 1500] ^= 0x01;
+        put_frame(SERIAL_PROTOCOL_V2, CMD_DATA, payload, 10, 0);
+        push(chunks[i], true);
+        check_counts("bad block", chunks[i], 1, 1);
+        CHECK(rx.blocks == 2 && rx.len == FRAME_BLOCK_SIZE + 10 && memcmp(rx.data, payload, FRAME_BLOCK_SIZE) == 0
+                  && memcmp(&rx.data[FRAME_BLOCK_SIZE], payload, 10) == 0,
+              "bad block: chunk %zu, %zu blocks of %zu bytes", chunks[i], rx.blocks, rx.len);
+
+        // the CRC of the last block
+        start_case(4096, FRAME_BLOCK_SIZE);
+        put_frame(SERIAL_PROTOCOL_V2, CMD_DATA, payload, sizeof(payload), FRAME_BLOCK_SIZE);
+        stream[stream_len - 2] ^= 0x01;
+        push(chunks[i], true);
+        check_counts("bad last block", chunks[i], 1, 0);
+        CHECK(rx.blocks == 2 && rx.len == 2 * FRAME_BLOCK_SIZE && memcmp(rx.data, payload, 2 * FRAME_BLOCK_SIZE) == 0,
+              "bad last block: chunk %zu, %zu blocks of %zu bytes", chunks[i], rx.blocks, rx.len);
+    }
+}
+
+static void test_full_queue(void)
+{
+    // no SOF in these payloads, the bytes of a dropped frame are hunted for the next SOF
+    static uint8_t payload[3000];
+    memset(payload, 0x5A, sizeof(payload));
+
+    for (size_t i = 0; i < CHUNKS; i++)
+    {
+        // the third frame finds both slots taken, it is dropped and the queued ones are kept
+        start_case(FRAME_PAYLOAD_MAX_SIZE, 0);
+        put_frame(SERIAL_PROTOCOL_V2, CMD_DATA, payload, 20, 0);
+        put_frame(SERIAL_PROTOCOL_V2, CMD_DATA, payload, 30, 0);
+        put_frame(SERIAL_PROTOCOL_V2, CMD_DATA, payload, 40, 0);
+        push(chunks[i], false);
+        check_counts("full queue", chunks[i], 1, 2);
+        drain();
+        CHECK(rx.blocks == 2 && rx.len == 50, "full queue: chunk %zu, %zu blocks of %zu bytes", chunks[i], rx.blocks, rx.len);
+
+        // once released, the slots take frames again
+        stream_len = 0;
+        put_frame(SERIAL_PROTOCOL_V2, CMD_DATA, payload, 40, 0);
+        push(chunks[i], false);
+        check_counts("released queue", chunks[i], 1, 3);
+
+        // the blocks of a large frame that are not taken: the third one has no slot and the frame is dropped
+        start_case(4096, FRAME_BLOCK_SIZE);
+        put_frame(SERIAL_PROTOCOL_V2, CMD_DATA, payload, sizeof(payload), FRAME_BLOCK_SIZE);
+        push(chunks[i], false);
+        check_counts("full queue blocks", chunks[i], 1, 0);
+        drain();
+        CHECK(rx.blocks == 2 && rx.len == 2 * FRAME_BLOCK_SIZE, "full queue blocks: chunk %zu, %zu blocks of %zu bytes",
+              chunks[i], rx.blocks, rx.len);
+    }
+}
+
+int main(void)
+{
+    test_split();
+    test_stray_sof();
+    test_bad_crc();
+    test_bad_block();
+    test_full_queue();
+    return TEST_EXIT();
+}
@@ -0,0 +1,212 @@
+#include "fw_delta.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// the image starts after the firmware header in sector 2, sectors 2, 3 and 4 are rewritten in order
+#define FW_HEADER_SIZE (0x200u)
+#define IMAGE_MAX      (16u * 1024u + 16u * 1024u + 64u * 1024u - FW_HEADER_SIZE)
+
+static const size_t sector_ends[] = {16u * 1024u - FW_HEADER_SIZE, 32u * 1024u - FW_HEADER_SIZE, IMAGE_MAX};
+
+#define SECTOR_COUNT (sizeof(sector_ends) / sizeof(sector_ends[0]))
+
+// the slot the delta is applied in place to, the base image until the new one replaces it sector by sector
+static uint8_t flash[IMAGE_MAX];
+static uint8_t out[IMAGE_MAX];
+static size_t out_len;
+
+static const char* python;
+static const char* script;
+static char work_dir[] = "/tmp/test_fw_delta.XXXXXX";
+
+static size_t intact_at(size_t written)
+{
+    size_t done = 0;
+    for (size_t i = 0; i < SECTOR_COUNT && written >= sector_ends[i]; i++)
+    {
+        done = sector_ends[i];
+    }
+    return done;
+}
+
+static size_t sim_intact(void)
+{
+    return intact_at(out_len);
+}
+
+static int sim_output(const uint8_t* buf, size_t len)
+{
+    if (out_len + len > IMAGE_MAX)
+    {
+        return -1;
+    }
+    const size_t done = intact_at(out_len);
+    memcpy(&out[out_len], buf, len);
+    out_len += len;
+    // the sectors completed by these bytes are erased and programmed with the new image
+    const size_t now = intact_at(out_len);
+    memcpy(&flash[done], &out[done], now - done);
+    return 0;
+}
+
+// applies a delta fed in chunks of chunk bytes, returns the fw_delta_feed() status
+static int apply(const uint8_t* base, size_t base_size, const uint8_t* delta, size_t delta_size, size_t size, size_t chunk)
+{
+    memset(flash, 0xFF, sizeof(flash));
+    memcpy(flash, base, base_size);
+    out_len = 0;
+    fw_delta_t applier;
+    fw_delta_init(&applier, flash, base_size, size, sim_output, sim_intact);
+    for (size_t pos = 0; pos < delta_size; pos += chunk)
+    {
+        const size_t len = delta_size - pos < chunk ? delta_size - pos : chunk;
+        if (fw_delta_feed(&applier, &delta[pos], len))
+        {
+            return -1;
+        }
+    }
+    return fw_delta_done(&applier) ? 0 : 1;
+}
+
+static void write_file(const char* path, const uint8_t* data, size_t len)
+{
+    FILE* f = fopen(path, "wb");
+    CHECK(f != NULL && fwrite(data, 1, len, f) == len, "write %s", path);
+    if (f != NULL)
+    {
+        fclose(f);
+    }
+}
+
+// the delta of fw_delta.py make, size 0 if it failed
+static size_t make_delta(const uint8_t* base, size_t base_size, const uint8_t* image, size_t size, uint8_t* delta, size_t max)
+{
+    char base_path[64], image_path[64], delta_path[64], command[512];
+    snprintf(base_path, sizeof(base_path), "%s/base.bin", work_dir);
+    snprintf(image_path, sizeof(image_path), "%s/image.bin", work_dir);
+    snprintf(delta_path, sizeof(delta_path), "%s/delta.bin", work_dir);
+    write_file(base_path, base, base_size);
+    write_file(image_path, image, size);
+    snprintf(command, sizeof(command), "%s %s make %s %s %s > /dev/null", python, script, base_path, image_path, delta_path);
+    if (system(command) != 0)
+    {
+        return 0;
+    }
+    FILE* f = fopen(delta_path, "rb");
+    if (f == NULL)
+    {
+        return 0;
+    }
+    const size_t len = fread(delta, 1, max, f);
+    fclose(f);
+    return len;
+}
+
+static void round_trip(const char* name, const uint8_t* base, size_t base_size, const uint8_t* image, size_t size)
+{
+    static uint8_t delta[2 * IMAGE_MAX];
+    const size_t delta_size = make_delta(base, base_size, image, size, delta, sizeof(delta));
+    CHECK(delta_size > 0, "%s: fw_delta.py make", name);
+    // a chunk of 1 splits every varint, the others end frames in the middle of operations
+    static const size_t chunks[] = {1, 2, 3, 7, 64, 2044, 2 * IMAGE_MAX};
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+    {
+        const int status = apply(base, base_size, delta, delta_size, size, chunks[i]);
+        CHECK(status == 0 && out_len == size && memcmp(out, image, size) == 0, "%s: chunk %zu status %d", name, chunks[i], status);
+    }
+    printf("%-20s %6zu bytes -> %6zu bytes delta\n", name, size, delta_size);
+}
+
+static void test_round_trips(void)
+{
+    static uint8_t base[IMAGE_MAX];
+    static uint8_t image[IMAGE_MAX];
+    const size_t base_size = 40000;
+    test_fill(base, base_size, 1);
+
+    round_trip("identical", base, base_size, base, base_size);
+
+    // a few bytes inserted, a range changed and some code appended
+    memcpy(image, base, 12000);
+    memcpy(&image[12000], "\x01\x02\x03\x04\x05", 5);
+    memcpy(&image[12005], &base[12000], base_size - 12000);
+    test_fill(&image[20000], 300, 2);
+    test_fill(&image[base_size + 5], 3000, 3);
+    round_trip("edited", base, base_size, image, base_size + 3005);
+
+    // halves swapped, the second half cannot come from the first sector once it is rewritten
+    memcpy(image, &base[base_size / 2], base_size / 2);
+    memcpy(&image[base_size / 2], base, base_size / 2);
+    round_trip("swapped", base, base_size, image, base_size);
+
+    test_fill(image, 50000, 4);
+    round_trip("unrelated", base, base_size, image, 50000);
+    round_trip("shrunk", base, base_size, base, 20000);
+}
+
+// hand made deltas, the generator never emits them
+static void test_rejected(void)
+{
+    static uint8_t base[IMAGE_MAX];
+    static uint8_t delta[IMAGE_MAX];
+    test_fill(base, 40000, 5);
+
+    // COPY src 200 len 300, both varints take two bytes and are split by a chunk of 1
+    const uint8_t copy_split[] = {0x00, 0xC8, 0x01, 0xAC, 0x02};
+    CHECK(apply(base, 40000, copy_split, sizeof(copy_split), 300, 1) == 0 && memcmp(out, &base[200], 300) == 0, "split varints");
+
+    // the first sector is rewritten by the INSERT, the COPY reads it afterwards
+    size_t len = 0;
+    delta[len++] = 0x01;
+    delta[len++] = (uint8_t) (0x80 | (sector_ends[0] & 0x7F));
+    delta[len++] = (uint8_t) (sector_ends[0] >> 7);
+    memset(&delta[len], 0x55, sector_ends[0]);
+    len += sector_ends[0];
+    const uint8_t overwritten[] = {0x00, 0x10, 0x10};
+    memcpy(&delta[len], overwritten, sizeof(overwritten));
+    len += sizeof(overwritten);
+    CHECK(apply(base, 40000, delta, len, sector_ends[0] + 16, 1000) < 0, "COPY of an overwritten offset");
+
+    // the same COPY before the sector is complete still reads the base
+    const uint8_t early[] = {0x01, 0x04, 0xAA, 0xBB, 0xCC, 0xDD, 0x00, 0x10, 0x10};
+    CHECK(apply(base, 40000, early, sizeof(early), 20, 3) == 0 && memcmp(&out[4], &base[16], 16) == 0, "COPY of an intact offset");
+
+    const uint8_t past_base[] = {0x00, 0xC0, 0xB8, 0x02, 0x10};
+    CHECK(apply(base, 40000, past_base, sizeof(past_base), 16, 2) < 0, "COPY past the base");
+    const uint8_t past_image[] = {0x01, 0x05, 1, 2, 3, 4, 5};
+    CHECK(apply(base, 40000, past_image, sizeof(past_image), 4, 2) < 0, "INSERT past the image");
+    const uint8_t after_end[] = {0x01, 0x02, 1, 2, 0x01, 0x01, 3};
+    CHECK(apply(base, 40000, after_end, sizeof(after_end), 2, 1) < 0, "data after the end");
+    const uint8_t unknown[] = {0x02, 0x00};
+    CHECK(apply(base, 40000, unknown, sizeof(unknown), 2, 1) < 0, "unknown operation");
+    const uint8_t long_varint[] = {0x01, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01};
+    CHECK(apply(base, 40000, long_varint, sizeof(long_varint), 2, 1) < 0, "varint longer than 32 bits");
+    const uint8_t short_delta[] = {0x01, 0x02, 1, 2};
+    CHECK(apply(base, 40000, short_delta, sizeof(short_delta), 3, 1) == 1, "image not complete");
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        printf("usage: %s <python> <fw_delta.py>\n", argv[0]);
+        return 2;
+    }
+    python = argv[1];
+    script = argv[2];
+    if (mkdtemp(work_dir) == NULL)
+    {
+        printf("no work directory\n");
+        return 2;
+    }
+    test_round_trips();
+    test_rejected();
+
+    char command[128];
+    snprintf(command, sizeof(command), "rm -rf %s", work_dir);
+    CHECK(system(command) == 0, "cleanup");
+    return TEST_EXIT();
+}
@@ -0,0 +1,264 @@
+#include "lz4_stream.h"
+#include "test.h"
+
+#include <string.h>
+
+#define IMAGE_MAX  (24u * 1024u)
+#define STREAM_MAX (2u * IMAGE_MAX)
+// a small ring wraps many times over an image, the bootloader uses up to 4 KB
+#define WINDOW_SIZE (256u)
+
+// a stream and the image it decodes to, built side by side
+typedef struct
+{
+    uint8_t data[STREAM_MAX];
+    size_t len;
+    uint8_t image[IMAGE_MAX];
+    size_t size;
+} stream_t;
+
+static uint8_t window[4096];
+static uint8_t out[IMAGE_MAX];
+static size_t out_len;
+static size_t out_calls_max;
+static int out_status;
+
+static int sim_output(const uint8_t* buf, size_t len)
+{
+    if (out_len + len > IMAGE_MAX)
+    {
+        return -1;
+    }
+    memcpy(&out[out_len], buf, len);
+    out_len += len;
+    out_calls_max = len > out_calls_max ? len : out_calls_max;
+    return out_status;
+}
+
+static void put_length(stream_t* s, size_t length)
+{
+    while (length >= 255)
+    {
+        s->data[s->len++] = 255;
+        length -= 255;
+    }
+    s->data[s->len++] = (uint8_t) length;
+}
+
+// one sequence, match_len 0 for the last one, the image follows the bytes it describes
+static void put_sequence(stream_t* s, const uint8_t* literals, size_t literal_len, size_t offset, size_t match_len)
+{
+    const size_t token_literal = literal_len < 15 ? literal_len : 15;
+    const size_t token_match = match_len == 0 ? 0 : (match_len - 4 < 15 ? match_len - 4 : 15);
+    s->data[s->len++] = (uint8_t) (token_literal << 4 | token_match);
+    if (token_literal == 15)
+    {
+        put_length(s, literal_len - 15);
+    }
+    memcpy(&s->data[s->len], literals, literal_len);
+    s->len += literal_len;
+    memcpy(&s->image[s->size], literals, literal_len);
+    s->size += literal_len;
+    if (match_len == 0)
+    {
+        return;
+    }
+    s->data[s->len++] = (uint8_t) offset;
+    s->data[s->len++] = (uint8_t) (offset >> 8);
+    if (token_match == 15)
+    {
+        put_length(s, match_len - 4 - 15);
+    }
+    for (size_t i = 0; i < match_len; i++)
+    {
+        // matches may overlap the bytes they produce
+        s->image[s->size] = s->image[s->size - offset];
+        s->size++;
+    }
+}
+
+// decodes len bytes of the stream in chunks of chunk bytes, returns the first lz4_stream_feed() error or 0
+static int decode(const uint8_t* data, size_t len, size_t limit, size_t window_size, size_t chunk, lz4_stream_t* decoder)
+{
+    memset(window, 0xEE, sizeof(window));
+    out_len = 0;
+    out_calls_max = 0;
+    out_status = 0;
+    lz4_stream_init(decoder, window, window_size, limit, sim_output);
+    for (size_t pos = 0; pos < len; pos += chunk)
+    {
+        const size_t count = len - pos < chunk ? len - pos : chunk;
+        if (lz4_stream_feed(decoder, &data[pos], count))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// decodes the whole stream, 0 if the image came out complete, 1 if it is incomplete, -1 if the stream was rejected
+static int decode_all(const stream_t* s, size_t limit, size_t window_size, size_t chunk)
+{
+    lz4_stream_t decoder;
+    if (decode(s->data, s->len, limit, window_size, chunk, &decoder))
+    {
+        return -1;
+    }
+    return lz4_stream_done(&decoder) ? 0 : 1;
+}
+
+static void check_round_trip(const char* name, const stream_t* s, size_t window_size)
+{
+    // a chunk of 1 splits every length and offset, the others end frames in the middle of sequences
+    static const size_t chunks[] = {1, 2, 3, 7, 64, 2044, STREAM_MAX};
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+    {
+        const int status = decode_all(s, s->size, window_size, chunks[i]);
+        CHECK(status == 0 && out_len == s->size && memcmp(out, s->image, s->size) == 0, "%s: chunk %zu status %d", name,
+              chunks[i], status);
+        // the output never spans the end of the ring
+        CHECK(out_calls_max <= window_size, "%s: chunk %zu output of %zu bytes", name, chunks[i], out_calls_max);
+    }
+}
+
+static void test_random(void)
+{
+    static stream_t s;
+    static uint8_t literals[IMAGE_MAX];
+    test_fill(literals, sizeof(literals), 1);
+    uint32_t state = 7;
+    s.len = 0;
+    s.size = 0;
+    put_sequence(&s, literals, 8, 8, 8);
+    while (s.size < IMAGE_MAX - 1200)
+    {
+        state = state * 1664525u + 1013904223u;
+        // short and long literal runs and matches, offsets anywhere in the ring
+        const size_t literal_len = (state >> 8) % 8 == 0 ? 15 + (state >> 12) % 600 : (state >> 12) % 20;
+        const size_t available = s.size + literal_len < WINDOW_SIZE ? s.size + literal_len : WINDOW_SIZE;
+        const size_t match_len = 4 + ((state >> 4) % 4 == 0 ? (state >> 16) % 500 : (state >> 16) % 16);
+        put_sequence(&s, &literals[s.size], literal_len, 1 + (state >> 20) % available, match_len);
+    }
+    put_sequence(&s, &literals[s.size], 5, 0, 0);
+    check_round_trip("random", &s, WINDOW_SIZE);
+    printf("%-20s %6zu bytes -> %6zu bytes stream\n", "random", s.size, s.len);
+}
+
+static void test_matches(void)
+{
+    static stream_t s;
+    static uint8_t literals[2 * WINDOW_SIZE];
+    test_fill(literals, sizeof(literals), 2);
+
+    // overlapping matches repeat the last bytes, offset 1 is a run
+    s.len = 0;
+    s.size = 0;
+    put_sequence(&s, (const uint8_t*) "ab", 2, 2, 40);
+    put_sequence(&s, (const uint8_t*) "x", 1, 1, 300);
+    put_sequence(&s, (const uint8_t*) "end", 3, 0, 0);
+    check_round_trip("overlapping", &s, WINDOW_SIZE);
+
+    // the largest offset reaches a full ring back, a match longer than the ring reads the bytes it wrote
+    s.len = 0;
+    s.size = 0;
+    put_sequence(&s, literals, WINDOW_SIZE + 37, WINDOW_SIZE, 3 * WINDOW_SIZE + 5);
+    put_sequence(&s, literals, 7, WINDOW_SIZE, 20);
+    put_sequence(&s, literals, 5, 0, 0);
+    check_round_trip("offset == window", &s, WINDOW_SIZE);
+
+    // literal and match lengths on several bytes, one of them exactly 255
+    s.len = 0;
+    s.size = 0;
+    put_sequence(&s, literals, 15 + 255, 100, 4 + 15 + 255 + 255 + 3);
+    put_sequence(&s, literals, 15, 15, 4 + 15);
+    put_sequence(&s, literals, 15 + 255 + 1, 0, 0);
+    check_round_trip("long lengths", &s, WINDOW_SIZE);
+}
+
+static void test_rejected(void)
+{
+    static stream_t s;
+    static uint8_t literals[2 * WINDOW_SIZE];
+    test_fill(literals, sizeof(literals), 3);
+
+    // offsets are checked against the ring and against the bytes decoded so far
+    s.len = 0;
+    s.size = 0;
+    put_sequence(&s, literals, WINDOW_SIZE + 1, WINDOW_SIZE + 1, 4);
+    CHECK(decode_all(&s, s.size, WINDOW_SIZE, 5) < 0, "offset past the window");
+    s.len = 0;
+    s.size = 0;
+    put_sequence(&s, literals, 3, 3, 4);
+    s.data[s.len - 2] = 4;
+    CHECK(decode_all(&s, 7, WINDOW_SIZE, 1) < 0, "offset past the decoded bytes");
+    s.data[s.len - 2] = 0;
+    CHECK(decode_all(&s, 7, WINDOW_SIZE, 1) < 0, "offset 0");
+
+    // a valid image of 40 bytes decoded with a smaller limit
+    s.len = 0;
+    s.size = 0;
+    put_sequence(&s, literals, 10, 4, 20);
+    put_sequence(&s, literals, 10, 0, 0);
+    CHECK(decode_all(&s, s.size, WINDOW_SIZE, 3) == 0, "exact limit");
+    CHECK(decode_all(&s, 25, WINDOW_SIZE, 3) < 0, "match past the image");
+    CHECK(decode_all(&s, 35, WINDOW_SIZE, 3) < 0, "literals past the image");
+
+    // truncated in the literals and in the offset: nothing wrong yet, but not done
+    const size_t full = s.len;
+    s.len = full - 4;
+    CHECK(decode_all(&s, 40, WINDOW_SIZE, 2) == 1, "truncated literals");
+    s.len = 12;
+    CHECK(decode_all(&s, 40, WINDOW_SIZE, 2) == 1, "truncated offset");
+    s.len = full;
+    CHECK(decode_all(&s, 40, WINDOW_SIZE, 2) == 0 && out_len == 40, "whole stream");
+
+    // bytes after the image, in the same feed or in the next one
+    s.data[s.len++] = 0x10;
+    s.data[s.len++] = 0xAA;
+    CHECK(decode_all(&s, 40, WINDOW_SIZE, STREAM_MAX) < 0, "trailing data");
+    CHECK(decode_all(&s, 40, WINDOW_SIZE, full) < 0, "trailing data in the next feed");
+
+    // a failed flash write stops the decoder
+    s.len = full;
+    lz4_stream_t decoder;
+    memset(window, 0, sizeof(window));
+    out_len = 0;
+    out_status = -1;
+    lz4_stream_init(&decoder, window, WINDOW_SIZE, 40, sim_output);
+    CHECK(lz4_stream_feed(&decoder, s.data, s.len) < 0 && !lz4_stream_done(&decoder), "output error");
+    CHECK(lz4_stream_feed(&decoder, s.data, 1) < 0, "no decoding after an error");
+}
+
+static void benchmark(void)
+{
+    static stream_t s;
+    static uint8_t literals[IMAGE_MAX];
+    test_fill(literals, sizeof(literals), 4);
+    s.len = 0;
+    s.size = 0;
+    while (s.size < IMAGE_MAX - 64)
+    {
+        // about 2:1, like a firmware image
+        put_sequence(&s, &literals[s.size], 16, s.size >= 1024 ? 1024 : 16, 16);
+    }
+    const int rounds = 200;
+    lz4_stream_t decoder;
+    const double start_s = test_seconds();
+    const uint64_t start = test_cycles();
+    for (int i = 0; i < rounds; i++)
+    {
+        decode(s.data, s.len, s.size, sizeof(window), 2044, &decoder);
+    }
+    const uint64_t cycles = test_cycles() - start;
+    CHECK(lz4_stream_done(&decoder) && memcmp(out, s.image, s.size) == 0, "benchmark image");
+    test_report("lz4_stream_feed", (uint64_t) s.size * rounds, cycles, test_seconds() - start_s);
+}
+
+int main(void)
+{
+    test_random();
+    test_matches();
+    test_rejected();
+    benchmark();
+    return TEST_EXIT();
+}
@@ -0,0 +1,53 @@
+"""Updates interrupted by power cuts and a lost link at several offsets, resumed by the next run and booted."""
+import re
+
+from sim_session import POWER_CUT_STATUS, Session
+
+RESUME_RE = re.compile(r'resuming at (\d+)/(\d+)')
+# the journal has one entry per 1 KB while its 64 entries last
+JOURNAL_FULL_STEP = 64 * 1024 - 512
+# received bytes that may not be programmed yet: the receive ring, the staging buffers and the frames in flight
+IN_FLIGHT_MAX = 16 * 1024
+
+
+def resumed_offset(host_out: str) -> int:
+    match = RESUME_RE.search(host_out)
+    return int(match.group(1)) if match else 0
+
+
+def check_boot(session: Session):
+    status, out = session.boot()
+    session.check(status == 0 and 'slot A' in out, 'the resumed image boots from slot A', out)
+
+
+session = Session(__doc__)
+
+# 95 KB is past the 63.5 KB one journal entry per buffer covers, the entries are spaced out
+for size, cuts in ((30000, (3000, 15000, 29000)), (97000, (40000, 90000))):
+    image = session.image(f'fw{size}', size, size)
+    for cut in cuts:
+        session.erase()
+        host_status, host_out, sim_status, sim_out = session.update(image, ('--power-cut-at', str(cut)))
+        session.check(sim_status == POWER_CUT_STATUS and host_status != 0, f'{size} B image, power cut after {cut} B',
+                      host_out + sim_out)
+        host_status, host_out, sim_status, sim_out = session.update(image)
+        offset = resumed_offset(host_out)
+        session.check(host_status == 0 and sim_status == 0 and cut - IN_FLIGHT_MAX <= offset <= cut,
+                      f'resumed at {offset}, host {host_status} simulator {sim_status}', host_out + sim_out)
+        if cut > JOURNAL_FULL_STEP + IN_FLIGHT_MAX:
+            session.check(offset > JOURNAL_FULL_STEP, 'the journal reaches past 63.5 KB', host_out)
+        check_boot(session)
+
+# the host goes away in the middle of the transfer, the bootloader keeps running and the next host resumes
+image = session.image('fw_link', 1, 60000)
+session.erase()
+sim = session.start()
+host_status, host_out = session.host(sim, image, kill_after=1.0)
+session.check(host_status != 0 and 'Firmware update complete' not in host_out, 'host killed during the transfer', host_out)
+host_status, host_out = session.host(sim, image)
+sim_status, sim_out = session.stop(sim)
+offset = resumed_offset(host_out)
+session.check(host_status == 0 and sim_status == 0 and offset > 0, f'link lost, resumed at {offset}, host {host_status} simulator {sim_status}', host_out + sim_out)
+check_boot(session)
+
+session.exit()
@@ -0,0 +1,101 @@
+"""Boot decision between slot A and slot B: the newest valid slot boots, sequence numbers wrap, a broken slot falls back."""
+import struct
+
+from sim_session import FW_HEADER_SIZE, POWER_CUT_STATUS, SLOT_ADDR, Session
+
+FW_MAGIC = 0xDEADBEEF
+SEQUENCE_OFFSET = 4 * (6 + 64)
+IMAGE_SIZE = 4096
+
+
+def crc16_ccitt(data: bytes) -> int:
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021 if crc & 0x8000 else crc << 1) & 0xFFFF
+    return crc
+
+
+def read_image(path: str) -> bytes:
+    with open(path, 'rb') as f:
+        return f.read()
+
+
+def write_slot(session: Session, slot: str, image: bytes, sequence: int):
+    """Header and image as an update leaves them, with the CRC16 of headers written before the CRC32 flag"""
+    header = struct.pack('<6I', FW_MAGIC, len(image), crc16_ccitt(image), 0, 0xFFFFFFFF, 0)
+    header += b'\xff' * (SEQUENCE_OFFSET - len(header)) + struct.pack('<I', sequence)
+    header += b'\xff' * (FW_HEADER_SIZE - len(header))
+    session.write(SLOT_ADDR[slot], header + image)
+
+
+def sequence_of(session: Session, slot: str) -> int:
+    return struct.unpack('<I', session.read_flash(SLOT_ADDR[slot] + SEQUENCE_OFFSET, 4))[0]
+
+
+def check_boot(session: Session, slot: str, what: str, sim_args=()):
+    status, out = session.boot(sim_args)
+    session.check(status == 0 and f'slot {slot}' in out, f'{what}: slot {slot} boots', out)
+    return out
+
+
+session = Session(__doc__)
+images = {slot: read_image(session.image(f'small_{slot}', ord(slot), IMAGE_SIZE, slot)) for slot in 'AB'}
+
+# the higher sequence wins, compared over the wrap of the 32-bit counter
+for seq_a, seq_b, newest in ((1, 2, 'B'), (2, 1, 'A'), (0xFFFFFFFF, 0, 'B'), (0, 0xFFFFFFFF, 'A'), (0xFFFFFFF0, 5, 'B'),
+                             (0x7FFFFFFF, 0x80000000, 'B')):
+    session.erase()
+    write_slot(session, 'A', images['A'], seq_a)
+    write_slot(session, 'B', images['B'], seq_b)
+    check_boot(session, newest, f'sequence A {seq_a:#x} B {seq_b:#x}')
+
+# a corrupted newer slot falls back to the older one
+session.erase()
+write_slot(session, 'A', images['A'], 1)
+write_slot(session, 'B', images['B'], 2)
+session.flip_byte(SLOT_ADDR['B'] + FW_HEADER_SIZE + 100)
+out = check_boot(session, 'A', 'newer slot corrupted')
+session.check('SLOT B DOES NOT BOOT' in out, 'slot B reported', out)
+
+# an update interrupted by a power cut goes to the slot not booting, the older image keeps booting until it is resumed
+session.erase()
+write_slot(session, 'A', images['A'], 7)
+image_b = session.image('fw_b', 2, 30000, 'B')
+host_status, host_out, sim_status, sim_out = session.update(image_b, ('--power-cut-at', '15000'))
+session.check(sim_status == POWER_CUT_STATUS, 'power cut during the update of slot B', host_out)
+session.check(sequence_of(session, 'B') == 8, f'slot B header has sequence {sequence_of(session, "B")}')
+check_boot(session, 'A', 'slot B interrupted')
+host_status, host_out, sim_status, sim_out = session.update(image_b)
+session.check(host_status == 0 and sim_status == 0, 'update of slot B resumed', host_out)
+check_boot(session, 'B', 'slot B complete')
+
+# the application writes the other slot through the update API, the new image boots next
+image_a = session.image('app_a', 3, 20000, 'A')
+status, out = session.app_update(image_a)
+session.check(status == 0 and 'app update of slot A OK' in out and 'slot A' in out, 'app update of slot A', out)
+session.check(sequence_of(session, 'A') == 9, f'slot A header has sequence {sequence_of(session, "A")}')
+check_boot(session, 'A', 'after the app update')
+# an image linked for the running slot is refused and the running image stays
+status, out = session.app_update(session.image('app_running', 4, 20000, 'A'))
+session.check(status != 0, 'app update with an image linked for the running slot refused', out)
+check_boot(session, 'A', 'after the refused app update')
+
+# builds with VERIFY_POLICY other than ALWAYS trust the token of the last verified image on the next boot
+session.erase()
+write_slot(session, 'A', images['A'], 1)
+probe = ('--backup', session.path('probe.bin'))
+session.boot(probe)
+if 'image CRC cached' in session.boot(probe)[1]:
+    # the token of the slot that boots outlives the failed check of the newer one
+    write_slot(session, 'B', images['B'], 2)
+    session.flip_byte(SLOT_ADDR['B'] + FW_HEADER_SIZE + 100)
+    backup = ('--backup', session.path('backup.bin'))
+    check_boot(session, 'A', 'first boot next to a corrupted slot B', backup)
+    out = check_boot(session, 'A', 'second boot next to a corrupted slot B', backup)
+    session.check('image CRC cached' in out, 'the token of slot A survives the failed check of slot B', out)
+else:
+    print('the image CRC is computed on every boot, the token is not checked')
+
+session.exit()
@@ -0,0 +1,167 @@
+#include "test.h"
+#include "uart_ring.h"
+
+#define RING_SIZE (64u)
+
+// circular DMA stream into the ring buffer, NDTR counts down and reloads like the DMA1 stream of USART1
+typedef struct
+{
+    uint8_t buffer[RING_SIZE];
+    size_t ndtr;
+    uint32_t total; // stream position of the next byte, the byte written there is stream_byte(total)
+    uart_ring_t ring;
+} dma_sim_t;
+
+static dma_sim_t sim;
+
+static uint8_t stream_byte(uint32_t n)
+{
+    return (uint8_t) ((n * 2654435761u) >> 24);
+}
+
+static void sim_init(void)
+{
+    sim.ndtr = RING_SIZE;
+    sim.total = 0;
+    uart_ring_init(&sim.ring, sim.buffer, RING_SIZE);
+}
+
+// the half transfer and transfer complete interrupts fire as the DMA crosses the boundaries
+static void sim_receive(size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        sim.buffer[RING_SIZE - sim.ndtr] = stream_byte(sim.total++);
+        if (--sim.ndtr == RING_SIZE / 2)
+        {
+            uart_ring_publish(&sim.ring, RING_SIZE / 2);
+        }
+        else if (sim.ndtr == 0)
+        {
+            sim.ndtr = RING_SIZE;
+            uart_ring_publish(&sim.ring, RING_SIZE);
+        }
+    }
+}
+
+static void sim_idle(void)
+{
+    uart_ring_publish(&sim.ring, RING_SIZE - sim.ndtr);
+}
+
+// reception aborted and started again at index 0
+static void sim_restart(void)
+{
+    uart_ring_restart(&sim.ring);
+    sim.ndtr = RING_SIZE;
+    sim.total = sim.ring.write_total;
+}
+
+// reads up to len bytes and checks that each one is the byte of its stream position
+static size_t sim_read(size_t len)
+{
+    uint8_t buf[4 * RING_SIZE];
+    const size_t available = uart_ring_available(&sim.ring);
+    const uint32_t start = sim.ring.read_total;
+    const size_t count = uart_ring_read(&sim.ring, buf, len);
+    CHECK(count == (len < available ? len : available), "read %zu of %zu available", count, available);
+    for (size_t i = 0; i < count; i++)
+    {
+        CHECK(buf[i] == stream_byte(start + (uint32_t) i), "byte at stream position %u", start + (unsigned) i);
+    }
+    return count;
+}
+
+static void test_idle_line(void)
+{
+    sim_init();
+    sim_receive(10);
+    CHECK(uart_ring_available(&sim.ring) == 0, "nothing before the idle event");
+    sim_idle();
+    uint8_t peeked[16] = {0};
+    CHECK(uart_ring_peek(&sim.ring, peeked, sizeof(peeked)) == 10 && peeked[0] == stream_byte(0)
+              && peeked[9] == stream_byte(9),
+          "peek");
+    CHECK(sim_read(100) == 10, "idle line publishes the partial buffer");
+    CHECK(uart_ring_available(&sim.ring) == 0, "empty after read");
+}
+
+static void test_half_full_events(void)
+{
+    sim_init();
+    sim_receive(RING_SIZE / 2);
+    CHECK(uart_ring_available(&sim.ring) == RING_SIZE / 2, "half transfer");
+    sim_receive(RING_SIZE / 2);
+    // the DMA may write the first half again before the next event, only the second half is safe
+    CHECK(sim_read(RING_SIZE) == RING_SIZE / 2, "transfer complete");
+    CHECK(uart_ring_dropped(&sim.ring) == RING_SIZE / 2, "first half dropped %u", uart_ring_dropped(&sim.ring));
+}
+
+// the reader keeps up, chunks of every size cross the wrap in every position
+static void test_wrap(void)
+{
+    sim_init();
+    uint32_t received = 0;
+    for (size_t chunk = 1; chunk < RING_SIZE / 2; chunk++)
+    {
+        for (size_t round = 0; round < 5; round++)
+        {
+            sim_receive(chunk);
+            sim_idle();
+            received += sim_read(chunk / 2 + 1);
+            received += sim_read(RING_SIZE);
+        }
+    }
+    CHECK(received == sim.total, "received %u of %u", received, sim.total);
+    CHECK(uart_ring_dropped(&sim.ring) == 0, "dropped %u", uart_ring_dropped(&sim.ring));
+}
+
+// the DMA laps the reader, the oldest bytes are dropped and what is read is still in order
+static void test_overrun(void)
+{
+    sim_init();
+    sim_receive(3 * RING_SIZE + 5);
+    sim_idle();
+    const size_t available = uart_ring_available(&sim.ring);
+    CHECK(available >= RING_SIZE / 2 && available <= RING_SIZE, "available %zu", available);
+    const uint32_t received = (uint32_t) sim_read(RING_SIZE);
+    CHECK(received + uart_ring_dropped(&sim.ring) == sim.total, "received %u dropped %u of %u", received,
+          uart_ring_dropped(&sim.ring), sim.total);
+
+    // the stream goes on normally afterwards
+    sim_receive(7);
+    sim_idle();
+    CHECK(sim_read(RING_SIZE) == 7, "after overrun");
+}
+
+static void test_restart(void)
+{
+    sim_init();
+    sim_receive(20);
+    sim_idle();
+    CHECK(sim_read(5) == 5, "before restart");
+    sim_restart();
+    CHECK(uart_ring_available(&sim.ring) == 0, "unread bytes discarded");
+    CHECK(uart_ring_dropped(&sim.ring) == 15, "dropped %u", uart_ring_dropped(&sim.ring));
+
+    sim_receive(RING_SIZE / 2 + 3);
+    sim_idle();
+    CHECK(sim_read(RING_SIZE) == RING_SIZE / 2 + 3, "after restart");
+
+    // a restart with everything read drops nothing
+    sim_restart();
+    sim_receive(4);
+    sim_idle();
+    CHECK(sim_read(RING_SIZE) == 4, "second restart");
+    CHECK(uart_ring_dropped(&sim.ring) == 15, "dropped %u", uart_ring_dropped(&sim.ring));
+}
+
+int main(void)
+{
+    test_idle_line();
+    test_half_full_events();
+    test_wrap();
+    test_overrun();
+    test_restart();
+    return TEST_EXIT();
+}
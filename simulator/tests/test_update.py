@@ -0,0 +1,62 @@
+"""Updates at the datasheet flash timing: raw at 2 Mbaud, large frames, compressed and delta, none may drop a byte."""
+import re
+
+from sim_session import SLOT_ADDR, Session
+
+# the flash programs and erases as slowly as on the chip
+DATASHEET_TIMING = 1
+DROPPED_RE = re.compile(r'dropped (\d+) B')
+BAUD_RE = re.compile(r'transfer [\d.]+ s at (\d+) baud')
+WINDOW_RE = re.compile(r'^window: (\d+)$', re.MULTILINE)
+FRAME_RE = re.compile(r'frame payload: (\d+)')
+
+
+def report(regex, out: str) -> int:
+    match = regex.search(out)
+    return int(match.group(1)) if match else -1
+
+
+def check_update(session: Session, image: str, what: str, host_args, slot: str):
+    host_status, host_out, sim_status, sim_out = session.update(image, (), host_args, DATASHEET_TIMING)
+    session.check(host_status == 0 and sim_status == 0, f'{what}, host {host_status} simulator {sim_status}',
+                  host_out + sim_out)
+    session.check(report(DROPPED_RE, sim_out) == 0, f'{what}: {report(DROPPED_RE, sim_out)} B dropped', sim_out)
+    session.check(report(BAUD_RE, sim_out) == 2000000, f'{what}: sent at {report(BAUD_RE, sim_out)} baud', sim_out)
+    status, out = session.boot()
+    session.check(status == 0 and f'slot {slot}' in out, f'{what}: slot {slot} boots', out)
+    return host_out
+
+
+session = Session(__doc__)
+
+# the default session: 1 KB frames received in place, a window of 4
+image = session.image('fw_raw', 1, 90000)
+session.erase()
+host_out = check_update(session, image, 'raw update of 90000 B', (), 'A')
+session.check(report(WINDOW_RE, host_out) == 4, 'raw update: window of 4', host_out)
+
+# a single frame of the largest payload the MCU grants
+session.erase()
+host_out = check_update(session, image, '--frame-size 16384', ('--frame-size', '16384'), 'A')
+session.check(report(FRAME_RE, host_out) == 4096, f'--frame-size 16384: granted {report(FRAME_RE, host_out)} B', host_out)
+
+# about 2:1, the MCU programs two bytes for each one received
+image_a = session.compressible_image('fw_lz4', 1, 90000)
+session.erase()
+host_out = check_update(session, image_a, 'LZ4 update of 90000 B', ('--compress', '12'), 'A')
+session.check('compressed 90000 ->' in host_out, 'the image was sent compressed', host_out)
+session.check(0 < report(WINDOW_RE, host_out) < 4, 'LZ4 update: window shrunk for the stream', host_out)
+
+# the same code with a few changes, linked for slot B, sent as a delta against slot A
+with open(image_a, 'rb') as f:
+    data = bytearray(f.read())
+data[4:8] = (SLOT_ADDR['B'] + 0x200 + 0x1c1).to_bytes(4, 'little')
+data[40000:40100] = bytes(range(100))
+image_b = session.path('fw_delta_b.bin')
+with open(image_b, 'wb') as f:
+    f.write(data)
+host_out = check_update(session, image_b, 'delta update of slot B', ('--base', image_a), 'B')
+session.check('delta 90000 ->' in host_out, 'the image was sent as a delta', host_out)
+session.check(0 < report(WINDOW_RE, host_out) < 4, 'delta update: window shrunk for the stream', host_out)
+
+session.exit()